@@ -0,0 +1,768 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_archive.c
+//  Description    : This is the implementation of the sealed archives of the
+//                   BLOCK memory system. The frames are read a frame at a
+//                   time, as for an export, and the frames holding only zeros
+//                   are left out. The archive backend looks a frame up in the
+//                   index and decompresses its chunk, the last chunk is kept
+//                   so that the frames read in order are decompressed once.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_archive.h>
+#include <block_backend.h>
+#include <block_cache.h>
+#include <block_compress.h>
+#include <block_driver_helper.h>
+#include <block_memory.h>
+#include <block_stats.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define ARCHIVE_CHUNK_SIZE (BLOCK_ARCHIVE_CHUNK_FRAMES * BLOCK_FRAME_SIZE) // Frames of a chunk, uncompressed
+#define ARCHIVE_ALIGN(offset) (((offset) + 7) & ~(uint64_t)7) // Alignment of the tables
+#define ARCHIVE_TEMP_SUFFIX ".tmp" // Image being written, renamed once complete
+#define BLOCK_UNIT_STORE "store.bin" // Frame file of the store of the unit test
+#define BLOCK_UNIT_IMAGE "store.bka" // Image the unit test seals the store into
+
+// Tables built while sealing, written after the chunks
+typedef struct {
+    BlockArchiveChunk* chunks;
+    BlockArchiveEntry* index;
+    BlockArchiveName* names;
+    char* chunk; // Frames of the chunk being filled
+    char* packed; // The chunk compressed
+    uint32_t filled; // Frames in the chunk being filled
+    uint64_t offset; // Offset of the next chunk in the image
+} ArchiveBuilder;
+
+// Driver state, the seal runs under the driver lock
+extern int isOn;
+extern superblock_t superblock;
+
+// State of an archive backend
+typedef struct {
+    int fd;
+    char* image;
+    size_t size;
+    const BlockArchiveHeader* header;
+    const BlockArchiveChunk* chunks;
+    const BlockArchiveEntry* index;
+    const BlockArchiveName* names;
+    char* buffer; // Frames of the last chunk decompressed
+    const char* current; // Frames of the last chunk read (in the buffer or the image)
+    int64_t currentChunk; // Index of the last chunk read, -1 if none
+    BlockArchiveStats stats;
+} ArchiveState;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_emit
+// Description  : Write the chunk being filled to the image, compressed if it
+//                gets smaller
+//
+// Inputs       : fh - the image
+//                builder - the tables of the seal
+//                seal - the result of the seal
+// Outputs      : 0 if successful, -1 if failure
+
+static int archive_emit(FILE* fh, ArchiveBuilder* builder, BlockArchiveSeal* seal)
+{
+    BlockArchiveChunk* chunk = &builder->chunks[seal->chunks];
+    int32_t size = builder->filled * BLOCK_FRAME_SIZE;
+    int32_t length;
+    const char* data;
+
+    if (builder->filled == 0) {
+        return (0);
+    }
+    length = block_compress_buffer(builder->chunk, size, builder->packed, size - 1);
+    chunk->offset = builder->offset;
+    chunk->frames = builder->filled;
+    if (length == -1) {
+        chunk->length = size;
+        chunk->flags = BLOCK_ARCHIVE_RAW;
+        data = builder->chunk;
+        seal->raw_chunks++;
+    } else {
+        chunk->length = length;
+        chunk->flags = 0;
+        data = builder->packed;
+    }
+    if (fwrite(data, chunk->length, 1, fh) != 1) {
+        return (-1);
+    }
+    builder->offset += chunk->length;
+    builder->filled = 0;
+    seal->chunks++;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_table
+// Description  : Write a table after the chunks, 8 byte aligned
+//
+// Inputs       : fh - the image
+//                builder - the tables of the seal
+//                table - the entries
+//                size - the size of the table
+//                offset - set to the offset of the table
+// Outputs      : 0 if successful, -1 if failure
+
+static int archive_table(FILE* fh, ArchiveBuilder* builder, const void* table, size_t size, uint64_t* offset)
+{
+    static const char padding[8] = { 0 };
+    uint64_t aligned = ARCHIVE_ALIGN(builder->offset);
+
+    if (aligned != builder->offset && fwrite(padding, aligned - builder->offset, 1, fh) != 1) {
+        return (-1);
+    }
+    if (size != 0 && fwrite(table, size, 1, fh) != 1) {
+        return (-1);
+    }
+    *offset = aligned;
+    builder->offset = aligned + size;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_archive_seal
+// Description  : Write the frames of the store to an image, the metadata
+//                area and the frames written since the last format, in order
+//                of frame number. The driver lock is held throughout, the
+//                dirty frames, the file table and the tables of the store are
+//                written first. The image is written under a temporary name
+//                and renamed once complete.
+//
+// Inputs       : path - the image to create
+//                seal - set to the result of the seal
+// Outputs      : 0 if successful, -1 if failure
+
+int block_archive_seal(const char* path, BlockArchiveSeal* seal)
+{
+    static const frame_t zeros = { 0 };
+    size_t tables = sizeof(BlockArchiveChunk) * (BLOCK_BLOCK_SIZE / BLOCK_ARCHIVE_CHUNK_FRAMES)
+        + sizeof(BlockArchiveEntry) * BLOCK_BLOCK_SIZE + sizeof(BlockArchiveName) * BLOCK_MAX_TOTAL_FILES
+        + 2 * ARCHIVE_CHUNK_SIZE + BLOCK_BLOCK_SIZE;
+    BlockArchiveHeader header;
+    ArchiveBuilder builder;
+    BlockArchiveEntry* entry;
+    file_t file;
+    uint8_t* wanted;
+    char* buffers;
+    char* temp;
+    frame_t frame;
+    uint32_t frame_nr;
+    FILE* fh;
+    int ret = 0;
+
+    memset(seal, 0, sizeof(BlockArchiveSeal));
+    temp = malloc(strlen(path) + sizeof(ARCHIVE_TEMP_SUFFIX));
+    buffers = block_memory_alloc(BLOCK_MEM_BUFFERS, tables);
+    if (temp == NULL || buffers == NULL) {
+        free(temp);
+        if (buffers != NULL) {
+            block_memory_free(BLOCK_MEM_BUFFERS, buffers, tables);
+        }
+        return (-1);
+    }
+    strcpy(temp, path);
+    strcat(temp, ARCHIVE_TEMP_SUFFIX);
+    builder.chunks = (BlockArchiveChunk*)buffers;
+    builder.index = (BlockArchiveEntry*)(builder.chunks + BLOCK_BLOCK_SIZE / BLOCK_ARCHIVE_CHUNK_FRAMES);
+    builder.names = (BlockArchiveName*)(builder.index + BLOCK_BLOCK_SIZE);
+    builder.chunk = (char*)(builder.names + BLOCK_MAX_TOTAL_FILES);
+    builder.packed = builder.chunk + ARCHIVE_CHUNK_SIZE;
+    wanted = (uint8_t*)(builder.packed + ARCHIVE_CHUNK_SIZE);
+    builder.filled = 0;
+    builder.offset = sizeof(BlockArchiveHeader);
+
+    // The image holds the store as it is now, the frames the cache has not
+    // written back and the metadata of the session are written to it first
+    lockDriver();
+    if (!isOn || flush_block_cache() == -1
+        || (!block_backend_readonly()
+            && (storeFileTable() == -1 || storeEpochTable() == -1 || storeGenTable() == -1 || storeSuperblock() == -1))) {
+        pthread_mutex_unlock(&blockDriverLock);
+        logMessage(LOG_ERROR_LEVEL, "Failure writing the store out before sealing [%s]", path);
+        block_memory_free(BLOCK_MEM_BUFFERS, buffers, tables);
+        free(temp);
+        return (-1);
+    }
+
+    // The metadata area, and the frames of the current format
+    memset(wanted, 0, BLOCK_BLOCK_SIZE);
+    memset(wanted + BLOCK_SUPERBLOCK_FRAME, 1, BLOCK_DATA_FRAME_START - BLOCK_SUPERBLOCK_FRAME);
+    for (frame_nr = 0; frame_nr < BLOCK_BLOCK_SIZE; frame_nr++) {
+        wanted[frame_nr] |= isChangedFrame(frame_nr, 0);
+    }
+    if ((fh = fopen(temp, "wb")) == NULL) {
+        pthread_mutex_unlock(&blockDriverLock);
+        logMessage(LOG_ERROR_LEVEL, "Failure creating the archive [%s]", path);
+        block_memory_free(BLOCK_MEM_BUFFERS, buffers, tables);
+        free(temp);
+        return (-1);
+    }
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, fh) != 1) {
+        ret = -1;
+    }
+
+    for (frame_nr = 0; frame_nr < BLOCK_BLOCK_SIZE && ret == 0; frame_nr++) {
+        if (!wanted[frame_nr]) {
+            continue;
+        }
+        if (fetchFrame(frame, frame_nr) == -1) {
+            ret = -1;
+            break;
+        }
+        if (memcmp(frame, zeros, BLOCK_FRAME_SIZE) == 0) {
+            seal->zero_frames++;
+            continue;
+        }
+        // The file table entries give the name table
+        if (frame_nr < BLOCK_MAX_TOTAL_FILES) {
+            memcpy(&file, frame, sizeof(file_t));
+            if (file.name[0] != '\0') {
+                memset(builder.names[seal->names].name, 0, BLOCK_MAX_PATH_LENGTH);
+                strncpy(builder.names[seal->names].name, file.name, BLOCK_MAX_PATH_LENGTH - 1);
+                builder.names[seal->names].size = file.size;
+                builder.names[seal->names].frames = file.nrFrames;
+                seal->names++;
+            }
+        }
+        entry = &builder.index[seal->frames];
+        entry->frame = frame_nr;
+        entry->pad = 0;
+        compute_frame_checksum(frame, &entry->checksum);
+        BLOCK_STAT_ADD(checksums, 1);
+        memcpy(builder.chunk + builder.filled * BLOCK_FRAME_SIZE, frame, BLOCK_FRAME_SIZE);
+        builder.filled++;
+        seal->frames++;
+        if (builder.filled == BLOCK_ARCHIVE_CHUNK_FRAMES) {
+            ret = archive_emit(fh, &builder, seal);
+        }
+    }
+    if (ret == 0) {
+        ret = archive_emit(fh, &builder, seal);
+    }
+
+    // The tables, then the header pointing at them
+    header.magic = BLOCK_ARCHIVE_MAGIC;
+    header.version = BLOCK_ARCHIVE_VERSION;
+    header.generation = superblock.generation;
+    header.frames = seal->frames;
+    header.chunks = seal->chunks;
+    header.names = seal->names;
+    if (ret == 0
+        && (archive_table(fh, &builder, builder.chunks, sizeof(BlockArchiveChunk) * seal->chunks, &header.chunks_offset) == -1
+            || archive_table(fh, &builder, builder.index, sizeof(BlockArchiveEntry) * seal->frames, &header.index_offset) == -1
+            || archive_table(fh, &builder, builder.names, sizeof(BlockArchiveName) * seal->names, &header.names_offset) == -1)) {
+        ret = -1;
+    }
+    header.size = builder.offset;
+    if (ret == 0 && (fseek(fh, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fh) != 1)) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&blockDriverLock);
+    if (ret == 0 && fflush(fh) != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && fsync(fileno(fh)) != 0) {
+        ret = -1;
+    }
+    if (fclose(fh) != 0) {
+        ret = -1;
+    }
+
+    // A partial image is never left under the name of the archive
+    if (ret == 0 && rename(temp, path) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        unlink(temp);
+        logMessage(LOG_ERROR_LEVEL, "Failure writing the archive [%s]", path);
+    }
+    seal->image_bytes = header.size;
+    block_memory_free(BLOCK_MEM_BUFFERS, buffers, tables);
+    free(temp);
+    return (ret);
+}
+
+//
+// Archive backend
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_chunk
+// Description  : Make a chunk the current chunk, decompressing it if needed
+//
+// Inputs       : state - the archive state
+//                chunk_nr - the index of the chunk
+// Outputs      : 0 if successful, -1 if the chunk is corrupted
+
+static int archive_chunk(ArchiveState* state, uint32_t chunk_nr)
+{
+    const BlockArchiveChunk* chunk = &state->chunks[chunk_nr];
+
+    if (state->currentChunk == chunk_nr) {
+        return (0);
+    }
+    state->currentChunk = -1;
+    if (chunk->offset > state->size || chunk->length > state->size - chunk->offset
+        || chunk->frames == 0 || chunk->frames > BLOCK_ARCHIVE_CHUNK_FRAMES) {
+        return (-1);
+    }
+    if (chunk->flags & BLOCK_ARCHIVE_RAW) {
+        // Read in place from the mapping
+        if (chunk->length != chunk->frames * BLOCK_FRAME_SIZE) {
+            return (-1);
+        }
+        state->current = state->image + chunk->offset;
+    } else {
+        if (block_decompress_buffer(state->image + chunk->offset, chunk->length, state->buffer,
+                chunk->frames * BLOCK_FRAME_SIZE) == -1) {
+            return (-1);
+        }
+        state->current = state->buffer;
+        state->stats.decodes++;
+    }
+    state->currentChunk = chunk_nr;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_read
+// Description  : Read a frame of an archive, a frame not in the index reads
+//                as zeros
+//
+// Inputs       : backend - the archive backend
+//                frame_nr - the frame to read
+//                frame - the buffer to fill
+//                checksum - set to the checksum of the frame
+// Outputs      : 0 if successful, -1 if the frame is corrupted
+
+static int archive_read(BlockBackend* backend, uint16_t frame_nr, void* frame, uint32_t* checksum)
+{
+    ArchiveState* state = backend->state;
+    uint32_t low = 0, high = state->header->frames, middle;
+
+    // The index is sorted by frame number
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (state->index[middle].frame < frame_nr) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    state->stats.reads++;
+    if (low == state->header->frames || state->index[low].frame != frame_nr) {
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        compute_frame_checksum(frame, checksum);
+        state->stats.zero_reads++;
+        return (0);
+    }
+    if (archive_chunk(state, low / BLOCK_ARCHIVE_CHUNK_FRAMES) == -1
+        || low % BLOCK_ARCHIVE_CHUNK_FRAMES >= state->chunks[low / BLOCK_ARCHIVE_CHUNK_FRAMES].frames) {
+        state->stats.bad_frames++;
+        return (-1);
+    }
+    memcpy(frame, state->current + (low % BLOCK_ARCHIVE_CHUNK_FRAMES) * BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE);
+    compute_frame_checksum(frame, checksum);
+    BLOCK_STAT_ADD(checksums, 1);
+    if (*checksum != state->index[low].checksum) {
+        state->stats.bad_frames++;
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_flush
+// Description  : Nothing to make durable, the image is never written
+//
+// Inputs       : backend - the archive backend
+// Outputs      : 0
+
+static int archive_flush(BlockBackend* backend)
+{
+    (void)backend;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_close
+// Description  : Unmap and close an archive backend
+//
+// Inputs       : backend - the archive backend
+// Outputs      : 0 if successful, -1 if failure
+
+static int archive_close(BlockBackend* backend)
+{
+    ArchiveState* state = backend->state;
+    int ret = 0;
+
+    if (munmap(state->image, state->size) == -1) {
+        ret = -1;
+    }
+    close(state->fd);
+    free(state->buffer);
+    free(state);
+    free(backend);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_check
+// Description  : Check that the header of an image is valid and that its
+//                tables are inside it
+//
+// Inputs       : image - the mapped image
+//                size - the size of the image
+// Outputs      : 0 if valid, -1 otherwise
+
+static int archive_check(const char* image, size_t size)
+{
+    const BlockArchiveHeader* header = (const BlockArchiveHeader*)image;
+
+    if (size < sizeof(BlockArchiveHeader) || header->magic != BLOCK_ARCHIVE_MAGIC
+        || header->version != BLOCK_ARCHIVE_VERSION || header->size != size) {
+        return (-1);
+    }
+    if (header->frames > BLOCK_BLOCK_SIZE || header->names > BLOCK_MAX_TOTAL_FILES
+        || header->chunks != (header->frames + BLOCK_ARCHIVE_CHUNK_FRAMES - 1) / BLOCK_ARCHIVE_CHUNK_FRAMES) {
+        return (-1);
+    }
+    if ((header->chunks_offset | header->index_offset | header->names_offset) & 7
+        || header->chunks_offset > size || sizeof(BlockArchiveChunk) * header->chunks > size - header->chunks_offset
+        || header->index_offset > size || sizeof(BlockArchiveEntry) * header->frames > size - header->index_offset
+        || header->names_offset > size || sizeof(BlockArchiveName) * header->names > size - header->names_offset) {
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_backend_archive
+// Description  : Open a read-only backend serving the frames of an image,
+//                mapped in memory
+//
+// Inputs       : path - the image
+// Outputs      : the backend, NULL on failure
+
+BlockBackend* block_backend_archive(const char* path)
+{
+    BlockBackend* backend;
+    ArchiveState* state;
+    struct stat st;
+    char* image;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the archive [%s]", path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return (NULL);
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Failure mapping the archive [%s]", path);
+        close(fd);
+        return (NULL);
+    }
+    if (archive_check(image, st.st_size) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "The archive [%s] is not a valid image", path);
+        munmap(image, st.st_size);
+        close(fd);
+        return (NULL);
+    }
+    backend = malloc(sizeof(BlockBackend));
+    state = calloc(1, sizeof(ArchiveState));
+    if (backend == NULL || state == NULL || (state->buffer = malloc(ARCHIVE_CHUNK_SIZE)) == NULL) {
+        free(backend);
+        free(state);
+        munmap(image, st.st_size);
+        close(fd);
+        return (NULL);
+    }
+    state->fd = fd;
+    state->image = image;
+    state->size = st.st_size;
+    state->header = (const BlockArchiveHeader*)image;
+    state->chunks = (const BlockArchiveChunk*)(image + state->header->chunks_offset);
+    state->index = (const BlockArchiveEntry*)(image + state->header->index_offset);
+    state->names = (const BlockArchiveName*)(image + state->header->names_offset);
+    state->currentChunk = -1;
+    backend->name = "archive";
+    backend->read = archive_read;
+    backend->write = NULL;
+    backend->flush = archive_flush;
+    backend->close = archive_close;
+    backend->state = state;
+    return (backend);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_archive_names
+// Description  : Get the name table of an archive
+//
+// Inputs       : archive - the archive backend
+//                names - set to the name table, in the mapped image
+// Outputs      : the number of files, -1 if not an archive
+
+int32_t block_archive_names(BlockBackend* archive, const BlockArchiveName** names)
+{
+    ArchiveState* state;
+
+    if (archive == NULL || archive->read != archive_read) {
+        return (-1);
+    }
+    state = archive->state;
+    *names = state->names;
+    return (state->header->names);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_archive_stats
+// Description  : Get the counters of an archive backend
+//
+// Inputs       : archive - the archive backend
+//                stats - the counters to fill
+// Outputs      : 0 if successful, -1 if not an archive
+
+int block_archive_stats(BlockBackend* archive, BlockArchiveStats* stats)
+{
+    ArchiveState* state;
+
+    if (archive == NULL || archive->read != archive_read) {
+        return (-1);
+    }
+    state = archive->state;
+    *stats = state->stats;
+    return (0);
+}
+
+//
+// Unit test
+
+// Files of the unit test and their sizes
+static char* unitNames[] = {"text", "noise", "small"};
+static int32_t unitSizes[] = {3 * BLOCK_FRAME_SIZE, 2 * BLOCK_FRAME_SIZE, 100};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_fill
+// Description  : Fill a buffer with the data of a file of the unit test, the
+//                first file compresses and the others do not
+//
+// Inputs       : buf - the buffer
+//                file - the index of the file
+// Outputs      : none
+
+static void unit_fill(char* buf, int file)
+{
+    uint32_t seed = file + 1;
+    int32_t i;
+
+    for (i = 0; i < unitSizes[file]; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (file == 0) ? 'a' + i % 26 : (char)(seed >> 24);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_seal
+// Description  : Session of the unit test writing the files and sealing the
+//                store while it is still on, the write-back frames of the
+//                first file are still dirty in the cache then
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_seal(void)
+{
+    BlockArchiveSeal seal;
+    char data[3 * BLOCK_FRAME_SIZE];
+    int16_t fd;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    for (i = 0; i < 3 && ret == 0; i++) {
+        unit_fill(data, i);
+        if ((fd = block_open_policy(unitNames[i], (i == 0) ? BLOCK_WRITE_BACK : BLOCK_WRITE_THROUGH)) == -1
+            || block_write(fd, data, unitSizes[i]) != unitSizes[i] || block_close(fd) == -1) {
+            ret = -1;
+        }
+    }
+    if (ret == 0 && (block_archive_seal(BLOCK_UNIT_IMAGE, &seal) == -1 || seal.names != 3 || seal.chunks < 2)) {
+        logMessage(LOG_ERROR_LEVEL, "The store was not sealed into an archive.");
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_read_back
+// Description  : Session of the unit test reading the files back from the
+//                archive only, the store can't be changed
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_read_back(void)
+{
+    char data[3 * BLOCK_FRAME_SIZE + 1], expected[3 * BLOCK_FRAME_SIZE];
+    int16_t fd;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_archive(BLOCK_UNIT_IMAGE)) == -1 || block_get_backend() == NULL
+        || block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "The store can't be mounted from the archive.");
+        return (-1);
+    }
+    for (i = 0; i < 3 && ret == 0; i++) {
+        unit_fill(expected, i);
+        if ((fd = block_open(unitNames[i])) == -1 || block_read(fd, data, unitSizes[i] + 1) != unitSizes[i]
+            || memcmp(data, expected, unitSizes[i]) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "File %s does not read back from the archive.", unitNames[i]);
+            ret = -1;
+        }
+        if (ret == 0 && (block_seek(fd, 0) == -1 || block_write(fd, data, 1) != -1)) {
+            logMessage(LOG_ERROR_LEVEL, "File %s was written in the archive.", unitNames[i]);
+            ret = -1;
+        }
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_corrupt
+// Description  : Check the reads of an archive with a byte of its last chunk
+//                changed, the frames of the chunk that don't match their
+//                checksum fail and the other chunks still read. An image cut
+//                short is not opened.
+//
+// Inputs       : path - the image
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_corrupt(const char* path)
+{
+    BlockArchiveHeader header;
+    BlockArchiveChunk chunk;
+    BlockArchiveStats stats;
+    BlockBackend* archive;
+    char frame[BLOCK_FRAME_SIZE], byte;
+    uint32_t checksum, i;
+    int fd, bad = 0, ret = 0;
+
+    if ((fd = open(path, O_RDWR)) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || pread(fd, &chunk, sizeof(chunk), header.chunks_offset + (header.chunks - 1) * sizeof(chunk)) != sizeof(chunk)
+        || pread(fd, &byte, 1, chunk.offset + chunk.length / 2) != 1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return (-1);
+    }
+    byte ^= 0x5a;
+    if (pwrite(fd, &byte, 1, chunk.offset + chunk.length / 2) != 1 || (archive = block_backend_archive(path)) == NULL) {
+        close(fd);
+        return (-1);
+    }
+    for (i = 0; i < header.frames; i++) {
+        uint16_t frame_nr = ((const ArchiveState*)archive->state)->index[i].frame;
+        if (archive->read(archive, frame_nr, frame, &checksum) == -1) {
+            bad++;
+            if (i / BLOCK_ARCHIVE_CHUNK_FRAMES != header.chunks - 1) {
+                logMessage(LOG_ERROR_LEVEL, "Frame %u of a chunk left as is does not read.", frame_nr);
+                ret = -1;
+            }
+        }
+    }
+    block_archive_stats(archive, &stats);
+    if (bad == 0 || stats.bad_frames != bad) {
+        logMessage(LOG_ERROR_LEVEL, "The frames of the corrupted chunk were read.");
+        ret = -1;
+    }
+    archive->close(archive);
+
+    // The size in the header no longer matches
+    if (ftruncate(fd, header.size - 1) == -1 || (archive = block_backend_archive(path)) != NULL) {
+        if (archive != NULL) {
+            archive->close(archive);
+        }
+        logMessage(LOG_ERROR_LEVEL, "An archive cut short was opened.");
+        ret = -1;
+    }
+    close(fd);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockArchiveUnitTest
+// Description  : Run a UNIT test sealing a store and reading it back from
+//                the archive, then reading a corrupted archive
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockArchiveUnitTest(void)
+{
+    char dir[32], path[64];
+    int ret = 0;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, BLOCK_UNIT_IMAGE);
+    if (unitSession(dir, unit_seal) == -1 || unitSession(dir, unit_read_back) == -1 || unit_corrupt(path) == -1) {
+        ret = -1;
+    }
+    unitCleanup(dir);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Archive unit test failed.");
+        return (-1);
+    }
+
+    // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Archive unit test completed successfully.");
+    return (0);
+}
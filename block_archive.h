@@ -0,0 +1,112 @@
+#ifndef BLOCK_ARCHIVE_INCLUDED
+#define BLOCK_ARCHIVE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_archive.h
+//  Description    : This is the header file for the sealed archives of the
+//                   BLOCK memory system. An archive is an immutable image of
+//                   a store: its frames compressed in chunks, an index of the
+//                   frames sorted by frame number and a table of the files.
+//                   The image is memory mapped by a read-only backend, so that
+//                   the files of a cold store are read in place through the
+//                   cache, one chunk decompressed at a time.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_backend.h>
+#include <block_driver.h>
+
+// Defines
+#define BLOCK_ARCHIVE_MAGIC 0x414b4c42 // "BLKA"
+#define BLOCK_ARCHIVE_VERSION 1
+#define BLOCK_ARCHIVE_CHUNK_FRAMES 8 // Frames compressed together
+#define BLOCK_ARCHIVE_RAW 0x1 // The chunk did not compress, it is stored as is
+
+// Header at the start of an image, followed by the chunks, then the chunk
+// table, the frame index and the name table (each 8 byte aligned)
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t generation; // Generation of the store sealed
+    uint32_t frames; // Frames in the index, the others read as zeros
+    uint32_t chunks; // Chunks in the chunk table
+    uint32_t names; // Files in the name table
+    uint64_t chunks_offset; // Offset of the chunk table
+    uint64_t index_offset; // Offset of the frame index
+    uint64_t names_offset; // Offset of the name table
+    uint64_t size; // Size of the image
+} BlockArchiveHeader;
+
+// Chunk of the image, frames i * BLOCK_ARCHIVE_CHUNK_FRAMES onwards of the
+// index compressed together
+typedef struct {
+    uint64_t offset; // Offset of the data in the image
+    uint32_t length; // Length of the data
+    uint16_t frames; // Frames in the chunk
+    uint16_t flags; // BLOCK_ARCHIVE_RAW if stored as is
+} BlockArchiveChunk;
+
+// Frame of the index
+typedef struct {
+    uint16_t frame; // Frame number in the store
+    uint16_t pad;
+    uint32_t checksum; // Checksum of the frame, checked when read
+} BlockArchiveEntry;
+
+// File of the name table
+typedef struct {
+    char name[BLOCK_MAX_PATH_LENGTH];
+    uint32_t size; // Size of the file in bytes
+    uint32_t frames; // Frames of the file (0 for a small file in a fragment)
+} BlockArchiveName;
+
+// Result of a seal
+typedef struct {
+    uint32_t frames; // Frames sealed
+    uint32_t zero_frames; // Frames left out as they only hold zeros
+    uint32_t chunks; // Chunks written
+    uint32_t raw_chunks; // Chunks stored as is
+    uint32_t names; // Files in the name table
+    uint64_t image_bytes; // Size of the image
+} BlockArchiveSeal;
+
+// Counters of an archive backend
+typedef struct {
+    uint64_t reads; // Frames read from the image
+    uint64_t zero_reads; // Frames read that are not in the image (zeros)
+    uint64_t decodes; // Chunks decompressed
+    uint64_t bad_frames; // Frames that did not match their checksum
+} BlockArchiveStats;
+
+//
+// Functional Prototypes
+
+int block_archive_seal(const char* path, BlockArchiveSeal* seal);
+// Write the frames of the store to the image "path". The driver must be
+// powered on, the store is written out first (dirty frames, file table and
+// tables) so the files sealed are those of the store as it is. A failed seal
+// leaves no image behind.
+
+BlockBackend* block_backend_archive(const char* path);
+// Open a read-only backend serving the frames of the image "path"
+
+int32_t block_archive_names(BlockBackend* archive, const BlockArchiveName** names);
+// Point "names" at the name table of an archive, returns the number of files
+// (-1 if the backend is not an archive)
+
+int block_archive_stats(BlockBackend* archive, BlockArchiveStats* stats);
+// Get the counters of an archive backend
+
+//
+// Unit test
+
+int blockArchiveUnitTest(void);
+// Run a UNIT test checking the seal and the archive backend
+
+#endif
@@ -0,0 +1,929 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_backend.c
+//  Description    : This is the implementation of the frame backends of the
+//                   BLOCK memory system driver, a memory mapped file and a
+//                   mirror writing the frames to two backends.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_backend.h>
+#include <block_controller.h>
+#include <block_driver_helper.h>
+#include <block_memory.h>
+#include <block_stats.h>
+#include <cmpsc311_log.h>
+
+// Checksum kept with each frame of a file backend
+typedef struct {
+    uint32_t checksum;
+    uint32_t written; // Set once the frame is written (unwritten frames read as zeros)
+} BlockFileTag;
+
+// State of a file backend, the tags follow the frames in the file
+typedef struct {
+    int fd;
+    char* frames;
+    BlockFileTag* tags;
+    size_t size;
+} BlockFileState;
+
+// Write waiting for the secondary of a mirror
+typedef struct {
+    uint16_t frame_nr;
+    uint32_t checksum;
+    char data[BLOCK_FRAME_SIZE];
+} BlockMirrorWrite;
+
+// State of a mirror, the primary is written synchronously and the writes to
+// the secondary are queued for its worker. A frame the secondary failed to
+// write is stale there, it is only read from the primary until the worker
+// copies it over again.
+typedef struct {
+    BlockBackend* replicas[2]; // Primary and secondary
+    BlockMirrorWrite* queue; // Ring of the writes the secondary is behind
+    uint32_t max_lag;
+    uint32_t head;
+    uint32_t count;
+    int next; // Replica of the next read when both are idle
+    int stopping;
+    uint8_t stale[BLOCK_BLOCK_SIZE]; // Frames the secondary is missing
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Signaled when a write is queued
+    pthread_cond_t drained; // Signaled when the secondary catches up a write
+    BlockMirrorStats stats;
+} BlockMirrorState;
+
+// Global data
+BlockBackend* blockBackend = NULL;
+int blockBackendGather = 0;
+extern int isOn;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_set_backend
+// Description  : Send the frame reads and writes to a backend, closing the
+//                previous one
+//
+// Inputs       : backend - the backend, NULL for the bus
+// Outputs      : 0 if successful, -1 if failure
+
+int block_set_backend(BlockBackend* backend)
+{
+    // The frames can't move while the driver is using them
+    if (isOn) {
+        return (-1);
+    }
+    if (blockBackend != NULL && blockBackend != backend) {
+        blockBackend->close(blockBackend);
+    }
+    blockBackend = backend;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_get_backend
+// Description  : Get the backend the frames go to
+//
+// Inputs       : none
+// Outputs      : the backend, NULL for the bus
+
+BlockBackend* block_get_backend(void)
+{
+    return (blockBackend);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_backend_readonly
+// Description  : Check if the frames go to a read-only backend
+//
+// Inputs       : none
+// Outputs      : 1 if read-only, 0 otherwise
+
+int block_backend_readonly(void)
+{
+    return ((blockBackend != NULL) && (blockBackend->write == NULL));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_backend_flush
+// Description  : Make the frames written to the backend durable
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int block_backend_flush(void)
+{
+    if (blockBackend == NULL) {
+        return (0);
+    }
+    return (blockBackend->flush(blockBackend));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_backend_gather
+// Description  : Mark the writes that follow as frames written back by the
+//                cache, the backend may hold them until it is flushed
+//
+// Inputs       : gather - 1 for the frames written back, 0 for the others
+// Outputs      : none
+
+void block_backend_gather(int gather)
+{
+    blockBackendGather = gather;
+}
+
+//
+// File backend
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_read
+// Description  : Read a frame of a file backend and check its checksum
+//
+// Inputs       : backend - the file backend
+//                frame_nr - the frame to read
+//                frame - the buffer to fill
+//                checksum - set to the checksum of the frame
+// Outputs      : 0 if successful, -1 if the frame does not match its checksum
+
+static int file_read(BlockBackend* backend, uint16_t frame_nr, void* frame, uint32_t* checksum)
+{
+    BlockFileState* state = backend->state;
+    BlockFileTag tag = state->tags[frame_nr];
+
+    memcpy(frame, state->frames + (size_t)frame_nr * BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE);
+    compute_frame_checksum(frame, checksum);
+    BLOCK_STAT_ADD(checksums, 1);
+    if (!tag.written) {
+        return (0);
+    }
+    return ((*checksum == tag.checksum) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_write
+// Description  : Write a frame of a file backend with its checksum
+//
+// Inputs       : backend - the file backend
+//                frame_nr - the frame to write
+//                frame - the data of the frame
+//                checksum - the checksum of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int file_write(BlockBackend* backend, uint16_t frame_nr, const void* frame, uint32_t checksum)
+{
+    BlockFileState* state = backend->state;
+
+    memcpy(state->frames + (size_t)frame_nr * BLOCK_FRAME_SIZE, frame, BLOCK_FRAME_SIZE);
+    state->tags[frame_nr].checksum = checksum;
+    state->tags[frame_nr].written = 1;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_flush
+// Description  : Write the frames of a file backend back to the file
+//
+// Inputs       : backend - the file backend
+// Outputs      : 0 if successful, -1 if failure
+
+static int file_flush(BlockBackend* backend)
+{
+    BlockFileState* state = backend->state;
+    return ((msync(state->frames, state->size, MS_SYNC) == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_close
+// Description  : Flush and close a file backend
+//
+// Inputs       : backend - the file backend
+// Outputs      : 0 if successful, -1 if failure
+
+static int file_close(BlockBackend* backend)
+{
+    BlockFileState* state = backend->state;
+    int ret = 0;
+
+    if (file_flush(backend) == -1 || munmap(state->frames, state->size) == -1) {
+        ret = -1;
+    }
+    close(state->fd);
+    free(state);
+    free(backend);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_backend_file
+// Description  : Open a backend keeping the frames in a memory mapped file,
+//                created (sparse) if needed
+//
+// Inputs       : path - the file
+// Outputs      : the backend, NULL on failure
+
+BlockBackend* block_backend_file(const char* path)
+{
+    BlockBackend* backend;
+    BlockFileState* state;
+    struct stat st;
+    size_t size = (size_t)BLOCK_BLOCK_SIZE * (BLOCK_FRAME_SIZE + sizeof(BlockFileTag));
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1 || fstat(fd, &st) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the frame file [%s]", path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return (NULL);
+    }
+    if ((size_t)st.st_size < size && ftruncate(fd, size) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure sizing the frame file [%s]", path);
+        close(fd);
+        return (NULL);
+    }
+    backend = malloc(sizeof(BlockBackend));
+    state = malloc(sizeof(BlockFileState));
+    if (backend == NULL || state == NULL) {
+        free(backend);
+        free(state);
+        close(fd);
+        return (NULL);
+    }
+    state->frames = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state->frames == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "Failure mapping the frame file [%s]", path);
+        free(backend);
+        free(state);
+        close(fd);
+        return (NULL);
+    }
+    state->fd = fd;
+    state->size = size;
+    state->tags = (BlockFileTag*)(state->frames + (size_t)BLOCK_BLOCK_SIZE * BLOCK_FRAME_SIZE);
+    backend->name = "file";
+    backend->read = file_read;
+    backend->write = file_write;
+    backend->flush = file_flush;
+    backend->close = file_close;
+    backend->state = state;
+    return (backend);
+}
+
+//
+// Mirror backend
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_queued
+// Description  : Find the latest queued write of a frame, with the mirror
+//                lock held
+//
+// Inputs       : state - the mirror state
+//                frame_nr - the frame
+// Outputs      : the write, NULL if the secondary is up to date for the frame
+
+static BlockMirrorWrite* mirror_queued(BlockMirrorState* state, uint16_t frame_nr)
+{
+    uint32_t i;
+    BlockMirrorWrite* write;
+
+    for (i = state->count; i > 0; i--) {
+        write = &state->queue[(state->head + i - 1) % state->max_lag];
+        if (write->frame_nr == frame_nr) {
+            return (write);
+        }
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_resync
+// Description  : Copy the stale frames from the primary to the secondary,
+//                stopping at the first the secondary fails to write. Frames
+//                with a write queued are left to it. Called with the mirror
+//                lock held, it is released while copying.
+//
+// Inputs       : state - the mirror state
+// Outputs      : none
+
+static void mirror_resync(BlockMirrorState* state)
+{
+    char data[BLOCK_FRAME_SIZE];
+    uint32_t checksum, frame_nr;
+    int ret;
+
+    for (frame_nr = 0; frame_nr < BLOCK_BLOCK_SIZE && state->stats.stale > 0; frame_nr++) {
+        if (!state->stale[frame_nr] || mirror_queued(state, frame_nr) != NULL) {
+            continue;
+        }
+        pthread_mutex_unlock(&state->lock);
+        ret = state->replicas[0]->read(state->replicas[0], frame_nr, data, &checksum);
+        if (ret == 0) {
+            ret = state->replicas[1]->write(state->replicas[1], frame_nr, data, checksum);
+            ret = (ret == 0) ? 0 : -2;
+        }
+        pthread_mutex_lock(&state->lock);
+        if (ret == -2) {
+            break;
+        }
+        // A frame bad on the primary too stays stale, it has no good copy
+        if (ret == 0 && state->stale[frame_nr]) {
+            state->stale[frame_nr] = 0;
+            state->stats.stale--;
+            state->stats.resyncs++;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_worker
+// Description  : Body of the worker thread of a mirror, it writes the queued
+//                frames to the secondary, and drains the queue when stopped.
+//                A frame the secondary fails to write is marked stale, and
+//                the stale frames are copied over once the queue is drained
+//                by writes that succeed.
+//
+// Inputs       : arg - the mirror state
+// Outputs      : NULL
+
+static void* mirror_worker(void* arg)
+{
+    BlockMirrorState* state = arg;
+    BlockMirrorWrite* write;
+    int ret;
+
+    pthread_mutex_lock(&state->lock);
+    for (;;) {
+        while (state->count == 0 && !state->stopping) {
+            pthread_cond_wait(&state->wake, &state->lock);
+        }
+        if (state->count == 0) {
+            break;
+        }
+
+        // The entry stays in the queue while it is written, so that the
+        // reads of its frame keep going to the primary
+        write = &state->queue[state->head];
+        pthread_mutex_unlock(&state->lock);
+        ret = state->replicas[1]->write(state->replicas[1], write->frame_nr, write->data, write->checksum);
+        pthread_mutex_lock(&state->lock);
+        if (ret == -1 && !state->stale[write->frame_nr]) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing frame %u to the mirror secondary, it is stale there", write->frame_nr);
+            state->stale[write->frame_nr] = 1;
+            state->stats.stale++;
+        } else if (ret == 0 && state->stale[write->frame_nr]) {
+            state->stale[write->frame_nr] = 0;
+            state->stats.stale--;
+        }
+        state->stats.secondary_failures += (ret == -1);
+        state->head = (state->head + 1) % state->max_lag;
+        state->count--;
+        if (ret == 0 && state->count == 0 && state->stats.stale > 0) {
+            mirror_resync(state);
+        }
+        pthread_cond_broadcast(&state->drained);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_read
+// Description  : Read a frame from the replica with the shortest queue (the
+//                primary while the secondary is behind for the frame), and
+//                from the other replica if the copy is bad, repairing it
+//
+// Inputs       : backend - the mirror
+//                frame_nr - the frame to read
+//                frame - the buffer to fill
+//                checksum - set to the checksum of the frame
+// Outputs      : 0 if successful, -1 if both copies are bad
+
+static int mirror_read(BlockBackend* backend, uint16_t frame_nr, void* frame, uint32_t* checksum)
+{
+    BlockMirrorState* state = backend->state;
+    BlockMirrorWrite* queued;
+    int replica, ret;
+
+    pthread_mutex_lock(&state->lock);
+    queued = mirror_queued(state, frame_nr);
+    if (queued != NULL || state->count > 0 || state->stale[frame_nr]) {
+        replica = 0;
+    } else {
+        replica = state->next;
+        state->next ^= 1;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    if (state->replicas[replica]->read(state->replicas[replica], frame_nr, frame, checksum) == 0) {
+        pthread_mutex_lock(&state->lock);
+        if (replica == 0) {
+            state->stats.primary_reads++;
+        } else {
+            state->stats.secondary_reads++;
+        }
+        pthread_mutex_unlock(&state->lock);
+        return (0);
+    }
+
+    // The copy is bad, the latest data is in the queue or on the other replica
+    pthread_mutex_lock(&state->lock);
+    state->stats.failovers++;
+    if ((queued = mirror_queued(state, frame_nr)) != NULL) {
+        memcpy(frame, queued->data, BLOCK_FRAME_SIZE);
+        *checksum = queued->checksum;
+        ret = 0;
+    } else {
+        // A stale copy on the secondary is older than the bad primary one
+        ret = state->stale[frame_nr] ? -1 : 1;
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (ret == 1) {
+        ret = state->replicas[replica ^ 1]->read(state->replicas[replica ^ 1], frame_nr, frame, checksum);
+    }
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Both mirror copies of frame %u are bad", frame_nr);
+        return (-1);
+    }
+    if (state->replicas[replica]->write(state->replicas[replica], frame_nr, frame, *checksum) == 0) {
+        pthread_mutex_lock(&state->lock);
+        state->stats.repairs++;
+        pthread_mutex_unlock(&state->lock);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_write
+// Description  : Write a frame to the primary, and queue it for the
+//                secondary, waiting when the secondary is too far behind
+//
+// Inputs       : backend - the mirror
+//                frame_nr - the frame to write
+//                frame - the data of the frame
+//                checksum - the checksum of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int mirror_write(BlockBackend* backend, uint16_t frame_nr, const void* frame, uint32_t checksum)
+{
+    BlockMirrorState* state = backend->state;
+    BlockMirrorWrite* write;
+
+    if (state->replicas[0]->write(state->replicas[0], frame_nr, frame, checksum) == -1) {
+        return (-1);
+    }
+    pthread_mutex_lock(&state->lock);
+    if (state->count == state->max_lag) {
+        state->stats.lag_waits++;
+        while (state->count == state->max_lag) {
+            pthread_cond_wait(&state->drained, &state->lock);
+        }
+    }
+    write = &state->queue[(state->head + state->count) % state->max_lag];
+    write->frame_nr = frame_nr;
+    write->checksum = checksum;
+    memcpy(write->data, frame, BLOCK_FRAME_SIZE);
+    state->count++;
+    if (state->count > state->stats.max_lag) {
+        state->stats.max_lag = state->count;
+    }
+    pthread_cond_signal(&state->wake);
+    pthread_mutex_unlock(&state->lock);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_flush
+// Description  : Wait for the secondary to catch up and copy the stale
+//                frames over, then flush both replicas. A mirror left
+//                degraded fails the flush, only the primary holds every
+//                frame.
+//
+// Inputs       : backend - the mirror
+// Outputs      : 0 if successful, -1 if failure (or degraded)
+
+static int mirror_flush(BlockBackend* backend)
+{
+    BlockMirrorState* state = backend->state;
+    int ret = 0;
+
+    pthread_mutex_lock(&state->lock);
+    while (state->count > 0) {
+        pthread_cond_wait(&state->drained, &state->lock);
+    }
+    if (state->stats.stale > 0) {
+        mirror_resync(state);
+    }
+    if (state->stats.stale > 0) {
+        logMessage(LOG_ERROR_LEVEL, "The mirror is degraded, %u frames are stale on the secondary", state->stats.stale);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (state->replicas[0]->flush(state->replicas[0]) == -1) {
+        ret = -1;
+    }
+    if (state->replicas[1]->flush(state->replicas[1]) == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_close
+// Description  : Let the secondary catch up, then close both replicas
+//
+// Inputs       : backend - the mirror
+// Outputs      : 0 if successful, -1 if failure
+
+static int mirror_close(BlockBackend* backend)
+{
+    BlockMirrorState* state = backend->state;
+    int ret = 0;
+
+    pthread_mutex_lock(&state->lock);
+    state->stopping = 1;
+    pthread_cond_signal(&state->wake);
+    pthread_mutex_unlock(&state->lock);
+    pthread_join(state->worker, NULL);
+
+    if (state->replicas[0]->close(state->replicas[0]) == -1) {
+        ret = -1;
+    }
+    if (state->replicas[1]->close(state->replicas[1]) == -1) {
+        ret = -1;
+    }
+    block_memory_free(BLOCK_MEM_BUFFERS, state->queue, sizeof(BlockMirrorWrite) * state->max_lag);
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->wake);
+    pthread_cond_destroy(&state->drained);
+    free(state);
+    free(backend);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_backend_mirror
+// Description  : Open a backend writing every frame to two backends, the
+//                secondary being written in the background
+//
+// Inputs       : primary - the backend written synchronously
+//                secondary - the backend written in the background
+//                max_lag - most writes the secondary may be behind (0 for
+//                          the default)
+// Outputs      : the backend, NULL on failure
+
+BlockBackend* block_backend_mirror(BlockBackend* primary, BlockBackend* secondary, uint32_t max_lag)
+{
+    BlockBackend* backend;
+    BlockMirrorState* state;
+
+    if (primary == NULL || secondary == NULL) {
+        return (NULL);
+    }
+    if (max_lag == 0) {
+        max_lag = BLOCK_MIRROR_MAX_LAG;
+    }
+    backend = malloc(sizeof(BlockBackend));
+    state = calloc(1, sizeof(BlockMirrorState));
+    if (backend == NULL || state == NULL) {
+        free(backend);
+        free(state);
+        return (NULL);
+    }
+    state->queue = block_memory_alloc(BLOCK_MEM_BUFFERS, sizeof(BlockMirrorWrite) * max_lag);
+    if (state->queue == NULL) {
+        free(backend);
+        free(state);
+        return (NULL);
+    }
+    state->replicas[0] = primary;
+    state->replicas[1] = secondary;
+    state->max_lag = max_lag;
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->wake, NULL);
+    pthread_cond_init(&state->drained, NULL);
+    if (pthread_create(&state->worker, NULL, mirror_worker, state) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Failure starting the mirror worker");
+        block_memory_free(BLOCK_MEM_BUFFERS, state->queue, sizeof(BlockMirrorWrite) * max_lag);
+        free(backend);
+        free(state);
+        return (NULL);
+    }
+    backend->name = "mirror";
+    backend->read = mirror_read;
+    backend->write = mirror_write;
+    backend->flush = mirror_flush;
+    backend->close = mirror_close;
+    backend->state = state;
+    return (backend);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mirror_stats
+// Description  : Get the counters of a mirror
+//
+// Inputs       : mirror - the mirror
+//                stats - the structure to fill
+// Outputs      : 0 if successful, -1 if the backend is not a mirror
+
+int block_mirror_stats(BlockBackend* mirror, BlockMirrorStats* stats)
+{
+    BlockMirrorState* state;
+
+    if (mirror == NULL || mirror->read != mirror_read) {
+        return (-1);
+    }
+    state = mirror->state;
+    pthread_mutex_lock(&state->lock);
+    *stats = state->stats;
+    pthread_mutex_unlock(&state->lock);
+    return (0);
+}
+
+//
+// Unit test
+
+// Set to make the writes of the failing backend of the unit test fail
+static int unitFailWrites = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_frame
+// Description  : Fill a frame with the data the unit test writes to it
+//
+// Inputs       : frame - the frame
+//                frame_nr - the frame number
+//                version - the version of the frame
+//                checksum - set to the checksum of the frame
+// Outputs      : none
+
+static void unit_frame(char* frame, uint16_t frame_nr, int version, uint32_t* checksum)
+{
+    int i;
+    for (i = 0; i < BLOCK_FRAME_SIZE; i++) {
+        frame[i] = (char)(frame_nr * 31 + version * 7 + i);
+    }
+    compute_frame_checksum(frame, checksum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_read_matches
+// Description  : Check that a frame reads back as written by the unit test
+//
+// Inputs       : backend - the backend
+//                frame_nr - the frame number
+//                version - the version of the frame expected
+// Outputs      : 0 if it does, -1 otherwise
+
+static int unit_read_matches(BlockBackend* backend, uint16_t frame_nr, int version)
+{
+    char frame[BLOCK_FRAME_SIZE], expected[BLOCK_FRAME_SIZE];
+    uint32_t checksum, read_checksum;
+
+    unit_frame(expected, frame_nr, version, &checksum);
+    if (backend->read(backend, frame_nr, frame, &read_checksum) == -1 || read_checksum != checksum
+        || memcmp(frame, expected, BLOCK_FRAME_SIZE) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Frame %u does not read back from the %s backend.", frame_nr, backend->name);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_failing_read
+// Description  : Read a frame of the failing backend of the unit test, a
+//                file backend whose writes fail while unitFailWrites is set
+//
+// Inputs       : see file_read
+// Outputs      : see file_read
+
+static int unit_failing_read(BlockBackend* backend, uint16_t frame_nr, void* frame, uint32_t* checksum)
+{
+    BlockBackend* file = backend->state;
+    return (file->read(file, frame_nr, frame, checksum));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_failing_write
+// Description  : Write a frame of the failing backend, it fails while
+//                unitFailWrites is set
+//
+// Inputs       : see file_write
+// Outputs      : see file_write
+
+static int unit_failing_write(BlockBackend* backend, uint16_t frame_nr, const void* frame, uint32_t checksum)
+{
+    BlockBackend* file = backend->state;
+    if (__atomic_load_n(&unitFailWrites, __ATOMIC_RELAXED)) {
+        return (-1);
+    }
+    return (file->write(file, frame_nr, frame, checksum));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_failing_flush
+// Description  : Flush the failing backend
+//
+// Inputs       : see file_flush
+// Outputs      : see file_flush
+
+static int unit_failing_flush(BlockBackend* backend)
+{
+    BlockBackend* file = backend->state;
+    return (file->flush(file));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_failing_close
+// Description  : Close the failing backend and its file backend
+//
+// Inputs       : see file_close
+// Outputs      : see file_close
+
+static int unit_failing_close(BlockBackend* backend)
+{
+    BlockBackend* file = backend->state;
+    free(backend);
+    return (file->close(file));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_mirror
+// Description  : Check the reads of a mirror with a bad copy on either
+//                replica, with both copies bad, and with the secondary
+//                failing its writes (degraded) until it is resynced
+//
+// Inputs       : dir - the directory of the replica files
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_mirror(const char* dir)
+{
+    BlockBackend *primary, *file, *secondary, *mirror;
+    BlockMirrorStats stats;
+    uint64_t secondary_reads;
+    char path[64], frame[BLOCK_FRAME_SIZE];
+    uint32_t checksum;
+    int i, ret = 0;
+
+    snprintf(path, sizeof(path), "%s/primary", dir);
+    primary = block_backend_file(path);
+    snprintf(path, sizeof(path), "%s/secondary", dir);
+    file = block_backend_file(path);
+    secondary = malloc(sizeof(BlockBackend));
+    if (primary == NULL || file == NULL || secondary == NULL) {
+        if (primary != NULL) {
+            primary->close(primary);
+        }
+        if (file != NULL) {
+            file->close(file);
+        }
+        free(secondary);
+        return (-1);
+    }
+    secondary->name = "failing";
+    secondary->read = unit_failing_read;
+    secondary->write = unit_failing_write;
+    secondary->flush = unit_failing_flush;
+    secondary->close = unit_failing_close;
+    secondary->state = file;
+    if ((mirror = block_backend_mirror(primary, secondary, 4)) == NULL) {
+        primary->close(primary);
+        secondary->close(secondary);
+        return (-1);
+    }
+    for (i = 0; i < 16; i++) {
+        unit_frame(frame, i, 0, &checksum);
+        if (mirror->write(mirror, i, frame, checksum) == -1) {
+            ret = -1;
+        }
+    }
+    mirror->flush(mirror);
+
+    // A bad copy on either replica is read from the other and repaired,
+    // whichever replica the reads go to first
+    unit_frame(frame, 3, 1, &checksum);
+    primary->write(primary, 3, frame, checksum + 1);
+    file->write(file, 5, frame, checksum + 1);
+    for (i = 0; i < 2 && ret == 0; i++) {
+        ret = (unit_read_matches(mirror, 3, 0) == 0 && unit_read_matches(mirror, 5, 0) == 0) ? 0 : -1;
+    }
+    block_mirror_stats(mirror, &stats);
+    if (ret == 0 && (stats.failovers != 2 || stats.repairs != 2 || unit_read_matches(primary, 3, 0) == -1
+                        || unit_read_matches(file, 5, 0) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "The bad mirror copies were not read from the other replica and repaired.");
+        ret = -1;
+    }
+
+    // Both copies bad
+    primary->write(primary, 7, frame, checksum + 1);
+    file->write(file, 7, frame, checksum + 1);
+    if (ret == 0 && mirror->read(mirror, 7, frame, &checksum) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "A frame bad on both replicas of the mirror was read.");
+        ret = -1;
+    }
+
+    // The frames the secondary fails to write are only read from the
+    // primary, and copied over once it takes writes again
+    __atomic_store_n(&unitFailWrites, 1, __ATOMIC_RELAXED);
+    unit_frame(frame, 10, 2, &checksum);
+    mirror->write(mirror, 10, frame, checksum);
+    if (ret == 0 && mirror->flush(mirror) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "The flush of the degraded mirror succeeded.");
+        ret = -1;
+    }
+    block_mirror_stats(mirror, &stats);
+    if (ret == 0 && (stats.stale != 1 || stats.secondary_failures == 0)) {
+        logMessage(LOG_ERROR_LEVEL, "The frame the mirror secondary failed to write is not stale.");
+        ret = -1;
+    }
+    secondary_reads = stats.secondary_reads;
+    for (i = 0; i < 4 && ret == 0; i++) {
+        ret = unit_read_matches(mirror, 10, 2);
+    }
+    block_mirror_stats(mirror, &stats);
+    if (ret == 0 && stats.secondary_reads != secondary_reads) {
+        logMessage(LOG_ERROR_LEVEL, "The degraded mirror read a stale frame from the secondary.");
+        ret = -1;
+    }
+    __atomic_store_n(&unitFailWrites, 0, __ATOMIC_RELAXED);
+    if (ret == 0 && mirror->flush(mirror) == -1) {
+        ret = -1;
+    }
+    block_mirror_stats(mirror, &stats);
+    if (ret == 0 && (stats.stale != 0 || stats.resyncs != 1 || unit_read_matches(file, 10, 2) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "The stale frame was not copied to the mirror secondary.");
+        ret = -1;
+    }
+    if (mirror->close(mirror) == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockBackendUnitTest
+// Description  : Run a UNIT test checking the backends
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockBackendUnitTest(void)
+{
+    char dir[32];
+    int ret;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    ret = unit_mirror(dir);
+    unitCleanup(dir);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Backend unit test failed.");
+        return (-1);
+    }
+
+    // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Backend unit test completed successfully.");
+    return (0);
+}
@@ -0,0 +1,93 @@
+#ifndef BLOCK_BACKEND_INCLUDED
+#define BLOCK_BACKEND_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_backend.h
+//  Description    : This is the header file for the frame backends of the
+//                   BLOCK memory system driver. The frames are read from and
+//                   written to the controller bus, unless a backend is set,
+//                   such as a file or a mirror of two backends.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define BLOCK_MIRROR_MAX_LAG 64 // Default frames the secondary of a mirror may lag behind
+
+typedef struct BlockBackend BlockBackend;
+
+// A store of frames, each frame is kept with its checksum. The read fails
+// (-1) when the frame does not match its checksum. The write is NULL for a
+// read-only backend, which can't be mirrored or striped.
+struct BlockBackend {
+    const char* name;
+    int (*read)(BlockBackend* backend, uint16_t frame_nr, void* frame, uint32_t* checksum);
+    int (*write)(BlockBackend* backend, uint16_t frame_nr, const void* frame, uint32_t checksum);
+    int (*flush)(BlockBackend* backend); // Make the writes so far durable
+    int (*close)(BlockBackend* backend);
+    void* state;
+};
+
+// Counters of a mirror
+typedef struct {
+    uint64_t primary_reads; // Reads served by the primary
+    uint64_t secondary_reads; // Reads served by the secondary
+    uint64_t failovers; // Reads that failed on a replica and were served by the other
+    uint64_t repairs; // Bad copies rewritten from the other replica
+    uint64_t lag_waits; // Writes that waited for the secondary to catch up
+    uint64_t secondary_failures; // Writes the secondary failed, their frames went stale
+    uint64_t resyncs; // Stale frames copied to the secondary once it took writes again
+    uint32_t stale; // Frames the secondary is missing, the mirror is degraded while set
+    uint32_t max_lag; // Most writes the secondary was behind
+} BlockMirrorStats;
+
+//
+// Global Data
+
+extern BlockBackend* blockBackend; // Backend the frames go to (NULL for the bus)
+extern int blockBackendGather; // Set while the cache writes frames back, see block_backend_gather
+
+//
+// Functional Prototypes
+
+int block_set_backend(BlockBackend* backend);
+// Send the frame reads and writes to "backend" (NULL for the bus), the
+// previous backend is closed. Only while the driver is powered off.
+
+BlockBackend* block_get_backend(void);
+// Get the backend the frames go to (NULL for the bus)
+
+int block_backend_readonly(void);
+// Check if the backend is read-only, the driver then refuses to change the
+// store
+
+int block_backend_flush(void);
+// Make the frames written to the backend durable, done at poweroff
+
+void block_backend_gather(int gather);
+// Mark the writes that follow as frames written back by the cache, which a
+// backend may hold until it is flushed, while "gather" is set. The other
+// writes are in the store once they return.
+
+BlockBackend* block_backend_file(const char* path);
+// Open a backend keeping the frames in a memory mapped file
+
+BlockBackend* block_backend_mirror(BlockBackend* primary, BlockBackend* secondary, uint32_t max_lag);
+// Open a backend writing every frame to both backends, the secondary at
+// most "max_lag" frames behind. The mirror owns the two backends, its flush
+// fails while it is degraded.
+
+int block_mirror_stats(BlockBackend* mirror, BlockMirrorStats* stats);
+// Get the counters of a mirror
+
+//
+// Unit test
+
+int blockBackendUnitTest(void);
+// Run a UNIT test checking the backends
+
+#endif
@@ -0,0 +1,526 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_bench.c
+//  Description    : This is the implementation of the benchmarks of the BLOCK
+//                   memory system driver. The scaling benchmark runs the same
+//                   mixed operations with more and more threads, to show how
+//                   the driver scales and how long the threads wait for its
+//                   lock. The power on and off benchmark times the power
+//                   cycles of stores of more and more files.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_bench.h>
+#include <block_driver.h>
+#include <block_stats.h>
+#include <cmpsc311_log.h>
+
+// A thread of a scaling step
+typedef struct {
+    const BlockBenchScaling* config;
+    int index; // Index of the thread in the step
+    uint32_t ops; // Operations of the thread
+    int nbFds; // Handles of the thread
+    int16_t fds[BLOCK_BENCH_FILES_PER_THREAD];
+    uint64_t* latencies; // Latency of each operation
+    uint32_t failures; // Operations the driver failed
+    pthread_barrier_t* start; // Released once all the threads are ready
+} BenchThread;
+
+// A store of the power on and off benchmark
+typedef struct {
+    int files;
+    int fragmentation; // Percent of the file frames interleaved with the other files
+} BenchStore;
+
+static const char* benchSharingNames[BLOCK_BENCH_SHARINGS] = { "disjoint", "shared", "hot" };
+static const BenchStore benchStores[BLOCK_BENCH_MOUNT_STORES] = {
+    { 0, 0 }, { 10, 0 }, { 10, 50 }, { 10, 100 }, { 100, 0 },
+    { 100, 50 }, { 100, 100 }, { 1024, 0 }, { 1024, 50 }, { 1024, 100 },
+};
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_bench_sharing_name
+// Description  : Get the name of a sharing mode
+//
+// Inputs       : sharing - the sharing mode
+// Outputs      : the name
+
+const char* block_bench_sharing_name(BlockBenchSharing sharing)
+{
+    return ((sharing >= 0 && sharing < BLOCK_BENCH_SHARINGS) ? benchSharingNames[sharing] : "unknown");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_random
+// Description  : Get the next number of a xorshift generator, the threads
+//                don't share a generator so they don't contend on it
+//
+// Inputs       : state - the state of the generator
+// Outputs      : the number
+
+static uint64_t bench_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return (x);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_compare
+// Description  : Order two latencies for qsort
+//
+// Inputs       : a, b - the latencies
+// Outputs      : -1, 0 or 1
+
+static int bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return ((x > y) - (x < y));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_worker
+// Description  : Run the operations of a thread, each a seek followed by a
+//                read or a write
+//
+// Inputs       : arg - the thread
+// Outputs      : NULL
+
+static void* bench_worker(void* arg)
+{
+    BenchThread* thread = arg;
+    char buf[BLOCK_BENCH_IO_SIZE];
+    uint64_t state = 0x9e3779b97f4a7c15ULL * (thread->index + 1);
+    uint64_t start;
+    uint32_t i, loc, span;
+    int16_t fd;
+    int32_t ret;
+
+    memset(buf, 'a' + thread->index % 26, sizeof(buf));
+    span = (thread->config->sharing == BLOCK_BENCH_HOT) ? BLOCK_BENCH_HOT_FRAMES * BLOCK_FRAME_SIZE
+                                                         : BLOCK_BENCH_FILE_FRAMES * BLOCK_FRAME_SIZE;
+    pthread_barrier_wait(thread->start);
+    for (i = 0; i < thread->ops; i++) {
+        fd = thread->fds[bench_random(&state) % thread->nbFds];
+        loc = (bench_random(&state) % (span / BLOCK_BENCH_IO_SIZE)) * BLOCK_BENCH_IO_SIZE;
+        start = block_stats_clock();
+        ret = block_seek(fd, loc);
+        if (ret != -1) {
+            if (bench_random(&state) % 100 < (uint64_t)thread->config->read_percent) {
+                ret = block_read(fd, buf, BLOCK_BENCH_IO_SIZE);
+            } else {
+                ret = block_write(fd, buf, BLOCK_BENCH_IO_SIZE);
+            }
+        }
+        thread->latencies[i] = block_stats_clock() - start;
+        thread->failures += (ret == -1);
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_populate
+// Description  : Create the files of a step, each filled to its full size
+//
+// Inputs       : nbFiles - the number of files
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_populate(int nbFiles)
+{
+    char name[32];
+    char* data;
+    int16_t fd;
+    int i, ret = 0;
+
+    data = malloc(BLOCK_BENCH_FILE_FRAMES * BLOCK_FRAME_SIZE);
+    if (data == NULL) {
+        return (-1);
+    }
+    for (i = 0; i < nbFiles && ret == 0; i++) {
+        snprintf(name, sizeof(name), "bench%04d", i);
+        memset(data, 'A' + i % 26, BLOCK_BENCH_FILE_FRAMES * BLOCK_FRAME_SIZE);
+        if (((fd = block_open(name)) == -1)
+            || (block_write(fd, data, BLOCK_BENCH_FILE_FRAMES * BLOCK_FRAME_SIZE) == -1) || (block_close(fd) == -1)) {
+            ret = -1;
+        }
+    }
+    free(data);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_step
+// Description  : Run a step of a scaling run on a freshly formatted store, the
+//                step closes the handles it opened
+//
+// Inputs       : config - the configuration of the run
+//                threads - the number of threads of the step
+//                step - the result to fill
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_step(const BlockBenchScaling* config, int threads, BlockBenchStep* step)
+{
+    BenchThread workers[BLOCK_BENCH_MAX_THREADS];
+    pthread_t tids[BLOCK_BENCH_MAX_THREADS];
+    pthread_barrier_t start;
+    BlockDriverStats before, after;
+    uint64_t* latencies;
+    uint64_t begin, end;
+    uint32_t failures = 0, offset = 0;
+    char name[32];
+    int i, j, file, nbFiles, ret = 0;
+
+    // The files are created before the threads start, each thread opens its
+    // own handles as the position is kept by the handle
+    nbFiles = (config->sharing == BLOCK_BENCH_DISJOINT) ? threads * BLOCK_BENCH_FILES_PER_THREAD
+                                                        : BLOCK_BENCH_FILES_PER_THREAD;
+    latencies = malloc(sizeof(uint64_t) * config->ops);
+    if ((latencies == NULL) || (block_format() == -1) || (bench_populate(nbFiles) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed setting up the benchmark files.");
+        free(latencies);
+        return (-1);
+    }
+    memset(workers, 0, sizeof(workers));
+    for (i = 0; i < threads; i++) {
+        workers[i].config = config;
+        workers[i].index = i;
+        workers[i].ops = config->ops / threads + ((uint32_t)i < config->ops % threads);
+        workers[i].latencies = latencies + offset;
+        offset += workers[i].ops;
+        workers[i].start = &start;
+        workers[i].nbFds = (config->sharing == BLOCK_BENCH_HOT) ? 1 : BLOCK_BENCH_FILES_PER_THREAD;
+        for (j = 0; j < workers[i].nbFds; j++) {
+            file = (config->sharing == BLOCK_BENCH_DISJOINT) ? i * BLOCK_BENCH_FILES_PER_THREAD + j : j;
+            snprintf(name, sizeof(name), "bench%04d", file);
+            workers[i].fds[j] = block_open(name);
+        }
+    }
+
+    // Run the threads, timed from the moment they are all ready
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, bench_worker, &workers[i]);
+    }
+    block_get_stats(&before);
+    pthread_barrier_wait(&start);
+    begin = block_stats_clock();
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        failures += workers[i].failures;
+    }
+    end = block_stats_clock();
+    block_get_stats(&after);
+    pthread_barrier_destroy(&start);
+    if (failures != 0) {
+        logMessage(LOG_ERROR_LEVEL, "%u benchmark operations failed with %d threads.", failures, threads);
+        ret = -1;
+    }
+    for (i = 0; i < threads; i++) {
+        for (j = 0; j < workers[i].nbFds; j++) {
+            block_close(workers[i].fds[j]);
+        }
+    }
+
+    // Summarize the step
+    qsort(latencies, config->ops, sizeof(uint64_t), bench_compare);
+    step->threads = threads;
+    step->ops = config->ops;
+    step->seconds = (end - begin) / 1e9;
+    step->ops_per_sec = (step->seconds > 0) ? config->ops / step->seconds : 0.0;
+    step->p99_us = (config->ops > 0) ? latencies[(config->ops - 1) * 99 / 100] / 1e3 : 0.0;
+    step->lock_wait_ms = (after.lock_wait_ns - before.lock_wait_ns) / 1e6;
+    step->lock_wait_share = (step->seconds > 0) ? step->lock_wait_ms / 1e3 / (step->seconds * threads) : 0.0;
+    free(latencies);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_bench_scaling
+// Description  : Run the same operations with 1, 2, 4... threads, each step
+//                on a freshly formatted store. The controller is powered on
+//                once for the whole run, as it can't be powered on again in
+//                the same process.
+//
+// Inputs       : config - the configuration of the run
+//                steps - the results to fill
+//                max_steps - the number of results that fit in steps
+// Outputs      : the number of steps run, -1 if failure
+
+int block_bench_scaling(const BlockBenchScaling* config, BlockBenchStep* steps, int max_steps)
+{
+    int threads, nbSteps = 0, ret = 0;
+
+    if ((config == NULL) || (config->max_threads < 1) || (config->max_threads > BLOCK_BENCH_MAX_THREADS)
+        || (config->sharing < 0) || (config->sharing >= BLOCK_BENCH_SHARINGS) || (config->read_percent < 0)
+        || (config->read_percent > 100) || (config->ops == 0)) {
+        return (-1);
+    }
+    if (block_poweron() == -1) {
+        return (-1);
+    }
+    for (threads = 1; nbSteps < max_steps; threads *= 2) {
+        // The last step runs the maximum even if it is not a power of two
+        if (threads > config->max_threads) {
+            if (threads / 2 == config->max_threads) {
+                break;
+            }
+            threads = config->max_threads;
+        }
+        if (bench_step(config, threads, &steps[nbSteps]) == -1) {
+            ret = -1;
+            break;
+        }
+        steps[nbSteps].speedup = (steps[0].ops_per_sec > 0) ? steps[nbSteps].ops_per_sec / steps[0].ops_per_sec : 0.0;
+        logMessage(LOG_INFO_LEVEL, "Scaling step with %d threads: %.0f ops/s.", threads, steps[nbSteps].ops_per_sec);
+        nbSteps++;
+        if (threads == config->max_threads) {
+            break;
+        }
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return ((ret == 0) ? nbSteps : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_fork
+// Description  : Run a part of the power on and off benchmark in a child
+//                process, as the controller can only be powered on once per
+//                process
+//
+// Inputs       : body - the part to run, filling "result"
+//                store - the store of the part
+//                result - the result sent back by the child
+//                size - the size of the result
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_fork(int (*body)(const BenchStore*, void*), const BenchStore* store, void* result, size_t size)
+{
+    int fds[2], status, ret;
+    ssize_t got;
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+        return (-1);
+    }
+    fflush(NULL);
+    if ((pid = fork()) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return (-1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        ret = body(store, result);
+        if ((ret == 0) && (write(fds[1], result, size) != (ssize_t)size)) {
+            ret = -1;
+        }
+        _exit((ret == 0) ? 0 : 1);
+    }
+    close(fds[1]);
+    got = read(fds[0], result, size);
+    close(fds[0]);
+    if ((waitpid(pid, &status, 0) == -1) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+        return (-1);
+    }
+    return ((got == (ssize_t)size) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_build
+// Description  : Format the store and create its files, the first frames of
+//                each file are written in one go and the others one frame at a
+//                time across all the files, interleaving their frames
+//
+// Inputs       : store - the store to build
+//                result - unused
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_build(const BenchStore* store, void* result)
+{
+    int16_t fds[BLOCK_MAX_TOTAL_FILES];
+    char name[32];
+    char* data;
+    int i, j, contiguous, ret = 0;
+
+    (void)result;
+    contiguous = BLOCK_BENCH_MOUNT_FILE_FRAMES - BLOCK_BENCH_MOUNT_FILE_FRAMES * store->fragmentation / 100;
+    data = malloc(BLOCK_BENCH_MOUNT_FILE_FRAMES * BLOCK_FRAME_SIZE);
+    if ((data == NULL) || (block_poweron() == -1) || (block_format() == -1)) {
+        free(data);
+        return (-1);
+    }
+    for (i = 0; (i < store->files) && (ret == 0); i++) {
+        snprintf(name, sizeof(name), "mount%04d", i);
+        memset(data, 'A' + i % 26, BLOCK_BENCH_MOUNT_FILE_FRAMES * BLOCK_FRAME_SIZE);
+        if (((fds[i] = block_open(name)) == -1) || (block_write(fds[i], data, contiguous * BLOCK_FRAME_SIZE) == -1)) {
+            ret = -1;
+        }
+    }
+    for (j = contiguous; (j < BLOCK_BENCH_MOUNT_FILE_FRAMES) && (ret == 0); j++) {
+        for (i = 0; (i < store->files) && (ret == 0); i++) {
+            ret = (block_write(fds[i], data, BLOCK_FRAME_SIZE) == -1) ? -1 : 0;
+        }
+    }
+    free(data);
+    if ((ret == -1) || (block_poweroff() == -1)) {
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_cycle
+// Description  : Power the store on and off, with a session rewriting the
+//                start of each file in between so that the power off has
+//                metadata to write
+//
+// Inputs       : store - the store to cycle
+//                result - the breakdown of the power on and off (2 entries)
+// Outputs      : 0 if successful, -1 if failure
+
+static int bench_cycle(const BenchStore* store, void* result)
+{
+    BlockMountProfile* profiles = result;
+    char name[32], data[64];
+    int16_t fd;
+    int i;
+
+    if (block_poweron() == -1) {
+        return (-1);
+    }
+    memset(data, 'z', sizeof(data));
+    for (i = 0; i < store->files; i++) {
+        snprintf(name, sizeof(name), "mount%04d", i);
+        if (((fd = block_open(name)) == -1) || (block_write(fd, data, sizeof(data)) == -1) || (block_close(fd) == -1)) {
+            block_poweroff();
+            return (-1);
+        }
+    }
+    if (block_poweroff() == -1) {
+        return (-1);
+    }
+    return (block_mount_profile(&profiles[0], &profiles[1]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_profile_add
+// Description  : Add a power on or off breakdown to a sum
+//
+// Inputs       : sum - the sum
+//                profile - the breakdown to add
+// Outputs      : none
+
+static void bench_profile_add(BlockMountProfile* sum, const BlockMountProfile* profile)
+{
+    uint64_t* s = (uint64_t*)sum;
+    const uint64_t* p = (const uint64_t*)profile;
+    size_t i;
+
+    for (i = 0; i < sizeof(BlockMountProfile) / sizeof(uint64_t); i++) {
+        s[i] += p[i];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_profile_mean
+// Description  : Divide a sum of power on or off breakdowns by their number
+//
+// Inputs       : sum - the sum
+//                runs - the number of breakdowns in the sum
+// Outputs      : none
+
+static void bench_profile_mean(BlockMountProfile* sum, int runs)
+{
+    uint64_t* s = (uint64_t*)sum;
+    size_t i;
+
+    for (i = 0; i < sizeof(BlockMountProfile) / sizeof(uint64_t); i++) {
+        s[i] /= runs;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_bench_mount
+// Description  : Build stores of more and more files, more and more
+//                fragmented, and time power cycles of each. Each build and
+//                each cycle runs in its own process.
+//
+// Inputs       : runs - the power cycles measured on each store
+//                results - the results to fill
+//                max_results - the number of results that fit in results
+// Outputs      : the number of stores measured, -1 if failure
+
+int block_bench_mount(int runs, BlockBenchMount* results, int max_results)
+{
+    BlockMountProfile profiles[2];
+    BlockBenchMount* result;
+    int i, r, nbResults = 0;
+
+    if (runs < 1) {
+        return (-1);
+    }
+    for (i = 0; (i < BLOCK_BENCH_MOUNT_STORES) && (nbResults < max_results); i++) {
+        result = &results[nbResults];
+        memset(result, 0, sizeof(BlockBenchMount));
+        result->files = benchStores[i].files;
+        result->fragmentation = benchStores[i].fragmentation;
+        result->frames = benchStores[i].files * BLOCK_BENCH_MOUNT_FILE_FRAMES;
+        if (bench_fork(bench_build, &benchStores[i], NULL, 0) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failed building the store of %d files.", result->files);
+            return (-1);
+        }
+        for (r = 0; r < runs; r++) {
+            if (bench_fork(bench_cycle, &benchStores[i], profiles, sizeof(profiles)) == -1) {
+                logMessage(LOG_ERROR_LEVEL, "Failed power cycling the store of %d files.", result->files);
+                return (-1);
+            }
+            bench_profile_add(&result->poweron, &profiles[0]);
+            bench_profile_add(&result->poweroff, &profiles[1]);
+            if (profiles[0].total_ns > result->poweron_max_ns) {
+                result->poweron_max_ns = profiles[0].total_ns;
+            }
+            if (profiles[1].total_ns > result->poweroff_max_ns) {
+                result->poweroff_max_ns = profiles[1].total_ns;
+            }
+        }
+        bench_profile_mean(&result->poweron, runs);
+        bench_profile_mean(&result->poweroff, runs);
+        result->runs = runs;
+        logMessage(LOG_INFO_LEVEL, "Power cycled the store of %d files (%d%% fragmented) %d times.", result->files,
+            result->fragmentation, runs);
+        nbResults++;
+    }
+    return (nbResults);
+}
@@ -0,0 +1,86 @@
+#ifndef BLOCK_BENCH_INCLUDED
+#define BLOCK_BENCH_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_bench.h
+//  Description    : This is the header file for the benchmarks of the BLOCK
+//                   memory system driver, run by the simulator instead of a
+//                   workload: the thread scaling benchmark and the power on
+//                   and off benchmark.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_stats.h>
+
+// Defines
+#define BLOCK_BENCH_MAX_THREADS 64 // Most threads of a scaling run
+#define BLOCK_BENCH_FILES_PER_THREAD 4 // Files of each thread (or shared by all)
+#define BLOCK_BENCH_FILE_FRAMES 16 // Frames of each benchmark file
+#define BLOCK_BENCH_HOT_FRAMES 2 // Frames all the threads use when sharing hot frames
+#define BLOCK_BENCH_IO_SIZE 512 // Bytes of each read or write
+#define BLOCK_BENCH_DEFAULT_OPS 20000 // Operations of a run, split over its threads
+#define BLOCK_BENCH_MOUNT_FILE_FRAMES 8 // Frames of each file of a power on and off store
+#define BLOCK_BENCH_MOUNT_STORES 10 // Stores built by a power on and off run
+#define BLOCK_BENCH_MOUNT_DEFAULT_RUNS 5 // Power cycles measured on each store
+
+// How the threads of a scaling run share the files
+typedef enum {
+    BLOCK_BENCH_DISJOINT = 0, // Each thread has its own files
+    BLOCK_BENCH_SHARED = 1, // All the threads use the same files
+    BLOCK_BENCH_HOT = 2, // All the threads use the first frames of one file
+    BLOCK_BENCH_SHARINGS = 3,
+} BlockBenchSharing;
+
+// Configuration of a scaling run
+typedef struct {
+    int max_threads; // Threads of the last step, the steps double from 1
+    BlockBenchSharing sharing;
+    int read_percent; // Share of the operations that are reads
+    uint32_t ops; // Operations of each step, split over its threads
+} BlockBenchScaling;
+
+// Result of a step of a scaling run
+typedef struct {
+    int threads;
+    uint32_t ops; // Operations made
+    double seconds; // Wall clock time of the step
+    double ops_per_sec;
+    double p99_us; // 99th percentile latency of an operation
+    double lock_wait_ms; // Time the threads waited for the driver lock
+    double lock_wait_share; // Part of the thread time spent waiting for the lock
+    double speedup; // Throughput over the throughput with one thread
+} BlockBenchStep;
+
+// Result of the power cycles of a store
+typedef struct {
+    int files;
+    int fragmentation; // Percent of the file frames interleaved with the other files
+    int frames; // Data frames used by the files
+    int runs; // Power cycles measured
+    BlockMountProfile poweron; // Mean of the power ons
+    BlockMountProfile poweroff; // Mean of the power offs
+    uint64_t poweron_max_ns; // Slowest power on
+    uint64_t poweroff_max_ns; // Slowest power off
+} BlockBenchMount;
+
+//
+// Functional Prototypes
+
+const char* block_bench_sharing_name(BlockBenchSharing sharing);
+// Get the name of a sharing mode ("disjoint", "shared" or "hot")
+
+int block_bench_scaling(const BlockBenchScaling* config, BlockBenchStep* steps, int max_steps);
+// Run the same operations with 1, 2, 4... up to max_threads threads, returns
+// the number of steps run (-1 on failure). The store is formatted.
+
+int block_bench_mount(int runs, BlockBenchMount* results, int max_results);
+// Build stores of 0, 10, 100 and 1024 files with more and more fragmented
+// files, and time "runs" power cycles of each. Returns the number of stores
+// measured (-1 on failure). The store is overwritten.
+
+#endif
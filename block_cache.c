@@ -9,34 +9,67 @@
 //
 
 // Includes
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 
 // Project includes
 #include <block_cache.h>
+#include <block_driver_helper.h>
+#include <block_memory.h>
+#include <block_perf.h>
+#include <block_trace.h>
 #include <cmpsc311_log.h>
 
 uint32_t block_cache_max_items = DEFAULT_BLOCK_FRAME_CACHE_SIZE; // Maximum number of items in cache
 
 typedef char Frame[BLOCK_FRAME_SIZE];
 
+#define BLOCK_CACHE_UNIT_FRAMES 16 // Frames of the bus of the unit test
+#define BLOCK_CACHE_UNIT_WAIT_MS 2000 // Most time the unit test waits for the reclaimer
+
 struct cacheEntry{
 	BlockIndex block;
 	BlockFrameIndex frm;
-	uint16_t access;
-	Frame cacheFrame;
+	uint32_t access;
+	uint8_t dirty; //set if the frame is newer than its copy on the bus
 };
 
 typedef struct cacheEntry blockCache;
 blockCache* cache;
+Frame* cacheFrames; // Payload arena, slot i holds the frame of cache[i]
 
 
-uint16_t putTracker = 0;
-uint16_t lastAccess = 0;
+uint32_t putTracker = 0;
+uint32_t lastAccess = 0;
+uint32_t cacheArena = 0; // Number of slots reserved in the payload arena
+uint32_t cacheSlots = 0; // Number of slots currently in use
+uint32_t cacheLimit = 0; // Upper bound on the slots set by the memory budget (0 if none)
 
 int cacheOn = 0;
+BlockCacheWriteback cacheWriteback = NULL; //writes the dirty frames back
+BlockCacheEvicted cacheEvicted = NULL; //told of the frames evicted
+
+uint32_t cacheLowWater = 0; //free slots under which the reclaimer is woken (0 if off)
+uint32_t cacheHighWater = 0; //free slots the reclaimer evicts up to
+
+//reclaimer thread, it takes the driver lock to evict while the inserts only
+//take its own lock to wake it, so that they never wait for it
+pthread_t reclaimWorker;
+pthread_mutex_t reclaimLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaimWake = PTHREAD_COND_INITIALIZER;
+int reclaimRunning = 0;
+int reclaimPending = 0; //set when woken, until the reclaimer starts evicting
+int reclaimHeld = 0; //holds on the reclaimer, it is not started while held
+
+// Counters, updated with relaxed atomic adds as the prefetch, batch and
+// reclaimer threads count too, and the metrics exporter reads them
+BlockCacheStats cacheStats;
+#define CACHE_STAT_INC(field) __atomic_fetch_add(&cacheStats.field, 1, __ATOMIC_RELAXED)
 
 //
 // Functions
@@ -55,6 +88,198 @@ int set_block_cache_size(uint32_t max_frames){
        	return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_block_cache_size
+// Description  : Get the configured size of the cache
+//
+// Inputs       : none
+// Outputs      : the maximum number of items the cache can hold
+
+uint32_t get_block_cache_size(void){
+	return (block_cache_max_items);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_block_cache_limit
+// Description  : Bound the number of frames of the cache below its configured
+//                size, the cache is resized on its next put. Can be called
+//                from any thread.
+//
+// Inputs       : max_frames - the bound (0 to remove it)
+// Outputs      : 0 if successful, -1 if failure
+
+int set_block_cache_limit(uint32_t max_frames){
+	__atomic_store_n(&cacheLimit, max_frames, __ATOMIC_RELAXED);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_block_cache_slot_size
+// Description  : Get the memory used by one frame of the cache
+//
+// Inputs       : none
+// Outputs      : the size of a cache slot in bytes
+
+uint32_t get_block_cache_slot_size(void){
+	return (sizeof(blockCache) + BLOCK_FRAME_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : account_block_cache
+// Description  : Report the memory used by the cache to the memory accounting
+//
+// Inputs       : none
+// Outputs      : none
+
+static void account_block_cache(void){
+	block_memory_set(BLOCK_MEM_CACHE_PAYLOAD, (uint64_t)cacheSlots * BLOCK_FRAME_SIZE);
+	block_memory_set(BLOCK_MEM_CACHE_METADATA, (uint64_t)cacheArena * sizeof(blockCache));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeback_block_cache
+// Description  : Write the frame of a slot back to the bus if it is dirty,
+//                the frame stays dirty if it can't be
+//
+// Inputs       : slot - the slot of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int writeback_block_cache(uint32_t slot){
+
+	if (!cache[slot].dirty){
+		return (0);
+	}
+	if (cacheWriteback == NULL || cacheWriteback(cache[slot].block, cache[slot].frm, cacheFrames[slot]) == -1){
+		CACHE_STAT_INC(writeback_failures);
+		logMessage(LOG_ERROR_LEVEL, "Failure writing the dirty frame %d back, it stays in the cache", cache[slot].frm);
+		return (-1);
+	}
+	cache[slot].dirty = 0;
+	CACHE_STAT_INC(writebacks);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : oldest_block_cache
+// Description  : Find the least recently used frame of the cache
+//
+// Inputs       : none
+// Outputs      : the slot of the frame (the cache must not be empty)
+
+static uint32_t oldest_block_cache(void){
+
+	uint32_t oldest = 0;
+
+	for (int i = 1; i < putTracker; i++){
+		if (cache[i].access < cache[oldest].access){
+			oldest = i;
+		}
+	}
+	return (oldest);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : evict_block_cache
+// Description  : Drop the frame of a slot (written back if dirty), keeping
+//                the used slots packed at the start of the array. A dirty
+//                frame that can't be written back is kept.
+//
+// Inputs       : slot - the slot of the frame
+// Outputs      : 0 if successful, -1 if the frame could not be written back
+
+static int evict_block_cache(uint32_t slot){
+
+	if (writeback_block_cache(slot) == -1){
+		return (-1);
+	}
+	CACHE_STAT_INC(evictions);
+	if (cacheEvicted != NULL){
+		cacheEvicted(cache[slot].block, cache[slot].frm);
+	}
+	putTracker--;
+	if (slot != putTracker){
+		memcpy(&cache[slot], &cache[putTracker], sizeof(blockCache));
+		memcpy(cacheFrames[slot], cacheFrames[putTracker], BLOCK_FRAME_SIZE);
+	}
+	//the slot freed is looked at by the lookups, it must not match a frame
+	memset(&cache[putTracker], 0, sizeof(blockCache));
+	cache[putTracker].frm = -1;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resize_block_cache
+// Description  : Change the number of slots of the cache (up to its
+//                configured size), the least recently used frames are dropped
+//                when it shrinks and the pages of the freed slots are given
+//                back to the system. It shrinks less if a dirty frame can't
+//                be written back.
+//
+// Inputs       : max_frames - the new number of slots
+// Outputs      : 0 if successful, -1 if failure
+
+static int resize_block_cache(uint32_t max_frames){
+
+	int ret = 0;
+
+	if (max_frames == 0){
+		max_frames = 1;
+	}
+	if (max_frames > cacheArena){
+		max_frames = cacheArena;
+	}
+
+	//drop the least recently used frames that don't fit anymore
+	while (putTracker > max_frames){
+		if (evict_block_cache(oldest_block_cache()) == -1){
+			max_frames = putTracker;
+			ret = -1;
+		}
+	}
+
+	//release the payload pages of the slots dropped, they are faulted back
+	//in (zeroed) when the cache grows again
+	if (max_frames < cacheSlots){
+		madvise(cacheFrames[max_frames], (size_t)(cacheSlots - max_frames) * BLOCK_FRAME_SIZE, MADV_DONTNEED);
+	}
+	for (int i = cacheSlots; i < max_frames; i++){
+		memset(&cache[i], 0, sizeof(blockCache));
+		cache[i].frm = -1;
+	}
+	cacheSlots = max_frames;
+	account_block_cache();
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : apply_block_cache_limit
+// Description  : Resize the cache if its bound changed since the last call
+//
+// Inputs       : none
+// Outputs      : none
+
+static void apply_block_cache_limit(void){
+
+	uint32_t slots = cacheArena;
+	uint32_t limit = __atomic_load_n(&cacheLimit, __ATOMIC_RELAXED);
+
+	if (limit != 0 && limit < slots){
+		slots = limit;
+	}
+	if (slots != cacheSlots){
+		resize_block_cache(slots);
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : init_block_cache
@@ -70,14 +295,36 @@ int init_block_cache(void){
 		return -1;
 	}
 	
-	//allocate space for the cache given the size
-	cache = malloc(sizeof(blockCache) * block_cache_max_items);
+	//allocate space for the cache given the size and the memory budget
+	cacheSlots = block_cache_max_items;
+	if (cacheLimit != 0 && cacheLimit < cacheSlots){
+		cacheSlots = cacheLimit;
+	}
+	//the payload arena is reserved for the configured size, so it can shrink
+	//and grow back in place
+	cacheArena = block_cache_max_items;
+	cache = malloc(sizeof(blockCache) * cacheArena);
+	cacheFrames = mmap(NULL, (size_t)cacheArena * BLOCK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (cache == NULL || cacheFrames == MAP_FAILED){
+		if (cacheFrames != MAP_FAILED){
+			munmap(cacheFrames, (size_t)cacheArena * BLOCK_FRAME_SIZE);
+		}
+		free(cache);
+		cache = NULL;
+		cacheFrames = NULL;
+		cacheArena = 0;
+		return -1;
+	}
 
 	//zero out the block cache
-	for (int i = 0; i < block_cache_max_items; i++){
+	for (int i = 0; i < cacheSlots; i++){
 		memset(&cache[i], 0, sizeof(blockCache));
 		cache[i].frm = -1;
 	}
+	putTracker = 0;
+	lastAccess = 0;
+	account_block_cache();
 
 	//set cache to on
 	cacheOn = 1;
@@ -100,12 +347,19 @@ int close_block_cache(void){
 	}
 
 	//clear all cache data
-	for (int i = 0; i < block_cache_max_items; i++){
+	for (int i = 0; i < cacheSlots; i++){
 		memset(&cache[i], 0, sizeof(blockCache));
 	}
 
 	//free the pointer
 	free(cache);
+	munmap(cacheFrames, (size_t)cacheArena * BLOCK_FRAME_SIZE);
+	cache = NULL;
+	cacheFrames = NULL;
+	cacheSlots = 0;
+	cacheArena = 0;
+	putTracker = 0;
+	account_block_cache();
 
 	//set cache to off
 	cacheOn = 0;
@@ -114,63 +368,401 @@ int close_block_cache(void){
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : put_block_cache
-// Description  : Put an object into the frame cache
+// Function     : set_block_cache_writeback
+// Description  : Set the function writing the dirty frames back to the bus
 //
-// Inputs       : block - the block number of the frame to cache
-//                frm - the frame number of the frame to cache
-//                buf - the buffer to insert into the cache
+// Inputs       : writeback - the function
 // Outputs      : 0 if successful, -1 if failure
 
-int put_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf){
+int set_block_cache_writeback(BlockCacheWriteback writeback){
+	cacheWriteback = writeback;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_block_cache_evicted
+// Description  : Set the function told of the frames evicted or reclaimed
+//
+// Inputs       : evicted - the function (NULL for none)
+// Outputs      : 0 if successful, -1 if failure
+
+int set_block_cache_evicted(BlockCacheEvicted evicted){
+	cacheEvicted = evicted;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_block_cache
+// Description  : Write all the dirty frames back to the bus, they stay cached
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_block_cache(void){
+
+	int ret = 0;
+	uint64_t start = BLOCK_TRACE_BEGIN();
 
-	//if cache is not on return -1
 	if(!cacheOn){
 		return -1;
 	}
+	for (int i = 0; i < putTracker; i++){
+		if (writeback_block_cache(i) == -1){
+			ret = -1;
+		}
+	}
+	BLOCK_TRACE_END(BLOCK_TRACE_CACHE_FLUSH, start, ret);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : watermark_block_cache
+// Description  : Get a watermark of the reclaimer for the current size of
+//                the cache, at most half of its slots are kept free
+//
+// Inputs       : mark - the watermark set
+// Outputs      : the number of free slots
+
+static uint32_t watermark_block_cache(uint32_t mark){
+	return ((mark < cacheSlots / 2) ? mark : cacheSlots / 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reclaim_block_cache
+// Description  : Evict the least recently used frames until the high
+//                watermark of free slots is reached, at most a batch of them.
+//                It stops at a dirty frame that can't be written back.
+//                Called with the driver lock held.
+//
+// Inputs       : none
+// Outputs      : 1 if there is more to evict, 0 otherwise
+
+static int reclaim_block_cache(void){
+
+	uint32_t slot, evicted = 0;
+	uint8_t dirty;
+
+	while (cacheOn && putTracker > 0 && cacheSlots - putTracker < watermark_block_cache(cacheHighWater)){
+		if (evicted == BLOCK_CACHE_RECLAIM_BATCH){
+			return (1);
+		}
+		slot = oldest_block_cache();
+		dirty = cache[slot].dirty;
+		if (evict_block_cache(slot) == -1){
+			return (0);
+		}
+		if (dirty){
+			CACHE_STAT_INC(reclaim_writebacks);
+		}
+		CACHE_STAT_INC(reclaimed);
+		evicted++;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reclaim_worker
+// Description  : Body of the reclaimer thread, it evicts a batch of frames
+//                at a time, releasing the driver lock in between
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void* reclaim_worker(void* arg){
+
+	int more;
+
+	pthread_mutex_lock(&reclaimLock);
+	while (reclaimRunning){
+		if (!reclaimPending){
+			pthread_cond_wait(&reclaimWake, &reclaimLock);
+			continue;
+		}
+		reclaimPending = 0;
+		pthread_mutex_unlock(&reclaimLock);
+		do {
+			lockDriver();
+			more = reclaim_block_cache();
+			pthread_mutex_unlock(&blockDriverLock);
+		} while (more);
+		pthread_mutex_lock(&reclaimLock);
+	}
+	pthread_mutex_unlock(&reclaimLock);
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wake_block_cache_reclaimer
+// Description  : Wake the reclaimer, starting it the first time
+//
+// Inputs       : none
+// Outputs      : none
+
+static void wake_block_cache_reclaimer(void){
+
+	pthread_mutex_lock(&reclaimLock);
+	if (!reclaimRunning){
+		if (reclaimHeld){
+			pthread_mutex_unlock(&reclaimLock);
+			return;
+		}
+		reclaimRunning = 1;
+		if (pthread_create(&reclaimWorker, NULL, reclaim_worker, NULL) != 0){
+			reclaimRunning = 0;
+			pthread_mutex_unlock(&reclaimLock);
+			return;
+		}
+	}
+	if (!reclaimPending){
+		reclaimPending = 1;
+		pthread_cond_signal(&reclaimWake);
+	}
+	pthread_mutex_unlock(&reclaimLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_block_cache_watermarks
+// Description  : Set the free slots the reclaimer keeps, it is woken once
+//                fewer than "low" slots are free and evicts up to "high"
+//
+// Inputs       : low - the low watermark (0 with high 0 to turn it off)
+//                high - the high watermark
+// Outputs      : 0 if successful, -1 if failure
+
+int set_block_cache_watermarks(uint32_t low, uint32_t high){
+
+	if (high < low || (low == 0 && high != 0)){
+		return (-1);
+	}
+	cacheLowWater = low;
+	cacheHighWater = high;
+	return (0);
+}
 
-	uint16_t replaceTracker;
-	uint16_t index=0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hold_block_cache_reclaimer
+// Description  : Keep the reclaimer from being started, so that it stays
+//                stopped once joined. Called with the driver lock held, the
+//                holds are counted.
+//
+// Inputs       : hold - 1 to take a hold, 0 to release one
+// Outputs      : 0 if successful, -1 if failure
+
+int hold_block_cache_reclaimer(int hold){
+
+	pthread_mutex_lock(&reclaimLock);
+	if (!hold && reclaimHeld == 0){
+		pthread_mutex_unlock(&reclaimLock);
+		return (-1);
+	}
+	reclaimHeld += hold ? 1 : -1;
+	pthread_mutex_unlock(&reclaimLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_block_cache_reclaimer
+// Description  : Stop the reclaimer thread, it takes the driver lock so this
+//                must not be called with it held
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the reclaimer was not running
+
+int stop_block_cache_reclaimer(void){
+
+	pthread_mutex_lock(&reclaimLock);
+	if (!reclaimRunning){
+		pthread_mutex_unlock(&reclaimLock);
+		return (-1);
+	}
+	reclaimRunning = 0;
+	reclaimPending = 0;
+	pthread_cond_signal(&reclaimWake);
+	pthread_mutex_unlock(&reclaimLock);
+	pthread_join(reclaimWorker, NULL);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_block_cache
+// Description  : Put a frame into the cache, evicting the least recently
+//                used frame (written back if dirty) when it is full. With the
+//                reclaimer on a free slot is normally waiting, and the
+//                reclaimer is woken when they run low.
+//
+// Inputs       : block - the block number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+//                dirty - 1 if the frame is not on the bus yet
+// Outputs      : 0 if successful, -1 if failure (the frame to evict could
+//                not be written back, the frame is not cached)
+
+static int store_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf, uint8_t dirty){
+
+	uint32_t replaceTracker;
+	uint32_t index=0;
+	uint64_t start = BLOCK_TRACE_BEGIN();
+
+	//apply a new size requested by the memory budget
+	apply_block_cache_limit();
 
 	//if the frame already exists update the access and return
 	
-	for (int i = 0; i < block_cache_max_items; i++){
-		if (cache[i].frm == frm){
+	for (int i = 0; i < cacheSlots; i++){
+		if (cache[i].block == block && cache[i].frm == frm){
+			CACHE_STAT_INC(updates);
+			if (dirty && cache[i].dirty){
+				CACHE_STAT_INC(absorbed);
+			}
 			lastAccess++;
-			memcpy(cache[i].cacheFrame, buf, BLOCK_FRAME_SIZE);
+			memcpy(cacheFrames[i], buf, BLOCK_FRAME_SIZE);
 			cache[i].access = lastAccess;
+			cache[i].dirty = dirty;
 			return (0);
 		}
 	}
 
 	//if the cache is not full, fill in first available spot
-	if (putTracker < block_cache_max_items){
-		lastAccess++;
-		cache[putTracker].block = block;
-		cache[putTracker].frm = frm;
-		cache[putTracker].access = lastAccess;
-		memcpy(cache[putTracker].cacheFrame, buf, BLOCK_FRAME_SIZE);
+	if (putTracker < cacheSlots){
+		index = putTracker;
 		putTracker++;
 	}
 
 	//else find the least recently used frame and overwrite
 	else{
 		replaceTracker = cache[0].access;
-		for (int i = 0; i < block_cache_max_items; i++){
+		for (int i = 0; i < cacheSlots; i++){
 			if (cache[i].access < replaceTracker){
 				replaceTracker = cache[i].access;
 				index = i;
 			}
 		}
-		lastAccess++;
-		cache[index].block = block;
-		cache[index].frm = frm;
-		cache[index].access = lastAccess;
-		memcpy(cache[index].cacheFrame, buf, BLOCK_FRAME_SIZE);
+		//a dirty frame that can't be written back is kept, the frame
+		//stored is then not cached
+		if (writeback_block_cache(index) == -1){
+			BLOCK_TRACE_END(BLOCK_TRACE_CACHE_INSERT, start, frm);
+			return (-1);
+		}
+		CACHE_STAT_INC(evictions);
+		if (cacheLowWater != 0){
+			CACHE_STAT_INC(stalls);
+		}
+		if (cacheEvicted != NULL){
+			cacheEvicted(cache[index].block, cache[index].frm);
+		}
 	}	
+	CACHE_STAT_INC(inserts);
+	lastAccess++;
+	cache[index].block = block;
+	cache[index].frm = frm;
+	cache[index].access = lastAccess;
+	cache[index].dirty = dirty;
+	memcpy(cacheFrames[index], buf, BLOCK_FRAME_SIZE);
+
+	//evict ahead of the next inserts once the free slots run low
+	if (cacheLowWater != 0 && cacheSlots - putTracker < watermark_block_cache(cacheLowWater)){
+		wake_block_cache_reclaimer();
+	}
+	BLOCK_TRACE_END(BLOCK_TRACE_CACHE_INSERT, start, frm);
 	return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_block_cache
+// Description  : Put an object into the frame cache, the frame is the same
+//                as on the bus
+//
+// Inputs       : block - the block number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int put_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf){
+
+	int ret;
+
+	//if cache is not on return -1
+	if(!cacheOn){
+		return -1;
+	}
+	BLOCK_PERF_ENTER(BLOCK_PERF_CACHE);
+	ret = store_block_cache(block, frm, buf, 0);
+	BLOCK_PERF_EXIT();
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_block_cache
+// Description  : Update the cache with a frame written under a write policy.
+//                Write-through caches the frame, write-back caches it dirty
+//                and write-around only updates a copy already cached.
+//
+// Inputs       : block - the block number of the frame written
+//                frm - the frame number of the frame written
+//                buf - the frame written
+//                policy - the write policy of the frame
+// Outputs      : 0 if successful, -1 if failure (the frame must then be
+//                written to the bus whatever the policy)
+
+int write_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf, BlockWritePolicy policy){
+
+	int ret;
+
+	//if cache is not on, or has no room, return -1
+	if(!cacheOn || cacheSlots == 0){
+		return -1;
+	}
+	CACHE_STAT_INC(policy_writes[policy]);
+	if (policy == BLOCK_WRITE_AROUND){
+		for (int i = 0; i < cacheSlots; i++){
+			if (cache[i].block == block && cache[i].frm == frm){
+				CACHE_STAT_INC(updates);
+				memcpy(cacheFrames[i], buf, BLOCK_FRAME_SIZE);
+				cache[i].dirty = 0;
+				return (0);
+			}
+		}
+		return (0);
+	}
+	if (!peek_block_cache(block, frm)){
+		CACHE_STAT_INC(policy_inserts[policy]);
+	}
+	BLOCK_PERF_ENTER(BLOCK_PERF_CACHE);
+	ret = store_block_cache(block, frm, buf, policy == BLOCK_WRITE_BACK);
+	BLOCK_PERF_EXIT();
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_write_policy_name
+// Description  : Get the name of a write policy
+//
+// Inputs       : policy - the write policy
+// Outputs      : the name, "unknown" if not a policy
+
+const char* block_write_policy_name(BlockWritePolicy policy){
+
+	static const char* names[BLOCK_WRITE_POLICIES] = {"through", "back", "around"};
+
+	if (policy < 0 || policy >= BLOCK_WRITE_POLICIES){
+		return ("unknown");
+	}
+	return (names[policy]);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_block_cache
@@ -182,31 +774,403 @@ int put_block_cache(BlockIndex block, BlockFrameIndex frm, void* buf){
 
 void* get_block_cache(BlockIndex block, BlockFrameIndex frm){
 	
+	//if cache is not on, there is nothing to find
+	if(!cacheOn){
+		return (NULL);
+	}
+
 	//search for the frame in hte block cache and return it if present
-	for (int i = 0; i < block_cache_max_items; i++){
-		if(cache[i].frm == frm){
+	CACHE_STAT_INC(lookups);
+	for (int i = 0; i < cacheSlots; i++){
+		if(cache[i].block == block && cache[i].frm == frm){
+			CACHE_STAT_INC(hits);
 			lastAccess++;
 			cache[i].access = lastAccess;
-			return cache[i].cacheFrame;
+			return cacheFrames[i];
 		}
 	}
        	return (NULL);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : peek_block_cache
+// Description  : Check if a frame is in the cache, neither the counters nor
+//                the LRU order are updated
+//
+// Inputs       : block - the block number of the block to find
+//                frm - the  number of the frame to find
+// Outputs      : 1 if the frame is cached, 0 otherwise
+
+int peek_block_cache(BlockIndex block, BlockFrameIndex frm){
+
+	if(!cacheOn){
+		return (0);
+	}
+	for (int i = 0; i < cacheSlots; i++){
+		if(cache[i].block == block && cache[i].frm == frm){
+			return (1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_block_cache_stats
+// Description  : Get the cache counters and the number of frames in the cache
+//
+// Inputs       : stats - the structure to fill with the counters
+//                frames - set to the number of frames in the cache (or NULL)
+// Outputs      : 0 if successful, -1 if failure
+
+int get_block_cache_stats(BlockCacheStats* stats, uint32_t* frames){
+
+	if (stats == NULL){
+		return (-1);
+	}
+	stats->lookups = __atomic_load_n(&cacheStats.lookups, __ATOMIC_RELAXED);
+	stats->hits = __atomic_load_n(&cacheStats.hits, __ATOMIC_RELAXED);
+	stats->inserts = __atomic_load_n(&cacheStats.inserts, __ATOMIC_RELAXED);
+	stats->updates = __atomic_load_n(&cacheStats.updates, __ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&cacheStats.evictions, __ATOMIC_RELAXED);
+	stats->writebacks = __atomic_load_n(&cacheStats.writebacks, __ATOMIC_RELAXED);
+	stats->absorbed = __atomic_load_n(&cacheStats.absorbed, __ATOMIC_RELAXED);
+	stats->reclaimed = __atomic_load_n(&cacheStats.reclaimed, __ATOMIC_RELAXED);
+	stats->reclaim_writebacks = __atomic_load_n(&cacheStats.reclaim_writebacks, __ATOMIC_RELAXED);
+	stats->writeback_failures = __atomic_load_n(&cacheStats.writeback_failures, __ATOMIC_RELAXED);
+	stats->stalls = __atomic_load_n(&cacheStats.stalls, __ATOMIC_RELAXED);
+	for (int i = 0; i < BLOCK_WRITE_POLICIES; i++){
+		stats->policy_writes[i] = __atomic_load_n(&cacheStats.policy_writes[i], __ATOMIC_RELAXED);
+		stats->policy_inserts[i] = __atomic_load_n(&cacheStats.policy_inserts[i], __ATOMIC_RELAXED);
+	}
+	if (frames != NULL){
+		*frames = __atomic_load_n(&putTracker, __ATOMIC_RELAXED);
+	}
+	return (0);
+}
+
 
 //
 // Unit test
 
+Frame unitBus[BLOCK_CACHE_UNIT_FRAMES]; //frames written back by the unit test
+uint32_t unitWritebacks = 0; //frames written back since the test started
+int unitFailing = 0; //set to make the write-backs fail
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_writeback
+// Description  : Write a dirty frame back to the bus of the unit test, it
+//                fails while unitFailing is set
+//
+// Inputs       : block - the block number of the frame
+//                frm - the frame number of the frame
+//                frame - the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_writeback(BlockIndex block, BlockFrameIndex frm, void* frame){
+
+	if (unitFailing || frm >= BLOCK_CACHE_UNIT_FRAMES){
+		return (-1);
+	}
+	memcpy(unitBus[frm], frame, BLOCK_FRAME_SIZE);
+	unitWritebacks++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_frame
+// Description  : Fill a frame with the data the unit test writes to it
+//
+// Inputs       : frame - the frame
+//                frm - the frame number
+//                version - the version of the frame
+// Outputs      : none
+
+static void unit_frame(char* frame, BlockFrameIndex frm, int version){
+	memset(frame, 'a' + (frm * 3 + version) % 26, BLOCK_FRAME_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_cached
+// Description  : Check that a frame is in the cache with the data of a version
+//
+// Inputs       : frm - the frame number
+//                version - the version expected
+// Outputs      : 1 if it is, 0 otherwise
+
+static int unit_cached(BlockFrameIndex frm, int version){
+
+	Frame expected;
+	void* frame;
+
+	unit_frame(expected, frm, version);
+	frame = get_block_cache(0, frm);
+	return (frame != NULL && memcmp(frame, expected, BLOCK_FRAME_SIZE) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_written
+// Description  : Check that a frame was written back with the data of a
+//                version
+//
+// Inputs       : frm - the frame number
+//                version - the version expected
+// Outputs      : 1 if it was, 0 otherwise
+
+static int unit_written(BlockFrameIndex frm, int version){
+
+	Frame expected;
+
+	unit_frame(expected, frm, version);
+	return (memcmp(unitBus[frm], expected, BLOCK_FRAME_SIZE) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_policies
+// Description  : Check the frames written under each write policy, only the
+//                write-back ones are written back, when flushed or evicted
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_policies(void){
+
+	BlockCacheStats before, after;
+	Frame frame;
+	uint32_t writebacks;
+	int i;
+
+	set_block_cache_size(4);
+	if (init_block_cache() == -1){
+		return (-1);
+	}
+	get_block_cache_stats(&before, NULL);
+	writebacks = unitWritebacks;
+
+	//write-through is cached clean, write-back is cached dirty and written
+	//once flushed, the second write of a dirty frame is absorbed
+	unit_frame(frame, 1, 0);
+	write_block_cache(0, 1, frame, BLOCK_WRITE_THROUGH);
+	unit_frame(frame, 2, 0);
+	write_block_cache(0, 2, frame, BLOCK_WRITE_BACK);
+	unit_frame(frame, 2, 1);
+	write_block_cache(0, 2, frame, BLOCK_WRITE_BACK);
+	if (!unit_cached(1, 0) || !unit_cached(2, 1) || unitWritebacks != writebacks){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: write-through or write-back frames not cached as written.");
+		return (-1);
+	}
+	if (flush_block_cache() == -1 || unitWritebacks != writebacks + 1 || !unit_written(2, 1)
+		|| flush_block_cache() == -1 || unitWritebacks != writebacks + 1){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: the write-back frame was not written back once flushed.");
+		return (-1);
+	}
+
+	//write-around only updates a frame already cached
+	unit_frame(frame, 3, 0);
+	write_block_cache(0, 3, frame, BLOCK_WRITE_AROUND);
+	unit_frame(frame, 1, 1);
+	write_block_cache(0, 1, frame, BLOCK_WRITE_AROUND);
+	if (peek_block_cache(0, 3) || !unit_cached(1, 1)){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: a write-around frame was cached.");
+		return (-1);
+	}
+
+	//a dirty frame evicted is written back
+	unit_frame(frame, 2, 2);
+	write_block_cache(0, 2, frame, BLOCK_WRITE_BACK);
+	for (i = 4; i < 8; i++){
+		unit_frame(frame, i, 0);
+		put_block_cache(0, i, frame);
+	}
+	if (peek_block_cache(0, 2) || unitWritebacks != writebacks + 2 || !unit_written(2, 2)){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: the dirty frame evicted was not written back.");
+		return (-1);
+	}
+	get_block_cache_stats(&after, NULL);
+	if (after.absorbed - before.absorbed != 1
+		|| after.policy_writes[BLOCK_WRITE_AROUND] - before.policy_writes[BLOCK_WRITE_AROUND] != 2
+		|| after.policy_inserts[BLOCK_WRITE_BACK] - before.policy_inserts[BLOCK_WRITE_BACK] != 1){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: the write policies were not counted.");
+		return (-1);
+	}
+	return (close_block_cache());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_failures
+// Description  : Check that the dirty frames that can't be written back stay
+//                in the cache, the frame that would evict them is not cached
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_failures(void){
+
+	BlockCacheStats before, after;
+	Frame frame;
+	int i;
+
+	set_block_cache_size(4);
+	if (init_block_cache() == -1){
+		return (-1);
+	}
+	get_block_cache_stats(&before, NULL);
+	for (i = 0; i < 4; i++){
+		unit_frame(frame, i, 0);
+		write_block_cache(0, i, frame, BLOCK_WRITE_BACK);
+	}
+
+	//the bus fails, nothing can be evicted or flushed
+	unitFailing = 1;
+	unit_frame(frame, 4, 0);
+	if (put_block_cache(0, 4, frame) != -1 || peek_block_cache(0, 4) || flush_block_cache() != -1){
+		unitFailing = 0;
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: a dirty frame was dropped while the bus failed.");
+		return (-1);
+	}
+	unitFailing = 0;
+	for (i = 0; i < 4; i++){
+		if (!unit_cached(i, 0)){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: dirty frame %d lost while the bus failed.", i);
+			return (-1);
+		}
+	}
+	get_block_cache_stats(&after, NULL);
+	if (after.writeback_failures - before.writeback_failures != 5){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: the failed write-backs were not counted.");
+		return (-1);
+	}
+
+	//the bus is back, the frames kept are written
+	if (flush_block_cache() == -1){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: the dirty frames kept were not flushed.");
+		return (-1);
+	}
+	for (i = 0; i < 4; i++){
+		if (!unit_written(i, 0)){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: dirty frame %d kept was not written back.", i);
+			return (-1);
+		}
+	}
+	return (close_block_cache());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_reclaim
+// Description  : Check that the reclaimer evicts the coldest frames from the
+//                low to the high watermark, ahead of the inserts
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_reclaim(void){
+
+	BlockCacheStats before, after;
+	struct timespec pause = {0, 1000000};
+	Frame frame;
+	uint32_t frames = 0;
+	int i, ret = 0;
+
+	if (set_block_cache_watermarks(4, 2) != -1 || set_block_cache_watermarks(0, 2) != -1){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: bad watermarks were set.");
+		return (-1);
+	}
+	set_block_cache_size(8);
+	if (init_block_cache() == -1){
+		return (-1);
+	}
+	set_block_cache_watermarks(2, 4);
+	get_block_cache_stats(&before, NULL);
+
+	//the reclaimer takes the driver lock, the inserts are made under it
+	//too. It is woken once a single slot is left free.
+	lockDriver();
+	for (i = 0; i < 7; i++){
+		unit_frame(frame, i, 0);
+		write_block_cache(0, i, frame, (i < 2) ? BLOCK_WRITE_BACK : BLOCK_WRITE_THROUGH);
+	}
+	pthread_mutex_unlock(&blockDriverLock);
+	for (i = 0; i < BLOCK_CACHE_UNIT_WAIT_MS; i++){
+		get_block_cache_stats(&after, &frames);
+		if (frames <= 4){
+			break;
+		}
+		nanosleep(&pause, NULL);
+	}
+	stop_block_cache_reclaimer();
+	set_block_cache_watermarks(0, 0);
+
+	get_block_cache_stats(&after, &frames);
+	if (frames != 4 || after.reclaimed - before.reclaimed != 3 || after.stalls != before.stalls){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: the reclaimer left %u frames cached.", frames);
+		ret = -1;
+	}
+	for (i = 0; i < 7 && ret == 0; i++){
+		if (peek_block_cache(0, i) != (i >= 3)){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: the reclaimer did not evict the coldest frames.");
+			ret = -1;
+		}
+	}
+	if (ret == 0 && (after.reclaim_writebacks - before.reclaim_writebacks != 2 || !unit_written(0, 0)
+		|| !unit_written(1, 0))){
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test: the dirty frames reclaimed were not written back.");
+		ret = -1;
+	}
+	if (close_block_cache() == -1){
+		ret = -1;
+	}
+	return (ret);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : blockCacheUnitTest
-// Description  : Run a UNIT test checking the cache implementation
+// Description  : Run a UNIT test checking the cache implementation, on a bus
+//                of its own: the write policies, the write-back failures and
+//                the reclaimer
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
 int blockCacheUnitTest(void)
 {
+    BlockCacheWriteback writeback = cacheWriteback;
+    BlockCacheEvicted evicted = cacheEvicted;
+    uint32_t size = block_cache_max_items;
+    uint32_t low = cacheLowWater, high = cacheHighWater;
+    int ret;
+
+    set_block_cache_writeback(unit_writeback);
+    set_block_cache_evicted(NULL);
+    ret = unit_policies();
+    if (ret == 0) {
+        ret = unit_failures();
+    }
+    if (ret == 0) {
+        ret = unit_reclaim();
+    }
+    unitFailing = 0;
+    stop_block_cache_reclaimer();
+    set_block_cache_watermarks(low, high);
+    if (cacheOn) {
+        close_block_cache();
+    }
+    set_block_cache_size(size);
+    set_block_cache_writeback(writeback);
+    set_block_cache_evicted(evicted);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Cache unit test failed.");
+        return (-1);
+    }
+
     // Return successfully
     logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
     return (0);
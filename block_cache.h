@@ -16,6 +16,38 @@
 
 // Defines
 #define DEFAULT_BLOCK_FRAME_CACHE_SIZE 1024 // Default size for cache
+#define BLOCK_CACHE_RECLAIM_BATCH 32 // Most frames the reclaimer evicts per hold of the driver lock
+
+// Write policies of the frames written through the cache
+typedef enum {
+    BLOCK_WRITE_THROUGH = 0, // Written to the bus and cached
+    BLOCK_WRITE_BACK = 1, // Cached dirty, written to the bus when evicted or flushed
+    BLOCK_WRITE_AROUND = 2, // Written to the bus, a cached copy is updated but none is added
+    BLOCK_WRITE_POLICIES = 3,
+} BlockWritePolicy;
+
+// Cache counters, they only ever increase
+typedef struct {
+    uint64_t lookups; // Calls to get_block_cache
+    uint64_t hits; // Lookups that found the frame
+    uint64_t inserts; // Frames added to the cache
+    uint64_t updates; // Puts of frames already in the cache
+    uint64_t evictions; // Frames replaced to make room
+    uint64_t writebacks; // Dirty frames written back to the bus
+    uint64_t absorbed; // Writes to frames already dirty (bus writes saved)
+    uint64_t reclaimed; // Frames evicted ahead of demand by the reclaimer
+    uint64_t reclaim_writebacks; // Dirty frames the reclaimer wrote back
+    uint64_t writeback_failures; // Dirty frames that could not be written back (kept dirty in the cache)
+    uint64_t stalls; // Inserts that found no free slot with the reclaimer on (evicted inline)
+    uint64_t policy_writes[BLOCK_WRITE_POLICIES]; // Frames written under each policy
+    uint64_t policy_inserts[BLOCK_WRITE_POLICIES]; // Frames written that were added to the cache
+} BlockCacheStats;
+
+// Writes a dirty frame back to the bus
+typedef int (*BlockCacheWriteback)(BlockIndex blk, BlockFrameIndex frm, void* frame);
+
+// Told of a frame evicted or reclaimed from the cache
+typedef void (*BlockCacheEvicted)(BlockIndex blk, BlockFrameIndex frm);
 
 ///
 // Cache Interfaces
@@ -23,18 +55,63 @@
 int set_block_cache_size(uint32_t max_frames);
 // Set the size of the cache (must be called before init)
 
+uint32_t get_block_cache_size(void);
+// Get the configured size of the cache
+
+int set_block_cache_limit(uint32_t max_frames);
+// Bound the size of the cache below its configured size (0 for no bound)
+
+uint32_t get_block_cache_slot_size(void);
+// Get the memory used by one frame of the cache
+
 int init_block_cache(void);
 // Initialize the cache
 
 int close_block_cache(void);
-// Clear all of the contents of the cache, cleanup
+// Clear all of the contents of the cache, cleanup (dirty frames are dropped,
+// flush the cache first to keep them)
+
+int set_block_cache_writeback(BlockCacheWriteback writeback);
+// Set the function writing the dirty frames back to the bus
+
+int set_block_cache_evicted(BlockCacheEvicted evicted);
+// Set the function told of the frames evicted or reclaimed (NULL for none)
+
+int flush_block_cache(void);
+// Write all the dirty frames back to the bus
+
+int set_block_cache_watermarks(uint32_t low, uint32_t high);
+// Keep between "low" and "high" free slots with a background reclaimer, which
+// evicts the coldest frames (writing them back if dirty) once fewer than
+// "low" slots are free. At most half of the slots are kept free, 0 and 0 turn
+// the reclaimer off (the default).
+
+int hold_block_cache_reclaimer(int hold);
+// Keep the reclaimer from being started while "hold" is set, called with the
+// driver lock held before stopping it
+
+int stop_block_cache_reclaimer(void);
+// Stop the reclaimer thread, must not be called with the driver lock held
 
 int put_block_cache(BlockIndex blk, BlockFrameIndex frm, void* frame);
 // Put an object into the object cache, evicting other items as necessary
 
+int write_block_cache(BlockIndex blk, BlockFrameIndex frm, void* frame, BlockWritePolicy policy);
+// Update the cache with a frame written under a write policy, the caller
+// writes the frame to the bus unless the policy is write-back
+
+const char* block_write_policy_name(BlockWritePolicy policy);
+// Get the name of a write policy ("through", "back" or "around")
+
 void* get_block_cache(BlockIndex blk, BlockFrameIndex frm);
 // Get an object from the cache (and return it)
 
+int peek_block_cache(BlockIndex blk, BlockFrameIndex frm);
+// Check if an object is in the cache, without counting it as an access
+
+int get_block_cache_stats(BlockCacheStats* stats, uint32_t* frames);
+// Get the cache counters and the number of frames in the cache
+
 //
 // Unit test
 
@@ -0,0 +1,409 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_compress.c
+//  Description    : This is the implementation of the codec of the at-rest
+//                   compression of the BLOCK memory system. The compressed
+//                   data is a list of sequences, each a token (literal run
+//                   length in the high nibble, match length less 4 in the low
+//                   nibble, 15 meaning more length bytes follow), the
+//                   literals, then the 2 byte offset of the match. The last
+//                   sequence has only literals.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <string.h>
+
+// Project includes
+#include <block_compress.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define COMPRESS_MIN_MATCH 4 // Shortest match encoded
+#define COMPRESS_HASH_BITS 12 // Size of the table of the last position of each 4 byte sequence
+#define BLOCK_UNIT_BUFFER (8 * BLOCK_FRAME_SIZE) // Buffer compressed by the unit test (a chunk of an archive)
+#define BLOCK_UNIT_KINDS 5 // Kinds of data compressed by the unit test
+
+//
+// Global data
+
+static int compressionEnabled = 0; // Set if the data frames written are compressed
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_set_compression
+// Description  : Compress the data frames written from now on
+//
+// Inputs       : enable - 1 to compress, 0 to store the frames raw
+// Outputs      : 0 if successful, -1 if failure
+
+int block_set_compression(int enable)
+{
+    compressionEnabled = enable;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_get_compression
+// Description  : Check if the data frames written are compressed
+//
+// Inputs       : none
+// Outputs      : 1 if compressed, 0 otherwise
+
+int block_get_compression(void)
+{
+    return (compressionEnabled);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compress_length
+// Description  : Write the rest of a length that did not fit in its nibble
+//
+// Inputs       : op - where to write, advanced past the bytes written
+//                end - the end of the output
+//                length - the rest of the length (length less 15)
+// Outputs      : 0 if successful, -1 if the output is full
+
+static int compress_length(uint8_t** op, uint8_t* end, int32_t length)
+{
+    while (length >= 255) {
+        if (*op >= end) {
+            return (-1);
+        }
+        *(*op)++ = 255;
+        length -= 255;
+    }
+    if (*op >= end) {
+        return (-1);
+    }
+    *(*op)++ = (uint8_t)length;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compress_sequence
+// Description  : Write a sequence, literals followed by a match (none if
+//                match is 0)
+//
+// Inputs       : op - where to write, advanced past the sequence
+//                end - the end of the output
+//                literals - the literals
+//                nbLiterals - the number of literals
+//                offset - the distance back to the match
+//                match - the length of the match (0 for the last sequence)
+// Outputs      : 0 if successful, -1 if the output is full
+
+static int compress_sequence(uint8_t** op, uint8_t* end, const uint8_t* literals, int32_t nbLiterals,
+    int32_t offset, int32_t match)
+{
+    uint8_t* token = *op;
+    int32_t rest = (match > 0) ? match - COMPRESS_MIN_MATCH : 0;
+
+    if (*op >= end) {
+        return (-1);
+    }
+    (*op)++;
+    *token = (uint8_t)(((nbLiterals < 15) ? nbLiterals : 15) << 4 | ((rest < 15) ? rest : 15));
+    if (nbLiterals >= 15 && compress_length(op, end, nbLiterals - 15) == -1) {
+        return (-1);
+    }
+    if (*op + nbLiterals > end) {
+        return (-1);
+    }
+    memcpy(*op, literals, nbLiterals);
+    *op += nbLiterals;
+    if (match == 0) {
+        return (0);
+    }
+    if (*op + 2 > end) {
+        return (-1);
+    }
+    *(*op)++ = (uint8_t)(offset & 0xff);
+    *(*op)++ = (uint8_t)(offset >> 8);
+    if (rest >= 15 && compress_length(op, end, rest - 15) == -1) {
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_compress
+// Description  : Compress a frame
+//
+// Inputs       : frame - the frame to compress
+//                out - the compressed data
+//                max - the longest compressed data wanted
+// Outputs      : the length of the compressed data, -1 if longer than max
+
+int32_t block_compress(const void* frame, void* out, int32_t max)
+{
+    return (block_compress_buffer(frame, BLOCK_FRAME_SIZE, out, max));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_compress_buffer
+// Description  : Compress a buffer, each 4 byte sequence is looked up in a
+//                table of the last position it was seen at and the longest
+//                match found there is taken
+//
+// Inputs       : buffer - the data to compress
+//                size - its length, at most BLOCK_COMPRESS_MAX_BUFFER
+//                out - the compressed data
+//                max - the longest compressed data wanted
+// Outputs      : the length of the compressed data, -1 if longer than max
+
+int32_t block_compress_buffer(const void* buffer, int32_t size, void* out, int32_t max)
+{
+    const uint8_t* in = buffer;
+    uint8_t* op = out;
+    uint8_t* end = op + max;
+    uint16_t table[1 << COMPRESS_HASH_BITS];
+    int32_t pos = 0, anchor = 0, candidate, match;
+    uint32_t sequence, hash;
+
+    if (size < 0 || size > BLOCK_COMPRESS_MAX_BUFFER) {
+        return (-1);
+    }
+    memset(table, 0xff, sizeof(table));
+    while (pos + COMPRESS_MIN_MATCH <= size) {
+        memcpy(&sequence, in + pos, sizeof(sequence));
+        hash = (sequence * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+        candidate = (table[hash] == 0xffff) ? -1 : table[hash];
+        table[hash] = (uint16_t)pos;
+        if (candidate < 0 || memcmp(in + candidate, in + pos, COMPRESS_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        match = COMPRESS_MIN_MATCH;
+        while (pos + match < size && in[candidate + match] == in[pos + match]) {
+            match++;
+        }
+        if (compress_sequence(&op, end, in + anchor, pos - anchor, pos - candidate, match) == -1) {
+            return (-1);
+        }
+        pos += match;
+        anchor = pos;
+    }
+    if (compress_sequence(&op, end, in + anchor, size - anchor, 0, 0) == -1) {
+        return (-1);
+    }
+    return ((int32_t)(op - (uint8_t*)out));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decompress_length
+// Description  : Read the rest of a length that did not fit in its nibble
+//
+// Inputs       : ip - where to read, advanced past the bytes read
+//                end - the end of the input
+//                length - the length to add the rest to
+// Outputs      : 0 if successful, -1 if the input ends first
+
+static int decompress_length(const uint8_t** ip, const uint8_t* end, int32_t* length)
+{
+    uint8_t byte;
+
+    do {
+        if (*ip >= end) {
+            return (-1);
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_decompress
+// Description  : Decompress a frame
+//
+// Inputs       : in - the compressed data
+//                length - the length of the compressed data
+//                frame - the frame to fill
+// Outputs      : 0 if successful, -1 if the data is not a compressed frame
+
+int block_decompress(const void* in, int32_t length, void* frame)
+{
+    return (block_decompress_buffer(in, length, frame, BLOCK_FRAME_SIZE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_decompress_buffer
+// Description  : Decompress a buffer, checking that each sequence stays in
+//                the input and in the buffer
+//
+// Inputs       : in - the compressed data
+//                length - the length of the compressed data
+//                buffer - the buffer to fill
+//                size - the length of the data before compression
+// Outputs      : 0 if successful, -1 if the data does not decompress to
+//                "size" bytes
+
+int block_decompress_buffer(const void* in, int32_t length, void* buffer, int32_t size)
+{
+    const uint8_t* ip = in;
+    const uint8_t* end = ip + length;
+    uint8_t* op = buffer;
+    uint8_t* bufferEnd = op + size;
+    int32_t nbLiterals, match, offset;
+    uint8_t token;
+
+    while (ip < end) {
+        token = *ip++;
+        nbLiterals = token >> 4;
+        if (nbLiterals == 15 && decompress_length(&ip, end, &nbLiterals) == -1) {
+            return (-1);
+        }
+        if (ip + nbLiterals > end || op + nbLiterals > bufferEnd) {
+            return (-1);
+        }
+        memcpy(op, ip, nbLiterals);
+        ip += nbLiterals;
+        op += nbLiterals;
+        if (ip == end) {
+            break;
+        }
+        if (ip + 2 > end) {
+            return (-1);
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        match = (token & 0xf) + COMPRESS_MIN_MATCH;
+        if ((token & 0xf) == 15 && decompress_length(&ip, end, &match) == -1) {
+            return (-1);
+        }
+        if (offset == 0 || offset > op - (uint8_t*)buffer || op + match > bufferEnd) {
+            return (-1);
+        }
+        // The match may overlap the bytes it writes
+        while (match-- > 0) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+    return ((op == bufferEnd) ? 0 : -1);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_buffer
+// Description  : Fill a buffer with one of the kinds of data of the unit test
+//
+// Inputs       : buffer - the buffer
+//                size - its length
+//                kind - zeros, text, random bytes, half random and half
+//                       zeros, or a short pattern repeated (overlapping
+//                       matches)
+// Outputs      : none
+
+static void unit_buffer(uint8_t* buffer, int32_t size, int kind)
+{
+    static const char text[] = "The frames of the store are compressed at rest. ";
+    uint32_t seed = 12345;
+    int32_t i;
+
+    for (i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        switch (kind) {
+        case 0:
+            buffer[i] = 0;
+            break;
+        case 1:
+            buffer[i] = text[i % (sizeof(text) - 1)];
+            break;
+        case 2:
+            buffer[i] = seed >> 24;
+            break;
+        case 3:
+            buffer[i] = (i < size / 2) ? seed >> 24 : 0;
+            break;
+        default:
+            buffer[i] = "abc"[i % 3];
+            break;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_round_trip
+// Description  : Compress a buffer and check that it decompresses to the
+//                same data, and that the data cut in half does not
+//
+// Inputs       : buffer - the data
+//                size - its length
+// Outputs      : the length of the compressed data, -1 if failure
+
+static int32_t unit_round_trip(const uint8_t* buffer, int32_t size)
+{
+    static uint8_t out[BLOCK_UNIT_BUFFER * 2], back[BLOCK_UNIT_BUFFER];
+    int32_t length;
+
+    length = block_compress_buffer(buffer, size, out, sizeof(out));
+    if (length <= 0 || block_decompress_buffer(out, length, back, size) == -1 || memcmp(back, buffer, size) != 0) {
+        return (-1);
+    }
+    if (block_decompress_buffer(out, length / 2, back, size) != -1
+        || block_decompress_buffer(out, length, back, size - 1) != -1) {
+        return (-1);
+    }
+    return (length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockCompressUnitTest
+// Description  : Run a UNIT test checking the codec, round trips of frames
+//                and buffers of each kind of data
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockCompressUnitTest(void)
+{
+    static uint8_t buffer[BLOCK_UNIT_BUFFER];
+    uint8_t out[BLOCK_FRAME_SIZE];
+    int32_t lengths[BLOCK_UNIT_KINDS];
+    int kind;
+
+    for (kind = 0; kind < BLOCK_UNIT_KINDS; kind++) {
+        unit_buffer(buffer, BLOCK_FRAME_SIZE, kind);
+        if ((lengths[kind] = unit_round_trip(buffer, BLOCK_FRAME_SIZE)) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Compress unit test: frame of kind %d does not round trip.", kind);
+            return (-1);
+        }
+        unit_buffer(buffer, BLOCK_UNIT_BUFFER, kind);
+        if (unit_round_trip(buffer, BLOCK_UNIT_BUFFER) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Compress unit test: buffer of kind %d does not round trip.", kind);
+            return (-1);
+        }
+    }
+
+    // Repeated data packs in a sector, random data is kept raw
+    unit_buffer(buffer, BLOCK_FRAME_SIZE, 2);
+    if (lengths[0] > BLOCK_COMPRESS_SECTOR_SIZE || lengths[4] > BLOCK_COMPRESS_SECTOR_SIZE
+        || lengths[3] > BLOCK_COMPRESS_MAX || block_compress(buffer, out, BLOCK_COMPRESS_MAX) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "Compress unit test: frames compressed to %d, %d, %d and %d bytes.", lengths[0],
+            lengths[2], lengths[3], lengths[4]);
+        return (-1);
+    }
+
+    // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Compress unit test completed successfully.");
+    return (0);
+}
@@ -0,0 +1,67 @@
+#ifndef BLOCK_COMPRESS_INCLUDED
+#define BLOCK_COMPRESS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_compress.h
+//  Description    : This is the header file for the at-rest compression of
+//                   the data frames of the BLOCK memory system. A frame is
+//                   compressed with a byte-oriented LZ77 codec (in the style of
+//                   LZ4) and packed with other compressed frames in sectors of
+//                   a physical frame. Frames that don't compress are stored
+//                   raw, in a frame of their own.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_controller.h>
+
+// Defines
+#define BLOCK_COMPRESS_SECTOR_SIZE 512 // Unit compressed frames are packed in
+#define BLOCK_COMPRESS_SECTORS (BLOCK_FRAME_SIZE / BLOCK_COMPRESS_SECTOR_SIZE) // Sectors of a physical frame
+#define BLOCK_COMPRESS_HEADER 2 // Length of the compressed data, before it in its sectors
+#define BLOCK_COMPRESS_MAX ((BLOCK_COMPRESS_SECTORS - 1) * BLOCK_COMPRESS_SECTOR_SIZE - BLOCK_COMPRESS_HEADER) // Longest compressed frame kept
+#define BLOCK_COMPRESS_MAX_BUFFER 0xffff // Longest buffer compressed at once (positions are 16 bits)
+
+// Placement of a frame of a file (file_t.packing), the sectors holding it
+// compressed, 0 if it is stored raw
+#define BLOCK_PACK(start, count) ((uint8_t)(((start) << 4) | (count)))
+#define BLOCK_PACK_START(pack) ((pack) >> 4)
+#define BLOCK_PACK_COUNT(pack) ((pack) & 0xf)
+#define BLOCK_PACK_PENDING 0xff // Frame added to the file and not stored yet
+#define BLOCK_PACK_CACHE_BLOCK(file_nr) ((file_nr) + 1) // Cache block of the unpacked frames of a file
+
+//
+// Functional Prototypes
+
+int block_set_compression(int enable);
+// Compress the data frames written from now on (the frames already written
+// stay as they are)
+
+int block_get_compression(void);
+// Check if the data frames written are compressed
+
+int32_t block_compress(const void* frame, void* out, int32_t max);
+// Compress a frame into "out", returns the length of the compressed data, -1
+// if it is longer than "max"
+
+int block_decompress(const void* in, int32_t length, void* frame);
+// Decompress "length" bytes of compressed data into a frame, returns -1 if the
+// data is not a valid compressed frame
+
+int32_t block_compress_buffer(const void* buffer, int32_t size, void* out, int32_t max);
+// Compress "size" bytes (several frames), as block_compress
+
+int block_decompress_buffer(const void* in, int32_t length, void* buffer, int32_t size);
+// Decompress into "size" bytes, as block_decompress
+
+//
+// Unit test
+
+int blockCompressUnitTest(void);
+// Run a UNIT test checking the codec
+
+#endif
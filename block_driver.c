@@ -8,82 +8,612 @@
 //
 
 // Includes
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 // Project Includes
+#include <block_backend.h>
 #include <block_controller.h>
 #include <block_driver.h>
 #include <block_driver_helper.h>
 #include <cmpsc311_log.h>
 #include <block_cache.h>
+#include <block_compress.h>
+#include <block_memory.h>
+#include <block_merkle.h>
+#include <block_prefetch.h>
+#include <block_record.h>
+#include <block_stats.h>
+#include <block_perf.h>
+#include <block_trace.h>
+
+// Defines
+#define BLOCK_UNIT_STORE "store.bin" // Frame file of the stores of the unit test
+#define BLOCK_UNIT_PROMOTED 2300 // Size a small file of the unit test grows to
+#define BLOCK_UNIT_FORMATTED 5000 // Size of the files of the unit test that take two frames
+#define BLOCK_UNIT_COMPRESSED (3 * BLOCK_FRAME_SIZE) // Size of the files the unit test writes compressed
+#define BLOCK_UNIT_REWRITES 10 // Rewrites of a compressed frame by the unit test
+#define BLOCK_UNIT_BATCH 4 // Frames of the file a batch of the unit test works on
+#define BLOCK_UNIT_LAID 4 // Frames of each file the unit test lays out again
+#define BLOCK_UNIT_LAID_FILES 6 // Files the unit test lays out again
+#define BLOCK_UNIT_STOPS 10 // Writes the unit test stops a relayout at
+#define BLOCK_UNIT_RELAYOUT_START (4 + BLOCK_JOURNAL_MAP_FRAMES) // Writes starting a relayout of the unit test: a frame of each table, the superblock, the map and the journal
+
+// Owner of a frame, in the list of the frame
+typedef struct {
+    int16_t file; // File owning the frame
+    int16_t index; // Index of the frame in the file (-1 for the file table entry)
+    int32_t next; // Next owner of the frame (-1 if none)
+} BlockOwner;
+
+// Owners of the frames, see block_owners
+struct block_owners {
+    int32_t first[BLOCK_BLOCK_SIZE]; // First owner of each frame (-1 if none)
+    int32_t count; // Owners in the lists
+    size_t size; // Size allocated
+    BlockOwner owners[];
+};
 
 // Global variables
 int isOn = 0;
+int isStopping = 0; // Poweroffs stopping the workers, none is started meanwhile
+int relayoutPending = 0; // A relayout failed partway, the files are refused until the next power on
+pthread_mutex_t blockDriverLock = PTHREAD_MUTEX_INITIALIZER; // Serializes the driver calls and the prefetch worker
 int nbFiles;
 int nbHandles;
 int freeFrameNr;
+fragment_t fragments[BLOCK_MAX_TOTAL_FILES]; // Fragment frames and their units held by slices
+int nbFragments; // Entries of the fragment table
+int packFrameNr; // Frame compressed frames are currently packed in (-1 if none)
+frame_t packBuffer; // Content of the current pack frame
+uint16_t packFrames[BLOCK_BLOCK_SIZE]; // Frames holding compressed frames, or free for them
+int nbPacks; // Entries of the pack frame table
+uint8_t packUsed[BLOCK_BLOCK_SIZE]; // Sectors of each frame holding a compressed frame
+frame_t* scratchFrames = NULL; // Scratch area of the driver calls, accounted as buffers while on
 file_t files[BLOCK_MAX_TOTAL_FILES];
 fh_t handles[BLOCK_MAX_TOTAL_FILES];
+superblock_t superblock;
+uint8_t frameEpochs[BLOCK_BLOCK_SIZE]; // Format epoch each frame was last written in
+uint8_t epochTableDirty[BLOCK_EPOCH_TABLE_FRAMES]; // Epoch table frames to write back
+uint32_t frameGens[BLOCK_BLOCK_SIZE]; // Generation each frame was last written in
+uint8_t genTableDirty[BLOCK_GEN_TABLE_FRAMES]; // Generation table frames to write back
+uint32_t fileTableChecksums[BLOCK_MAX_TOTAL_FILES]; // Checksum of each file table frame when loaded
+uint8_t writePolicies[BLOCK_MAX_TOTAL_FILES]; // Cache write policy of each file (BlockWritePolicy)
+BlockMountProfile* mountProfile = NULL; // Set while a power on or off is profiled
+static BlockMountProfile poweronProfile; // Breakdown of the last power on
+static BlockMountProfile poweroffProfile; // Breakdown of the last power off
 
 //
 // Implementation
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_poweron
+// Function     : writebackFrame
+// Description  : Write a dirty frame evicted or flushed from the cache to the
+//                bus
+//
+// Inputs       : blk - the block of the frame
+//                frm - the frame number
+//                frame - the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int writebackFrame(BlockIndex blk, BlockFrameIndex frm, void* frame)
+{
+    int ret;
+
+    // Only the frames written back may be held by the backend until flushed
+    (void)blk;
+    block_backend_gather(1);
+    ret = executeOpcode(frame, BLOCK_OP_WRFRME, frm, NULL);
+    block_backend_gather(0);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : evictedFrame
+// Description  : Count the frames prefetched that leave the cache unread
+//
+// Inputs       : blk - the block of the frame
+//                frm - the frame number
+// Outputs      : none
+
+static void evictedFrame(BlockIndex blk, BlockFrameIndex frm)
+{
+    if (blk == 0) {
+        block_prefetch_drop(frm);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeFrame
+// Description  : Write a frame under a write policy, a write-back frame only
+//                reaches the bus when it leaves the cache
+//
+// Inputs       : frame_nr - the frame number
+//                frame - the frame
+//                policy - the write policy
+//                checksum - set to the checksum of a frame written to the bus
+// Outputs      : 1 if held in the cache, 0 if written, -1 if failure
+
+static int writeFrame(uint16_t frame_nr, frame_t frame, BlockWritePolicy policy, uint32_t* checksum)
+{
+    // A frame prefetched is overwritten before it was read
+    block_prefetch_drop(frame_nr);
+    if (policy == BLOCK_WRITE_BACK && write_block_cache(0, frame_nr, frame, policy) == 0) {
+        return (1);
+    }
+    if (executeOpcode(frame, BLOCK_OP_WRFRME, frame_nr, checksum) == -1) {
+        return (-1);
+    }
+    if (policy != BLOCK_WRITE_BACK) {
+        write_block_cache(0, frame_nr, frame, policy);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storeFrame
+// Description  : Write a frame of a file under the write policy of the file.
+//                A data frame written with compression on (or stored
+//                compressed before) is packed if it compresses, its pack
+//                frame is written under the policy and the frame is cached
+//                unpacked.
+//
+// Inputs       : file_nr - the number of the file
+//                index - the index of the frame in the file (-1 for a fragment)
+//                frame_nr - the frame number
+//                frame - the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int storeFrame(int32_t file_nr, int32_t index, uint16_t frame_nr, frame_t frame)
+{
+    BlockWritePolicy policy = writePolicies[file_nr];
+    BlockIndex block = BLOCK_PACK_CACHE_BLOCK(file_nr);
+    uint32_t checksum;
+    char* physical;
+    int ret;
+
+    if (index >= 0 && (block_get_compression() || files[file_nr].packing[index] != 0)) {
+        if ((ret = packFrame(file_nr, index, frame, &physical)) == -1) {
+            return (-1);
+        }
+        if (ret == 1) {
+            if (writeFrame(files[file_nr].frames[index], physical, policy, NULL) == -1) {
+                return (-1);
+            }
+            // Never dirty, the pack frame holds the frame
+            if (policy != BLOCK_WRITE_AROUND || peek_block_cache(block, index)) {
+                put_block_cache(block, index, frame);
+            }
+            block_merkle_update_frame(file_nr, index, frame);
+            return (0);
+        }
+        // Stored raw, in a frame of its own
+        frame_nr = files[file_nr].frames[index];
+    }
+    if ((ret = writeFrame(frame_nr, frame, policy, &checksum)) == -1) {
+        return (-1);
+    }
+    // The checksum of a written frame is its leaf in the hash tree of the file
+    if (index >= 0) {
+        if (ret == 1) {
+            block_merkle_update_frame(file_nr, index, frame);
+        } else {
+            block_merkle_update(file_nr, index, checksum);
+        }
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : profileOwnTime
+// Description  : Get the time of the power on or off being profiled, less its
+//                controller time, metadata I/O and checksums, so that the
+//                difference of two calls is the time of a phase on its own
+//
+// Inputs       : none
+// Outputs      : the time in ns
+
+static uint64_t profileOwnTime(void)
+{
+    return (block_stats_clock() - mountProfile->controller_ns - mountProfile->bus_ns - mountProfile->checksum_ns);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storeJournal
+// Description  : Write the header of the relayout journal
+//
+// Inputs       : journal - the header, NULL to clear the journal
+// Outputs      : 0 if successful, -1 if failure
+
+static int storeJournal(journal_t* journal)
+{
+    char* frame = scratchFrames[1];
+
+    memset(frame, 0, BLOCK_FRAME_SIZE);
+    if (journal != NULL) {
+        memcpy(frame, journal, sizeof(journal_t));
+    }
+    return (executeOpcode(frame, BLOCK_OP_WRFRME, BLOCK_JOURNAL_FRAME, NULL));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stepDone
+// Description  : Record in the journal that a step of the relayout is done,
+//                a step is only done again if the relayout is interrupted
+//                before it is recorded (it reads frames no step before it
+//                wrote)
+//
+// Inputs       : journal - the header of the journal
+// Outputs      : 0 if successful, -1 if failure
+
+static int stepDone(journal_t* journal)
+{
+    journal->done++;
+    return (storeJournal(journal));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : moveFrames
+// Description  : Move the frames to their new frame numbers, following each
+//                chain of moves back from a free frame, then the cycles left
+//                with the first frame of each held aside in the journal. The
+//                moves are in the same order for the same target, the ones
+//                the journal has as done are skipped.
+//
+// Inputs       : target - the new frame number of each frame (-1 if none)
+//                source - the frame moving to each frame number (-1 if none)
+//                journal - the header of the journal
+//                steps - set to the number of steps of the moves
+// Outputs      : the number of frames moved, -1 if a frame could not be moved
+
+static int32_t moveFrames(int32_t* target, int32_t* source, journal_t* journal, uint32_t* steps)
+{
+    char* frame = scratchFrames[0];
+    int32_t moved = 0, cur, from, first;
+    uint32_t step = 0;
+    int i;
+
+    // A frame number that is not in use can be written right away, which
+    // frees the frame moving into it, and so on
+    for (i = BLOCK_DATA_FRAME_START; i < BLOCK_BLOCK_SIZE; i++) {
+        if (source[i] == -1 || target[i] != -1) {
+            continue;
+        }
+        for (cur = i; source[cur] != -1; cur = from) {
+            from = source[cur];
+            if (step++ >= journal->done) {
+                if (executeOpcode(frame, BLOCK_OP_RDFRME, from, NULL) == -1
+                    || executeOpcode(frame, BLOCK_OP_WRFRME, cur, NULL) == -1 || stepDone(journal) == -1) {
+                    return -1;
+                }
+            }
+            source[cur] = -1;
+            target[from] = -1;
+            moved++;
+        }
+    }
+    // Only cycles are left (and the frames that stay in place)
+    for (i = BLOCK_DATA_FRAME_START; i < BLOCK_BLOCK_SIZE; i++) {
+        if (target[i] == -1 || target[i] == i) {
+            continue;
+        }
+        first = i;
+        if (step++ >= journal->done) {
+            if (executeOpcode(frame, BLOCK_OP_RDFRME, first, NULL) == -1
+                || executeOpcode(frame, BLOCK_OP_WRFRME, BLOCK_JOURNAL_HELD_FRAME, NULL) == -1
+                || stepDone(journal) == -1) {
+                return -1;
+            }
+        }
+        for (cur = first; source[cur] != first; cur = from) {
+            from = source[cur];
+            if (step++ >= journal->done) {
+                if (executeOpcode(frame, BLOCK_OP_RDFRME, from, NULL) == -1
+                    || executeOpcode(frame, BLOCK_OP_WRFRME, cur, NULL) == -1 || stepDone(journal) == -1) {
+                    return -1;
+                }
+            }
+            target[from] = -1;
+            moved++;
+        }
+        if (step++ >= journal->done) {
+            if (executeOpcode(frame, BLOCK_OP_RDFRME, BLOCK_JOURNAL_HELD_FRAME, NULL) == -1
+                || executeOpcode(frame, BLOCK_OP_WRFRME, cur, NULL) == -1 || stepDone(journal) == -1) {
+                return -1;
+            }
+        }
+        target[first] = -1;
+        moved++;
+    }
+    *steps = step;
+    return (moved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startRelayout
+// Description  : Start a relayout: the frames moved to are stamped with the
+//                current epoch (so that they read back if the relayout is
+//                completed at the next power on), then the new frame numbers
+//                and the header of the journal are written
+//
+// Inputs       : map - the new frame number of each frame (0 if none)
+//                journal - the header of the journal to fill
+// Outputs      : 0 if successful, -1 if failure
+
+static int startRelayout(const uint16_t* map, journal_t* journal)
+{
+    int i;
+
+    for (i = BLOCK_DATA_FRAME_START; i < BLOCK_BLOCK_SIZE; i++) {
+        if (map[i] != 0 && map[i] != i) {
+            frameEpochs[map[i]] = superblock.epoch;
+            epochTableDirty[map[i] / BLOCK_FRAME_SIZE] = 1;
+            frameGens[map[i]] = ++superblock.generation;
+            genTableDirty[map[i] / BLOCK_GEN_PER_FRAME] = 1;
+        }
+    }
+    if (storeEpochTable() == -1 || storeGenTable() == -1 || storeSuperblock() == -1) {
+        return -1;
+    }
+    for (i = 0; i < (int)BLOCK_JOURNAL_MAP_FRAMES; i++) {
+        if (executeOpcode((char*)&map[i * BLOCK_JOURNAL_PER_FRAME], BLOCK_OP_WRFRME, BLOCK_JOURNAL_MAP_FRAME + i, NULL) == -1) {
+            return -1;
+        }
+    }
+    // The journal is only valid once all of it is in the store, and it is
+    // before the first frame moves
+    journal->magic = BLOCK_JOURNAL_MAGIC;
+    journal->epoch = superblock.epoch;
+    journal->done = 0;
+    journal->pending = 0;
+    if (block_backend_flush() == -1 || storeJournal(journal) == -1 || block_backend_flush() == -1) {
+        return -1;
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layoutFrames
+// Description  : Carry out a relayout started with its journal: move the
+//                frames, write the file table entries with their new frames,
+//                then the tables of the store, and clear the journal
+//
+// Inputs       : target - the new frame number of each frame (-1 if none)
+//                source - the frame moving to each frame number (-1 if none)
+//                map - the new frame number of each frame (0 if none)
+//                journal - the header of the journal
+// Outputs      : the number of frames moved, -1 if failure
+
+static int32_t layoutFrames(int32_t* target, int32_t* source, const uint16_t* map, journal_t* journal)
+{
+    char* buf = scratchFrames[0];
+    uint32_t step;
+    int32_t moved;
+    int i, j;
+
+    moved = moveFrames(target, source, journal, &step);
+    if (moved == -1) {
+        return -1;
+    }
+    // The entries the journal has as done were written with their new
+    // frames. The journal holds the checksum of the entry being written, an
+    // entry already written when the relayout was interrupted is kept as is.
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        if (files[i].name[0] == '\0' || step++ < journal->done) {
+            continue;
+        }
+        if (journal->pending == 0 || journal->pending != fileTableChecksums[i]) {
+            for (j = 0; j < files[i].nrFrames; j++) {
+                files[i].frames[j] = map[files[i].frames[j]];
+            }
+            if (files[i].nrFrames == 0 && files[i].fragLength != 0) {
+                files[i].fragFrame = map[files[i].fragFrame];
+            }
+        }
+        memset(buf, 0, BLOCK_FRAME_SIZE);
+        memcpy(buf, &files[i], sizeof(file_t));
+        compute_frame_checksum(buf, &journal->pending);
+        if (storeJournal(journal) == -1 || executeOpcode(buf, BLOCK_OP_WRFRME, i, &fileTableChecksums[i]) == -1) {
+            return -1;
+        }
+        // Recorded with the entry that follows, or when the journal is cleared
+        journal->done++;
+        journal->pending = 0;
+    }
+    // The tables are in the store before the journal is cleared
+    if (storeEpochTable() == -1 || storeGenTable() == -1 || storeSuperblock() == -1 || block_backend_flush() == -1
+        || storeJournal(NULL) == -1 || block_backend_flush() == -1) {
+        return -1;
+    }
+    return (moved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadFileTable
+// Description  : Read the file table entries of the store into files, with
+//                their checksums
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int loadFileTable(void)
+{
+    char* buf = scratchFrames[0];
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        if (executeOpcode(buf, BLOCK_OP_RDFRME, i, &fileTableChecksums[i]) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure reading the file table.");
+            return -1;
+        }
+        // Entries of older drivers have no fragment fields
+        memcpy(&files[i], buf, sizeof(file_t));
+        checkFileEntry(&files[i]);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : recoverRelayout
+// Description  : Complete the relayout the journal has as in progress, once
+//                the file table is loaded from the store (at power on, or
+//                when a relayout failed partway)
+//
+// Inputs       : none
+// Outputs      : the number of frames moved (0 if no relayout in progress),
+//                -1 if failure
+
+static int32_t recoverRelayout(void)
+{
+    size_t size = BLOCK_BLOCK_SIZE * (2 * sizeof(int32_t) + sizeof(uint16_t));
+    journal_t journal;
+    int32_t* target;
+    int32_t* source;
+    uint16_t* map;
+    int32_t moved = -1;
+    int i;
+
+    if (executeOpcode(scratchFrames[1], BLOCK_OP_RDFRME, BLOCK_JOURNAL_FRAME, NULL) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure reading the relayout journal.");
+        return -1;
+    }
+    memcpy(&journal, scratchFrames[1], sizeof(journal_t));
+    if (journal.magic != BLOCK_JOURNAL_MAGIC || journal.epoch != superblock.epoch) {
+        return (0);
+    }
+    if (block_backend_readonly()) {
+        logMessage(LOG_ERROR_LEVEL, "The read-only store has a relayout in progress.");
+        return -1;
+    }
+    target = block_memory_alloc(BLOCK_MEM_BUFFERS, size);
+    if (target == NULL) {
+        return -1;
+    }
+    source = target + BLOCK_BLOCK_SIZE;
+    map = (uint16_t*)(source + BLOCK_BLOCK_SIZE);
+    memset(target, 0xff, 2 * sizeof(int32_t) * BLOCK_BLOCK_SIZE);
+    for (i = 0; i < (int)BLOCK_JOURNAL_MAP_FRAMES; i++) {
+        if (executeOpcode((char*)&map[i * BLOCK_JOURNAL_PER_FRAME], BLOCK_OP_RDFRME, BLOCK_JOURNAL_MAP_FRAME + i, NULL) == -1) {
+            break;
+        }
+    }
+    if (i == (int)BLOCK_JOURNAL_MAP_FRAMES) {
+        for (i = BLOCK_DATA_FRAME_START; i < BLOCK_BLOCK_SIZE; i++) {
+            if (map[i] != 0) {
+                target[i] = map[i];
+                source[map[i]] = i;
+            }
+        }
+        moved = layoutFrames(target, source, map, &journal);
+    }
+    block_memory_free(BLOCK_MEM_BUFFERS, target, size);
+    if (moved == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure completing the relayout in progress.");
+        return -1;
+    }
+    logMessage(LOG_INFO_LEVEL, "Completed the relayout in progress, %d frames moved.", moved);
+    return (moved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_poweron_locked
 // Description  : Startup up the BLOCK interface, initialize filesystem
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t block_poweron(void)
+static int32_t block_poweron_locked(void)
 {
     int i;
+    uint64_t start, mark;
     // Check that the device is not already on
     if (isOn) {
         return -1;
     }
+    memset(&poweronProfile, 0, sizeof(poweronProfile));
+    mountProfile = &poweronProfile;
+    start = block_stats_clock();
 
     // Call the INITMS opcode
-    executeOpcode(NULL, BLOCK_OP_INITMS, 0);
+    executeOpcode(NULL, BLOCK_OP_INITMS, 0, NULL);
     isOn = 1;
-    // Call the BZERO opcode
-    
-    // Legacy code from assign2. Uncomment below to zero out the block.
-    // executeOpcode(NULL, BLOCK_OP_BZERO, 0);
+    // The store is not zeroed with BZERO, frames written before the last
+    // format are read as zeros instead (see block_format)
+    if (loadSuperblock() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure mounting the store.");
+        executeOpcode(NULL, BLOCK_OP_POWOFF, 0, NULL);
+        isOn = 0;
+        mountProfile = NULL;
+        return -1;
+    }
+    // The frames the calls work on besides the one they read or write are in
+    // the scratch area, so that the budget sees them
+    scratchFrames = block_memory_alloc(BLOCK_MEM_BUFFERS, sizeof(frame_t) * BLOCK_SCRATCH_FRAMES);
+    if (scratchFrames == NULL) {
+        executeOpcode(NULL, BLOCK_OP_POWOFF, 0, NULL);
+        isOn = 0;
+        mountProfile = NULL;
+        return -1;
+    }
 
     // Init the data structures
+    block_memory_set(BLOCK_MEM_INODES, sizeof(files) + sizeof(superblock) + sizeof(frameEpochs) + sizeof(epochTableDirty)
+        + sizeof(frameGens) + sizeof(genTableDirty) + sizeof(fileTableChecksums) + sizeof(writePolicies) + sizeof(fragments)
+        + sizeof(packFrames) + sizeof(packUsed));
+    block_memory_set(BLOCK_MEM_HANDLES, sizeof(handles));
     for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
 	    // memset(&files[i], 0, sizeof(file_t));
 	    memset(&handles[i], 0, sizeof(fh_t));
     }    
 
-    //create a buffer to store file metadata
-    char * buf;
-
-    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++){
-
-	    //allocate buffer memory to size of a frame
-	    buf = (char *) malloc(sizeof(frame_t));
-
-	    //read the frames containing metadata into the buffer
-	    executeOpcode(buf, BLOCK_OP_RDFRME, i);
-
-	    //copy the buffer into the files struct
-	    memcpy(&files[i], buf, sizeof(file_t));
-
-	    //free allocated buffer memory
-	    free(buf);
-    }	    
+    //load the file table, a relayout interrupted is completed before the
+    //frames are used
+    if (loadFileTable() == -1 || recoverRelayout() == -1) {
+	    block_memory_free(BLOCK_MEM_BUFFERS, scratchFrames, sizeof(frame_t) * BLOCK_SCRATCH_FRAMES);
+	    scratchFrames = NULL;
+	    executeOpcode(NULL, BLOCK_OP_POWOFF, 0, NULL);
+	    isOn = 0;
+	    mountProfile = NULL;
+	    return -1;
+    }
 
     nbHandles = 0;
+    mark = profileOwnTime();
     freeFrameNr = getFreeFrame(files);
+    loadFragments();
+    packFrameNr = -1;
+    loadPacks();
     nbFiles = getNbFiles(files);
+    poweronProfile.allocator_ns = profileOwnTime() - mark;
 
+    mark = profileOwnTime();
     if (init_block_cache() == -1){
+	    mountProfile = NULL;
 	    return -1;
     }
+    poweronProfile.cache_ns = profileOwnTime() - mark;
+    set_block_cache_writeback(writebackFrame);
+    set_block_cache_evicted(evictedFrame);
+    memset(writePolicies, BLOCK_WRITE_THROUGH, sizeof(writePolicies));
+    block_prefetch_reset();
+    block_merkle_drop_all();
+    poweronProfile.total_ns = block_stats_clock() - start;
+    mountProfile = NULL;
 
     // Return successfully
     return (0);
@@ -91,53 +621,136 @@ int32_t block_poweron(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_poweroff
+// Function     : block_poweroff_locked
 // Description  : Shut down the BLOCK interface, close all files
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t block_poweroff(void)
+static int32_t block_poweroff_locked(void)
 {
     // Check that the device is powered on
     if (!isOn) {
         return -1;
     }
 
-    int i;
-    
-    //create a char buffer for transfering files metadata
-    char * buf;
+    int32_t ret = 0;
+    uint64_t start, mark;
+
+    memset(&poweroffProfile, 0, sizeof(poweroffProfile));
+    mountProfile = &poweroffProfile;
+    start = block_stats_clock();
 
+    //write the write-back frames still dirty before dropping the cache, the
+    //driver stays on if they can't be
+    mark = profileOwnTime();
+    if (flush_block_cache() == -1) {
+	    logMessage(LOG_ERROR_LEVEL, "Failure writing the dirty frames back, the store stays on.");
+	    mountProfile = NULL;
+	    return -1;
+    }
     if(close_block_cache() == -1){
+	    mountProfile = NULL;
 	    return -1;
     }
+    poweroffProfile.cache_ns = profileOwnTime() - mark;
 
-    for(i=0; i<BLOCK_MAX_TOTAL_FILES; i++){
-
-	    //allocate memory for buffer equivalent to a frame
-	    buf = (char *) malloc(sizeof(frame_t));
-
-	    //copy the data in files struct to the created buffer
-	    memcpy(buf, &files[i], sizeof(frame_t));
-
-	    //execute the write command of the buffer to the current frame
-	    executeOpcode(buf, BLOCK_OP_WRFRME, i);
-
-	    //free the allocated buffer memory
-	    free(buf);
+    //a read-only store was not changed, its metadata is left as is, else
+    //only the file table entries that changed are written (none after a
+    //failed relayout, the journal completes it at the next power on)
+    if (!block_backend_readonly() && !relayoutPending && storeFileTable() == -1) {
+	    ret = -1;
     }
 
+    // Save the epochs and generations of the frames written during this session
+    if (!block_backend_readonly()) {
+        if (storeEpochTable() == -1 || storeGenTable() == -1 || storeSuperblock() == -1) {
+            ret = -1;
+        }
+        // The frames the backend still holds, or a mirror left degraded,
+        // fail the flush
+        if (block_backend_flush() == -1) {
+            ret = -1;
+        }
+    }
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure writing the metadata or flushing the store at poweroff.");
+    }
 
     // Call the POWOFF opcode
-    executeOpcode(NULL, BLOCK_OP_POWOFF, 0);
+    executeOpcode(NULL, BLOCK_OP_POWOFF, 0, NULL);
+    poweroffProfile.total_ns = block_stats_clock() - start;
+    mountProfile = NULL;
     // Close all files
     closeAllFiles(handles);
     // Free the data structures
+    block_merkle_drop_all();
+    block_memory_free(BLOCK_MEM_BUFFERS, scratchFrames, sizeof(frame_t) * BLOCK_SCRATCH_FRAMES);
+    scratchFrames = NULL;
     nbFiles = 0;
     nbHandles = 0;
     freeFrameNr = 0;
+    nbFragments = 0;
+    packFrameNr = -1;
+    nbPacks = 0;
+    relayoutPending = 0;
+    superblock.epoch = 0;
 
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_format_locked
+// Description  : Lazily format the BLOCK storage, removing all files. Only the
+//                superblock is written, frames from older epochs read as zeros
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t block_format_locked(void)
+{
+    // Check that the device is powered on, and the store can be changed
+    if (!isOn || block_backend_readonly()) {
+        return -1;
+    }
+
+    // Drop all the files and the frames cached for them, the journal of a
+    // failed relayout is left behind with the epoch
+    closeAllFiles(handles);
+    memset(files, 0, sizeof(files));
+    relayoutPending = 0;
+    nbFiles = 0;
+    nbHandles = 0;
+    block_file_stats_reset();
+    block_prefetch_reset();
+    block_merkle_drop_all();
+    memset(writePolicies, BLOCK_WRITE_THROUGH, sizeof(writePolicies));
+    freeFrameNr = BLOCK_DATA_FRAME_START;
+    nbFragments = 0;
+    packFrameNr = -1;
+    nbPacks = 0;
+    if (close_block_cache() == -1 || init_block_cache() == -1) {
+        return -1;
+    }
+
+    // Incremental backups taken before now must restart from an empty store
+    superblock.formatGeneration = ++superblock.generation;
+
+    // Start a new epoch, when the counter wraps the table is reset instead
+    if (superblock.epoch == UINT8_MAX) {
+        memset(frameEpochs, 0, BLOCK_BLOCK_SIZE);
+        memset(epochTableDirty, 1, BLOCK_EPOCH_TABLE_FRAMES);
+        superblock.epoch = 1;
+        if (storeEpochTable() == -1) {
+            return -1;
+        }
+    } else {
+        superblock.epoch++;
+    }
+    if (storeSuperblock() == -1) {
+        return -1;
+    }
 
     // Return successfully
     return (0);
@@ -145,132 +758,210 @@ int32_t block_poweroff(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_open
+// Function     : findFile
+// Description  : Find a file by name
+//
+// Inputs       : path - filename of the file
+// Outputs      : the number of the file, -1 if there is none
+
+static int findFile(char* path)
+{
+    int i;
+    for (i = 0; i < nbFiles; i++) {
+        if (memcmp(files[i].name, path, strlen(path)) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_open_locked
 // Description  : This function opens the file and returns a file handle
 //
 // Inputs       : path - filename of the file to open
 // Outputs      : file handle if successful, -1 if failure
 
-int16_t block_open(char* path)
+static int16_t block_open_locked(char* path)
 {
     int i;
-    int found;
     int16_t fd;
-    // Check that the device is on
-    if (!isOn) {
+    // Check that the device is on, and its files not refused
+    if (!isOn || relayoutPending) {
         return -1;
     }
     // Check if file exists
-    found = 0;
-    i = 0;
-    while (i < nbFiles && !found) {
-        if (memcmp(files[i].name, path, strlen(path)) == 0) {
-            found = 1;
-        } else {
-            i++;
+    i = findFile(path);
+    // If no, create/init it (not in a read-only store)
+    if (i == -1) {
+        if (block_backend_readonly()) {
+            return -1;
         }
-    }
-    // If no, create/init it
-    if (!found) {
         createNewFile(path, &files[nbFiles]);
         i = nbFiles;
         nbFiles++;
     }
     // Open the file
+    BLOCK_STAT_ADD(opens, 1);
     openFile(&handles[nbHandles], &files[i]);
+    block_prefetch_close(nbHandles);
+    if (!isStopping) {
+        block_prefetch_open(&files[i]);
+    }
     fd = nbHandles;
     nbHandles++;
+    if (blockRecording) {
+        block_record_op(BLOCK_RECORD_OPEN, fd, 0, fd, path, strlen(path));
+    }
     // THIS SHOULD RETURN A FILE HANDLE
     return (fd);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_close
-// Description  : This function closes the file
+// Function     : block_advise_locked
+// Description  : Set the cache write policy of the file behind a file handle,
+//                the frames it left dirty are written when they leave the
+//                cache
 //
 // Inputs       : fd - the file descriptor
+//                policy - the write policy
 // Outputs      : 0 if successful, -1 if failure
 
-int16_t block_close(int16_t fd)
+static int32_t block_advise_locked(int16_t fd, BlockWritePolicy policy)
 {
-    // Check that the device is on
-    if (!isOn) {
+    if (!isOn || fd < 0 || fd >= nbHandles || handles[fd].status == CLOSED) {
         return -1;
     }
-    // Check that fd is a valid file handler (file exists, is open, ...)
-    if (handles[fd].status == CLOSED) {
+    if (policy < BLOCK_WRITE_THROUGH || policy >= BLOCK_WRITE_POLICIES) {
         return -1;
     }
-    // Set the file as closed
-    closeFile(&handles[fd]);
-    // Return successfully
+    writePolicies[handles[fd].file - files] = policy;
     return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_read
-// Description  : Reads "count" bytes from the file handle "fh" into the
-//                buffer "buf"
+// Function     : checkHandle
+// Description  : Check that the device is on (and its files not refused
+//                after a failed relayout) and a file handle is open
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
+// Inputs       : fd - the file handle
+// Outputs      : 0 if the handle can be used, -1 otherwise
 
-int32_t block_read(int16_t fd, void* buf, int32_t count)
+static int checkHandle(int16_t fd)
 {
-    int32_t remaining;
-    int32_t bufOffset;
-    int32_t frame_offset;
-    int32_t frame_nr;
-    int32_t data_size;
-    int32_t loc;
-    int32_t fileSize;
-    frame_t frame;
-    file_t* file;
-    void* pointer;
-
-    // Check that the device is on
-    if (!isOn) {
+    if (!isOn || relayoutPending || fd < 0 || fd >= nbHandles || handles[fd].status == CLOSED) {
         return -1;
     }
-    // Check that the file handle is correct (file exists, is open, ...)
-    if (handles[fd].status == CLOSED) {
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : closeHandle
+// Description  : Close the file of a handle, the handle must be open (see
+//                checkHandle)
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+static int16_t closeHandle(int16_t fd)
+{
+    // Set the file as closed
+    BLOCK_STAT_ADD(closes, 1);
+    block_prefetch_closed(handles[fd].read);
+    closeFile(&handles[fd]);
+    block_prefetch_close(fd);
+    if (blockRecording) {
+        block_record_op(BLOCK_RECORD_CLOSE, fd, 0, 0, NULL, 0);
+    }
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_close_locked
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+static int16_t block_close_locked(int16_t fd)
+{
+    // Check that fd is a valid file handler (file exists, is open, ...)
+    if (checkHandle(fd) == -1) {
         return -1;
     }
+    return (closeHandle(fd));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readHandle
+// Description  : Reads "count" bytes from the file handle "fh" into the
+//                buffer "buf", the handle must be open (see checkHandle)
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t readHandle(int16_t fd, void* buf, int32_t count)
+{
+    int32_t remaining;
+    int32_t bufOffset;
+    int32_t frame_offset;
+    int32_t frame_nr;
+    int32_t data_size;
+    int32_t loc;
+    int32_t fileSize;
+    int32_t requested;
+    int missed;
+    frame_t frame;
+    file_t* file;
+    BlockFileStatsMark mark;
+
+    block_file_stats_mark(&mark);
     file = handles[fd].file;
+    requested = count;
     // Make sure we don't read more bytes than we have
     loc = handles[fd].loc;
     fileSize = file->size;
     if (fileSize - loc < count) {
         count = fileSize - loc;
     }
-    // While we haven't read `count` or reached the end of the file:
     remaining = count;
     bufOffset = 0;
+    // Small files are read from their slice of a fragment frame
+    if (file->nrFrames == 0 && remaining > 0) {
+        missed = fetchFrame(frame, file->fragFrame);
+        if (missed == -1) {
+            return -1;
+        }
+        if (missed) {
+            put_block_cache(0, file->fragFrame, frame);
+        }
+        block_prefetch_access(fd, file, -1, file->fragFrame, missed);
+        memcpy(buf, frame + file->fragOffset + loc, remaining);
+        loc += remaining;
+        remaining = 0;
+    }
+    // While we haven't read `count` or reached the end of the file:
     while (remaining != 0) {
         frame_offset = loc % BLOCK_FRAME_SIZE;
         frame_nr = file->frames[loc / BLOCK_FRAME_SIZE];
 
-	//check cache for the frame
-	pointer = get_block_cache(0, frame_nr);
-
-	//if the frame pointer returned was NULL then execute the opcode
-	if(pointer == NULL){
-		executeOpcode(frame, BLOCK_OP_RDFRME, frame_nr);
-		//place frame in cache
-		put_block_cache(0, frame_nr, frame);
+	//check cache for the frame, on a miss read it and place it in cache
+	missed = fetchFileFrame(file, loc / BLOCK_FRAME_SIZE, frame, 1);
+	if (missed == -1) {
+		return -1;
 	}
-	//else copy the frame at pointer
-	else{
-		memcpy(frame, pointer, BLOCK_FRAME_SIZE);
+	if (file->packing[loc / BLOCK_FRAME_SIZE] == 0) {
+		block_prefetch_access(fd, file, loc / BLOCK_FRAME_SIZE, frame_nr, missed);
 	}
-	///////////////////////////////////////////////////////////////
-
-
-
 
         //  Copy the relevant contents of the frame over to the buffer
         if (BLOCK_FRAME_SIZE - frame_offset > remaining) {
@@ -284,22 +975,51 @@ int32_t block_read(int16_t fd, void* buf, int32_t count)
         remaining -= data_size;
     }
     handles[fd].loc = loc;
+    handles[fd].read = 1;
+    BLOCK_STAT_ADD(reads, 1);
+    BLOCK_STAT_ADD(bytes_read, count);
+    block_histogram_add(&BLOCK_STATS()->read_latency, block_stats_clock() - mark.start_ns);
+    block_file_stats_record(file - files, 0, count, &mark);
+    if (blockRecording) {
+        block_record_op(BLOCK_RECORD_READ, fd, requested, count, buf, count);
+    }
     // Return successfully
     return (count);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_write
+// Function     : block_read_locked
+// Description  : Reads "count" bytes from the file handle "fh" into the
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+static int32_t block_read_locked(int16_t fd, void* buf, int32_t count)
+{
+    // Check that the file handle is correct (file exists, is open, ...)
+    if (checkHandle(fd) == -1) {
+        return -1;
+    }
+    return (readHandle(fd, buf, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeHandle
 // Description  : Writes "count" bytes to the file handle "fh" from the
-//                buffer  "buf"
+//                buffer  "buf", fails if the store is read-only. The handle
+//                must be open (see checkHandle).
 //
 // Inputs       : fd - filename of the file to write to
 //                buf - pointer to buffer to write from
 //                count - number of bytes to write
 // Outputs      : bytes written if successful, -1 if failure
 
-int32_t block_write(int16_t fd, void* buf, int32_t count)
+static int32_t writeHandle(int16_t fd, void* buf, int32_t count)
 {
     int32_t loc;
     int32_t remaining;
@@ -309,20 +1029,41 @@ int32_t block_write(int16_t fd, void* buf, int32_t count)
     int32_t data_size;
     file_t* file;
     frame_t frame;
-    void* pointer;
+    BlockFileStatsMark mark;
 
-    // Check that the file handle is correct (file exists, is open, ...)
-    if (handles[fd].status == CLOSED) {
+    if (block_backend_readonly()) {
         return -1;
     }
+    block_file_stats_mark(&mark);
     file = handles[fd].file;
     loc = handles[fd].loc;
+    remaining = count;
+    bufOffset = 0;
+    // Small files are written to their slice of a fragment frame
+    if (file->nrFrames == 0 && remaining > 0 && loc + remaining <= BLOCK_FRAGMENT_MAX_SIZE) {
+        if (allocateFragment(file, loc + remaining) == -1) {
+            return -1;
+        }
+        if (fetchFrame(frame, file->fragFrame) == -1) {
+            return -1;
+        }
+        memcpy(frame + file->fragOffset + loc, buf, remaining);
+        if (storeFrame(file - files, -1, file->fragFrame, frame) == -1) {
+            return -1;
+        }
+        loc += remaining;
+        remaining = 0;
+    }
+    // The file outgrew its fragment slice, move it to a dedicated frame
+    if (remaining > 0 && file->nrFrames == 0 && file->fragLength != 0) {
+        if (promoteFragment(file) == -1) {
+            return -1;
+        }
+    }
     // If needed, add new frames to the file (to allow it to store all the new data)
-    if (allocateNewFrames(&handles[fd], count) == -1) {
+    if (remaining > 0 && allocateNewFrames(&handles[fd], count) == -1) {
         return -1;
     }
-    remaining = count;
-    bufOffset = 0;
     // While we have not written `count`:
     while (remaining > 0) {
         frame_nr = file->frames[loc / BLOCK_FRAME_SIZE];
@@ -330,13 +1071,10 @@ int32_t block_write(int16_t fd, void* buf, int32_t count)
 
 
 	//////////////////////////////////////////
-	pointer = get_block_cache(0, frame_nr);
-
-	if(pointer == NULL){
-		executeOpcode(frame, BLOCK_OP_RDFRME, frame_nr);
-	}
-	else{
-		memcpy(frame, pointer, BLOCK_FRAME_SIZE);
+	//a frame overwritten whole is not fetched
+	if ((frame_offset != 0 || remaining < BLOCK_FRAME_SIZE)
+	    && fetchFileFrame(file, loc / BLOCK_FRAME_SIZE, frame, 0) == -1) {
+		return -1;
 	}
 	//////////////////////////////////////////
 
@@ -348,10 +1086,10 @@ int32_t block_write(int16_t fd, void* buf, int32_t count)
         }
         memcpy(frame + frame_offset, (char*)buf + bufOffset, data_size);
 
-        //  Call the WRFRME opcode to write the frame buffer
-        executeOpcode(frame, BLOCK_OP_WRFRME, frame_nr);
-
-	put_block_cache(0, frame_nr, frame);
+        //  Write the frame buffer under the write policy of the file
+        if (storeFrame(file - files, loc / BLOCK_FRAME_SIZE, frame_nr, frame) == -1) {
+            return -1;
+        }
 	///////////////////////////////////////////////////
 
         loc += data_size;
@@ -363,26 +1101,2341 @@ int32_t block_write(int16_t fd, void* buf, int32_t count)
     if(file->size < loc){
 	    file->size = loc;
     }
+    if (file->nrFrames == 0 && count > 0) {
+        block_merkle_update_fragment(file - files, frame + file->fragOffset, file->size);
+    }
+    BLOCK_STAT_ADD(writes, 1);
+    BLOCK_STAT_ADD(bytes_written, count);
+    block_histogram_add(&BLOCK_STATS()->write_latency, block_stats_clock() - mark.start_ns);
+    block_file_stats_record(file - files, 1, count, &mark);
+    if (blockRecording) {
+        block_record_op(BLOCK_RECORD_WRITE, fd, count, count, buf, count);
+    }
     return (count);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : block_read
-// Description  : Seek to specific point in the file
+// Function     : block_write_locked
+// Description  : Writes "count" bytes to the file handle "fh" from the
+//                buffer  "buf", fails if the store is read-only
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+static int32_t block_write_locked(int16_t fd, void* buf, int32_t count)
+{
+    // Check that the file handle is correct (file exists, is open, ...)
+    if (checkHandle(fd) == -1) {
+        return -1;
+    }
+    return (writeHandle(fd, buf, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : seekHandle
+// Description  : Seek to specific point in the file, the handle must be open
+//                (see checkHandle)
 //
 // Inputs       : fd - filename of the file to write to
 //                loc - offfset of file in relation to beginning of file
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t block_seek(int16_t fd, uint32_t loc)
+static int32_t seekHandle(int16_t fd, uint32_t loc)
 {
-    // Check that the file handle is correct (file exists, is open, ...)
-    if (handles[fd].status == CLOSED || handles[fd].file->size < loc) {
+    if (handles[fd].file->size < loc) {
         return -1;
     }
     // Set the position to the desired location
+    BLOCK_STAT_ADD(seeks, 1);
     handles[fd].loc = loc;
+    if (blockRecording) {
+        block_record_op(BLOCK_RECORD_SEEK, fd, loc, 0, NULL, 0);
+    }
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_seek_locked
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t block_seek_locked(int16_t fd, uint32_t loc)
+{
+    // Check that the file handle is correct (file exists, is open, ...)
+    if (checkHandle(fd) == -1) {
+        return -1;
+    }
+    return (seekHandle(fd, loc));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : batchHandle
+// Description  : Resolve the file handle of an operation of a batch
+//
+// Inputs       : ops - the operations of the batch
+//                i - the index of the operation
+// Outputs      : the file handle, -1 if it is not a valid open handle (the
+//                device is checked once for the batch)
+
+static int16_t batchHandle(BlockBatchOp* ops, int32_t i)
+{
+    int16_t fd = ops[i].fd;
+    int32_t opened;
+
+    if (fd < -1) {
+        // Handle returned by an earlier open of the batch
+        opened = -2 - fd;
+        if (opened >= i || ops[opened].type != BLOCK_BATCH_OPEN) {
+            return -1;
+        }
+        fd = ops[opened].result;
+    }
+    if (fd < 0 || fd >= nbHandles || handles[fd].status == CLOSED) {
+        return -1;
+    }
+    return (fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : batchPlan
+// Description  : Find the frames the operations of a batch will fetch, by
+//                following the position of each handle through the batch,
+//                and read those missing from the cache up front in frame
+//                order. Each frame is read once however many operations
+//                need it, and charged to the file of the first one. The
+//                writes of write-around files are left to fetch their frames
+//                themselves, as they do not cache them, and the frames a
+//                write overwrites whole are not fetched.
+//
+// Inputs       : ops - the operations of the batch
+//                n - the number of operations
+// Outputs      : the number of frames read, -1 if failure
+
+static int32_t batchPlan(BlockBatchOp* ops, int32_t n)
+{
+    typedef struct {
+        file_t* file; // File behind the handle (NULL if not open)
+        int32_t loc; // Position of the handle
+    } planHandle;
+    size_t size = sizeof(planHandle) * BLOCK_MAX_TOTAL_FILES + sizeof(uint16_t) * BLOCK_BLOCK_SIZE;
+    planHandle* plan;
+    uint16_t* wanted;
+    int32_t nbWanted = 0, max, nextHandle, first, last, end;
+    int32_t i, j, fd, opened, write;
+    BlockFileStatsMark mark;
+    file_t* file;
+    frame_t frame;
+
+    // Frames read beyond half of the cache could evict each other before use
+    max = get_block_cache_size() / 2;
+    plan = block_memory_alloc(BLOCK_MEM_BUFFERS, size);
+    if (plan == NULL) {
+        return -1;
+    }
+    // The file wanting each frame (and if for a write), 0 if none
+    wanted = (uint16_t*)&plan[BLOCK_MAX_TOTAL_FILES];
+    memset(wanted, 0, sizeof(uint16_t) * BLOCK_BLOCK_SIZE);
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        plan[i].file = (i < nbHandles && handles[i].status != CLOSED) ? handles[i].file : NULL;
+        plan[i].loc = (plan[i].file != NULL) ? handles[i].loc : 0;
+    }
+
+    nextHandle = nbHandles;
+    for (i = 0; i < n && nbWanted < max; i++) {
+        if (ops[i].type == BLOCK_BATCH_OPEN) {
+            // Opens are given the next handle (kept in the result until the
+            // open runs), new files have no frames yet
+            ops[i].result = -1;
+            if (nextHandle < BLOCK_MAX_TOTAL_FILES && ops[i].path != NULL) {
+                j = findFile(ops[i].path);
+                plan[nextHandle].file = (j != -1) ? &files[j] : NULL;
+                plan[nextHandle].loc = 0;
+                ops[i].result = nextHandle++;
+            }
+            continue;
+        }
+        fd = ops[i].fd;
+        if (fd < -1) {
+            opened = -2 - fd;
+            fd = (opened < i && ops[opened].type == BLOCK_BATCH_OPEN) ? ops[opened].result : -1;
+        }
+        if (fd < 0 || fd >= BLOCK_MAX_TOTAL_FILES || (file = plan[fd].file) == NULL) {
+            continue;
+        }
+        switch (ops[i].type) {
+        case BLOCK_BATCH_CLOSE:
+            plan[fd].file = NULL;
+            break;
+
+        case BLOCK_BATCH_SEEK:
+            if (ops[i].count >= 0 && ops[i].count <= file->size) {
+                plan[fd].loc = ops[i].count;
+            }
+            break;
+
+        case BLOCK_BATCH_READ:
+        case BLOCK_BATCH_WRITE:
+            if (ops[i].count <= 0) {
+                break;
+            }
+            // Reads stop at the end of the file, writes fetch the frames they
+            // partly overwrite (the frames they add are not on the bus yet)
+            write = (ops[i].type == BLOCK_BATCH_WRITE);
+            end = plan[fd].loc + ops[i].count;
+            if (!write && end > file->size) {
+                end = file->size;
+            }
+            if (write && writePolicies[file - files] == BLOCK_WRITE_AROUND) {
+                // Not cached, the write fetches them itself
+            } else if (file->nrFrames == 0) {
+                if (file->fragLength != 0 && plan[fd].loc < file->size && !wanted[file->fragFrame]) {
+                    wanted[file->fragFrame] = 1 + 2 * (file - files) + write;
+                    nbWanted++;
+                }
+            } else {
+                first = plan[fd].loc / BLOCK_FRAME_SIZE;
+                last = (end - 1) / BLOCK_FRAME_SIZE;
+                for (j = first; j <= last && j < file->nrFrames && nbWanted < max; j++) {
+                    // Compressed frames are cached unpacked, by the read itself
+                    if (file->packing[j] != 0 || wanted[file->frames[j]]
+                        || (write && j * BLOCK_FRAME_SIZE >= plan[fd].loc && (j + 1) * BLOCK_FRAME_SIZE <= end)) {
+                        continue;
+                    }
+                    wanted[file->frames[j]] = 1 + 2 * (file - files) + write;
+                    nbWanted++;
+                }
+            }
+            plan[fd].loc = end;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // Read the frames missing from the cache in frame order, the bus
+    // operations are charged to the files and to their reads or writes
+    j = 0;
+    for (i = 0; i < BLOCK_BLOCK_SIZE && nbWanted > 0; i++) {
+        if (wanted[i]) {
+            nbWanted--;
+            if (peek_block_cache(0, i)) {
+                continue;
+            }
+            // A frame that can't be read is left to fail the call reading it
+            block_file_stats_mark(&mark);
+            if (executeOpcode(frame, BLOCK_OP_RDFRME, i, NULL) == 0) {
+                put_block_cache(0, i, frame);
+                j++;
+            }
+            block_file_stats_charge((wanted[i] - 1) / 2, (wanted[i] - 1) % 2, &mark);
+        }
+    }
+    BLOCK_STAT_ADD(batch_reads, j);
+    block_memory_free(BLOCK_MEM_BUFFERS, plan, size);
+    return (j);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_batch_locked
+// Description  : Execute a batch of operations, the power is checked once
+//                and the frames the batch needs are read before the first
+//                operation
+//
+// Inputs       : ops - the operations
+//                n - the number of operations
+// Outputs      : the number of operations that succeeded, -1 if failure
+
+static int32_t block_batch_locked(BlockBatchOp* ops, int32_t n)
+{
+    int32_t i, done = 0;
+    int16_t fd;
+
+    if (!isOn || relayoutPending || ops == NULL || n < 0) {
+        return -1;
+    }
+    BLOCK_STAT_ADD(batches, 1);
+    BLOCK_STAT_ADD(batch_ops, n);
+    batchPlan(ops, n);
+
+    for (i = 0; i < n; i++) {
+        if (ops[i].type == BLOCK_BATCH_OPEN) {
+            ops[i].result = (ops[i].path != NULL) ? block_open_locked(ops[i].path) : -1;
+        } else if ((fd = batchHandle(ops, i)) == -1) {
+            ops[i].result = -1;
+        } else {
+            switch (ops[i].type) {
+            // The handle was checked by batchHandle
+            case BLOCK_BATCH_CLOSE:
+                ops[i].result = closeHandle(fd);
+                break;
+            case BLOCK_BATCH_READ:
+                ops[i].result = readHandle(fd, ops[i].buf, ops[i].count);
+                break;
+            case BLOCK_BATCH_WRITE:
+                ops[i].result = writeHandle(fd, ops[i].buf, ops[i].count);
+                break;
+            case BLOCK_BATCH_SEEK:
+                ops[i].result = (ops[i].count >= 0) ? seekHandle(fd, ops[i].count) : -1;
+                break;
+            default:
+                ops[i].result = -1;
+                break;
+            }
+        }
+        if (ops[i].result != -1) {
+            done++;
+        }
+    }
+    return (done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_fstats_locked
+// Description  : Get the I/O counters of the file behind a file handle
+//
+// Inputs       : fd - the file descriptor
+//                stats - the structure to fill
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t block_fstats_locked(int16_t fd, BlockFileStats* stats)
+{
+    // Check that the file handle is correct
+    if (!isOn || fd < 0 || fd >= nbHandles || handles[fd].status == CLOSED) {
+        return -1;
+    }
+    return (block_get_file_stats(handles[fd].file - files, stats));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_fstats_top_locked
+// Description  : Get the files with the highest counter, open or not
+//
+// Inputs       : key - the counter to rank the files by
+//                n - the maximum number of files to return
+//                top - the entries to fill, highest first
+// Outputs      : the number of files returned, -1 if failure
+
+static int32_t block_fstats_top_locked(BlockFileStatsKey key, int32_t n, BlockFileTop* top)
+{
+    int32_t nrs[BLOCK_MAX_TOTAL_FILES];
+    int i, found;
+
+    if (top == NULL || n <= 0) {
+        return -1;
+    }
+    if (n > BLOCK_MAX_TOTAL_FILES) {
+        n = BLOCK_MAX_TOTAL_FILES;
+    }
+    found = block_file_stats_top(key, n, nrs, NULL);
+    for (i = 0; i < found; i++) {
+        memcpy(top[i].name, files[nrs[i]].name, BLOCK_MAX_PATH_LENGTH);
+        block_get_file_stats(nrs[i], &top[i].stats);
+    }
+    return (found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_digest_locked
+// Description  : Get the digest of the file behind a file handle, from the
+//                root of its hash tree and its size
+//
+// Inputs       : fd - the file descriptor
+//                digest - set to the digest
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t block_file_digest_locked(int16_t fd, uint64_t* digest)
+{
+    BlockMerkleTree* tree;
+    file_t* file;
+
+    // Check that the file handle is correct
+    if (checkHandle(fd) == -1 || digest == NULL) {
+        return -1;
+    }
+    file = handles[fd].file;
+    if ((tree = block_merkle_tree(file - files, file)) == NULL) {
+        return -1;
+    }
+    *digest = block_merkle_digest(tree, file->size);
+
+    // Trees that are not kept up to date on write are only built for the call
+    if (!block_get_merkle()) {
+        block_merkle_drop(file - files);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_diff_locked
+// Description  : List the frames that differ between two files, comparing
+//                their hash trees from the root down
+//
+// Inputs       : fd_a, fd_b - the file descriptors
+//                frames - the frame indexes to fill (or NULL)
+//                max - the number of indexes that fit in frames
+// Outputs      : the number of frames that differ, -1 if failure
+
+static int32_t block_diff_locked(int16_t fd_a, int16_t fd_b, uint16_t* frames, int32_t max)
+{
+    BlockMerkleTree *a, *b;
+    file_t *file_a, *file_b;
+    int32_t found;
+
+    // Check that the file handles are correct
+    if (checkHandle(fd_a) == -1 || checkHandle(fd_b) == -1) {
+        return -1;
+    }
+    file_a = handles[fd_a].file;
+    file_b = handles[fd_b].file;
+    a = block_merkle_tree(file_a - files, file_a);
+    b = block_merkle_tree(file_b - files, file_b);
+    found = (a != NULL && b != NULL) ? block_merkle_diff(a, b, frames, max) : -1;
+    if (!block_get_merkle()) {
+        block_merkle_drop(file_a - files);
+        block_merkle_drop(file_b - files);
+    }
+    return (found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : addFrameOwner
+// Description  : Add an owner at the head of the list of a frame
+//
+// Inputs       : owners - the map of the owners
+//                frame_nr - the frame
+//                file - the file owning it
+//                index - the index of the frame in the file
+// Outputs      : none
+
+static void addFrameOwner(BlockOwners* owners, uint16_t frame_nr, int16_t file, int16_t index)
+{
+    BlockOwner* owner = &owners->owners[owners->count];
+
+    owner->file = file;
+    owner->index = index;
+    owner->next = owners->first[frame_nr];
+    owners->first[frame_nr] = owners->count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_owners_locked
+// Description  : Map the frames of the store to the files owning them. File
+//                table frames are owned by the file of the entry with index
+//                -1, fragment and pack frames by every file with data in
+//                them, listed by file and index.
+//
+// Inputs       : none
+// Outputs      : the map, NULL if failure
+
+static BlockOwners* block_owners_locked(void)
+{
+    BlockOwners* owners;
+    int32_t count = BLOCK_MAX_TOTAL_FILES;
+    size_t size;
+    int i, j;
+
+    if (!isOn || relayoutPending) {
+        return NULL;
+    }
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        count += (files[i].nrFrames == 0 && files[i].fragLength != 0) ? 1 : files[i].nrFrames;
+    }
+    size = sizeof(BlockOwners) + sizeof(BlockOwner) * count;
+    owners = block_memory_alloc(BLOCK_MEM_BUFFERS, size);
+    if (owners == NULL) {
+        return NULL;
+    }
+    memset(owners->first, 0xff, sizeof(owners->first));
+    owners->count = 0;
+    owners->size = size;
+
+    // Added backwards, so that each list is in the order of the files
+    for (i = BLOCK_MAX_TOTAL_FILES - 1; i >= 0; i--) {
+        if (files[i].name[0] == '\0') {
+            continue;
+        }
+        for (j = files[i].nrFrames - 1; j >= 0; j--) {
+            addFrameOwner(owners, files[i].frames[j], i, j);
+        }
+        if (files[i].nrFrames == 0 && files[i].fragLength != 0) {
+            addFrameOwner(owners, files[i].fragFrame, i, 0);
+        }
+        addFrameOwner(owners, i, i, -1);
+    }
+    return (owners);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_changed_since_locked
+// Description  : List the frames written after a generation, once for each
+//                file owning the frame. The entries of a frame are never
+//                split between two calls.
+//
+// Inputs       : gen - the generation of the last backup
+//                owners - the owners of the frames (NULL to list each frame
+//                         once, with no file)
+//                cursor - the first frame to look at, advanced past the
+//                         frames listed
+//                changes - the entries to fill
+//                max - the number of entries that fit in changes
+// Outputs      : the number of entries listed, -1 if failure
+
+static int32_t block_changed_since_locked(uint32_t gen, const BlockOwners* owners, uint32_t* cursor, BlockChange* changes, int32_t max)
+{
+    int32_t found = 0, needed, owner;
+    uint32_t frame_nr;
+
+    if (!isOn || relayoutPending || cursor == NULL || changes == NULL || max <= 0) {
+        return -1;
+    }
+    // The write-back frames get their generation once on the bus, the
+    // frames that can't be written back would be left out
+    if (flush_block_cache() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure writing the dirty frames back, the changes can't be listed.");
+        return -1;
+    }
+
+    for (frame_nr = *cursor; frame_nr < BLOCK_BLOCK_SIZE; frame_nr++) {
+        if (!isChangedFrame(frame_nr, gen)) {
+            continue;
+        }
+        needed = 0;
+        owner = (owners != NULL) ? owners->first[frame_nr] : -1;
+        for (; owner != -1; owner = owners->owners[owner].next) {
+            needed++;
+        }
+        if (found + ((needed > 0) ? needed : 1) > max) {
+            if (found == 0) {
+                logMessage(LOG_ERROR_LEVEL, "Frame %u has more owners than the %d entries listed at a time", frame_nr, max);
+                return -1;
+            }
+            break;
+        }
+        owner = (owners != NULL) ? owners->first[frame_nr] : -1;
+        do {
+            changes[found].frame = frame_nr;
+            changes[found].file = (owner != -1) ? owners->owners[owner].file : -1;
+            changes[found].index = (owner != -1) ? owners->owners[owner].index : -1;
+            changes[found].pad = 0;
+            changes[found].generation = frameGens[frame_nr];
+            found++;
+            owner = (owner != -1) ? owners->owners[owner].next : -1;
+        } while (owner != -1);
+    }
+    *cursor = frame_nr;
+    return (found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_read_frame_locked
+// Description  : Read a frame of the store, from the cache if it is there
+//
+// Inputs       : frame_nr - the frame to read
+//                frame - the buffer filled
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t block_read_frame_locked(uint16_t frame_nr, void* frame)
+{
+    if (!isOn || relayoutPending || frame == NULL) {
+        return -1;
+    }
+    return ((fetchFrame(frame, frame_nr) == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_apply_frame_locked
+// Description  : Write a frame of another store as is, the file table entry
+//                of a file table frame is taken in (with the frames and the
+//                fragments it holds)
+//
+// Inputs       : frame_nr - the frame to write
+//                frame - the content of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int32_t block_apply_frame_locked(uint16_t frame_nr, const void* frame)
+{
+    char* buf = scratchFrames[0];
+    int i;
+
+    if (!isOn || relayoutPending || frame == NULL || block_backend_readonly()
+        || (frame_nr >= BLOCK_SUPERBLOCK_FRAME && frame_nr < BLOCK_DATA_FRAME_START)) {
+        return -1;
+    }
+    // The files open would keep the entries they were opened with
+    for (i = 0; i < nbHandles; i++) {
+        if (handles[i].status == OPEN) {
+            return -1;
+        }
+    }
+    memcpy(buf, frame, BLOCK_FRAME_SIZE);
+    block_prefetch_drop(frame_nr);
+    if (executeOpcode(buf, BLOCK_OP_WRFRME, frame_nr,
+            (frame_nr < BLOCK_MAX_TOTAL_FILES) ? &fileTableChecksums[frame_nr] : NULL) == -1) {
+        return -1;
+    }
+    // The trees of the files are rebuilt from the frames as they are now
+    write_block_cache(0, frame_nr, buf, BLOCK_WRITE_AROUND);
+    block_merkle_drop_all();
+    if (frame_nr < BLOCK_MAX_TOTAL_FILES) {
+        memcpy(&files[frame_nr], buf, sizeof(file_t));
+        checkFileEntry(&files[frame_nr]);
+        freeFrameNr = getFreeFrame(files);
+        loadFragments();
+        packFrameNr = -1;
+        loadPacks();
+        nbFiles = getNbFiles(files);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_frames_locked
+// Description  : List the frames of a file in the order of the file
+//
+// Inputs       : path - filename of the file
+//                frames - the frame numbers to fill
+//                max - the number of frames that fit in frames
+// Outputs      : the number of frames of the file (its fragment frame for a
+//                small file), -1 if failure
+
+static int32_t block_file_frames_locked(char* path, uint16_t* frames, int32_t max)
+{
+    file_t* file;
+    int32_t i;
+    int nr;
+
+    if (!isOn || relayoutPending || path == NULL || frames == NULL || (nr = findFile(path)) == -1) {
+        return -1;
+    }
+    file = &files[nr];
+    if (file->nrFrames == 0) {
+        if (file->fragLength == 0) {
+            return (0);
+        }
+        if (max > 0) {
+            frames[0] = file->fragFrame;
+        }
+        return (1);
+    }
+    for (i = 0; i < file->nrFrames && i < max; i++) {
+        frames[i] = file->frames[i];
+    }
+    return (file->nrFrames);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_relayout_locked
+// Description  : Lay the frames of the files out again from the first data
+//                frame, the frames of "order" first and in that order, then
+//                the other frames in their current order. The files are
+//                updated to their new frames. The moves are journaled, a
+//                relayout that fails is completed from the journal right
+//                away, else the files are refused until it is completed at
+//                the next power on.
+//
+// Inputs       : order - the frame numbers in the order to lay them out
+//                n - the number of frame numbers in order
+// Outputs      : the number of frames moved, -1 if failure
+
+static int32_t block_relayout_locked(const uint16_t* order, int32_t n)
+{
+    size_t size = BLOCK_BLOCK_SIZE * (2 * sizeof(int32_t) + sizeof(uint16_t));
+    journal_t journal;
+    int32_t* target;
+    int32_t* source;
+    uint16_t* map;
+    int32_t moved, next = BLOCK_DATA_FRAME_START;
+    int i, j;
+
+    if (!isOn || relayoutPending || (order == NULL && n > 0) || block_backend_readonly()) {
+        return -1;
+    }
+    target = block_memory_alloc(BLOCK_MEM_BUFFERS, size);
+    if (target == NULL) {
+        return -1;
+    }
+    source = target + BLOCK_BLOCK_SIZE;
+    map = (uint16_t*)(source + BLOCK_BLOCK_SIZE);
+
+    // Frames in use are marked with the frame number itself until placed
+    memset(target, 0xff, 2 * sizeof(int32_t) * BLOCK_BLOCK_SIZE);
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        for (j = 0; j < files[i].nrFrames; j++) {
+            target[files[i].frames[j]] = -2;
+        }
+        if (files[i].nrFrames == 0 && files[i].fragLength != 0) {
+            target[files[i].fragFrame] = -2;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (target[order[i]] == -2) {
+            target[order[i]] = next++;
+        }
+    }
+    for (i = BLOCK_DATA_FRAME_START; i < BLOCK_BLOCK_SIZE; i++) {
+        if (target[i] == -2) {
+            target[i] = next++;
+        }
+    }
+    memset(map, 0, sizeof(uint16_t) * BLOCK_BLOCK_SIZE);
+    for (i = BLOCK_DATA_FRAME_START; i < BLOCK_BLOCK_SIZE; i++) {
+        if (target[i] >= 0) {
+            source[target[i]] = i;
+            map[i] = target[i];
+        }
+    }
+
+    // The write-back frames reach their current frame before it moves, and
+    // the frames cached under their old numbers are dropped
+    if (flush_block_cache() == -1 || startRelayout(map, &journal) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure starting the relayout, the frames are not moved.");
+        block_memory_free(BLOCK_MEM_BUFFERS, target, size);
+        return -1;
+    }
+    moved = layoutFrames(target, source, map, &journal);
+    block_memory_free(BLOCK_MEM_BUFFERS, target, size);
+
+    // The entries in files are partly remapped, they are loaded again and
+    // the relayout completed from the journal. If it still fails, the files
+    // are refused until it is completed at the next power on.
+    if (moved == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure laying the frames out, completing the relayout from the journal.");
+        if (loadFileTable() == -1 || (moved = recoverRelayout()) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "The relayout is completed at the next power on, the files are refused until then.");
+            relayoutPending = 1;
+        }
+    }
+    freeFrameNr = getFreeFrame(files);
+    loadFragments();
+    packFrameNr = -1;
+    loadPacks();
+    block_prefetch_reset();
+    if (close_block_cache() == -1 || init_block_cache() == -1) {
+        return -1;
+    }
+    return (moved);
+}
+
+//
+// Entry points, each call runs under the driver lock as the prefetch
+// worker shares the cache and the bus with the callers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_poweron
+// Description  : Startup up the BLOCK interface, initialize filesystem
+//
+// Inputs       : none
+// Outputs      : see block_poweron_locked
+
+int32_t block_poweron(void)
+{
+    int32_t ret;
+    uint64_t start;
+
+    // Trace the session if the environment asks for it
+    block_trace_start_env();
+    start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_poweron_locked();
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_POWERON, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_poweroff
+// Description  : Shut down the BLOCK interface, close all files
+//
+// Inputs       : none
+// Outputs      : see block_poweroff_locked
+
+int32_t block_poweroff(void)
+{
+    int32_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+
+    // The workers take the driver lock, they are kept from starting again
+    // under the lock, then stopped without it
+    lockDriver();
+    isStopping++;
+    hold_block_cache_reclaimer(1);
+    pthread_mutex_unlock(&blockDriverLock);
+    block_prefetch_stop();
+    stop_block_cache_reclaimer();
+    lockDriver();
+    ret = block_poweroff_locked();
+    hold_block_cache_reclaimer(0);
+    isStopping--;
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_POWEROFF, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_format
+// Description  : Lazily format the BLOCK storage, removing all files
+//
+// Inputs       : none
+// Outputs      : see block_format_locked
+
+int32_t block_format(void)
+{
+    int32_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_format_locked();
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_FORMAT, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_open
+// Description  : This function opens the file and returns a file handle
+//
+// Inputs       : see block_open_locked
+// Outputs      : see block_open_locked
+
+int16_t block_open(char* path)
+{
+    int16_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_open_locked(path);
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_OPEN, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_open_policy
+// Description  : Open a file and set its cache write policy
+//
+// Inputs       : path - filename of the file to open
+//                policy - the write policy
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t block_open_policy(char* path, BlockWritePolicy policy)
+{
+    int16_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_open_locked(path);
+    if (ret != -1 && block_advise_locked(ret, policy) == -1) {
+        block_close_locked(ret);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_OPEN, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_advise
+// Description  : Set the cache write policy of the file behind a file handle
+//
+// Inputs       : see block_advise_locked
+// Outputs      : see block_advise_locked
+
+int32_t block_advise(int16_t fd, BlockWritePolicy policy)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_advise_locked(fd, policy);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_close
+// Description  : This function closes the file
+//
+// Inputs       : see block_close_locked
+// Outputs      : see block_close_locked
+
+int16_t block_close(int16_t fd)
+{
+    int16_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_close_locked(fd);
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_CLOSE, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_read
+// Description  : Reads "count" bytes from the file handle "fh" into the buffer "buf"
+//
+// Inputs       : see block_read_locked
+// Outputs      : see block_read_locked
+
+int32_t block_read(int16_t fd, void* buf, int32_t count)
+{
+    int32_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_read_locked(fd, buf, count);
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_READ, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_write
+// Description  : Writes "count" bytes to the file handle "fh" from the buffer "buf"
+//
+// Inputs       : see block_write_locked
+// Outputs      : see block_write_locked
+
+int32_t block_write(int16_t fd, void* buf, int32_t count)
+{
+    int32_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_write_locked(fd, buf, count);
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_WRITE, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : see block_seek_locked
+// Outputs      : see block_seek_locked
+
+int32_t block_seek(int16_t fd, uint32_t loc)
+{
+    int32_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_seek_locked(fd, loc);
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_SEEK, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_batch
+// Description  : Execute a batch of operations in one call
+//
+// Inputs       : see block_batch_locked
+// Outputs      : see block_batch_locked
+
+int32_t block_batch(BlockBatchOp* ops, int32_t n)
+{
+    int32_t ret;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_DRIVER);
+    lockDriver();
+    ret = block_batch_locked(ops, n);
+    pthread_mutex_unlock(&blockDriverLock);
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_BATCH, start, ret);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_fstats
+// Description  : Get the I/O counters of the file behind a file handle
+//
+// Inputs       : see block_fstats_locked
+// Outputs      : see block_fstats_locked
+
+int32_t block_fstats(int16_t fd, BlockFileStats* stats)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_fstats_locked(fd, stats);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_fstats_top
+// Description  : Get the files with the highest counter
+//
+// Inputs       : see block_fstats_top_locked
+// Outputs      : see block_fstats_top_locked
+
+int32_t block_fstats_top(BlockFileStatsKey key, int32_t n, BlockFileTop* top)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_fstats_top_locked(key, n, top);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_digest
+// Description  : Get the digest of the file behind a file handle
+//
+// Inputs       : see block_file_digest_locked
+// Outputs      : see block_file_digest_locked
+
+int32_t block_file_digest(int16_t fd, uint64_t* digest)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_file_digest_locked(fd, digest);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_diff
+// Description  : List the frames that differ between two files
+//
+// Inputs       : see block_diff_locked
+// Outputs      : see block_diff_locked
+
+int32_t block_diff(int16_t fd_a, int16_t fd_b, uint16_t* frames, int32_t max)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_diff_locked(fd_a, fd_b, frames, max);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_generation
+// Description  : Get the current generation of the store
+//
+// Inputs       : none
+// Outputs      : the generation
+
+uint32_t block_generation(void)
+{
+    uint32_t ret;
+    lockDriver();
+    ret = superblock.generation;
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_format_generation
+// Description  : Get the generation of the last format
+//
+// Inputs       : none
+// Outputs      : the generation
+
+uint32_t block_format_generation(void)
+{
+    uint32_t ret;
+    lockDriver();
+    ret = superblock.formatGeneration;
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_owners
+// Description  : Map the frames of the store to the files owning them
+//
+// Inputs       : see block_owners_locked
+// Outputs      : see block_owners_locked
+
+BlockOwners* block_owners(void)
+{
+    BlockOwners* ret;
+    lockDriver();
+    ret = block_owners_locked();
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_owners_free
+// Description  : Free a map of the owners of the frames
+//
+// Inputs       : owners - the map (NULL is ignored)
+// Outputs      : none
+
+void block_owners_free(BlockOwners* owners)
+{
+    if (owners != NULL) {
+        block_memory_free(BLOCK_MEM_BUFFERS, owners, owners->size);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_changed_since
+// Description  : List the frames written after a generation
+//
+// Inputs       : see block_changed_since_locked
+// Outputs      : see block_changed_since_locked
+
+int32_t block_changed_since(uint32_t gen, const BlockOwners* owners, uint32_t* cursor, BlockChange* changes, int32_t max)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_changed_since_locked(gen, owners, cursor, changes, max);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_read_frame
+// Description  : Read a frame of the store
+//
+// Inputs       : see block_read_frame_locked
+// Outputs      : see block_read_frame_locked
+
+int32_t block_read_frame(uint16_t frame_nr, void* frame)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_read_frame_locked(frame_nr, frame);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_apply_frame
+// Description  : Write a frame of another store as is
+//
+// Inputs       : see block_apply_frame_locked
+// Outputs      : see block_apply_frame_locked
+
+int32_t block_apply_frame(uint16_t frame_nr, const void* frame)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_apply_frame_locked(frame_nr, frame);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_mount_profile
+// Description  : Get the breakdown of the last power on and power off
+//
+// Inputs       : poweron - the breakdown of the last power on (or NULL)
+//                poweroff - the breakdown of the last power off (or NULL)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t block_mount_profile(BlockMountProfile* poweron, BlockMountProfile* poweroff)
+{
+    lockDriver();
+    if (poweron != NULL) {
+        *poweron = poweronProfile;
+    }
+    if (poweroff != NULL) {
+        *poweroff = poweroffProfile;
+    }
+    pthread_mutex_unlock(&blockDriverLock);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_frames
+// Description  : List the frames of a file
+//
+// Inputs       : see block_file_frames_locked
+// Outputs      : see block_file_frames_locked
+
+int32_t block_file_frames(char* path, uint16_t* frames, int32_t max)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_file_frames_locked(path, frames, max);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_relayout
+// Description  : Lay the frames of the files out again
+//
+// Inputs       : see block_relayout_locked
+// Outputs      : see block_relayout_locked
+
+int32_t block_relayout(const uint16_t* order, int32_t n)
+{
+    int32_t ret;
+    lockDriver();
+    ret = block_relayout_locked(order, n);
+    pthread_mutex_unlock(&blockDriverLock);
+    return (ret);
+}
+
+//
+// Unit test
+
+// Small files of the unit test and their sizes, all fit in one fragment frame
+static char* unitNames[] = {"small0", "small1", "small2", "small3"};
+static int32_t unitSizes[] = {100, 300, 900, 300};
+
+// Writes of the stopping backend of the unit test
+static int32_t unitWrites; // Writes since the relayout started
+static int32_t unitStopAt = -1; // Write the writes fail from (-1 if none)
+static int unitStopOnce; // Only that write fails
+static int unitRefused; // The files are expected to be refused once the relayout stopped
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_fill
+// Description  : Fill a buffer with the data the unit test writes to a file,
+//                byte i of the file is the same whatever the size written
+//
+// Inputs       : buf - the buffer
+//                size - the number of bytes
+//                seed - the pattern, one per file
+// Outputs      : none
+
+static void unit_fill(char* buf, int32_t size, int seed)
+{
+    int32_t i;
+    for (i = 0; i < size; i++) {
+        buf[i] = 'a' + (i * 7 + seed) % 26;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_write
+// Description  : Write data to a file of the unit test
+//
+// Inputs       : name - the file
+//                data - the data
+//                loc - the location written in the file
+//                size - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_write(char* name, char* data, uint32_t loc, int32_t size)
+{
+    int16_t fd;
+    int ret = -1;
+
+    if ((fd = block_open(name)) == -1) {
+        return (-1);
+    }
+    if (block_seek(fd, loc) == 0 && block_write(fd, data, size) == size) {
+        ret = 0;
+    }
+    block_close(fd);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_matches
+// Description  : Check that a file of the unit test holds exactly the data
+//                written
+//
+// Inputs       : name - the file
+//                data - the data expected
+//                size - the size expected
+// Outputs      : 0 if it does, -1 otherwise
+
+static int unit_matches(char* name, char* data, int32_t size)
+{
+    char* buf = malloc(size + 1);
+    int16_t fd;
+    int ret = -1;
+
+    if (buf != NULL && (fd = block_open(name)) != -1) {
+        if (block_read(fd, buf, size + 1) == size && memcmp(buf, data, size) == 0) {
+            ret = 0;
+        }
+        block_close(fd);
+    }
+    free(buf);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "File %s does not hold the data written.", name);
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_fragments_write
+// Description  : Session of the unit test packing small files in a fragment
+//                frame, one of them outgrows its slice and is promoted to a
+//                frame of its own, and a new file takes the slice released
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_fragments_write(void)
+{
+    char data[BLOCK_UNIT_PROMOTED];
+    uint16_t frame, fragment = 0;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    for (i = 0; i < 3 && ret == 0; i++) {
+        unit_fill(data, unitSizes[i], i);
+        if (unit_write(unitNames[i], data, 0, unitSizes[i]) == -1 || block_file_frames(unitNames[i], &frame, 1) != 1
+            || (i > 0 && frame != fragment)) {
+            logMessage(LOG_ERROR_LEVEL, "The small files are not packed in one fragment frame.");
+            ret = -1;
+        }
+        fragment = frame;
+    }
+
+    // Appending past the largest slice moves the file to a frame of its own
+    unit_fill(data, BLOCK_UNIT_PROMOTED, 1);
+    if (ret == 0 && (unit_write(unitNames[1], data + unitSizes[1], unitSizes[1], BLOCK_UNIT_PROMOTED - unitSizes[1]) == -1
+                        || block_file_frames(unitNames[1], &frame, 1) != 1 || frame == fragment)) {
+        logMessage(LOG_ERROR_LEVEL, "The small file that outgrew its slice was not promoted.");
+        ret = -1;
+    }
+    if (ret == 0 && unit_matches(unitNames[1], data, BLOCK_UNIT_PROMOTED) == -1) {
+        ret = -1;
+    }
+    for (i = 0; i < 3 && ret == 0; i += 2) {
+        unit_fill(data, unitSizes[i], i);
+        ret = unit_matches(unitNames[i], data, unitSizes[i]);
+    }
+
+    // The slice released is handed out again
+    unit_fill(data, unitSizes[3], 3);
+    if (ret == 0 && (unit_write(unitNames[3], data, 0, unitSizes[3]) == -1
+                        || block_file_frames(unitNames[3], &frame, 1) != 1 || frame != fragment)) {
+        logMessage(LOG_ERROR_LEVEL, "The slice released by the promoted file was not reused.");
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_fragments_read
+// Description  : Session of the unit test reading the files packed in the
+//                previous session back after a power cycle
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_fragments_read(void)
+{
+    char data[BLOCK_UNIT_PROMOTED];
+    uint16_t frame, fragment = 0;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    for (i = 0; i < 4 && ret == 0; i++) {
+        unit_fill(data, (i == 1) ? BLOCK_UNIT_PROMOTED : unitSizes[i], i);
+        ret = unit_matches(unitNames[i], data, (i == 1) ? BLOCK_UNIT_PROMOTED : unitSizes[i]);
+        if (ret == 0 && i != 1 && (block_file_frames(unitNames[i], &frame, 1) != 1 || (i > 0 && frame != fragment))) {
+            logMessage(LOG_ERROR_LEVEL, "The small files are not in their fragment frame after a power cycle.");
+            ret = -1;
+        }
+        fragment = (i == 0) ? frame : fragment;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_fragments
+// Description  : Check the packing of small files in fragment frames and
+//                their promotion once they outgrow their slice
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_fragments(void)
+{
+    char dir[32];
+    int ret = 0;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    if (unitSession(dir, unit_fragments_write) == -1 || unitSession(dir, unit_fragments_read) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed packing small files in fragments.");
+        ret = -1;
+    }
+    unitCleanup(dir);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_format_write
+// Description  : Session of the unit test formatting a store holding a file,
+//                the frames of the file read as zeros once it is formatted
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_format_write(void)
+{
+    char data[BLOCK_UNIT_FORMATTED];
+    uint16_t frames[2];
+    frame_t frame, zeros;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    unit_fill(data, BLOCK_UNIT_FORMATTED, 0);
+    if (unit_write("old", data, 0, BLOCK_UNIT_FORMATTED) == -1 || block_file_frames("old", frames, 2) != 2
+        || block_format() == -1) {
+        ret = -1;
+    }
+    memset(zeros, 0, BLOCK_FRAME_SIZE);
+    for (i = 0; i < 2 && ret == 0; i++) {
+        if (block_read_frame(frames[i], frame) == -1 || memcmp(frame, zeros, BLOCK_FRAME_SIZE) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Frame %d of a file removed by the format does not read as zeros.", frames[i]);
+            ret = -1;
+        }
+    }
+    if (ret == 0 && block_file_frames("old", frames, 2) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "The file written before the format is still there.");
+        ret = -1;
+    }
+    unit_fill(data, unitSizes[0], 1);
+    if (ret == 0 && unit_write("new", data, 0, unitSizes[0]) == -1) {
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_format_read
+// Description  : Session of the unit test checking that the format outlives
+//                a power cycle, only the file written after it is there
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_format_read(void)
+{
+    char data[BLOCK_UNIT_FORMATTED];
+    uint16_t frame;
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    if (block_file_frames("old", &frame, 1) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "The file written before the format is back after a power cycle.");
+        ret = -1;
+    }
+    unit_fill(data, unitSizes[0], 1);
+    if (ret == 0 && unit_matches("new", data, unitSizes[0]) == -1) {
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_legacy_write
+// Description  : Session of the unit test writing a store the way drivers
+//                older than the superblock did, its file has a frame in the
+//                metadata area now reserved
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_legacy_write(void)
+{
+    BlockBackend* backend;
+    char data[BLOCK_UNIT_FORMATTED];
+    frame_t frame;
+    file_t entry;
+    uint32_t checksum;
+    int i, ret = 0;
+
+    if ((backend = block_backend_file(BLOCK_UNIT_STORE)) == NULL) {
+        return (-1);
+    }
+    memset(&entry, 0, sizeof(file_t));
+    strcpy(entry.name, "legacy");
+    entry.size = BLOCK_UNIT_FORMATTED;
+    entry.nrFrames = 2;
+    entry.frames[0] = BLOCK_EPOCH_TABLE_FRAME + 5;
+    entry.frames[1] = BLOCK_DATA_FRAME_START + 40;
+    unit_fill(data, BLOCK_UNIT_FORMATTED, 2);
+    for (i = 0; i < 2 && ret == 0; i++) {
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        memcpy(frame, data + i * BLOCK_FRAME_SIZE, (i == 0) ? BLOCK_FRAME_SIZE : BLOCK_UNIT_FORMATTED - BLOCK_FRAME_SIZE);
+        compute_frame_checksum(frame, &checksum);
+        ret = backend->write(backend, entry.frames[i], frame, checksum);
+    }
+    memset(frame, 0, BLOCK_FRAME_SIZE);
+    memcpy(frame, &entry, sizeof(file_t));
+    compute_frame_checksum(frame, &checksum);
+    if (ret == 0 && backend->write(backend, 0, frame, checksum) == -1) {
+        ret = -1;
+    }
+    if (backend->close(backend) == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_legacy_read
+// Description  : Session of the unit test mounting the store written by the
+//                older driver, it is migrated and its file read back
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_legacy_read(void)
+{
+    char data[BLOCK_UNIT_FORMATTED];
+    uint16_t frames[2];
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "The store written before the superblock can't be mounted.");
+        return (-1);
+    }
+    unit_fill(data, BLOCK_UNIT_FORMATTED, 2);
+    if (unit_matches("legacy", data, BLOCK_UNIT_FORMATTED) == -1) {
+        ret = -1;
+    }
+    if (ret == 0 && (block_file_frames("legacy", frames, 2) != 2 || frames[0] < BLOCK_DATA_FRAME_START
+                        || frames[1] < BLOCK_DATA_FRAME_START)) {
+        logMessage(LOG_ERROR_LEVEL, "The frames of the migrated store were not moved out of the metadata area.");
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_format
+// Description  : Check the lazy format of a store, and the mount of a store
+//                written before the superblock
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_format(void)
+{
+    char dir[32];
+    int ret = 0;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    if (unitSession(dir, unit_format_write) == -1 || unitSession(dir, unit_format_read) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed formatting a store.");
+        ret = -1;
+    }
+    unitCleanup(dir);
+    if (ret == -1 || unitDirectory(dir) == -1) {
+        return (-1);
+    }
+
+    // The store is mounted twice, migrated by the first power on only
+    if (unitSession(dir, unit_legacy_write) == -1 || unitSession(dir, unit_legacy_read) == -1
+        || unitSession(dir, unit_legacy_read) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed mounting a store written before the superblock.");
+        ret = -1;
+    }
+    unitCleanup(dir);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_random
+// Description  : Fill a buffer with data of the unit test that does not
+//                compress
+//
+// Inputs       : buf - the buffer
+//                size - the number of bytes
+//                seed - the pattern, one per file
+// Outputs      : none
+
+static void unit_random(char* buf, int32_t size, uint32_t seed)
+{
+    int32_t i;
+    for (i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 24;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_compressed_write
+// Description  : Session of the unit test writing a file that compresses and
+//                one that does not with the compression on, the frames of
+//                the first are packed in sectors of shared frames
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_compressed_write(void)
+{
+    char data[BLOCK_UNIT_COMPRESSED];
+    uint16_t frames[BLOCK_UNIT_COMPRESSED / BLOCK_FRAME_SIZE];
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_set_compression(1) == -1
+        || block_poweron() == -1) {
+        return (-1);
+    }
+    unit_fill(data, BLOCK_UNIT_COMPRESSED, 0);
+    if (unit_write("packed", data, 0, BLOCK_UNIT_COMPRESSED) == -1
+        || unit_matches("packed", data, BLOCK_UNIT_COMPRESSED) == -1) {
+        ret = -1;
+    }
+    if (ret == 0 && (block_file_frames("packed", frames, 3) != 3 || frames[0] != frames[1] || frames[1] != frames[2])) {
+        logMessage(LOG_ERROR_LEVEL, "The compressed frames of a file are not packed in one frame.");
+        ret = -1;
+    }
+    unit_random(data, BLOCK_UNIT_COMPRESSED, 1);
+    if (ret == 0 && (unit_write("raw", data, 0, BLOCK_UNIT_COMPRESSED) == -1
+                        || unit_matches("raw", data, BLOCK_UNIT_COMPRESSED) == -1)) {
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_compressed_read
+// Description  : Session of the unit test reading the files written with the
+//                compression on after a power cycle, with the compression
+//                off, and rewriting a packed frame raw
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_compressed_read(void)
+{
+    char data[BLOCK_UNIT_COMPRESSED];
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    unit_random(data, BLOCK_UNIT_COMPRESSED, 1);
+    if (unit_matches("raw", data, BLOCK_UNIT_COMPRESSED) == -1) {
+        ret = -1;
+    }
+    unit_fill(data, BLOCK_UNIT_COMPRESSED, 0);
+    if (ret == 0 && unit_matches("packed", data, BLOCK_UNIT_COMPRESSED) == -1) {
+        ret = -1;
+    }
+    unit_random(data + BLOCK_FRAME_SIZE, 100, 2);
+    if (ret == 0 && (unit_write("packed", data + BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE, 100) == -1
+                        || unit_matches("packed", data, BLOCK_UNIT_COMPRESSED) == -1)) {
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_rewrite
+// Description  : Fill the data of the write-back file of the unit test as
+//                left by a rewrite, its first frame compressing less at each
+//                rewrite and not at all at every third one
+//
+// Inputs       : data - the data of the file
+//                rewrite - the number of the rewrite
+// Outputs      : none
+
+static void unit_rewrite(char* data, int rewrite)
+{
+    unit_fill(data, BLOCK_UNIT_COMPRESSED, 3);
+    unit_random(data, (rewrite % 3 == 2) ? BLOCK_FRAME_SIZE : 250 * (rewrite + 1), rewrite);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_compressed_pack
+// Description  : Session of the unit test writing compressed frames to a
+//                write-back file, their pack frame is held in the cache until
+//                the power off. A frame rewritten larger, or raw and then
+//                packed again, leaves sectors and frames that are reused.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_compressed_pack(void)
+{
+    char data[BLOCK_UNIT_COMPRESSED];
+    BlockDriverStats before, after;
+    int16_t fd;
+    int i, frames, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_set_compression(1) == -1
+        || block_poweron() == -1) {
+        return (-1);
+    }
+    if ((fd = block_open_policy("back", BLOCK_WRITE_BACK)) == -1) {
+        block_poweroff();
+        return (-1);
+    }
+    unit_fill(data, BLOCK_UNIT_COMPRESSED, 3);
+    block_get_stats(&before);
+    if (block_write(fd, data, BLOCK_UNIT_COMPRESSED) != BLOCK_UNIT_COMPRESSED) {
+        ret = -1;
+    }
+    block_get_stats(&after);
+    if (ret == 0 && after.bus_writes != before.bus_writes) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: compressed frames of a write-back file were written through.");
+        ret = -1;
+    }
+    block_close(fd);
+
+    // Grown or stored raw, the frame takes no more than a frame of its own
+    // and one more pack frame
+    frames = freeFrameNr;
+    for (i = 0; i < BLOCK_UNIT_REWRITES && ret == 0; i++) {
+        unit_rewrite(data, i);
+        if (unit_write("back", data, 0, BLOCK_FRAME_SIZE) == -1 || unit_matches("back", data, BLOCK_UNIT_COMPRESSED) == -1) {
+            ret = -1;
+        }
+    }
+    if (ret == 0 && freeFrameNr > frames + 2) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: frames rewritten compressed took %d more frames.", freeFrameNr - frames);
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_compressed_repacked
+// Description  : Session of the unit test reading the write-back file after
+//                a power cycle, its pack frames written at the power off
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_compressed_repacked(void)
+{
+    char data[BLOCK_UNIT_COMPRESSED];
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    unit_rewrite(data, BLOCK_UNIT_REWRITES - 1);
+    if (unit_matches("back", data, BLOCK_UNIT_COMPRESSED) == -1) {
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_compressed
+// Description  : Check the round trip of files written compressed, through a
+//                power cycle, and the reuse of the sectors they leave
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_compressed(void)
+{
+    char dir[32];
+    int ret = 0;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    if (unitSession(dir, unit_compressed_write) == -1 || unitSession(dir, unit_compressed_read) == -1
+        || unitSession(dir, unit_compressed_pack) == -1 || unitSession(dir, unit_compressed_repacked) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed reading back the files written compressed.");
+        ret = -1;
+    }
+    unitCleanup(dir);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_batch_write
+// Description  : Session of the unit test writing the files a batch works on
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_batch_write(void)
+{
+    char data[BLOCK_UNIT_BATCH * BLOCK_FRAME_SIZE];
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    unit_fill(data, sizeof(data), 5);
+    if (unit_write("batched", data, 0, BLOCK_UNIT_BATCH * BLOCK_FRAME_SIZE) == -1
+        || unit_write("around", data, 0, 2 * BLOCK_FRAME_SIZE) == -1 || unit_write(unitNames[0], data, 0, unitSizes[0]) == -1) {
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_batch_run
+// Description  : Session of the unit test running a batch from an empty
+//                cache: only the frames read or partly overwritten are read
+//                ahead (not those overwritten whole nor those of a
+//                write-around file), and they are charged to their file
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_batch_run(void)
+{
+    char data[BLOCK_UNIT_BATCH * BLOCK_FRAME_SIZE], changed[BLOCK_FRAME_SIZE], read[BLOCK_FRAME_SIZE];
+    BlockDriverStats before, after;
+    BlockFileStats fstats;
+    BlockBatchOp ops[10];
+    uint16_t around[2];
+    int16_t fd;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    if ((fd = block_open_policy("around", BLOCK_WRITE_AROUND)) == -1 || block_file_frames("around", around, 2) != 2) {
+        block_poweroff();
+        return (-1);
+    }
+    memset(changed, 'Y', BLOCK_FRAME_SIZE);
+    memset(ops, 0, sizeof(ops));
+    ops[0].type = BLOCK_BATCH_OPEN;
+    ops[0].path = "batched";
+    ops[1].type = BLOCK_BATCH_READ;
+    ops[1].fd = BLOCK_BATCH_OPENED(0);
+    ops[1].buf = read;
+    ops[1].count = 100;
+    ops[2].type = BLOCK_BATCH_SEEK;
+    ops[2].fd = BLOCK_BATCH_OPENED(0);
+    ops[2].count = BLOCK_FRAME_SIZE;
+    ops[3].type = BLOCK_BATCH_WRITE; // Frame 1 overwritten whole
+    ops[3].fd = BLOCK_BATCH_OPENED(0);
+    ops[3].buf = changed;
+    ops[3].count = BLOCK_FRAME_SIZE;
+    ops[4].type = BLOCK_BATCH_WRITE; // Frame 2 partly overwritten
+    ops[4].fd = BLOCK_BATCH_OPENED(0);
+    ops[4].buf = changed;
+    ops[4].count = 10;
+    ops[5].type = BLOCK_BATCH_WRITE; // Write-around, not cached
+    ops[5].fd = fd;
+    ops[5].buf = changed;
+    ops[5].count = 10;
+    ops[6].type = BLOCK_BATCH_OPEN;
+    ops[6].path = unitNames[0];
+    ops[7].type = BLOCK_BATCH_READ;
+    ops[7].fd = BLOCK_BATCH_OPENED(6);
+    ops[7].buf = read + 100;
+    ops[7].count = unitSizes[0];
+    ops[8].type = BLOCK_BATCH_CLOSE;
+    ops[8].fd = BLOCK_BATCH_OPENED(0);
+    ops[9].type = BLOCK_BATCH_CLOSE;
+    ops[9].fd = BLOCK_BATCH_OPENED(6);
+    block_get_stats(&before);
+    if (block_batch(ops, 10) != 10) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: operations of the batch failed.");
+        ret = -1;
+    }
+    block_get_stats(&after);
+
+    // Frame 0 and the fragment read, frame 2 for its write, frame 0 of the
+    // write-around file read by the write itself
+    if (ret == 0 && (after.batch_reads - before.batch_reads != 3 || after.bus_reads - before.bus_reads != 4
+                        || peek_block_cache(0, around[0]))) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: the batch read %lu frames ahead, %lu in all.",
+            (unsigned long)(after.batch_reads - before.batch_reads), (unsigned long)(after.bus_reads - before.bus_reads));
+        ret = -1;
+    }
+    if (ret == 0 && (after.read_bus_bytes - before.read_bus_bytes != 2 * BLOCK_FRAME_SIZE
+                        || after.write_bus_bytes - before.write_bus_bytes != 5 * BLOCK_FRAME_SIZE)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: the frames read ahead were not charged to the calls.");
+        ret = -1;
+    }
+
+    // The file charged with its frames read ahead and written
+    block_close(fd);
+    unit_fill(data, sizeof(data), 5);
+    memset(&data[BLOCK_FRAME_SIZE], 'Y', BLOCK_FRAME_SIZE + 10);
+    if (ret == 0 && ((fd = block_open("batched")) == -1 || block_fstats(fd, &fstats) == -1 || fstats.bus_ops != 4
+                        || block_close(fd) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: the frames read ahead were not charged to their file.");
+        ret = -1;
+    }
+    if (ret == 0 && (memcmp(read, data, 100) != 0 || memcmp(read + 100, data, unitSizes[0]) != 0
+                        || unit_matches("batched", data, BLOCK_UNIT_BATCH * BLOCK_FRAME_SIZE) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: the batch did not read or write the files.");
+        ret = -1;
+    }
+    unit_fill(data, sizeof(data), 5);
+    memcpy(data, changed, 10);
+    if (ret == 0 && unit_matches("around", data, 2 * BLOCK_FRAME_SIZE) == -1) {
+        ret = -1;
+    }
+    for (i = 0; i < 10 && ret == 0; i++) {
+        if (ops[i].result != ((ops[i].type == BLOCK_BATCH_READ || ops[i].type == BLOCK_BATCH_WRITE) ? ops[i].count
+                                  : (ops[i].type == BLOCK_BATCH_SEEK) ? 0 : ops[i].result)) {
+            ret = -1;
+        }
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_batch
+// Description  : Check the frames a batch reads ahead of its operations
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_batch(void)
+{
+    char dir[32];
+    int ret = 0;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    if (unitSession(dir, unit_batch_write) == -1 || unitSession(dir, unit_batch_run) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed running a batch.");
+        ret = -1;
+    }
+    unitCleanup(dir);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_stopping_read
+// Description  : Read a frame of the stopping backend, from its file backend
+//
+// Inputs       : see block_backend_file
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_stopping_read(BlockBackend* backend, uint16_t frame_nr, void* frame, uint32_t* checksum)
+{
+    BlockBackend* file = backend->state;
+    return (file->read(file, frame_nr, frame, checksum));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_stopping_write
+// Description  : Write a frame of the stopping backend, the writes are
+//                counted and fail from write unitStopAt on (only that one
+//                with unitStopOnce)
+//
+// Inputs       : see block_backend_file
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_stopping_write(BlockBackend* backend, uint16_t frame_nr, const void* frame, uint32_t checksum)
+{
+    BlockBackend* file = backend->state;
+    int32_t write = unitWrites++;
+
+    if (unitStopAt >= 0 && (write == unitStopAt || (write > unitStopAt && !unitStopOnce))) {
+        return (-1);
+    }
+    return (file->write(file, frame_nr, frame, checksum));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_stopping_flush
+// Description  : Flush the stopping backend
+//
+// Inputs       : see block_backend_file
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_stopping_flush(BlockBackend* backend)
+{
+    BlockBackend* file = backend->state;
+    return (file->flush(file));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_stopping_close
+// Description  : Close the stopping backend and its file backend
+//
+// Inputs       : see block_backend_file
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_stopping_close(BlockBackend* backend)
+{
+    BlockBackend* file = backend->state;
+    free(backend);
+    return (file->close(file));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_stopping_backend
+// Description  : Open the store of the unit test through a backend whose
+//                writes can be made to fail, as if the process stopped
+//
+// Inputs       : none
+// Outputs      : the backend, NULL if failure
+
+static BlockBackend* unit_stopping_backend(void)
+{
+    BlockBackend* file = block_backend_file(BLOCK_UNIT_STORE);
+    BlockBackend* backend = malloc(sizeof(BlockBackend));
+
+    if (file == NULL || backend == NULL) {
+        if (file != NULL) {
+            file->close(file);
+        }
+        free(backend);
+        return (NULL);
+    }
+    backend->name = "stopping";
+    backend->read = unit_stopping_read;
+    backend->write = unit_stopping_write;
+    backend->flush = unit_stopping_flush;
+    backend->close = unit_stopping_close;
+    backend->state = file;
+    return (backend);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_relayout_write
+// Description  : Session of the unit test writing files with their frames
+//                interleaved, over a store formatted again so that each case
+//                starts from the same frames
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_relayout_write(void)
+{
+    char data[BLOCK_UNIT_LAID * BLOCK_FRAME_SIZE], name[16];
+    int i, j, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    if (block_format() == -1) {
+        ret = -1;
+    }
+    for (j = 0; j < BLOCK_UNIT_LAID && ret == 0; j++) {
+        for (i = 0; i < BLOCK_UNIT_LAID_FILES && ret == 0; i++) {
+            snprintf(name, sizeof(name), "laid%d", i);
+            unit_fill(data, sizeof(data), i);
+            ret = unit_write(name, &data[j * BLOCK_FRAME_SIZE], j * BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE);
+        }
+        if (ret == 0 && j < 4) {
+            unit_fill(data, unitSizes[j], 10 + j);
+            ret = unit_write(unitNames[j], data, 0, unitSizes[j]);
+        }
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_relayout_matches
+// Description  : Check that the files of the relayout unit test hold the data
+//                written
+//
+// Inputs       : none
+// Outputs      : 0 if they do, -1 otherwise
+
+static int unit_relayout_matches(void)
+{
+    char data[BLOCK_UNIT_LAID * BLOCK_FRAME_SIZE], name[16];
+    int i;
+
+    for (i = 0; i < BLOCK_UNIT_LAID_FILES; i++) {
+        snprintf(name, sizeof(name), "laid%d", i);
+        unit_fill(data, sizeof(data), i);
+        if (unit_matches(name, data, sizeof(data)) == -1) {
+            return (-1);
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        unit_fill(data, unitSizes[i], 10 + i);
+        if (unit_matches(unitNames[i], data, unitSizes[i]) == -1) {
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_relayout_stop
+// Description  : Session of the unit test laying the files out one after the
+//                other, with the writes failing from write unitStopAt of the
+//                relayout on (none if -1, the writes are then counted in the
+//                file "writes"). A relayout stopped is completed from the
+//                journal if the writes come back, else the files are
+//                refused.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_relayout_stop(void)
+{
+    uint16_t order[BLOCK_UNIT_LAID * BLOCK_UNIT_LAID_FILES];
+    int32_t moved, n = 0;
+    char name[16];
+    FILE* writes;
+    int i, ret = 0;
+
+    if (block_set_backend(unit_stopping_backend()) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    for (i = 0; i < BLOCK_UNIT_LAID_FILES; i++) {
+        snprintf(name, sizeof(name), "laid%d", i);
+        n += block_file_frames(name, &order[n], BLOCK_UNIT_LAID);
+    }
+    unitWrites = 0;
+    moved = block_relayout(order, n);
+    if (unitStopAt == -1) {
+        if (moved <= 0 || (writes = fopen("writes", "w")) == NULL) {
+            block_poweroff();
+            return (-1);
+        }
+        fprintf(writes, "%d\n", unitWrites);
+        fclose(writes);
+    } else if (unitStopOnce) {
+        if (moved <= 0) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test: relayout not completed after write %d failed.", unitStopAt);
+            ret = -1;
+        }
+    } else if (moved != -1 || (block_open(unitNames[0]) == -1) != unitRefused) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test: relayout stopped at write %d %s the files.", unitStopAt,
+            unitRefused ? "did not refuse" : "refused");
+        ret = -1;
+    }
+    // The files read back right away unless they are refused
+    if (ret == 0 && !(unitStopAt >= 0 && !unitStopOnce && unitRefused) && unit_relayout_matches() == -1) {
+        ret = -1;
+    }
+    if (block_poweroff() == -1 && (unitStopAt == -1 || unitStopOnce)) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_relayout_read
+// Description  : Session of the unit test checking the files after the power
+//                on that completes the relayout stopped
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_relayout_read(void)
+{
+    int ret;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    ret = unit_relayout_matches();
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_relayout
+// Description  : Check a relayout stopped before and after its journal is
+//                valid, during the moves, the file table entries and the
+//                tables, and a failure of one write during the moves
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_relayout(void)
+{
+    char dir[32], path[64];
+    int32_t total = 0, step;
+    FILE* writes;
+    int i, ret = 0;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    // Count the writes of the relayout
+    unitStopAt = -1;
+    if (unitSession(dir, unit_relayout_write) == -1 || unitSession(dir, unit_relayout_stop) == -1) {
+        ret = -1;
+    }
+    snprintf(path, sizeof(path), "%s/writes", dir);
+    if (ret == 0 && ((writes = fopen(path, "r")) == NULL || fscanf(writes, "%d", &total) != 1 || fclose(writes) != 0
+                        || total <= BLOCK_UNIT_RELAYOUT_START)) {
+        ret = -1;
+    }
+
+    // The journal is valid once its header is written after the map, the
+    // files are only refused from then on. The writes stop at the last frame
+    // of the map, at the header, then at steps spread up to the last write.
+    for (i = 0; i < BLOCK_UNIT_STOPS && ret == 0; i++) {
+        step = (i < 2) ? BLOCK_UNIT_RELAYOUT_START - 2 + i
+                       : BLOCK_UNIT_RELAYOUT_START + (total - 1 - BLOCK_UNIT_RELAYOUT_START) * (i - 2) / (BLOCK_UNIT_STOPS - 3);
+        unitStopAt = step;
+        unitStopOnce = 0;
+        unitRefused = (step >= BLOCK_UNIT_RELAYOUT_START);
+        if (unitSession(dir, unit_relayout_write) == -1 || unitSession(dir, unit_relayout_stop) == -1
+            || unitSession(dir, unit_relayout_read) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Driver unit test failed a relayout stopped at write %d of %d.", step, total);
+            ret = -1;
+        }
+    }
+    unitStopAt = total / 2;
+    unitStopOnce = 1;
+    if (ret == 0
+        && (unitSession(dir, unit_relayout_write) == -1 || unitSession(dir, unit_relayout_stop) == -1
+            || unitSession(dir, unit_relayout_read) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Driver unit test failed a relayout with write %d failing.", unitStopAt);
+        ret = -1;
+    }
+    unitStopAt = -1;
+    unitStopOnce = 0;
+    unitCleanup(dir);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockDriverUnitTest
+// Description  : Run a UNIT test checking the driver, each store is powered
+//                on in child processes working in a directory of their own
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockDriverUnitTest(void)
+{
+    if (unit_fragments() == -1 || unit_format() == -1 || unit_compressed() == -1 || unit_batch() == -1
+        || unit_relayout() == -1) {
+        return (-1);
+    }
+
     // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Driver unit test completed successfully.");
     return (0);
 }
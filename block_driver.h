@@ -13,12 +13,56 @@
 // Include files
 #include <stdint.h>
 
+#include <block_cache.h>
 #include <block_driver_helper.h>
+#include <block_stats.h>
 
 // Defines
 #define BLOCK_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define BLOCK_MAX_PATH_LENGTH 128 // Maximum length of filename length
 #define BLOCK_MAX_FRAME_PER_FILE 1024 // Maximum number of frames per file
+#define BLOCK_FRAGMENT_MAX_SIZE 1024 // Largest file kept in a fragment frame
+#define BLOCK_FRAGMENT_UNIT 64 // Granularity of fragment frame slices
+
+// Entry of the per-file top-N query
+typedef struct {
+    char name[BLOCK_MAX_PATH_LENGTH];
+    BlockFileStats stats;
+} BlockFileTop;
+
+// Frame written after a generation, see block_changed_since
+typedef struct {
+    uint16_t frame; // Frame number in the store
+    int16_t file; // File owning the frame (-1 if none)
+    int16_t index; // Index of the frame in the file (-1 for the file table entry)
+    uint16_t pad;
+    uint32_t generation; // Generation the frame was last written in
+} BlockChange;
+
+// Map of the frames to the files owning them, see block_owners
+typedef struct block_owners BlockOwners;
+
+// Operations of a batch, see block_batch
+typedef enum {
+    BLOCK_BATCH_OPEN = 0,
+    BLOCK_BATCH_CLOSE = 1,
+    BLOCK_BATCH_READ = 2,
+    BLOCK_BATCH_WRITE = 3,
+    BLOCK_BATCH_SEEK = 4,
+} BlockBatchOpType;
+
+// File handle returned by the open at index "i" of the same batch
+#define BLOCK_BATCH_OPENED(i) ((int16_t)(-2 - (i)))
+
+// An operation of a batch
+typedef struct {
+    BlockBatchOpType type;
+    int16_t fd; // File handle, or BLOCK_BATCH_OPENED of an earlier open (not for opens)
+    char* path; // File to open
+    void* buf; // Buffer to read into or write from
+    int32_t count; // Bytes to read or write, location to seek to
+    int32_t result; // What the same single call would return, set by block_batch
+} BlockBatchOp;
 
 //
 // Interface functions
@@ -29,9 +73,19 @@ int32_t block_poweron(void);
 int32_t block_poweroff(void);
 // Shut down the BLOCK interface, close all files
 
+int32_t block_format(void);
+// Lazily format the BLOCK storage, removing all files
+
 int16_t block_open(char* path);
 // This function opens the file and returns a file handle
 
+int16_t block_open_policy(char* path, BlockWritePolicy policy);
+// Open a file and set its cache write policy (write-through by default)
+
+int32_t block_advise(int16_t fd, BlockWritePolicy policy);
+// Set the cache write policy of the file behind the file handle "fd", kept
+// until the next poweron or format
+
 int16_t block_close(int16_t fd);
 // This function closes the file
 
@@ -44,4 +98,70 @@ int32_t block_write(int16_t fd, void* buf, int32_t count);
 int32_t block_seek(int16_t fd, uint32_t loc);
 // Seek to specific point in the file
 
+int32_t block_batch(BlockBatchOp* ops, int32_t n);
+// Execute the "n" operations of "ops" in order, in one call. Returns the
+// number of operations that succeeded, the result of each is in "ops".
+
+int32_t block_fstats(int16_t fd, BlockFileStats* stats);
+// Get the I/O counters of the file behind the file handle "fd"
+
+int32_t block_fstats_top(BlockFileStatsKey key, int32_t n, BlockFileTop* top);
+// Get the "n" files with the highest "key" counter, returns how many were found
+
+int32_t block_file_digest(int16_t fd, uint64_t* digest);
+// Get the digest of the file behind the file handle "fd", equal for files
+// with the same content
+
+int32_t block_diff(int16_t fd_a, int16_t fd_b, uint16_t* frames, int32_t max);
+// List in "frames" (up to "max") the indexes of the frames that differ between
+// two files, returns how many differ
+
+uint32_t block_generation(void);
+// Get the current generation of the store, bumped on every frame write
+
+uint32_t block_format_generation(void);
+// Get the generation of the last format, changes since an older generation
+// must be applied to an empty store
+
+BlockOwners* block_owners(void);
+// Map the frames of the store to the files owning them as they are now, to
+// list the changes of an export with block_changed_since (NULL if failure)
+
+void block_owners_free(BlockOwners* owners);
+// Free a map of the owners of the frames
+
+int32_t block_changed_since(uint32_t gen, const BlockOwners* owners, uint32_t* cursor, BlockChange* changes, int32_t max);
+// List the frames written after generation "gen", once per file in "owners"
+// (a fragment or pack frame is shared) or once with no file if "owners" is
+// NULL. "cursor" starts at 0 and is advanced by each call, returns the number
+// of entries listed (0 once done)
+
+int32_t block_read_frame(uint16_t frame_nr, void* frame);
+// Read the frame "frame_nr" of the store, from the cache if it is there
+
+int32_t block_apply_frame(uint16_t frame_nr, const void* frame);
+// Write the frame "frame_nr" of another store as is, taking in the file
+// table entry of a file table frame (no file may be open), see
+// block_export_apply
+
+int32_t block_mount_profile(BlockMountProfile* poweron, BlockMountProfile* poweroff);
+// Get the breakdown of the last power on and the last power off (either may
+// be NULL)
+
+int32_t block_file_frames(char* path, uint16_t* frames, int32_t max);
+// List in "frames" (up to "max") the frame numbers of the file "path" in the
+// order of the file, returns the number of frames of the file (-1 if none)
+
+int32_t block_relayout(const uint16_t* order, int32_t n);
+// Lay the frames of the files out again, the "n" frames of "order" first and
+// next to each other, returns the number of frames moved. The new layout is
+// in the store when it returns, a relayout interrupted is completed at the
+// next power on.
+
+//
+// Unit test
+
+int blockDriverUnitTest(void);
+// Run a UNIT test checking the driver
+
 #endif
@@ -1,13 +1,41 @@
+#include <dirent.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 // Project Includes
+#include <block_backend.h>
 #include <block_controller.h>
 #include <block_driver.h>
 #include <block_driver_helper.h>
+#include <block_cache.h>
+#include <block_compress.h>
+#include <block_merkle.h>
+#include <block_stats.h>
+#include <block_perf.h>
+#include <block_trace.h>
+#include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 extern int freeFrameNr;
+extern fragment_t fragments[BLOCK_MAX_TOTAL_FILES];
+extern int nbFragments;
+extern int packFrameNr;
+extern frame_t packBuffer;
+extern uint16_t packFrames[BLOCK_BLOCK_SIZE];
+extern int nbPacks;
+extern uint8_t packUsed[BLOCK_BLOCK_SIZE];
+extern file_t files[BLOCK_MAX_TOTAL_FILES];
+extern superblock_t superblock;
+extern uint8_t frameEpochs[BLOCK_BLOCK_SIZE];
+extern uint8_t epochTableDirty[BLOCK_EPOCH_TABLE_FRAMES];
+extern uint32_t frameGens[BLOCK_BLOCK_SIZE];
+extern uint8_t genTableDirty[BLOCK_GEN_TABLE_FRAMES];
+extern uint32_t fileTableChecksums[BLOCK_MAX_TOTAL_FILES];
 
 // Packs the given register
 BlockXferRegister pack(uint32_t ky1, uint32_t fm1, uint32_t cs1, uint32_t rt1)
@@ -41,15 +69,54 @@ int createNewFile(const char* path, file_t* file)
     memcpy(file->name, path, strlen(path));
     file->size = 0;
     file->nrFrames = 0;
+    file->layout = BLOCK_FILE_LAYOUT;
+    file->fragFrame = 0;
+    file->fragOffset = 0;
+    file->fragLength = 0;
     return 0;
 }
 
+// Checks the fields of a file table entry read from the store. Older drivers
+// wrote the entries up to nrFrames, the rest of their frame held the next
+// entry: those entries, and the entries with fields out of range, get no
+// fragment and no packed frames. Returns 0 if the entry is valid, -1 if its
+// fields were cleared
+int checkFileEntry(file_t* file)
+{
+    int i, valid = (file->layout == BLOCK_FILE_LAYOUT);
+    uint8_t pack;
+    if (valid && file->fragLength != 0) {
+        valid = (file->nrFrames == 0 && file->fragLength <= BLOCK_FRAGMENT_MAX_SIZE && file->size <= file->fragLength
+            && file->fragLength % BLOCK_FRAGMENT_UNIT == 0 && file->fragOffset % BLOCK_FRAGMENT_UNIT == 0
+            && file->fragOffset + file->fragLength <= BLOCK_FRAME_SIZE && file->fragFrame >= BLOCK_DATA_FRAME_START);
+    }
+    for (i = 0; valid && i < file->nrFrames && i < BLOCK_MAX_FRAME_PER_FILE; i++) {
+        pack = file->packing[i];
+        valid = (pack == 0 || pack == BLOCK_PACK_PENDING
+            || (BLOCK_PACK_COUNT(pack) != 0 && BLOCK_PACK_START(pack) + BLOCK_PACK_COUNT(pack) <= BLOCK_COMPRESS_SECTORS));
+    }
+    if (valid || file->name[0] == '\0') {
+        return 0;
+    }
+    if (file->layout == BLOCK_FILE_LAYOUT) {
+        logMessage(LOG_WARNING_LEVEL, "File table entry of %s is corrupted, its fragment is dropped", file->name);
+    }
+    // Marked, so that the entry is written back in the current layout
+    file->layout = BLOCK_FILE_LAYOUT;
+    file->fragFrame = 0;
+    file->fragOffset = 0;
+    file->fragLength = 0;
+    memset(file->packing, 0, sizeof(file->packing));
+    return -1;
+}
+
 // Opens a new file handle to the given file
 int openFile(fh_t* handle, file_t* file)
 {
     handle->file = file;
     handle->loc = 0;
     handle->status = OPEN;
+    handle->read = 0;
     return 0;
 }
 
@@ -74,32 +141,433 @@ int verify_cs1(frame_t frame, uint32_t cs1)
     }
 }
 
-// Given a frame buffer, an instruction and a frame number,
-// executes the instruction
-void executeOpcode(frame_t frame, uint32_t ky1, uint32_t fm1)
+// Returns 1 if reads of the given frame depend on the epoch it was written in
+static int isEpochFrame(uint32_t frame_nr)
+{
+    return (frame_nr < BLOCK_SUPERBLOCK_FRAME || frame_nr >= BLOCK_DATA_FRAME_START);
+}
+
+// Counts a frame moved to or from the store
+static void countFrameOp(uint32_t ky1, uint32_t fm1)
+{
+    BLOCK_STAT_ADD(bus_ops, 1);
+    if (ky1 == BLOCK_OP_RDFRME) {
+        BLOCK_STAT_ADD(bus_reads, 1);
+        BLOCK_STAT_ADD(bus_bytes_read, BLOCK_FRAME_SIZE);
+    } else if (ky1 == BLOCK_OP_WRFRME) {
+        BLOCK_STAT_ADD(bus_writes, 1);
+        BLOCK_STAT_ADD(bus_bytes_written, BLOCK_FRAME_SIZE);
+    }
+    // File table, superblock and epoch table frames are metadata
+    if ((ky1 == BLOCK_OP_RDFRME || ky1 == BLOCK_OP_WRFRME) && fm1 < BLOCK_DATA_FRAME_START) {
+        BLOCK_STAT_ADD(bus_meta_bytes, BLOCK_FRAME_SIZE);
+    }
+}
+
+// Computes the checksum of a frame moved to or from the store
+static uint32_t checksumFrame(frame_t frame, uint32_t fm1)
+{
+    uint32_t checksum;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    uint64_t mountStart = (mountProfile != NULL) ? block_stats_clock() : 0;
+    BLOCK_PERF_ENTER(BLOCK_PERF_CHECKSUM);
+    compute_frame_checksum(frame, &checksum);
+    BLOCK_PERF_EXIT();
+    BLOCK_STAT_ADD(checksums, 1);
+    BLOCK_TRACE_END(BLOCK_TRACE_CHECKSUM, start, fm1);
+    if (mountProfile != NULL) {
+        mountProfile->checksum_ns += block_stats_clock() - mountStart;
+    }
+    return (checksum);
+}
+
+// Charges a bus operation that started at "start" to the mount profile
+static void profileBusOp(uint32_t ky1, uint64_t start)
+{
+    if (ky1 == BLOCK_OP_RDFRME || ky1 == BLOCK_OP_WRFRME) {
+        mountProfile->bus_ns += block_stats_clock() - start;
+    } else {
+        mountProfile->controller_ns += block_stats_clock() - start;
+    }
+    mountProfile->bus_ops++;
+    mountProfile->bus_reads += (ky1 == BLOCK_OP_RDFRME);
+    mountProfile->bus_writes += (ky1 == BLOCK_OP_WRFRME);
+}
+
+// Moves a frame to or from the backend, a frame that can't be read from it
+// is zeroed. Sets "checksum" to the checksum of the frame moved, returns 0
+// if successful, -1 if the backend failed
+static int backendOpcode(frame_t frame, uint32_t ky1, uint32_t fm1, uint32_t* checksum)
+{
+    uint64_t start;
+    int ret = 0;
+    countFrameOp(ky1, fm1);
+    if (ky1 == BLOCK_OP_WRFRME) {
+        *checksum = checksumFrame(frame, fm1);
+        start = (blockTracing || mountProfile != NULL) ? block_stats_clock() : 0;
+        BLOCK_PERF_ENTER(BLOCK_PERF_BUS);
+        if (blockBackend->write == NULL || blockBackend->write(blockBackend, fm1, frame, *checksum) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing frame %u to the %s backend", fm1, blockBackend->name);
+            ret = -1;
+        }
+        BLOCK_PERF_EXIT();
+        BLOCK_TRACE_END(BLOCK_TRACE_BUS_WRITE, start, fm1);
+        if (mountProfile != NULL) {
+            profileBusOp(ky1, start);
+        }
+        return (ret);
+    }
+    start = (blockTracing || mountProfile != NULL) ? block_stats_clock() : 0;
+    BLOCK_PERF_ENTER(BLOCK_PERF_BUS);
+    if (blockBackend->read(blockBackend, fm1, frame, checksum) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Frame %u is bad in the %s backend", fm1, blockBackend->name);
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        *checksum = 0;
+        ret = -1;
+    }
+    BLOCK_PERF_EXIT();
+    BLOCK_TRACE_END(BLOCK_TRACE_BUS_READ, start, fm1);
+    if (mountProfile != NULL) {
+        profileBusOp(ky1, start);
+    }
+    return (ret);
+}
+
+// Given a frame buffer, an instruction and a frame number, executes the
+// instruction. Sets "checksum" (unless NULL) to the checksum of the frame
+// moved, 0 if the instruction moved no frame. Returns 0 if successful, -1 if
+// the frame could not be moved (a frame not read is zeroed)
+int executeOpcode(frame_t frame, uint32_t ky1, uint32_t fm1, uint32_t* checksum)
 {
-    uint32_t rt1, cs1, cs1_comp;
+    uint32_t rt1, cs1, cs1_comp, op, moved = 0;
+    uint64_t start;
     BlockXferRegister regstate;
+    checksum = (checksum != NULL) ? checksum : &moved;
+    *checksum = 0;
+    // Frames last written before the current format read as zeros, no bus op needed
+    if (ky1 == BLOCK_OP_RDFRME && isEpochFrame(fm1) && frameEpochs[fm1] != superblock.epoch) {
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        return (0);
+    }
+    if (ky1 == BLOCK_OP_WRFRME && isEpochFrame(fm1)) {
+        if (frameEpochs[fm1] != superblock.epoch) {
+            frameEpochs[fm1] = superblock.epoch;
+            epochTableDirty[fm1 / BLOCK_FRAME_SIZE] = 1;
+        }
+        // Stamp the frame with a new generation for the incremental backups
+        frameGens[fm1] = ++superblock.generation;
+        genTableDirty[fm1 / BLOCK_GEN_PER_FRAME] = 1;
+    }
+    // Frames go to the backend when one is set, there is no retry loop as
+    // the backend fails over to another copy itself
+    if (blockBackend != NULL && (ky1 == BLOCK_OP_RDFRME || ky1 == BLOCK_OP_WRFRME)) {
+        return (backendOpcode(frame, ky1, fm1, checksum));
+    }
     rt1 = -1;
     while (rt1 != 0) {
         if (ky1 == BLOCK_OP_WRFRME) {
-            compute_frame_checksum(frame, &cs1);
+            cs1 = checksumFrame(frame, fm1);
+            *checksum = cs1;
         } else {
             cs1 = 0;
         }
         regstate = pack(ky1, fm1, cs1, 0);
+        countFrameOp(ky1, fm1);
+        op = ky1;
+        start = (blockTracing || mountProfile != NULL) ? block_stats_clock() : 0;
+        BLOCK_PERF_ENTER(BLOCK_PERF_BUS);
         regstate = block_io_bus(regstate, frame);
+        BLOCK_PERF_EXIT();
+        BLOCK_TRACE_END((op == BLOCK_OP_RDFRME) ? BLOCK_TRACE_BUS_READ
+            : (op == BLOCK_OP_WRFRME) ? BLOCK_TRACE_BUS_WRITE : BLOCK_TRACE_BUS_OTHER, start,
+            (op == BLOCK_OP_RDFRME || op == BLOCK_OP_WRFRME) ? (int32_t)fm1 : (int32_t)op);
+        if (mountProfile != NULL) {
+            profileBusOp(op, start);
+        }
         unpack(regstate, &ky1, &fm1, &cs1, &rt1);
         if (ky1 == BLOCK_OP_RDFRME) {
-            compute_frame_checksum(frame, &cs1_comp);
+            cs1_comp = checksumFrame(frame, fm1);
             rt1 = (cs1 == cs1_comp) ? 0 : -1;
+            *checksum = cs1_comp;
         }
     }
-    return;
+    return (0);
+}
+
+// Takes the driver lock, counting the calls that had to wait for it and
+// how long they waited
+void lockDriver(void)
+{
+    uint64_t start;
+    if (pthread_mutex_trylock(&blockDriverLock) == 0) {
+        return;
+    }
+    start = block_stats_clock();
+    pthread_mutex_lock(&blockDriverLock);
+    BLOCK_STAT_ADD(lock_waits, 1);
+    BLOCK_STAT_ADD(lock_wait_ns, block_stats_clock() - start);
+}
+
+// Fills the frame buffer with the given frame, from the cache if possible.
+// Returns 1 if the frame had to be read from the bus, 0 otherwise, -1 if it
+// could not be read
+int fetchFrame(frame_t frame, uint16_t frame_nr)
+{
+    void* pointer;
+    uint64_t start = BLOCK_TRACE_BEGIN();
+    BLOCK_PERF_ENTER(BLOCK_PERF_CACHE);
+    pointer = get_block_cache(0, frame_nr);
+    BLOCK_PERF_EXIT();
+    if (pointer == NULL) {
+        BLOCK_STAT_ADD(cache_misses, 1);
+        BLOCK_TRACE_END(BLOCK_TRACE_CACHE_MISS, start, frame_nr);
+        return ((executeOpcode(frame, BLOCK_OP_RDFRME, frame_nr, NULL) == 0) ? 1 : -1);
+    }
+    BLOCK_STAT_ADD(cache_hits, 1);
+    memcpy(frame, pointer, BLOCK_FRAME_SIZE);
+    BLOCK_TRACE_END(BLOCK_TRACE_CACHE_HIT, start, frame_nr);
+    return 0;
+}
+
+// Fills the frame buffer with the frame "index" of a file, unpacking it if it
+// is stored compressed. The frame is cached if read from the bus and "cache"
+// is set. Returns 1 if the frame had to be read from the bus, 0 otherwise, -1
+// if it could not be read (or does not decompress)
+int fetchFileFrame(file_t* file, int32_t index, frame_t frame, int cache)
+{
+    uint8_t pack = file->packing[index];
+    uint16_t frame_nr = file->frames[index];
+    BlockIndex block = BLOCK_PACK_CACHE_BLOCK(file - files);
+    char* packed = scratchFrames[0];
+    void* pointer;
+    uint16_t length;
+    int missed;
+
+    if (pack == 0) {
+        missed = fetchFrame(frame, frame_nr);
+        if (missed == 1 && cache) {
+            put_block_cache(0, frame_nr, frame);
+        }
+        return missed;
+    }
+    // A frame added by the write in progress has no content yet
+    if (pack == BLOCK_PACK_PENDING) {
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        return 0;
+    }
+    // Compressed frames are cached unpacked, under the file and the index
+    BLOCK_PERF_ENTER(BLOCK_PERF_CACHE);
+    pointer = get_block_cache(block, index);
+    BLOCK_PERF_EXIT();
+    if (pointer != NULL) {
+        BLOCK_STAT_ADD(cache_hits, 1);
+        memcpy(frame, pointer, BLOCK_FRAME_SIZE);
+        return 0;
+    }
+    BLOCK_STAT_ADD(cache_misses, 1);
+    // The pack frame is cached as read, for the other frames packed in it
+    if (frame_nr == packFrameNr) {
+        memcpy(packed, packBuffer, BLOCK_FRAME_SIZE);
+        missed = 0;
+    } else {
+        if ((missed = fetchFrame(packed, frame_nr)) == -1) {
+            memset(frame, 0, BLOCK_FRAME_SIZE);
+            return -1;
+        }
+        if (missed == 1) {
+            put_block_cache(0, frame_nr, packed);
+        }
+    }
+    pointer = packed + BLOCK_PACK_START(pack) * BLOCK_COMPRESS_SECTOR_SIZE;
+    memcpy(&length, pointer, sizeof(length));
+    if (length > BLOCK_PACK_COUNT(pack) * BLOCK_COMPRESS_SECTOR_SIZE - BLOCK_COMPRESS_HEADER
+        || block_decompress((char*)pointer + BLOCK_COMPRESS_HEADER, length, frame) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Compressed frame %d of file %s is corrupted", index, file->name);
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        return -1;
+    }
+    if (cache) {
+        put_block_cache(block, index, frame);
+    }
+    return missed;
+}
+
+// Returns the sectors of a pack frame held by a compressed frame
+static uint8_t packSectors(int start, int count)
+{
+    return (uint8_t)(((1 << count) - 1) << start);
+}
+
+// Returns the first sector of a free run of `count` sectors in a pack frame,
+// -1 if it has none
+static int findSectors(uint8_t used, int count)
+{
+    int start;
+    for (start = 0; start + count <= BLOCK_COMPRESS_SECTORS; start++) {
+        if ((used & packSectors(start, count)) == 0) {
+            return start;
+        }
+    }
+    return -1;
+}
+
+// Rebuilds the table of the pack frames from the compressed frames of the
+// files, the sectors not holding one are free. As with fragments, a pack
+// frame left empty (or a raw frame released by a frame now packed) is reused
+// until the next power off, it is then lost to the store
+void loadPacks(void)
+{
+    uint8_t pack;
+    int i, j;
+    nbPacks = 0;
+    memset(packUsed, 0, sizeof(packUsed));
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        for (j = 0; j < files[i].nrFrames; j++) {
+            pack = files[i].packing[j];
+            if (pack == 0 || pack == BLOCK_PACK_PENDING) {
+                continue;
+            }
+            if (packUsed[files[i].frames[j]] == 0) {
+                packFrames[nbPacks++] = files[i].frames[j];
+            }
+            packUsed[files[i].frames[j]] |= packSectors(BLOCK_PACK_START(pack), BLOCK_PACK_COUNT(pack));
+        }
+    }
+}
+
+// Makes another frame the pack frame, with a free run of `count` sectors:
+// the first pack frame with one, read once into the pack buffer, else a new
+// frame. Returns 0 if successful, -1 if failure
+static int openPackFrame(int count)
+{
+    int i, missed;
+    for (i = 0; i < nbPacks; i++) {
+        if (packFrames[i] != packFrameNr && findSectors(packUsed[packFrames[i]], count) != -1) {
+            break;
+        }
+    }
+    if (i == nbPacks) {
+        if (freeFrameNr >= BLOCK_BLOCK_SIZE) {
+            return -1;
+        }
+        packFrames[nbPacks++] = freeFrameNr++;
+    }
+    // An empty frame has nothing to keep
+    if (packUsed[packFrames[i]] == 0) {
+        memset(packBuffer, 0, BLOCK_FRAME_SIZE);
+    } else {
+        if ((missed = fetchFrame(packBuffer, packFrames[i])) == -1) {
+            return -1;
+        }
+        if (missed == 1) {
+            put_block_cache(0, packFrames[i], packBuffer);
+        }
+    }
+    packFrameNr = packFrames[i];
+    return 0;
+}
+
+// Returns a frame for a frame stored raw, an empty pack frame if there is
+// one, -1 if the store is full
+static int takeRawFrame(void)
+{
+    uint16_t frame_nr;
+    int i;
+    for (i = 0; i < nbPacks; i++) {
+        if (packFrames[i] != packFrameNr && packUsed[packFrames[i]] == 0) {
+            frame_nr = packFrames[i];
+            packFrames[i] = packFrames[--nbPacks];
+            return frame_nr;
+        }
+    }
+    return ((freeFrameNr < BLOCK_BLOCK_SIZE) ? freeFrameNr++ : -1);
+}
+
+// Packs the frame "index" of a file compressed, with the other compressed
+// frames. A frame rewritten in no more sectors than it had keeps them,
+// otherwise it takes a free run of sectors in the pack frame, which is kept in
+// the pack buffer until another one is needed. The sectors (or the raw frame)
+// a frame leaves are released for other frames. The pack frame to store is
+// returned in `physical`. Returns 1 if the frame was packed, 0 if it must be
+// stored raw (the file then has a frame of its own for it), -1 if failure
+int packFrame(int32_t file_nr, int32_t index, frame_t frame, char** physical)
+{
+    file_t* file = &files[file_nr];
+    uint8_t pack = file->packing[index];
+    uint16_t frame_nr = file->frames[index];
+    char* blob = scratchFrames[0];
+    char* target;
+    uint16_t length;
+    int32_t compressed;
+    int sectors, start, missed, taken;
+
+    compressed = block_get_compression() ? block_compress(frame, blob, BLOCK_COMPRESS_MAX) : -1;
+    if (compressed == -1) {
+        if (block_get_compression()) {
+            BLOCK_STAT_ADD(raw_frames, 1);
+        }
+        if (pack != 0) {
+            if ((taken = takeRawFrame()) == -1) {
+                return -1;
+            }
+            if (pack != BLOCK_PACK_PENDING) {
+                packUsed[frame_nr] &= ~packSectors(BLOCK_PACK_START(pack), BLOCK_PACK_COUNT(pack));
+            }
+            file->frames[index] = taken;
+            file->packing[index] = 0;
+        }
+        return 0;
+    }
+    length = compressed;
+    sectors = (BLOCK_COMPRESS_HEADER + length + BLOCK_COMPRESS_SECTOR_SIZE - 1) / BLOCK_COMPRESS_SECTOR_SIZE;
+
+    if (pack != 0 && pack != BLOCK_PACK_PENDING && sectors <= BLOCK_PACK_COUNT(pack)) {
+        // Rewrite the frame in its sectors
+        start = BLOCK_PACK_START(pack);
+        sectors = BLOCK_PACK_COUNT(pack);
+        if (frame_nr == packFrameNr) {
+            target = packBuffer;
+        } else {
+            target = scratchFrames[1];
+            if ((missed = fetchFrame(target, frame_nr)) == -1) {
+                return -1;
+            }
+            if (missed == 1) {
+                put_block_cache(0, frame_nr, target);
+            }
+        }
+    } else {
+        // Take free sectors in the pack frame, the ones left are released
+        // once the frame is placed
+        start = (packFrameNr == -1) ? -1 : findSectors(packUsed[packFrameNr], sectors);
+        if (start == -1) {
+            if (openPackFrame(sectors) == -1) {
+                return -1;
+            }
+            start = findSectors(packUsed[packFrameNr], sectors);
+        }
+        packUsed[packFrameNr] |= packSectors(start, sectors);
+        if (pack == 0) {
+            // The raw frame left is empty, it is reused as a pack frame
+            packFrames[nbPacks++] = frame_nr;
+        } else if (pack != BLOCK_PACK_PENDING) {
+            packUsed[frame_nr] &= ~packSectors(BLOCK_PACK_START(pack), BLOCK_PACK_COUNT(pack));
+        }
+        file->frames[index] = packFrameNr;
+        target = packBuffer;
+    }
+    memcpy(target + start * BLOCK_COMPRESS_SECTOR_SIZE, &length, sizeof(length));
+    memcpy(target + start * BLOCK_COMPRESS_SECTOR_SIZE + BLOCK_COMPRESS_HEADER, blob, length);
+    file->packing[index] = BLOCK_PACK(start, sectors);
+    *physical = target;
+    BLOCK_STAT_ADD(packed_frames, 1);
+    BLOCK_STAT_ADD(packed_bytes, BLOCK_COMPRESS_HEADER + length);
+    return 1;
 }
 
 // Given a file handle and a number of bytes to write to a file,
-// allocates as many frames as required to the file
+// allocates as many frames as required to the file. With compression on, the
+// frames are only marked as pending, they are placed once written
 int allocateNewFrames(fh_t* handle, int32_t count)
 {
     uint16_t nrFrames;
@@ -107,6 +575,12 @@ int allocateNewFrames(fh_t* handle, int32_t count)
     nrFrames = handle->file->nrFrames;
     loc = handle->loc;
     while (loc + count > nrFrames * BLOCK_FRAME_SIZE) {
+        if (block_get_compression()) {
+            handle->file->frames[nrFrames] = 0;
+            handle->file->packing[nrFrames] = BLOCK_PACK_PENDING;
+            nrFrames++;
+            continue;
+        }
         handle->file->frames[nrFrames] = freeFrameNr;
         freeFrameNr++;
         nrFrames++;
@@ -119,6 +593,417 @@ int allocateNewFrames(fh_t* handle, int32_t count)
     return 0;
 }
 
+// Returns the units of a fragment frame held by a slice
+static uint64_t sliceUnits(uint16_t offset, uint16_t length)
+{
+    return ((((uint64_t)1 << (length / BLOCK_FRAGMENT_UNIT)) - 1) << (offset / BLOCK_FRAGMENT_UNIT));
+}
+
+// Returns the entry of a fragment frame in the table, NULL if it has none
+static fragment_t* findFragment(uint16_t frame_nr)
+{
+    int i;
+    for (i = 0; i < nbFragments; i++) {
+        if (fragments[i].frame == frame_nr) {
+            return &fragments[i];
+        }
+    }
+    return NULL;
+}
+
+// Rebuilds the table of the fragment frames from the slices of the files, the
+// units not in a slice are free. A fragment frame left with no slice is
+// reused for slices until the next power off, it is then lost to the store
+void loadFragments(void)
+{
+    fragment_t* fragment;
+    int i;
+    nbFragments = 0;
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        if (files[i].nrFrames != 0 || files[i].fragLength == 0) {
+            continue;
+        }
+        if ((fragment = findFragment(files[i].fragFrame)) == NULL) {
+            fragment = &fragments[nbFragments++];
+            fragment->frame = files[i].fragFrame;
+            fragment->used = 0;
+        }
+        fragment->used |= sliceUnits(files[i].fragOffset, files[i].fragLength);
+    }
+}
+
+// Makes sure the fragment slice of a small file can hold `size` bytes,
+// moving the file's current data to a larger slice if needed. The slice is
+// the first free run of units large enough in the fragment frames, a new
+// fragment frame is started if none has one
+int allocateFragment(file_t* file, int32_t size)
+{
+    int32_t length;
+    uint64_t mask = 0;
+    fragment_t* fragment = NULL;
+    fragment_t* current;
+    char* frame = scratchFrames[0];
+    char* data = scratchFrames[1];
+    int i, start = 0;
+    if (size <= file->fragLength) {
+        return 0;
+    }
+    // Grow geometrically so that appends don't move the slice every time
+    length = (size > 2 * file->fragLength) ? size : 2 * file->fragLength;
+    length = (length + BLOCK_FRAGMENT_UNIT - 1) / BLOCK_FRAGMENT_UNIT * BLOCK_FRAGMENT_UNIT;
+    if (length > BLOCK_FRAGMENT_MAX_SIZE) {
+        length = BLOCK_FRAGMENT_MAX_SIZE;
+    }
+    // Save the current contents of the file, and release its slice (the
+    // slice can grow in place if the units after it are free)
+    current = (file->fragLength != 0) ? findFragment(file->fragFrame) : NULL;
+    if (file->fragLength != 0 && file->size > 0) {
+        if (fetchFrame(frame, file->fragFrame) == -1) {
+            return -1;
+        }
+        memcpy(data, frame + file->fragOffset, file->size);
+    }
+    if (current != NULL) {
+        current->used &= ~sliceUnits(file->fragOffset, file->fragLength);
+    }
+    for (i = 0; i < nbFragments && fragment == NULL; i++) {
+        for (start = 0; start + length / BLOCK_FRAGMENT_UNIT <= BLOCK_FRAGMENT_UNITS; start++) {
+            mask = sliceUnits(start * BLOCK_FRAGMENT_UNIT, length);
+            if ((fragments[i].used & mask) == 0) {
+                fragment = &fragments[i];
+                break;
+            }
+        }
+    }
+    // Start a new fragment frame if none has room
+    if (fragment == NULL) {
+        if (freeFrameNr >= BLOCK_BLOCK_SIZE || nbFragments == BLOCK_MAX_TOTAL_FILES) {
+            if (current != NULL) {
+                current->used |= sliceUnits(file->fragOffset, file->fragLength);
+            }
+            return -1;
+        }
+        fragment = &fragments[nbFragments++];
+        fragment->frame = freeFrameNr;
+        fragment->used = 0;
+        freeFrameNr++;
+        start = 0;
+        mask = sliceUnits(0, length);
+    }
+    // Copy the contents over to the new slice, the file keeps its slice if
+    // it can't be
+    if (file->fragLength != 0 && file->size > 0) {
+        if (fetchFrame(frame, fragment->frame) == -1) {
+            if (current != NULL) {
+                current->used |= sliceUnits(file->fragOffset, file->fragLength);
+            }
+            return -1;
+        }
+        memcpy(frame + start * BLOCK_FRAGMENT_UNIT, data, file->size);
+        if (executeOpcode(frame, BLOCK_OP_WRFRME, fragment->frame, NULL) == -1) {
+            if (current != NULL) {
+                current->used |= sliceUnits(file->fragOffset, file->fragLength);
+            }
+            return -1;
+        }
+        put_block_cache(0, fragment->frame, frame);
+    }
+    fragment->used |= mask;
+    file->fragFrame = fragment->frame;
+    file->fragOffset = start * BLOCK_FRAGMENT_UNIT;
+    file->fragLength = length;
+    return 0;
+}
+
+// Moves the data of a small file from its fragment slice to a dedicated
+// frame, its slice is released
+int promoteFragment(file_t* file)
+{
+    fragment_t* fragment;
+    char* frame = scratchFrames[0];
+    char* data = scratchFrames[1];
+    if (freeFrameNr >= BLOCK_BLOCK_SIZE) {
+        return -1;
+    }
+    memset(data, 0, BLOCK_FRAME_SIZE);
+    if (file->size > 0 && fetchFrame(frame, file->fragFrame) == -1) {
+        return -1;
+    }
+    if (file->size > 0) {
+        memcpy(data, frame + file->fragOffset, file->size);
+    }
+    // The file keeps its slice if its frame can't be written
+    if (executeOpcode(data, BLOCK_OP_WRFRME, freeFrameNr, NULL) == -1) {
+        freeFrameNr++;
+        return -1;
+    }
+    file->frames[0] = freeFrameNr;
+    file->packing[0] = 0;
+    file->nrFrames = 1;
+    freeFrameNr++;
+    put_block_cache(0, file->frames[0], data);
+    if ((fragment = findFragment(file->fragFrame)) != NULL) {
+        fragment->used &= ~sliceUnits(file->fragOffset, file->fragLength);
+    }
+    file->fragFrame = 0;
+    file->fragOffset = 0;
+    file->fragLength = 0;
+    return 0;
+}
+
+// Moves the data of a store written before the superblock, its data frames
+// start at the superblock frame. The frames of its files in the metadata area
+// are moved after the last frame in use, and all the frames of its files are
+// taken into the first epoch. The file table must be in `files`. Returns 0 if
+// successful, -1 if the store can't be migrated (nothing is written then)
+static int migrateStore(void)
+{
+    int32_t i, j, top = BLOCK_DATA_FRAME_START - 1, moves = 0, nbEntries = 0;
+    uint16_t frame_nr;
+    frame_t frame;
+
+    // Check the whole file table before changing anything
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        if (files[i].name[0] == '\0') {
+            continue;
+        }
+        nbEntries++;
+        if (files[i].nrFrames < 0 || files[i].nrFrames > BLOCK_MAX_FRAME_PER_FILE || files[i].size < 0
+            || files[i].size > files[i].nrFrames * BLOCK_FRAME_SIZE) {
+            logMessage(LOG_ERROR_LEVEL, "File table entry of %s is not valid, the store is not migrated", files[i].name);
+            return -1;
+        }
+        for (j = 0; j < files[i].nrFrames; j++) {
+            frame_nr = files[i].frames[j];
+            if (frame_nr < BLOCK_SUPERBLOCK_FRAME) {
+                logMessage(LOG_ERROR_LEVEL, "File %s has frames in the file table, the store is not migrated", files[i].name);
+                return -1;
+            }
+            top = (frame_nr > top) ? frame_nr : top;
+            moves += (frame_nr < BLOCK_DATA_FRAME_START);
+        }
+    }
+    if (top + moves >= BLOCK_BLOCK_SIZE) {
+        logMessage(LOG_ERROR_LEVEL, "No room to move %d frames out of the metadata area, the store is not migrated", moves);
+        return -1;
+    }
+
+    // The frames of the files hold data of the first epoch
+    superblock.magic = BLOCK_SUPERBLOCK_MAGIC;
+    superblock.version = BLOCK_SUPERBLOCK_VERSION;
+    superblock.epoch = 1;
+    superblock.generation = 0;
+    superblock.formatGeneration = 0;
+    memset(frameGens, 0, sizeof(uint32_t) * BLOCK_BLOCK_SIZE);
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        for (j = 0; files[i].name[0] != '\0' && j < files[i].nrFrames; j++) {
+            frameEpochs[files[i].frames[j]] = superblock.epoch;
+        }
+    }
+
+    // Move the frames out of the metadata area (it is read from the bus
+    // whatever the epochs), then write the entries with their new frames
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        if (files[i].name[0] == '\0') {
+            continue;
+        }
+        for (j = 0; j < files[i].nrFrames; j++) {
+            if (files[i].frames[j] < BLOCK_DATA_FRAME_START) {
+                if (executeOpcode(frame, BLOCK_OP_RDFRME, files[i].frames[j], NULL) == -1
+                    || executeOpcode(frame, BLOCK_OP_WRFRME, top + 1, NULL) == -1) {
+                    logMessage(LOG_ERROR_LEVEL, "Failure moving the frames of %s, the store is not migrated", files[i].name);
+                    return -1;
+                }
+                files[i].frames[j] = ++top;
+            }
+        }
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        memcpy(frame, &files[i], sizeof(file_t));
+        if (executeOpcode(frame, BLOCK_OP_WRFRME, i, NULL) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing the entry of %s, the store is not migrated", files[i].name);
+            return -1;
+        }
+    }
+    // The superblock goes last, a store left without one is migrated again
+    memset(epochTableDirty, 1, BLOCK_EPOCH_TABLE_FRAMES);
+    memset(genTableDirty, 1, BLOCK_GEN_TABLE_FRAMES);
+    if (storeEpochTable() == -1 || storeGenTable() == -1 || storeSuperblock() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure writing the tables of the migrated store");
+        return -1;
+    }
+    logMessage(LOG_INFO_LEVEL, "Migrated a store of %d files, %d frames moved out of the metadata area", nbEntries, moves);
+    return 0;
+}
+
+// Reads the superblock and the epoch table. A store without a valid
+// superblock is formatted if it is empty, and migrated if it was written
+// before the superblock (it has files). Returns 1 if the store was formatted,
+// 0 otherwise, -1 if it can't be mounted (read-only, or neither empty nor
+// a store that can be migrated)
+int loadSuperblock(void)
+{
+    int i, files_found = 0, data_found = 0;
+    frame_t frame;
+    // Reads of the metadata area always go to the bus
+    superblock.epoch = 0;
+    memset(frameEpochs, 0, BLOCK_BLOCK_SIZE);
+    if (executeOpcode(frame, BLOCK_OP_RDFRME, BLOCK_SUPERBLOCK_FRAME, NULL) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failure reading the superblock.");
+        return -1;
+    }
+    memcpy(&superblock, frame, sizeof(superblock_t));
+    if (superblock.magic != BLOCK_SUPERBLOCK_MAGIC || superblock.version != BLOCK_SUPERBLOCK_VERSION
+        || superblock.epoch == 0) {
+        // Every frame is from epoch 0 until then, so they are read from the bus
+        superblock.epoch = 0;
+        for (i = 0; i < BLOCK_FRAME_SIZE && !data_found; i++) {
+            data_found = (frame[i] != 0);
+        }
+        // Files were added from the first entry on, the table is only read
+        // if it has one
+        for (i = 0; i < BLOCK_MAX_TOTAL_FILES && (i == 0 || files_found); i++) {
+            if (executeOpcode(frame, BLOCK_OP_RDFRME, i, NULL) == -1) {
+                logMessage(LOG_ERROR_LEVEL, "Failure reading the file table.");
+                return -1;
+            }
+            memcpy(&files[i], frame, sizeof(file_t));
+            checkFileEntry(&files[i]);
+            files_found += (files[i].name[0] != '\0');
+        }
+        // A read-only store can't be formatted nor migrated
+        if (block_backend_readonly()) {
+            logMessage(LOG_ERROR_LEVEL, "The read-only store has no valid superblock.");
+            return -1;
+        }
+        if (files_found != 0) {
+            return ((migrateStore() == 0) ? 0 : -1);
+        }
+        if (data_found) {
+            logMessage(LOG_ERROR_LEVEL, "The store has no files and no valid superblock, it is not formatted.");
+            return -1;
+        }
+        // Every frame is from an older epoch (0), write the whole table out
+        superblock.magic = BLOCK_SUPERBLOCK_MAGIC;
+        superblock.version = BLOCK_SUPERBLOCK_VERSION;
+        superblock.epoch = 1;
+        superblock.generation = 0;
+        superblock.formatGeneration = 0;
+        memset(frameGens, 0, sizeof(uint32_t) * BLOCK_BLOCK_SIZE);
+        memset(epochTableDirty, 1, BLOCK_EPOCH_TABLE_FRAMES);
+        memset(genTableDirty, 1, BLOCK_GEN_TABLE_FRAMES);
+        if (storeEpochTable() == -1 || storeGenTable() == -1 || storeSuperblock() == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure formatting the store.");
+            return -1;
+        }
+        return 1;
+    }
+    for (i = 0; i < BLOCK_EPOCH_TABLE_FRAMES; i++) {
+        if (executeOpcode(frame, BLOCK_OP_RDFRME, BLOCK_EPOCH_TABLE_FRAME + i, NULL) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure reading the epoch table.");
+            return -1;
+        }
+        memcpy(&frameEpochs[i * BLOCK_FRAME_SIZE], frame, BLOCK_FRAME_SIZE);
+    }
+    memset(epochTableDirty, 0, BLOCK_EPOCH_TABLE_FRAMES);
+    memset(genTableDirty, 0, BLOCK_GEN_TABLE_FRAMES);
+    if (superblock.generation == 0) {
+        // Stores older than the generation table count as written in generation 1
+        superblock.generation = 1;
+        for (i = 0; i < BLOCK_BLOCK_SIZE; i++) {
+            frameGens[i] = (isEpochFrame(i) && frameEpochs[i] == superblock.epoch) ? 1 : 0;
+        }
+        memset(genTableDirty, 1, BLOCK_GEN_TABLE_FRAMES);
+        return 0;
+    }
+    for (i = 0; i < (int)BLOCK_GEN_TABLE_FRAMES; i++) {
+        if (executeOpcode(frame, BLOCK_OP_RDFRME, BLOCK_GEN_TABLE_FRAME + i, NULL) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure reading the generation table.");
+            return -1;
+        }
+        memcpy(&frameGens[i * BLOCK_GEN_PER_FRAME], frame, BLOCK_FRAME_SIZE);
+    }
+    return 0;
+}
+
+// Writes the file table entries that changed since they were loaded, so that
+// they are the only ones in the next incremental backup (entries of older
+// epochs read as zeros, they are only written if they hold a file). Returns 0
+// if successful, -1 otherwise
+int storeFileTable(void)
+{
+    int i, ret = 0;
+    uint32_t checksum;
+    uint64_t mark;
+    frame_t frame;
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        memset(frame, 0, BLOCK_FRAME_SIZE);
+        memcpy(frame, &files[i], sizeof(file_t));
+        mark = block_stats_clock();
+        compute_frame_checksum(frame, &checksum);
+        if (mountProfile != NULL) {
+            mountProfile->checksum_ns += block_stats_clock() - mark;
+        }
+        BLOCK_STAT_ADD(checksums, 1);
+        if ((frameEpochs[i] == superblock.epoch) ? (checksum != fileTableChecksums[i]) : (files[i].name[0] != '\0')) {
+            if (executeOpcode(frame, BLOCK_OP_WRFRME, i, &fileTableChecksums[i]) == -1) {
+                ret = -1;
+            }
+        }
+    }
+    return (ret);
+}
+
+// Writes the superblock to its frame. Returns 0 if successful, -1 otherwise
+int storeSuperblock(void)
+{
+    frame_t frame;
+    memset(frame, 0, BLOCK_FRAME_SIZE);
+    memcpy(frame, &superblock, sizeof(superblock_t));
+    return (executeOpcode(frame, BLOCK_OP_WRFRME, BLOCK_SUPERBLOCK_FRAME, NULL));
+}
+
+// Writes the frames of the epoch table that changed since they were loaded,
+// the frames not written stay dirty. Returns 0 if successful, -1 otherwise
+int storeEpochTable(void)
+{
+    int i, ret = 0;
+    for (i = 0; i < BLOCK_EPOCH_TABLE_FRAMES; i++) {
+        if (epochTableDirty[i]) {
+            if (executeOpcode((char*)&frameEpochs[i * BLOCK_FRAME_SIZE], BLOCK_OP_WRFRME, BLOCK_EPOCH_TABLE_FRAME + i, NULL) == -1) {
+                ret = -1;
+                continue;
+            }
+            epochTableDirty[i] = 0;
+        }
+    }
+    return (ret);
+}
+
+// Writes the frames of the generation table that changed since they were
+// loaded, the frames not written stay dirty. Returns 0 if successful, -1
+// otherwise
+int storeGenTable(void)
+{
+    int i, ret = 0;
+    for (i = 0; i < (int)BLOCK_GEN_TABLE_FRAMES; i++) {
+        if (genTableDirty[i]) {
+            if (executeOpcode((char*)&frameGens[i * BLOCK_GEN_PER_FRAME], BLOCK_OP_WRFRME, BLOCK_GEN_TABLE_FRAME + i, NULL) == -1) {
+                ret = -1;
+                continue;
+            }
+            genTableDirty[i] = 0;
+        }
+    }
+    return (ret);
+}
+
+// Returns 1 if the given frame was written after generation "gen" and still
+// holds data (frames from older epochs read as zeros)
+int isChangedFrame(uint32_t frame_nr, uint32_t gen)
+{
+    return (isEpochFrame(frame_nr) && frameEpochs[frame_nr] == superblock.epoch && frameGens[frame_nr] > gen);
+}
+
 // Given an array of files, returns the number of files
 int getNbFiles(file_t* files)
 {
@@ -131,24 +1016,78 @@ int getNbFiles(file_t* files)
     return i;
 }
 
-// Given an array of file_t, returns the number of the first frame unused by all the files
+// Given an array of file_t, returns the number of the first frame after all the
+// frames used by the files (frames are handed out in increasing order, a
+// fragment frame with no slice left is only reused through the fragment table)
 int getFreeFrame(file_t* files)
 {
     int i;
     int j;
-    int8_t frames[BLOCK_BLOCK_SIZE];
-    memset(frames, 0, BLOCK_BLOCK_SIZE);
-    // Set all the used frames to -1
+    int last = BLOCK_DATA_FRAME_START - 1;
+    // Find the last frame used by a file
     for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
         for (j = 0; j < files[i].nrFrames; j++) {
-            frames[files[i].frames[j]] = -1;
+            if (files[i].frames[j] > last) {
+                last = files[i].frames[j];
+            }
+        }
+        if (files[i].nrFrames == 0 && files[i].fragLength != 0 && files[i].fragFrame > last) {
+            last = files[i].fragFrame;
         }
     }
-    // Search for the first frame that is unused (i.e. has a 0 in the `frames` array)
-    for (i = BLOCK_MAX_TOTAL_FILES; i < BLOCK_BLOCK_SIZE; i++) {
-        if (frames[i] == 0) {
-            return i;
+    return (last + 1 < BLOCK_BLOCK_SIZE) ? last + 1 : -1;
+}
+
+// Creates an empty directory under /tmp for the files of a unit test, its
+// path is copied to `dir` (at least 32 bytes). Returns 0 if successful, -1
+// otherwise
+int unitDirectory(char* dir)
+{
+    strcpy(dir, "/tmp/block_unit.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure creating the directory of a unit test.");
+        return -1;
+    }
+    return 0;
+}
+
+// Runs a session of a unit test in a child process working in `dir`, as the
+// controller can only be powered on once per process (its image is written
+// to the working directory). Returns 0 if the session succeeded, -1 otherwise
+int unitSession(const char* dir, int (*session)(void))
+{
+    int status, ret;
+    pid_t pid;
+    fflush(NULL);
+    if ((pid = fork()) == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        ret = (chdir(dir) == 0) ? session() : -1;
+        fflush(NULL);
+        _exit((ret == 0) ? 0 : 1);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Removes the directory of a unit test and the files in it
+void unitCleanup(const char* dir)
+{
+    char path[PATH_MAX];
+    struct dirent* entry;
+    DIR* files;
+    if ((files = opendir(dir)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(files)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
         }
     }
-    return -1;
+    closedir(files);
+    rmdir(dir);
 }
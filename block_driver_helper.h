@@ -1,14 +1,36 @@
 #ifndef BLOCK_DRIVER_HELPER_H
 #define BLOCK_DRIVER_HELPER_H
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include <block_controller.h>
 #include <block_driver.h>
+#include <block_stats.h>
 
 #define OPEN 1
 #define CLOSED 0
 
+// Layout of the metadata area that follows the file table
+#define BLOCK_SUPERBLOCK_FRAME BLOCK_MAX_TOTAL_FILES // Frame holding the superblock
+#define BLOCK_EPOCH_TABLE_FRAME (BLOCK_SUPERBLOCK_FRAME + 1) // First frame of the epoch table
+#define BLOCK_EPOCH_TABLE_FRAMES (BLOCK_BLOCK_SIZE / BLOCK_FRAME_SIZE) // Frames in the epoch table
+#define BLOCK_GEN_TABLE_FRAME (BLOCK_EPOCH_TABLE_FRAME + BLOCK_EPOCH_TABLE_FRAMES) // First frame of the generation table
+#define BLOCK_GEN_TABLE_FRAMES (BLOCK_BLOCK_SIZE * sizeof(uint32_t) / BLOCK_FRAME_SIZE) // Frames in the generation table
+#define BLOCK_GEN_PER_FRAME (BLOCK_FRAME_SIZE / sizeof(uint32_t)) // Generations in a frame of the table
+#define BLOCK_JOURNAL_FRAME (BLOCK_GEN_TABLE_FRAME + BLOCK_GEN_TABLE_FRAMES) // Header of the relayout journal
+#define BLOCK_JOURNAL_HELD_FRAME (BLOCK_JOURNAL_FRAME + 1) // Frame held aside while a cycle of moves is laid out
+#define BLOCK_JOURNAL_MAP_FRAME (BLOCK_JOURNAL_FRAME + 2) // First frame of the new frame numbers of the relayout
+#define BLOCK_JOURNAL_MAP_FRAMES (BLOCK_BLOCK_SIZE * sizeof(uint16_t) / BLOCK_FRAME_SIZE) // Frames of the new frame numbers
+#define BLOCK_JOURNAL_PER_FRAME (BLOCK_FRAME_SIZE / sizeof(uint16_t)) // New frame numbers in a frame of the journal
+#define BLOCK_DATA_FRAME_START (BLOCK_SUPERBLOCK_FRAME + 128) // First data frame (rest is reserved)
+#define BLOCK_SUPERBLOCK_MAGIC 0x424c4b53 // "BLKS"
+#define BLOCK_SUPERBLOCK_VERSION 1
+#define BLOCK_JOURNAL_MAGIC 0x424c4b4a // "BLKJ", set while a relayout is in progress
+#define BLOCK_FILE_LAYOUT 0xf11e7ab1 // Marks the file table entries written with the fields after nrFrames
+#define BLOCK_SCRATCH_FRAMES 2 // Frames of the scratch area of the driver calls
+#define BLOCK_FRAGMENT_UNITS (BLOCK_FRAME_SIZE / BLOCK_FRAGMENT_UNIT) // Units of a fragment frame (one bit each)
+
 typedef char frame_t[BLOCK_FRAME_SIZE];
 
 struct file_data {
@@ -16,28 +38,78 @@ struct file_data {
     int size;
     uint16_t frames[1024];
     int nrFrames;
+    uint32_t layout; // BLOCK_FILE_LAYOUT, older drivers wrote the next entry here
+    uint16_t fragFrame; // Shared fragment frame holding a small file's data
+    uint16_t fragOffset; // Offset of the file's slice in the fragment frame
+    uint16_t fragLength; // Length reserved for the slice (0 if none)
+    uint8_t packing[1024]; // Sectors holding each frame compressed, 0 if stored raw (see block_compress.h)
 };
 typedef struct file_data file_t;
 
+struct fragment_data {
+    uint16_t frame; // Fragment frame
+    uint64_t used; // Units of the frame held by the slices of files
+};
+typedef struct fragment_data fragment_t;
+
 struct file_handler {
     file_t* file;
     int loc;
     int status;
+    int read; // Set once the file is read through the handle
 };
 typedef struct file_handler fh_t;
 
+struct superblock_data {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t epoch; // Current format epoch, frames written in older epochs read as zeros
+    uint32_t generation; // Bumped on every frame write, 0 in stores older than the generation table
+    uint32_t formatGeneration; // Generation of the last format
+};
+typedef struct superblock_data superblock_t;
+
+struct journal_data {
+    uint32_t magic; // BLOCK_JOURNAL_MAGIC while a relayout is in progress
+    uint8_t epoch; // Epoch of the store the relayout started in
+    uint32_t done; // Steps of the relayout completed (moves, then file table entries)
+    uint32_t pending; // Checksum of the file table entry being written with its new frames (0 if none)
+};
+typedef struct journal_data journal_t;
+
 extern int compute_frame_checksum(void* frame, uint32_t* cs1);
+extern pthread_mutex_t blockDriverLock; // Held by the driver calls and the prefetch worker
+extern BlockMountProfile* mountProfile; // Set while a power on or off is profiled
+extern frame_t* scratchFrames; // Scratch area of the driver calls, used under the driver lock
 
 BlockXferRegister pack(uint32_t ky1, uint32_t fm1, uint32_t cs1, uint32_t rt1);
 void unpack(BlockXferRegister reg, uint32_t* ky1, uint32_t* fm1, uint32_t* cs1, uint32_t* rt1);
 void closeAllFiles(fh_t* handles);
 int createNewFile(const char* path, file_t* file);
+int checkFileEntry(file_t* file);
 int openFile(fh_t* handle, file_t* file);
 void closeFile(fh_t* handle);
 int verify_cs1(frame_t frame, uint32_t cs1);
-void executeOpcode(frame_t frame, uint32_t ky1, uint32_t fm1);
+int executeOpcode(frame_t frame, uint32_t ky1, uint32_t fm1, uint32_t* checksum);
+int fetchFrame(frame_t frame, uint16_t frame_nr);
+int fetchFileFrame(file_t* file, int32_t index, frame_t frame, int cache);
+int packFrame(int32_t file_nr, int32_t index, frame_t frame, char** physical);
+void loadPacks(void);
+void lockDriver(void);
 int allocateNewFrames(fh_t* handle, int32_t count);
+int allocateFragment(file_t* file, int32_t size);
+int promoteFragment(file_t* file);
+void loadFragments(void);
+int loadSuperblock(void);
+int storeFileTable(void);
+int storeSuperblock(void);
+int storeEpochTable(void);
+int storeGenTable(void);
+int isChangedFrame(uint32_t frame_nr, uint32_t gen);
 int getNbFiles(file_t* files);
 int getFreeFrame(file_t* files);
+int unitDirectory(char* dir);
+int unitSession(const char* dir, int (*session)(void));
+void unitCleanup(const char* dir);
 
 #endif // BLOCK_DRIVER_HELPER_H
\ No newline at end of file
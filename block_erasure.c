@@ -0,0 +1,1055 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_erasure.c
+//  Description    : This is the implementation of the erasure coded backend
+//                   of the BLOCK memory system driver. Frame f is frame f/K
+//                   of data backend f%K, and the parity backends hold a
+//                   Cauchy Reed-Solomon code of each stripe over GF(2^8).
+//                   The frames the cache writes back are gathered until
+//                   their stripe is whole or another stripe is written back,
+//                   so that sequential write-backs compute the parity
+//                   without reading anything. The other writes reach their
+//                   shard and the parity before they return.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+// Project includes
+#include <block_backend.h>
+#include <block_controller.h>
+#include <block_driver_helper.h>
+#include <block_erasure.h>
+#include <block_memory.h>
+#include <block_stats.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define BLOCK_UNIT_DATA 4 // Data shards of the unit test
+#define BLOCK_UNIT_PARITY 2 // Parity shards of the unit test
+#define BLOCK_UNIT_FRAMES 10 // Frames written by the unit test, two stripes and a half
+#define BLOCK_UNIT_REWRITTEN 5 // Frame the unit test writes a second time
+#define BLOCK_UNIT_THROUGH 13 // First of the two frames the unit test writes through
+#define BLOCK_UNIT_HELD 16 // Frame the unit test writes back and leaves held meanwhile
+
+// State of an erasure coded backend
+typedef struct {
+    BlockBackend* shards[BLOCK_ERASURE_MAX_DATA + BLOCK_ERASURE_MAX_PARITY]; // Data then parity (NULL if missing)
+    int k;
+    int m;
+    uint8_t coefs[BLOCK_ERASURE_MAX_PARITY][BLOCK_ERASURE_MAX_DATA]; // Cauchy matrix of the code
+    int32_t open; // Stripe whose writes are being gathered (-1 if none)
+    uint32_t gathered; // Frames of the open stripe written
+    int failed; // The open stripe failed to be written, it is held and encoded whole on the next try
+    uint32_t checksums[BLOCK_ERASURE_MAX_DATA]; // Checksums of the frames gathered
+    char* stripe; // Data frames of the open stripe, then the parity frames
+    char* scratch; // Frames read to rebuild a frame
+    BlockErasureStats stats;
+} BlockErasureState;
+
+// Global data
+uint8_t gfExp[512]; // Powers of the generator, doubled to skip the modulo
+uint8_t gfLog[256];
+pthread_once_t gfOnce = PTHREAD_ONCE_INIT;
+void (*gfMulAdd)(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len); // Fastest kernel of the CPU
+
+//
+// GF(2^8) arithmetic
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_mul
+// Description  : Multiply two elements of GF(2^8)
+//
+// Inputs       : a, b - the elements
+// Outputs      : the product
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0) {
+        return (0);
+    }
+    return (gfExp[gfLog[a] + gfLog[b]]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_inv
+// Description  : Invert a non zero element of GF(2^8)
+//
+// Inputs       : a - the element
+// Outputs      : its inverse
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return (gfExp[255 - gfLog[a]]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_tables
+// Description  : Get the products of a constant by the low and high nibbles,
+//                c*x is then low[x & 15] ^ high[x >> 4]
+//
+// Inputs       : c - the constant
+//                low, high - the 16 entry tables to fill
+// Outputs      : none
+
+static void gf_tables(uint8_t c, uint8_t* low, uint8_t* high)
+{
+    int i;
+    for (i = 0; i < 16; i++) {
+        low[i] = gf_mul(c, i);
+        high[i] = gf_mul(c, i << 4);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_muladd_scalar
+// Description  : Add c times a region to another region, dst ^= c * src
+//
+// Inputs       : dst - the region added to
+//                src - the region multiplied
+//                c - the constant
+//                len - the length of the regions
+// Outputs      : none
+
+static void gf_muladd_scalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len)
+{
+    uint8_t low[16], high[16];
+    size_t i;
+
+    gf_tables(c, low, high);
+    for (i = 0; i < len; i++) {
+        dst[i] ^= low[src[i] & 0x0f] ^ high[src[i] >> 4];
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_muladd_ssse3
+// Description  : Add c times a region to another region, 16 bytes at a time
+//                with the nibble tables in PSHUFB lookups
+//
+// Inputs       : see gf_muladd_scalar
+// Outputs      : none
+
+__attribute__((target("ssse3"))) static void gf_muladd_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c,
+    size_t len)
+{
+    uint8_t low[16], high[16];
+    __m128i tlow, thigh, mask, s, p;
+    size_t i;
+
+    gf_tables(c, low, high);
+    tlow = _mm_loadu_si128((const __m128i*)low);
+    thigh = _mm_loadu_si128((const __m128i*)high);
+    mask = _mm_set1_epi8(0x0f);
+    for (i = 0; i + 16 <= len; i += 16) {
+        s = _mm_loadu_si128((const __m128i*)(src + i));
+        p = _mm_xor_si128(_mm_shuffle_epi8(tlow, _mm_and_si128(s, mask)),
+            _mm_shuffle_epi8(thigh, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst + i)), p));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= low[src[i] & 0x0f] ^ high[src[i] >> 4];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_muladd_avx2
+// Description  : Add c times a region to another region, 32 bytes at a time
+//
+// Inputs       : see gf_muladd_scalar
+// Outputs      : none
+
+__attribute__((target("avx2"))) static void gf_muladd_avx2(uint8_t* dst, const uint8_t* src, uint8_t c,
+    size_t len)
+{
+    uint8_t low[16], high[16];
+    __m256i tlow, thigh, mask, s, p;
+    size_t i;
+
+    gf_tables(c, low, high);
+    tlow = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+    thigh = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+    mask = _mm256_set1_epi8(0x0f);
+    for (i = 0; i + 32 <= len; i += 32) {
+        s = _mm256_loadu_si256((const __m256i*)(src + i));
+        p = _mm256_xor_si256(_mm256_shuffle_epi8(tlow, _mm256_and_si256(s, mask)),
+            _mm256_shuffle_epi8(thigh, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst + i)), p));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= low[src[i] & 0x0f] ^ high[src[i] >> 4];
+    }
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_init
+// Description  : Build the tables of GF(2^8) (polynomial 0x11d) and pick the
+//                fastest region kernel of the CPU
+//
+// Inputs       : none
+// Outputs      : none
+
+static void gf_init(void)
+{
+    int i, x = 1;
+
+    for (i = 0; i < 255; i++) {
+        gfExp[i] = gfExp[i + 255] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+    gfMulAdd = gf_muladd_scalar;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        gfMulAdd = gf_muladd_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gfMulAdd = gf_muladd_ssse3;
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf_invert
+// Description  : Invert a square matrix of GF(2^8) by Gauss-Jordan elimination
+//
+// Inputs       : a - the matrix, destroyed
+//                inv - the inverse to fill
+//                n - the size of the matrices
+// Outputs      : 0 if successful, -1 if the matrix is singular
+
+static int gf_invert(uint8_t a[][BLOCK_ERASURE_MAX_DATA], uint8_t inv[][BLOCK_ERASURE_MAX_DATA], int n)
+{
+    uint8_t t, f;
+    int i, j, r;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            inv[i][j] = (i == j);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        for (r = i; r < n && a[r][i] == 0; r++) {
+        }
+        if (r == n) {
+            return (-1);
+        }
+        for (j = 0; j < n; j++) {
+            t = a[i][j], a[i][j] = a[r][j], a[r][j] = t;
+            t = inv[i][j], inv[i][j] = inv[r][j], inv[r][j] = t;
+        }
+        f = gf_inv(a[i][i]);
+        for (j = 0; j < n; j++) {
+            a[i][j] = gf_mul(a[i][j], f);
+            inv[i][j] = gf_mul(inv[i][j], f);
+        }
+        for (r = 0; r < n; r++) {
+            if (r != i && a[r][i] != 0) {
+                f = a[r][i];
+                for (j = 0; j < n; j++) {
+                    a[r][j] ^= gf_mul(f, a[i][j]);
+                    inv[r][j] ^= gf_mul(f, inv[i][j]);
+                }
+            }
+        }
+    }
+    return (0);
+}
+
+//
+// Stripes
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_frames
+// Description  : Get the number of frames in a stripe, the last one may be
+//                short (its missing frames count as zeros)
+//
+// Inputs       : state - the backend state
+//                stripe - the stripe
+// Outputs      : the number of frames
+
+static int stripe_frames(BlockErasureState* state, int32_t stripe)
+{
+    int32_t left = BLOCK_BLOCK_SIZE - stripe * state->k;
+    return ((left < state->k) ? left : state->k);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shard_read
+// Description  : Read the frame of a stripe held by a shard
+//
+// Inputs       : state - the backend state
+//                shard - the shard, data then parity
+//                stripe - the stripe
+//                frame - the buffer to fill
+// Outputs      : 0 if successful, -1 if the shard is missing or bad
+
+static int shard_read(BlockErasureState* state, int shard, int32_t stripe, void* frame)
+{
+    uint32_t checksum;
+    if (state->shards[shard] == NULL) {
+        return (-1);
+    }
+    return (state->shards[shard]->read(state->shards[shard], stripe, frame, &checksum));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shard_write
+// Description  : Write the frame of a stripe held by a shard, missing shards
+//                are skipped
+//
+// Inputs       : state - the backend state
+//                shard - the shard, data then parity
+//                stripe - the stripe
+//                frame - the data of the frame
+//                checksum - its checksum, computed if 0
+// Outputs      : 0 if successful, -1 if failure
+
+static int shard_write(BlockErasureState* state, int shard, int32_t stripe, const void* frame, uint32_t checksum)
+{
+    if (state->shards[shard] == NULL) {
+        return (0);
+    }
+    if (checksum == 0) {
+        compute_frame_checksum((void*)frame, &checksum);
+        BLOCK_STAT_ADD(checksums, 1);
+    }
+    return (state->shards[shard]->write(state->shards[shard], stripe, frame, checksum));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_rebuild
+// Description  : Rebuild a data frame of a stripe from K other frames of the
+//                stripe that read correctly
+//
+// Inputs       : state - the backend state
+//                stripe - the stripe
+//                index - the data frame to rebuild
+//                frame - the buffer to fill
+// Outputs      : 0 if successful, -1 if more than M frames are lost
+
+static int stripe_rebuild(BlockErasureState* state, int32_t stripe, int index, char* frame)
+{
+    uint8_t a[BLOCK_ERASURE_MAX_DATA][BLOCK_ERASURE_MAX_DATA], inv[BLOCK_ERASURE_MAX_DATA][BLOCK_ERASURE_MAX_DATA];
+    int rows = 0, shard, i;
+
+    // Gather K frames of the stripe, each is a row of the code matrix
+    for (shard = 0; shard < state->k + state->m && rows < state->k; shard++) {
+        if (shard == index || shard_read(state, shard, stripe, state->scratch + rows * BLOCK_FRAME_SIZE) == -1) {
+            continue;
+        }
+        for (i = 0; i < state->k; i++) {
+            a[rows][i] = (shard < state->k) ? (shard == i) : state->coefs[shard - state->k][i];
+        }
+        rows++;
+    }
+    if (rows < state->k || gf_invert(a, inv, state->k) == -1) {
+        return (-1);
+    }
+
+    // The frame is its row of the inverse applied to the frames read
+    memset(frame, 0, BLOCK_FRAME_SIZE);
+    for (i = 0; i < state->k; i++) {
+        if (inv[index][i] != 0) {
+            gfMulAdd((uint8_t*)frame, (uint8_t*)state->scratch + i * BLOCK_FRAME_SIZE, inv[index][i], BLOCK_FRAME_SIZE);
+        }
+    }
+    state->stats.reconstructions++;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_read
+// Description  : Read a data frame of a stripe as stored, rebuilding it if
+//                its shard is missing or bad
+//
+// Inputs       : state - the backend state
+//                stripe - the stripe
+//                index - the data frame
+//                frame - the buffer to fill
+// Outputs      : 0 if successful, -1 if failure
+
+static int stripe_read(BlockErasureState* state, int32_t stripe, int index, char* frame)
+{
+    if (shard_read(state, index, stripe, frame) == 0) {
+        return (0);
+    }
+    return (stripe_rebuild(state, stripe, index, frame));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_flush
+// Description  : Write the frames gathered for the open stripe and update its
+//                parity. A whole stripe needs no read, otherwise the parity
+//                is updated from the old frames written (read-modify-write)
+//                or computed from the frames not written, whichever reads
+//                fewer frames. A stripe that fails is held for the next
+//                flush, with its frames.
+//
+// Inputs       : state - the backend state
+// Outputs      : 0 if successful, -1 if failure
+
+static int stripe_flush(BlockErasureState* state)
+{
+    char* parity = state->stripe + state->k * BLOCK_FRAME_SIZE;
+    int32_t stripe = state->open;
+    int n, written, i, j, rmw, ret = 0;
+    frame_t old;
+
+    if (stripe == -1) {
+        return (0);
+    }
+    n = stripe_frames(state, stripe);
+    written = __builtin_popcount(state->gathered);
+    // The frames of a stripe that failed may be written already
+    rmw = !state->failed && (written < n) && (written + state->m < n - written);
+
+    // Read-modify-write, the parity changes by the code of the changes
+    if (rmw) {
+        for (j = 0; j < state->m && rmw; j++) {
+            rmw = (shard_read(state, state->k + j, stripe, parity + j * BLOCK_FRAME_SIZE) == 0);
+            state->stats.stripe_reads++;
+        }
+        for (i = 0; i < n && rmw; i++) {
+            if (state->gathered & (1 << i)) {
+                if (stripe_read(state, stripe, i, old) == -1) {
+                    rmw = 0;
+                    break;
+                }
+                state->stats.stripe_reads++;
+                for (j = 0; j < (int)BLOCK_FRAME_SIZE; j++) {
+                    old[j] ^= state->stripe[i * BLOCK_FRAME_SIZE + j];
+                }
+                for (j = 0; j < state->m; j++) {
+                    gfMulAdd((uint8_t*)parity + j * BLOCK_FRAME_SIZE, (uint8_t*)old, state->coefs[j][i], BLOCK_FRAME_SIZE);
+                }
+            }
+        }
+    }
+
+    // Otherwise complete the stripe and encode it
+    if (!rmw) {
+        for (i = 0; i < state->k; i++) {
+            if (state->gathered & (1 << i)) {
+                continue;
+            }
+            if (i >= n) {
+                memset(state->stripe + i * BLOCK_FRAME_SIZE, 0, BLOCK_FRAME_SIZE);
+            } else if (stripe_read(state, stripe, i, state->stripe + i * BLOCK_FRAME_SIZE) == -1) {
+                logMessage(LOG_ERROR_LEVEL, "Stripe %d can't be read, its parity is lost", stripe);
+                ret = -1;
+            } else {
+                state->stats.stripe_reads++;
+            }
+        }
+        memset(parity, 0, state->m * BLOCK_FRAME_SIZE);
+        for (j = 0; j < state->m; j++) {
+            for (i = 0; i < state->k; i++) {
+                gfMulAdd((uint8_t*)parity + j * BLOCK_FRAME_SIZE, (uint8_t*)state->stripe + i * BLOCK_FRAME_SIZE,
+                    state->coefs[j][i], BLOCK_FRAME_SIZE);
+            }
+        }
+    }
+    if (written == n) {
+        state->stats.full_stripes++;
+    } else {
+        state->stats.partial_stripes++;
+    }
+
+    // Write the frames gathered, then the parity
+    for (i = 0; i < n; i++) {
+        if ((state->gathered & (1 << i)) && shard_write(state, i, stripe, state->stripe + i * BLOCK_FRAME_SIZE,
+                                                state->checksums[i]) == -1) {
+            ret = -1;
+        }
+    }
+    for (j = 0; j < state->m; j++) {
+        if (shard_write(state, state->k + j, stripe, parity + j * BLOCK_FRAME_SIZE, 0) == -1) {
+            ret = -1;
+        }
+    }
+    state->failed = (ret == -1);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Stripe %d could not be written, its frames are held", stripe);
+        return (-1);
+    }
+    state->open = -1;
+    state->gathered = 0;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frame_write
+// Description  : Write a frame outside of the open stripe, the parity of its
+//                stripe is updated from the old frame (read-modify-write)
+//
+// Inputs       : state - the backend state
+//                stripe - the stripe
+//                index - the data frame
+//                frame - the data of the frame
+//                checksum - its checksum
+// Outputs      : 0 if successful, -1 if failure
+
+static int frame_write(BlockErasureState* state, int32_t stripe, int index, const char* frame, uint32_t checksum)
+{
+    frame_t delta, parity;
+    int i, j, ret = 0;
+
+    // The parity changes by the code of the change
+    if (stripe_read(state, stripe, index, delta) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Frame %d of stripe %d can't be read, its parity can't be updated", index, stripe);
+        return (-1);
+    }
+    state->stats.stripe_reads++;
+    state->stats.partial_stripes++;
+    for (i = 0; i < (int)BLOCK_FRAME_SIZE; i++) {
+        delta[i] ^= frame[i];
+    }
+    if (shard_write(state, index, stripe, frame, checksum) == -1) {
+        ret = -1;
+    }
+    for (j = 0; j < state->m; j++) {
+        if (state->shards[state->k + j] == NULL) {
+            continue;
+        }
+        if (shard_read(state, state->k + j, stripe, parity) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Parity %d of stripe %d can't be read, it is lost", j, stripe);
+            ret = -1;
+            continue;
+        }
+        state->stats.stripe_reads++;
+        gfMulAdd((uint8_t*)parity, (uint8_t*)delta, state->coefs[j][index], BLOCK_FRAME_SIZE);
+        if (shard_write(state, state->k + j, stripe, parity, 0) == -1) {
+            ret = -1;
+        }
+    }
+    return (ret);
+}
+
+//
+// Backend
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : erasure_read
+// Description  : Read a frame from its data backend, or rebuild it from its
+//                stripe and write it back if it is missing or bad
+//
+// Inputs       : backend - the erasure coded backend
+//                frame_nr - the frame to read
+//                frame - the buffer to fill
+//                checksum - set to the checksum of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int erasure_read(BlockBackend* backend, uint16_t frame_nr, void* frame, uint32_t* checksum)
+{
+    BlockErasureState* state = backend->state;
+    int32_t stripe = frame_nr / state->k;
+    int index = frame_nr % state->k;
+
+    // Frames gathered for the open stripe are not written yet
+    if (stripe == state->open && (state->gathered & (1 << index))) {
+        memcpy(frame, state->stripe + index * BLOCK_FRAME_SIZE, BLOCK_FRAME_SIZE);
+        *checksum = state->checksums[index];
+        return (0);
+    }
+    if (state->shards[index] != NULL && state->shards[index]->read(state->shards[index], stripe, frame, checksum) == 0) {
+        state->stats.reads++;
+        return (0);
+    }
+    if (stripe_rebuild(state, stripe, index, frame) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Frame %u can't be rebuilt, more than %d shards lost", frame_nr, state->m);
+        return (-1);
+    }
+    compute_frame_checksum(frame, checksum);
+    BLOCK_STAT_ADD(checksums, 1);
+    if (state->shards[index] != NULL && shard_write(state, index, stripe, frame, *checksum) == 0) {
+        state->stats.repairs++;
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : erasure_write
+// Description  : Write a frame and the parity of its stripe. A frame written
+//                back by the cache is gathered in its stripe instead, the
+//                stripe is written once whole or when another stripe is
+//                written back. The failure of a stripe held is reported by
+//                the writes to it and the flush, the frames of other stripes
+//                are written on their own meanwhile.
+//
+// Inputs       : backend - the erasure coded backend
+//                frame_nr - the frame to write
+//                frame - the data of the frame
+//                checksum - the checksum of the frame
+// Outputs      : 0 if successful, -1 if failure
+
+static int erasure_write(BlockBackend* backend, uint16_t frame_nr, const void* frame, uint32_t checksum)
+{
+    BlockErasureState* state = backend->state;
+    int32_t stripe = frame_nr / state->k;
+    int index = frame_nr % state->k;
+
+    // A stripe written back before that fails is held, it is not the
+    // failure of this frame
+    if (blockBackendGather && state->open != stripe) {
+        stripe_flush(state);
+    }
+    if (state->open != -1 && state->open != stripe) {
+        return (frame_write(state, stripe, index, frame, checksum));
+    }
+    state->open = stripe;
+    memcpy(state->stripe + index * BLOCK_FRAME_SIZE, frame, BLOCK_FRAME_SIZE);
+    state->checksums[index] = checksum;
+    state->gathered |= (1 << index);
+    if (!blockBackendGather || state->gathered == (1u << stripe_frames(state, stripe)) - 1) {
+        return (stripe_flush(state));
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : erasure_flush
+// Description  : Write the open stripe and flush the shards
+//
+// Inputs       : backend - the erasure coded backend
+// Outputs      : 0 if successful, -1 if failure
+
+static int erasure_flush(BlockBackend* backend)
+{
+    BlockErasureState* state = backend->state;
+    int ret, i;
+
+    ret = stripe_flush(state);
+    for (i = 0; i < state->k + state->m; i++) {
+        if (state->shards[i] != NULL && state->shards[i]->flush(state->shards[i]) == -1) {
+            ret = -1;
+        }
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : erasure_close
+// Description  : Write the open stripe and close the shards, the frames of a
+//                stripe that fails again are lost
+//
+// Inputs       : backend - the erasure coded backend
+// Outputs      : 0 if successful, -1 if failure
+
+static int erasure_close(BlockBackend* backend)
+{
+    BlockErasureState* state = backend->state;
+    int ret, i;
+
+    ret = stripe_flush(state);
+    for (i = 0; i < state->k + state->m; i++) {
+        if (state->shards[i] != NULL && state->shards[i]->close(state->shards[i]) == -1) {
+            ret = -1;
+        }
+    }
+    block_memory_free(BLOCK_MEM_BUFFERS, state->stripe, (2 * state->k + state->m) * BLOCK_FRAME_SIZE);
+    free(state);
+    free(backend);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_backend_erasure
+// Description  : Open a backend striping the frames over K data backends with
+//                M parity backends
+//
+// Inputs       : shards - the K data backends then the M parity backends,
+//                         up to M of them NULL
+//                k - the number of data backends
+//                m - the number of parity backends
+// Outputs      : the backend, NULL on failure
+
+BlockBackend* block_backend_erasure(BlockBackend** shards, int k, int m)
+{
+    BlockBackend* backend;
+    BlockErasureState* state;
+    int i, j, missing = 0;
+
+    if (k < 1 || k > BLOCK_ERASURE_MAX_DATA || m < 1 || m > BLOCK_ERASURE_MAX_PARITY) {
+        return (NULL);
+    }
+    for (i = 0; i < k + m; i++) {
+        missing += (shards[i] == NULL);
+    }
+    if (missing > m) {
+        logMessage(LOG_ERROR_LEVEL, "%d of the %d shards are missing, at most %d can be", missing, k + m, m);
+        return (NULL);
+    }
+    pthread_once(&gfOnce, gf_init);
+    backend = malloc(sizeof(BlockBackend));
+    state = calloc(1, sizeof(BlockErasureState));
+    if (backend == NULL || state == NULL) {
+        free(backend);
+        free(state);
+        return (NULL);
+    }
+    state->stripe = block_memory_alloc(BLOCK_MEM_BUFFERS, (2 * k + m) * BLOCK_FRAME_SIZE);
+    if (state->stripe == NULL) {
+        free(backend);
+        free(state);
+        return (NULL);
+    }
+    state->scratch = state->stripe + (k + m) * BLOCK_FRAME_SIZE;
+    memcpy(state->shards, shards, (k + m) * sizeof(BlockBackend*));
+    state->k = k;
+    state->m = m;
+    state->open = -1;
+
+    // Cauchy matrix 1/(x_j + y_i) with distinct x_j = j and y_i = m + i,
+    // any K rows of the identity stacked on it are independent
+    for (j = 0; j < m; j++) {
+        for (i = 0; i < k; i++) {
+            state->coefs[j][i] = gf_inv(j ^ (m + i));
+        }
+    }
+    backend->name = "erasure";
+    backend->read = erasure_read;
+    backend->write = erasure_write;
+    backend->flush = erasure_flush;
+    backend->close = erasure_close;
+    backend->state = state;
+    return (backend);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_erasure_stats
+// Description  : Get the counters of an erasure coded backend
+//
+// Inputs       : backend - the backend
+//                stats - the structure to fill
+// Outputs      : 0 if successful, -1 if the backend is not erasure coded
+
+int block_erasure_stats(BlockBackend* backend, BlockErasureStats* stats)
+{
+    if (backend == NULL || backend->read != erasure_read) {
+        return (-1);
+    }
+    *stats = ((BlockErasureState*)backend->state)->stats;
+    return (0);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_frame
+// Description  : Fill a frame with the data the unit test writes to it
+//
+// Inputs       : frame - the frame
+//                frame_nr - the frame number
+//                version - the version of the frame
+// Outputs      : none
+
+static void unit_frame(char* frame, uint16_t frame_nr, int version)
+{
+    int i;
+    for (i = 0; i < BLOCK_FRAME_SIZE; i++) {
+        frame[i] = (char)(frame_nr * 13 + version * 5 + i * 3);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_open
+// Description  : Open the erasure coded backend of the unit test, over file
+//                backends in a directory
+//
+// Inputs       : dir - the directory of the shard files
+//                missing - bit mask of the shards left out
+//                shards - set to the shards opened (NULL if missing)
+// Outputs      : the backend, NULL on failure
+
+static BlockBackend* unit_open(const char* dir, uint32_t missing, BlockBackend** shards)
+{
+    BlockBackend* backend;
+    char path[64];
+    int i;
+
+    for (i = 0; i < BLOCK_UNIT_DATA + BLOCK_UNIT_PARITY; i++) {
+        snprintf(path, sizeof(path), "%s/shard%d", dir, i);
+        shards[i] = (missing & (1 << i)) ? NULL : block_backend_file(path);
+    }
+    if ((backend = block_backend_erasure(shards, BLOCK_UNIT_DATA, BLOCK_UNIT_PARITY)) == NULL) {
+        for (i = 0; i < BLOCK_UNIT_DATA + BLOCK_UNIT_PARITY; i++) {
+            if (shards[i] != NULL) {
+                shards[i]->close(shards[i]);
+            }
+        }
+    }
+    return (backend);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_reads
+// Description  : Check that the frames of the unit test read back as written
+//
+// Inputs       : backend - the erasure coded backend
+// Outputs      : 0 if they do, -1 otherwise
+
+static int unit_reads(BlockBackend* backend)
+{
+    char frame[BLOCK_FRAME_SIZE], expected[BLOCK_FRAME_SIZE];
+    uint32_t checksum, expected_checksum;
+    int i;
+
+    for (i = 0; i < BLOCK_UNIT_FRAMES; i++) {
+        unit_frame(expected, i, (i == BLOCK_UNIT_REWRITTEN) ? 1 : 0);
+        compute_frame_checksum(expected, &expected_checksum);
+        if (backend->read(backend, i, frame, &checksum) == -1 || checksum != expected_checksum
+            || memcmp(frame, expected, BLOCK_FRAME_SIZE) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Frame %d does not read back from the erasure coded backend.", i);
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_stored
+// Description  : Check whether a frame of the unit test is in the store, with
+//                the parity of its stripe: it is then rebuilt by another
+//                backend missing its shard
+//
+// Inputs       : dir - the directory of the shard files
+//                frame_nr - the frame
+//                expected - 1 if the frame should be in the store, else 0
+// Outputs      : 0 if it is as expected, -1 otherwise
+
+static int unit_stored(const char* dir, uint16_t frame_nr, int expected)
+{
+    BlockBackend* shards[BLOCK_UNIT_DATA + BLOCK_UNIT_PARITY];
+    BlockBackend* backend;
+    char frame[BLOCK_FRAME_SIZE], expected_frame[BLOCK_FRAME_SIZE];
+    uint32_t checksum;
+    int stored;
+
+    if ((backend = unit_open(dir, 1 << (frame_nr % BLOCK_UNIT_DATA), shards)) == NULL) {
+        return (-1);
+    }
+    unit_frame(expected_frame, frame_nr, 0);
+    stored = (backend->read(backend, frame_nr, frame, &checksum) == 0 && memcmp(frame, expected_frame, BLOCK_FRAME_SIZE) == 0);
+    backend->close(backend);
+    if (stored != expected) {
+        logMessage(LOG_ERROR_LEVEL, "Frame %u written %s is %sin the store.", frame_nr, expected ? "through" : "back",
+            stored ? "" : "not ");
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_erasure
+// Description  : Check the write-backs of whole and partial stripes, the
+//                writes through that reach the shards right away, and the
+//                reads with shards missing or bad, up to the parity shards
+//
+// Inputs       : dir - the directory of the shard files
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_erasure(const char* dir)
+{
+    BlockBackend* shards[BLOCK_UNIT_DATA + BLOCK_UNIT_PARITY];
+    BlockBackend* backend;
+    BlockErasureStats stats;
+    char frame[BLOCK_FRAME_SIZE];
+    uint32_t checksum;
+    uint16_t frame_nr;
+    int i, ret = 0;
+
+    // Two whole stripes and the start of a third written back, then a
+    // frame rewritten alone (read-modify-write)
+    if ((backend = unit_open(dir, 0, shards)) == NULL) {
+        return (-1);
+    }
+    block_backend_gather(1);
+    for (i = 0; i <= BLOCK_UNIT_FRAMES; i++) {
+        unit_frame(frame, (i < BLOCK_UNIT_FRAMES) ? i : BLOCK_UNIT_REWRITTEN, i / BLOCK_UNIT_FRAMES);
+        compute_frame_checksum(frame, &checksum);
+        if (backend->write(backend, (i < BLOCK_UNIT_FRAMES) ? i : BLOCK_UNIT_REWRITTEN, frame, checksum) == -1) {
+            ret = -1;
+        }
+    }
+    block_backend_gather(0);
+    if (backend->flush(backend) == -1) {
+        ret = -1;
+    }
+    block_erasure_stats(backend, &stats);
+    if (ret == 0 && (stats.full_stripes != 2 || stats.partial_stripes != 2)) {
+        logMessage(LOG_ERROR_LEVEL, "The erasure coded backend wrote %lu whole and %lu partial stripes.",
+            stats.full_stripes, stats.partial_stripes);
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = unit_reads(backend);
+    }
+
+    // A frame written through is in the store once written, with no stripe
+    // held or with another stripe held, a frame written back only once
+    // flushed
+    for (i = 0; i < 3 && ret == 0; i++) {
+        block_backend_gather(i == 1);
+        frame_nr = (i == 1) ? BLOCK_UNIT_HELD : BLOCK_UNIT_THROUGH + i / 2;
+        unit_frame(frame, frame_nr, 0);
+        compute_frame_checksum(frame, &checksum);
+        if (backend->write(backend, frame_nr, frame, checksum) == -1 || unit_stored(dir, frame_nr, i != 1) == -1) {
+            ret = -1;
+        }
+    }
+    block_backend_gather(0);
+    if (ret == 0 && (backend->flush(backend) == -1 || unit_stored(dir, BLOCK_UNIT_HELD, 1) == -1)) {
+        ret = -1;
+    }
+    backend->close(backend);
+
+    // A data and a parity shard missing, the frames of the data shard are
+    // rebuilt from the others
+    if (ret == 0 && (backend = unit_open(dir, (1 << 1) | (1 << BLOCK_UNIT_DATA), shards)) != NULL) {
+        ret = unit_reads(backend);
+        block_erasure_stats(backend, &stats);
+        if (ret == 0 && stats.reconstructions == 0) {
+            logMessage(LOG_ERROR_LEVEL, "The frames of the missing shard were not rebuilt.");
+            ret = -1;
+        }
+        backend->close(backend);
+    } else {
+        ret = -1;
+    }
+
+    // Two data frames of a stripe bad, they are rebuilt and repaired
+    if (ret == 0 && (backend = unit_open(dir, 0, shards)) != NULL) {
+        memset(frame, 0xff, BLOCK_FRAME_SIZE);
+        shards[0]->write(shards[0], 0, frame, 0);
+        shards[2]->write(shards[2], 0, frame, 0);
+        ret = unit_reads(backend);
+        block_erasure_stats(backend, &stats);
+        if (ret == 0 && (stats.reconstructions != 2 || stats.repairs != 2
+                            || shards[0]->read(shards[0], 0, frame, &checksum) == -1)) {
+            logMessage(LOG_ERROR_LEVEL, "The bad frames of the stripe were not rebuilt and repaired.");
+            ret = -1;
+        }
+
+        // More frames lost than there are parity shards
+        for (i = 0; i <= BLOCK_UNIT_PARITY; i++) {
+            shards[i]->write(shards[i], 1, frame, 0);
+        }
+        if (ret == 0 && backend->read(backend, BLOCK_UNIT_DATA, frame, &checksum) != -1) {
+            logMessage(LOG_ERROR_LEVEL, "A frame of a stripe with too many shards lost was read.");
+            ret = -1;
+        }
+        backend->close(backend);
+    } else {
+        ret = -1;
+    }
+
+    // No more shards may be missing than there are parity shards
+    if (ret == 0 && (backend = unit_open(dir, (1 << (BLOCK_UNIT_PARITY + 1)) - 1, shards)) != NULL) {
+        logMessage(LOG_ERROR_LEVEL, "An erasure coded backend was opened with too many shards missing.");
+        backend->close(backend);
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_kernel
+// Description  : Check the region kernel picked for the CPU against the
+//                scalar one, on a length that is not a multiple of the vectors
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_kernel(void)
+{
+    uint8_t src[BLOCK_FRAME_SIZE + 13], fast[BLOCK_FRAME_SIZE + 13], scalar[BLOCK_FRAME_SIZE + 13];
+    int c;
+    size_t i;
+
+    pthread_once(&gfOnce, gf_init);
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = (uint8_t)(i * 37 + 11);
+    }
+    for (c = 0; c < 256; c += 17) {
+        memset(fast, 0x5a, sizeof(fast));
+        memset(scalar, 0x5a, sizeof(scalar));
+        gfMulAdd(fast, src, c, sizeof(src));
+        gf_muladd_scalar(scalar, src, c, sizeof(src));
+        if (memcmp(fast, scalar, sizeof(src)) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "The GF(2^8) region kernel differs from the scalar one for %d.", c);
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockErasureUnitTest
+// Description  : Run a UNIT test checking the erasure coded backend
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockErasureUnitTest(void)
+{
+    char dir[32];
+    int ret;
+
+    if (unit_kernel() == -1 || unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    ret = unit_erasure(dir);
+    unitCleanup(dir);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Erasure unit test failed.");
+        return (-1);
+    }
+
+    // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Erasure unit test completed successfully.");
+    return (0);
+}
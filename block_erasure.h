@@ -0,0 +1,52 @@
+#ifndef BLOCK_ERASURE_INCLUDED
+#define BLOCK_ERASURE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_erasure.h
+//  Description    : This is the header file for the erasure coded backend of
+//                   the BLOCK memory system driver. The frames are striped
+//                   over K data backends, and M parity backends keep a
+//                   Reed-Solomon code of each stripe so that any M backends
+//                   can be lost.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_backend.h>
+
+// Defines
+#define BLOCK_ERASURE_MAX_DATA 12 // Most data backends in a stripe
+#define BLOCK_ERASURE_MAX_PARITY 4 // Most parity backends in a stripe
+
+// Counters of an erasure coded backend
+typedef struct {
+    uint64_t reads; // Frames read from their data backend
+    uint64_t reconstructions; // Frames rebuilt from the rest of their stripe
+    uint64_t repairs; // Rebuilt frames written back to their data backend
+    uint64_t full_stripes; // Stripes written whole, without reading
+    uint64_t partial_stripes; // Stripes written in part (read-modify-write)
+    uint64_t stripe_reads; // Frames read to write partial stripes
+} BlockErasureStats;
+
+//
+// Functional Prototypes
+
+BlockBackend* block_backend_erasure(BlockBackend** shards, int k, int m);
+// Open a backend striping the frames over the "k" data backends of "shards",
+// followed by "m" parity backends. Up to "m" of them may be NULL (missing).
+// The backend owns the shards.
+
+int block_erasure_stats(BlockBackend* backend, BlockErasureStats* stats);
+// Get the counters of an erasure coded backend
+
+//
+// Unit test
+
+int blockErasureUnitTest(void);
+// Run a UNIT test checking the erasure coded backend
+
+#endif
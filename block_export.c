@@ -0,0 +1,524 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_export.c
+//  Description    : This is the implementation of the incremental export of
+//                   the BLOCK memory system. Only the frames written since the
+//                   previous export are streamed, a frame at a time so that
+//                   the driver calls are not held for the whole export. The
+//                   file table is written at poweroff, so the file entries
+//                   exported are those of the last poweroff. An export is
+//                   applied to a replica by writing its frames as they are.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Project includes
+#include <block_backend.h>
+#include <block_driver_helper.h>
+#include <block_export.h>
+#include <block_memory.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define BLOCK_UNIT_SOURCE "source.bin" // Frame file of the store the unit test exports
+#define BLOCK_UNIT_REPLICA "replica.bin" // Frame file of the store the exports are applied to
+#define BLOCK_UNIT_FULL "full.bkx" // Export of the whole store
+#define BLOCK_UNIT_CHANGES "changes.bkx" // Export of the frames changed after the full export
+#define BLOCK_UNIT_FILES 3 // Files of the unit test
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_export
+// Description  : Write the frames written since a generation to a file. The
+//                frames written during the export may be exported too, the
+//                next export starts from the generation in the header.
+//
+// Inputs       : path - the export to create
+//                since - the generation of the previous export (0 for all)
+//                frames - set to the number of frames exported
+//                nr_files - set to the number of files with frames exported
+// Outputs      : 0 if successful, -1 if failure
+
+int block_export(const char* path, uint32_t since, uint32_t* frames, uint32_t* nr_files)
+{
+    BlockExportHeader header;
+    BlockExportFrame entry;
+    BlockExportOwner owner;
+    BlockOwners* owners;
+    BlockChange* changes;
+    uint8_t seen[BLOCK_MAX_TOTAL_FILES];
+    frame_t frame;
+    uint32_t cursor = 0;
+    int32_t found, i, j, k;
+    FILE* fh;
+    int ret = 0;
+
+    *frames = 0;
+    *nr_files = 0;
+    if ((fh = fopen(path, "wb")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure creating the export [%s]", path);
+        return (-1);
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = BLOCK_EXPORT_MAGIC;
+    header.version = BLOCK_EXPORT_VERSION;
+    header.flags = (since < block_format_generation()) ? BLOCK_EXPORT_FULL : 0;
+    header.since = since;
+    header.generation = block_generation();
+    if (fwrite(&header, sizeof(header), 1, fh) != 1) {
+        fclose(fh);
+        return (-1);
+    }
+
+    // The owners are mapped once, the files of the frames written during the
+    // export are those when it started
+    changes = block_memory_alloc(BLOCK_MEM_BUFFERS, sizeof(BlockChange) * BLOCK_EXPORT_BATCH);
+    if (changes == NULL || (owners = block_owners()) == NULL) {
+        block_memory_free(BLOCK_MEM_BUFFERS, changes, sizeof(BlockChange) * BLOCK_EXPORT_BATCH);
+        fclose(fh);
+        return (-1);
+    }
+    memset(seen, 0, sizeof(seen));
+    while (ret == 0 && (found = block_changed_since(since, owners, &cursor, changes, BLOCK_EXPORT_BATCH)) > 0) {
+        for (i = 0; i < found && ret == 0; i = j) {
+            // The entries of a shared frame follow each other, its content
+            // is written once with all its owners
+            for (j = i + 1; j < found && changes[j].frame == changes[i].frame; j++) {
+            }
+            if (block_read_frame(changes[i].frame, frame) == -1) {
+                ret = -1;
+                break;
+            }
+            entry.frame = changes[i].frame;
+            entry.owners = (changes[i].file >= 0) ? j - i : 0;
+            entry.generation = changes[i].generation;
+            if (fwrite(&entry, sizeof(entry), 1, fh) != 1 || fwrite(frame, BLOCK_FRAME_SIZE, 1, fh) != 1) {
+                ret = -1;
+            }
+            for (k = i; k < i + entry.owners && ret == 0; k++) {
+                owner.file = changes[k].file;
+                owner.index = changes[k].index;
+                if (fwrite(&owner, sizeof(owner), 1, fh) != 1) {
+                    ret = -1;
+                }
+                if (!seen[owner.file]) {
+                    seen[owner.file] = 1;
+                    (*nr_files)++;
+                }
+            }
+            if (ret == -1) {
+                logMessage(LOG_ERROR_LEVEL, "Failure writing the export [%s]", path);
+            }
+            (*frames)++;
+        }
+    }
+    if (found < 0) {
+        ret = -1;
+    }
+    block_owners_free(owners);
+    block_memory_free(BLOCK_MEM_BUFFERS, changes, sizeof(BlockChange) * BLOCK_EXPORT_BATCH);
+    if (fclose(fh) != 0) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_export_apply
+// Description  : Write the frames of an export to the store, the store is
+//                emptied first if the export is a full one. The frames are
+//                written as they are, with the file table entries.
+//
+// Inputs       : path - the export to apply
+//                frames - set to the number of frames written
+// Outputs      : 0 if successful, -1 if failure
+
+int block_export_apply(const char* path, uint32_t* frames)
+{
+    BlockExportHeader header;
+    BlockExportFrame entry;
+    frame_t frame;
+    FILE* fh;
+    int ret = 0;
+
+    *frames = 0;
+    if ((fh = fopen(path, "rb")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the export [%s]", path);
+        return (-1);
+    }
+    if (fread(&header, sizeof(header), 1, fh) != 1 || header.magic != BLOCK_EXPORT_MAGIC
+        || header.version != BLOCK_EXPORT_VERSION) {
+        logMessage(LOG_ERROR_LEVEL, "The export [%s] is not a valid export", path);
+        fclose(fh);
+        return (-1);
+    }
+    if ((header.flags & BLOCK_EXPORT_FULL) && block_format() == -1) {
+        fclose(fh);
+        return (-1);
+    }
+    while (fread(&entry, sizeof(entry), 1, fh) == 1) {
+        if (fread(frame, BLOCK_FRAME_SIZE, 1, fh) != 1
+            || fseek(fh, (long)entry.owners * sizeof(BlockExportOwner), SEEK_CUR) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "The export [%s] is cut short", path);
+            ret = -1;
+            break;
+        }
+        if (block_apply_frame(entry.frame, frame) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failure applying frame %u of the export [%s]", entry.frame, path);
+            ret = -1;
+            break;
+        }
+        (*frames)++;
+    }
+    if (ret == 0 && ferror(fh)) {
+        ret = -1;
+    }
+    fclose(fh);
+    return (ret);
+}
+
+//
+// Unit test
+
+// Files of the unit test, a file of three frames and two small files sharing
+// a fragment frame
+static char* unitNames[BLOCK_UNIT_FILES] = {"big", "small0", "small1"};
+static int32_t unitSizes[BLOCK_UNIT_FILES] = {3 * BLOCK_FRAME_SIZE, 100, 300};
+static int32_t unitChanged[BLOCK_UNIT_FILES] = {BLOCK_FRAME_SIZE + 100, -1, 50}; // Offset changed (-1 if none)
+static int32_t unitChangedSize[BLOCK_UNIT_FILES] = {100, 0, 10};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_content
+// Description  : Fill a buffer with the content of a file of the unit test,
+//                before or after the change made after the full export
+//
+// Inputs       : buf - the buffer
+//                file - the index of the file
+//                changed - 1 for the content after the change
+// Outputs      : none
+
+static void unit_content(char* buf, int file, int changed)
+{
+    int32_t i;
+
+    for (i = 0; i < unitSizes[file]; i++) {
+        buf[i] = 'a' + (i * 5 + file) % 26;
+    }
+    if (changed && unitChanged[file] != -1) {
+        memset(&buf[unitChanged[file]], 'Z', unitChangedSize[file]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_matches
+// Description  : Check that the files of the unit test hold their content
+//
+// Inputs       : changed - 1 for the content after the change
+// Outputs      : 0 if they do, -1 otherwise
+
+static int unit_matches(int changed)
+{
+    char data[3 * BLOCK_FRAME_SIZE + 1], expected[3 * BLOCK_FRAME_SIZE];
+    int16_t fd;
+    int i, ret = 0;
+
+    for (i = 0; i < BLOCK_UNIT_FILES; i++) {
+        unit_content(expected, i, changed);
+        if ((fd = block_open(unitNames[i])) == -1 || block_read(fd, data, unitSizes[i] + 1) != unitSizes[i]
+            || memcmp(data, expected, unitSizes[i]) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Export unit test: file %s does not hold its content.", unitNames[i]);
+            ret = -1;
+        }
+        if (fd != -1) {
+            block_close(fd);
+        }
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_parse
+// Description  : Read an export back, each frame must be in it once, and
+//                the fragment frame with both its owners
+//
+// Inputs       : path - the export
+//                fragment - the fragment frame of the small files
+//                header - filled with the header of the export
+//                frames - set to the number of frames of the export
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_parse(const char* path, uint16_t fragment, BlockExportHeader* header, uint32_t* frames)
+{
+    BlockExportFrame entry;
+    BlockExportOwner owners[BLOCK_UNIT_FILES];
+    uint8_t* seen = calloc(BLOCK_BLOCK_SIZE, 1);
+    frame_t frame;
+    FILE* fh;
+    int ret = 0, shared = 0;
+
+    *frames = 0;
+    if (seen == NULL || (fh = fopen(path, "rb")) == NULL) {
+        free(seen);
+        return (-1);
+    }
+    if (fread(header, sizeof(BlockExportHeader), 1, fh) != 1 || header->magic != BLOCK_EXPORT_MAGIC) {
+        ret = -1;
+    }
+    while (ret == 0 && fread(&entry, sizeof(entry), 1, fh) == 1) {
+        if (seen[entry.frame] || entry.owners > BLOCK_UNIT_FILES || fread(frame, BLOCK_FRAME_SIZE, 1, fh) != 1
+            || (entry.owners > 0 && fread(owners, sizeof(BlockExportOwner), entry.owners, fh) != entry.owners)) {
+            logMessage(LOG_ERROR_LEVEL, "Export unit test: frame %u is exported twice or cut short.", entry.frame);
+            ret = -1;
+            break;
+        }
+        seen[entry.frame] = 1;
+        (*frames)++;
+        if (entry.frame == fragment) {
+            shared = (entry.owners == 2 && owners[0].index == 0 && owners[1].index == 0 && owners[0].file != owners[1].file);
+        }
+    }
+    if (ret == 0 && !shared) {
+        logMessage(LOG_ERROR_LEVEL, "Export unit test: the fragment frame is not exported once with its two owners.");
+        ret = -1;
+    }
+    fclose(fh);
+    free(seen);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_write
+// Description  : Session of the unit test writing the files of the store
+//                exported
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_write(void)
+{
+    char data[3 * BLOCK_FRAME_SIZE];
+    int16_t fd;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_SOURCE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    for (i = 0; i < BLOCK_UNIT_FILES && ret == 0; i++) {
+        unit_content(data, i, 0);
+        if ((fd = block_open(unitNames[i])) == -1 || block_write(fd, data, unitSizes[i]) != unitSizes[i]
+            || block_close(fd) == -1) {
+            ret = -1;
+        }
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_changes
+// Description  : Session of the unit test exporting the whole store, then
+//                changing a frame of the big file (write-back) and the
+//                fragment frame, and checking the frames listed as changed
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_changes(void)
+{
+    BlockExportHeader header;
+    BlockOwners* owners;
+    BlockChange changes[8];
+    char data[3 * BLOCK_FRAME_SIZE];
+    uint16_t big[3], fragment;
+    uint32_t cursor = 0, frames, nr_files;
+    int16_t fd;
+    int32_t found;
+    int i, ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_SOURCE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    if (block_file_frames(unitNames[0], big, 3) != 3 || block_file_frames(unitNames[1], &fragment, 1) != 1
+        || block_export(BLOCK_UNIT_FULL, 0, &frames, &nr_files) == -1 || nr_files != BLOCK_UNIT_FILES
+        || unit_parse(BLOCK_UNIT_FULL, fragment, &header, &frames) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Export unit test: the store was not exported.");
+        block_poweroff();
+        return (-1);
+    }
+
+    // Nothing changed since the export
+    if (block_changed_since(header.generation, NULL, &cursor, changes, 8) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Export unit test: frames listed as changed after the export.");
+        ret = -1;
+    }
+    for (i = 0; i < BLOCK_UNIT_FILES && ret == 0; i++) {
+        if (unitChanged[i] == -1) {
+            continue;
+        }
+        unit_content(data, i, 1);
+        if ((fd = block_open_policy(unitNames[i], (i == 0) ? BLOCK_WRITE_BACK : BLOCK_WRITE_THROUGH)) == -1
+            || block_seek(fd, unitChanged[i]) == -1
+            || block_write(fd, &data[unitChanged[i]], unitChangedSize[i]) != unitChangedSize[i] || block_close(fd) == -1) {
+            ret = -1;
+        }
+    }
+
+    // The dirty frame of the big file is listed, and the fragment frame once
+    // for each small file (once with no owners)
+    cursor = 0;
+    if (ret == 0 && (found = block_changed_since(header.generation, NULL, &cursor, changes, 8)) != 2) {
+        logMessage(LOG_ERROR_LEVEL, "Export unit test: %d frames listed as changed instead of 2.", found);
+        ret = -1;
+    }
+    cursor = 0;
+    if (ret == 0 && (owners = block_owners()) != NULL) {
+        found = block_changed_since(header.generation, owners, &cursor, changes, 8);
+        block_owners_free(owners);
+        for (i = 0; i < found; i++) {
+            if (!(changes[i].frame == big[1] && changes[i].index == 1)
+                && !(changes[i].frame == fragment && changes[i].index == 0)) {
+                found = -1;
+                break;
+            }
+        }
+        if (found != 3) {
+            logMessage(LOG_ERROR_LEVEL, "Export unit test: the changed frames were not listed with their owners.");
+            ret = -1;
+        }
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_export_changes
+// Description  : Session of the unit test exporting the frames changed after
+//                the full export
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_export_changes(void)
+{
+    BlockExportHeader full, header;
+    uint32_t frames, all, nr_files;
+    uint16_t fragment;
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_SOURCE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    if (block_file_frames(unitNames[1], &fragment, 1) != 1 || unit_parse(BLOCK_UNIT_FULL, fragment, &full, &all) == -1
+        || block_export(BLOCK_UNIT_CHANGES, full.generation, &frames, &nr_files) == -1
+        || unit_parse(BLOCK_UNIT_CHANGES, fragment, &header, &frames) == -1 || frames >= all
+        || (header.flags & BLOCK_EXPORT_FULL)) {
+        logMessage(LOG_ERROR_LEVEL, "Export unit test: the changes were not exported on their own.");
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_apply
+// Description  : Session of the unit test applying the full export to an
+//                empty replica, then the changes
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_apply(void)
+{
+    uint32_t frames;
+    int ret = 0;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_REPLICA)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    if (block_export_apply(BLOCK_UNIT_FULL, &frames) == -1 || unit_matches(0) == -1
+        || block_export_apply(BLOCK_UNIT_CHANGES, &frames) == -1 || unit_matches(1) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Export unit test: the exports applied do not hold the files.");
+        ret = -1;
+    }
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_replica
+// Description  : Session of the unit test mounting the replica again
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_replica(void)
+{
+    int ret;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_REPLICA)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    ret = unit_matches(1);
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockExportUnitTest
+// Description  : Run a UNIT test listing the frames changed after an export,
+//                exporting them and applying the exports to a replica
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockExportUnitTest(void)
+{
+    char dir[32];
+    int ret = 0;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    if (unitSession(dir, unit_write) == -1 || unitSession(dir, unit_changes) == -1
+        || unitSession(dir, unit_export_changes) == -1 || unitSession(dir, unit_apply) == -1
+        || unitSession(dir, unit_replica) == -1) {
+        ret = -1;
+    }
+    unitCleanup(dir);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Export unit test failed.");
+        return (-1);
+    }
+
+    // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Export unit test completed successfully.");
+    return (0);
+}
@@ -0,0 +1,66 @@
+#ifndef BLOCK_EXPORT_INCLUDED
+#define BLOCK_EXPORT_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_export.h
+//  Description    : This is the header file for the incremental export of the
+//                   BLOCK memory system, a stream of the frames written since
+//                   a generation of the store.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_driver.h>
+
+// Defines
+#define BLOCK_EXPORT_MAGIC 0x584b4c42 // "BLKX"
+#define BLOCK_EXPORT_VERSION 2
+#define BLOCK_EXPORT_FULL 0x1 // The store was formatted since, apply to an empty store
+#define BLOCK_EXPORT_BATCH 256 // Frames listed at a time
+
+// Header at the start of an export, followed by the frames exported
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags; // BLOCK_EXPORT_FULL if the store must be emptied first
+    uint32_t since; // Generation the export starts from
+    uint32_t generation; // Generation of the store when the export started
+} BlockExportHeader;
+
+// Frame of an export, followed by its content and then by its owners (a
+// frame shared by several files is written once)
+typedef struct {
+    uint16_t frame; // Frame number in the store
+    uint16_t owners; // Owners that follow the content (0 if none)
+    uint32_t generation; // Generation the frame was last written in
+} BlockExportFrame;
+
+// Owner of a frame of an export
+typedef struct {
+    int16_t file; // File owning the frame
+    int16_t index; // Index of the frame in the file (-1 for the file table entry)
+} BlockExportOwner;
+
+//
+// Functional Prototypes
+
+int block_export(const char* path, uint32_t since, uint32_t* frames, uint32_t* nr_files);
+// Write the frames written since generation "since" to "path", and set
+// "frames" and "nr_files" to the number of frames and files exported
+
+int block_export_apply(const char* path, uint32_t* frames);
+// Write the frames of the export "path" to the store, which must hold the
+// store the export starts from (or be emptied first for a full export), and
+// set "frames" to the number of frames written. No file may be open.
+
+//
+// Unit test
+
+int blockExportUnitTest(void);
+// Run a UNIT test checking the changed frames and the exports applied
+
+#endif
@@ -0,0 +1,393 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_layout.c
+//  Description    : This is the implementation of the frame layout optimizer
+//                   of the BLOCK memory system. The recording is followed
+//                   handle by handle to get the frames read and written, in
+//                   order. Each pair of frames accessed one after the other is
+//                   an edge weighted by how often it occurs, and the edges are
+//                   taken heaviest first to join the frames into chains (as
+//                   code layout does with basic blocks). The chains are laid
+//                   out in the order they are first accessed.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Project includes
+#include <block_driver.h>
+#include <block_layout.h>
+#include <block_record.h>
+#include <cmpsc311_log.h>
+
+// A handle of the recording
+typedef struct {
+    uint16_t* frames; // Frames of the file (NULL if the handle is not open)
+    int32_t nrFrames;
+    int32_t loc;
+} LayoutHandle;
+
+// An edge between two frames accessed one after the other
+typedef struct {
+    uint32_t pair; // Frame accessed first in the high half, next in the low half
+    uint32_t weight; // Times it occurs
+} LayoutEdge;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layout_access
+// Description  : Add a frame access to the sequence, growing it as needed
+//
+// Inputs       : seq - the sequence
+//                n - the number of accesses in the sequence
+//                size - the number of accesses that fit in the sequence
+//                frame_nr - the frame accessed
+// Outputs      : 0 if successful, -1 if failure
+
+static int layout_access(uint16_t** seq, uint32_t* n, uint32_t* size, uint16_t frame_nr)
+{
+    uint16_t* grown;
+
+    // Accesses to the same frame in a row move nothing
+    if (*n > 0 && (*seq)[*n - 1] == frame_nr) {
+        return (0);
+    }
+    if (*n == *size) {
+        *size = (*size == 0) ? 4096 : *size * 2;
+        if ((grown = realloc(*seq, sizeof(uint16_t) * *size)) == NULL) {
+            return (-1);
+        }
+        *seq = grown;
+    }
+    (*seq)[(*n)++] = frame_nr;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layout_trace
+// Description  : Follow the handles of a recording to get the frames of the
+//                store it reads and writes, in order. The files are looked up
+//                in the store as it is now, files no longer there are skipped.
+//
+// Inputs       : recording - the recording
+//                seq - set to the frames accessed (to free)
+//                n - set to the number of frames accessed
+// Outputs      : 0 if successful, -1 if failure
+
+static int layout_trace(const char* recording, uint16_t** seq, uint32_t* n)
+{
+    LayoutHandle* handles;
+    LayoutHandle* h;
+    BlockRecordHeader header;
+    BlockRecordEntry entry;
+    FILE* fhandle;
+    char* data;
+    uint32_t size = 0;
+    int32_t idx, last;
+    int ret = 0, got, i;
+
+    *seq = NULL;
+    *n = 0;
+    if (block_record_open(recording, &fhandle, &header) == -1) {
+        return (-1);
+    }
+    data = malloc(BLOCK_MAX_FRAME_PER_FILE * BLOCK_FRAME_SIZE + 1);
+    handles = calloc(BLOCK_MAX_TOTAL_FILES, sizeof(LayoutHandle));
+    if (data == NULL || handles == NULL) {
+        free(data);
+        free(handles);
+        fclose(fhandle);
+        return (-1);
+    }
+    while (ret == 0 && (got = block_record_next(fhandle, &entry, data, BLOCK_MAX_FRAME_PER_FILE * BLOCK_FRAME_SIZE + 1)) == 1) {
+        if (entry.fd < 0 || entry.fd >= BLOCK_MAX_TOTAL_FILES || entry.result == -1) {
+            continue;
+        }
+        h = &handles[entry.fd];
+        switch (entry.op) {
+        case BLOCK_RECORD_OPEN:
+            data[entry.length] = '\0';
+            free(h->frames);
+            h->frames = malloc(sizeof(uint16_t) * BLOCK_MAX_FRAME_PER_FILE);
+            h->nrFrames = (h->frames != NULL) ? block_file_frames(data, h->frames, BLOCK_MAX_FRAME_PER_FILE) : -1;
+            h->loc = 0;
+            if (h->nrFrames == -1) {
+                free(h->frames);
+                h->frames = NULL;
+            }
+            break;
+
+        case BLOCK_RECORD_CLOSE:
+            free(h->frames);
+            h->frames = NULL;
+            break;
+
+        case BLOCK_RECORD_SEEK:
+            // A seek the driver refused did not move the handle
+            h->loc = (entry.arg >= 0) ? entry.arg : h->loc;
+            break;
+
+        case BLOCK_RECORD_READ:
+        case BLOCK_RECORD_WRITE:
+            if (h->frames == NULL || entry.result <= 0) {
+                break;
+            }
+            last = (h->loc + entry.result - 1) / BLOCK_FRAME_SIZE;
+            for (idx = h->loc / BLOCK_FRAME_SIZE; idx <= last && idx < h->nrFrames && ret == 0; idx++) {
+                ret = layout_access(seq, n, &size, h->frames[idx]);
+            }
+            h->loc += entry.result;
+            break;
+        }
+    }
+    if (got == -1) {
+        ret = -1;
+    }
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        free(handles[i].frames);
+    }
+    free(handles);
+    free(data);
+    fclose(fhandle);
+    if (ret == -1) {
+        free(*seq);
+        *seq = NULL;
+        *n = 0;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layout_measure
+// Description  : Count the accesses of a sequence that break a run of frames,
+//                and the distance between the frames accessed
+//
+// Inputs       : seq - the frames accessed
+//                n - the number of frames accessed
+//                breaks - set to the accesses not to the frame following the
+//                         previous one
+//                distance - set to the sum of the distances
+// Outputs      : none
+
+static void layout_measure(const uint16_t* seq, uint32_t n, uint32_t* breaks, uint64_t* distance)
+{
+    uint32_t i;
+
+    *breaks = 0;
+    *distance = 0;
+    for (i = 1; i < n; i++) {
+        *breaks += (seq[i] != seq[i - 1] + 1);
+        *distance += (seq[i] > seq[i - 1]) ? seq[i] - seq[i - 1] : seq[i - 1] - seq[i];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layout_compare_pairs, layout_compare_edges,
+//                layout_compare_chains
+// Description  : Order the pairs of frames, the edges by decreasing weight
+//                and the chains by first access, for qsort
+//
+// Inputs       : a, b - the entries to compare
+// Outputs      : -1, 0 or 1
+
+static int layout_compare_pairs(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return ((x > y) - (x < y));
+}
+
+static int layout_compare_edges(const void* a, const void* b)
+{
+    const LayoutEdge* x = a;
+    const LayoutEdge* y = b;
+    if (x->weight != y->weight) {
+        return ((x->weight < y->weight) - (x->weight > y->weight));
+    }
+    return ((x->pair > y->pair) - (x->pair < y->pair));
+}
+
+static int layout_compare_chains(const void* a, const void* b)
+{
+    // Chains are sorted as (first access << 16 | head frame)
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return ((x > y) - (x < y));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layout_chain_root
+// Description  : Find the chain a frame was joined to, flattening the path
+//
+// Inputs       : root - the chain of each frame
+//                frame_nr - the frame
+// Outputs      : the chain
+
+static int32_t layout_chain_root(int32_t* root, int32_t frame_nr)
+{
+    int32_t r = frame_nr, next;
+
+    while (root[r] != r) {
+        r = root[r];
+    }
+    while (root[frame_nr] != r) {
+        next = root[frame_nr];
+        root[frame_nr] = r;
+        frame_nr = next;
+    }
+    return (r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layout_order
+// Description  : Join the frames of a sequence into chains, heaviest edges
+//                first, and list the chains in the order of their first
+//                access
+//
+// Inputs       : seq - the frames accessed
+//                n - the number of frames accessed
+//                order - the frames in their new order (BLOCK_BLOCK_SIZE)
+//                stats - the counters to fill
+// Outputs      : the number of frames in order, -1 if failure
+
+static int32_t layout_order(const uint16_t* seq, uint32_t n, uint16_t* order, BlockLayoutStats* stats)
+{
+    uint32_t* pairs;
+    LayoutEdge* edges;
+    int32_t* next;
+    int32_t* prev;
+    int32_t* root;
+    int32_t* first;
+    uint64_t* chains;
+    uint32_t i, nbPairs = 0, nbEdges = 0, nbChains = 0;
+    int32_t a, b, f, earliest, nbOrder = 0;
+
+    pairs = malloc(sizeof(uint32_t) * (n + 1));
+    edges = malloc(sizeof(LayoutEdge) * (n + 1));
+    next = malloc(sizeof(int32_t) * 4 * BLOCK_BLOCK_SIZE);
+    chains = malloc(sizeof(uint64_t) * BLOCK_BLOCK_SIZE);
+    if (pairs == NULL || edges == NULL || next == NULL || chains == NULL) {
+        free(pairs);
+        free(edges);
+        free(next);
+        free(chains);
+        return (-1);
+    }
+    prev = next + BLOCK_BLOCK_SIZE;
+    root = prev + BLOCK_BLOCK_SIZE;
+    first = root + BLOCK_BLOCK_SIZE;
+
+    // Weigh each pair of frames accessed one after the other
+    for (i = 1; i < n; i++) {
+        pairs[nbPairs++] = ((uint32_t)seq[i - 1] << 16) | seq[i];
+    }
+    qsort(pairs, nbPairs, sizeof(uint32_t), layout_compare_pairs);
+    for (i = 0; i < nbPairs; i++) {
+        if (nbEdges > 0 && edges[nbEdges - 1].pair == pairs[i]) {
+            edges[nbEdges - 1].weight++;
+        } else {
+            edges[nbEdges].pair = pairs[i];
+            edges[nbEdges++].weight = 1;
+        }
+    }
+    qsort(edges, nbEdges, sizeof(LayoutEdge), layout_compare_edges);
+
+    // Join the tail of a chain to the head of another, heaviest edges first
+    for (f = 0; f < BLOCK_BLOCK_SIZE; f++) {
+        next[f] = prev[f] = first[f] = -1;
+        root[f] = f;
+    }
+    for (i = 0; i < n; i++) {
+        if (first[seq[i]] == -1) {
+            first[seq[i]] = i;
+            stats->frames++;
+        }
+    }
+    for (i = 0; i < nbEdges; i++) {
+        a = edges[i].pair >> 16;
+        b = edges[i].pair & 0xffff;
+        if (next[a] == -1 && prev[b] == -1 && layout_chain_root(root, a) != layout_chain_root(root, b)) {
+            next[a] = b;
+            prev[b] = a;
+            root[layout_chain_root(root, b)] = layout_chain_root(root, a);
+        }
+    }
+
+    // Lay the chains out by their first access
+    for (f = 0; f < BLOCK_BLOCK_SIZE; f++) {
+        if (first[f] != -1 && prev[f] == -1) {
+            earliest = first[f];
+            for (a = next[f]; a != -1; a = next[a]) {
+                earliest = (first[a] < earliest) ? first[a] : earliest;
+            }
+            chains[nbChains++] = ((uint64_t)earliest << 16) | f;
+        }
+    }
+    qsort(chains, nbChains, sizeof(uint64_t), layout_compare_chains);
+    for (i = 0; i < nbChains; i++) {
+        for (a = chains[i] & 0xffff; a != -1; a = next[a]) {
+            order[nbOrder++] = a;
+        }
+    }
+    stats->chains = nbChains;
+
+    free(pairs);
+    free(edges);
+    free(next);
+    free(chains);
+    return (nbOrder);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_layout_optimize
+// Description  : Lay out the frames of the store by the accesses of a
+//                recording, then follow the recording again to measure the
+//                new layout
+//
+// Inputs       : recording - the recording
+//                stats - the counters to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int block_layout_optimize(const char* recording, BlockLayoutStats* stats)
+{
+    uint16_t* seq;
+    uint16_t* order;
+    uint32_t n;
+    int32_t nbOrder, moved;
+
+    memset(stats, 0, sizeof(BlockLayoutStats));
+    if (layout_trace(recording, &seq, &n) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed following the recording [%s]", recording);
+        return (-1);
+    }
+    stats->accesses = n;
+    layout_measure(seq, n, &stats->breaks_before, &stats->distance_before);
+    order = malloc(sizeof(uint16_t) * BLOCK_BLOCK_SIZE);
+    nbOrder = (order != NULL) ? layout_order(seq, n, order, stats) : -1;
+    free(seq);
+    if (nbOrder == -1 || (moved = block_relayout(order, nbOrder)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Failed laying out the store");
+        free(order);
+        return (-1);
+    }
+    stats->moved = moved;
+    free(order);
+
+    if (layout_trace(recording, &seq, &n) == -1) {
+        return (-1);
+    }
+    layout_measure(seq, n, &stats->breaks_after, &stats->distance_after);
+    free(seq);
+    return (0);
+}
@@ -0,0 +1,38 @@
+#ifndef BLOCK_LAYOUT_INCLUDED
+#define BLOCK_LAYOUT_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_layout.h
+//  Description    : This is the header file for the frame layout optimizer of
+//                   the BLOCK memory system. The frames accessed one after the
+//                   other in a recording are laid out next to each other, so
+//                   that the store is laid out the way it is read.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+// Counters of a layout
+typedef struct {
+    uint32_t accesses; // Frame accesses in the recording (repeats of a frame counted once)
+    uint32_t frames; // Distinct frames accessed
+    uint32_t chains; // Chains of frames accessed one after the other
+    uint32_t moved; // Frames moved
+    uint32_t breaks_before; // Accesses not to the frame following the previous one, before
+    uint32_t breaks_after; // and after the layout
+    uint64_t distance_before; // Sum of the distances between the frames accessed, before
+    uint64_t distance_after; // and after the layout
+} BlockLayoutStats;
+
+//
+// Functional Prototypes
+
+int block_layout_optimize(const char* recording, BlockLayoutStats* stats);
+// Lay out the frames of the store (powered on) by the accesses of the
+// recording, the frames most often accessed one after the other first
+// placed next to each other
+
+#endif
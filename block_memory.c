@@ -0,0 +1,439 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_memory.c
+//  Description    : This is the implementation of the memory accounting of the
+//                   BLOCK memory system driver and its memory budget.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_cache.h>
+#include <block_memory.h>
+#include <cmpsc311_log.h>
+
+// Global data, updated atomically as any thread can allocate
+uint64_t memoryBytes[BLOCK_MEM_MAXVAL]; // Bytes used by each subsystem
+uint64_t othersBytes = 0; // Bytes used outside the cache
+uint64_t othersLimit = 0; // Bytes outside the cache the cache bound leaves room for
+uint64_t memoryBudget = 0; // Global memory budget (0 if unlimited)
+uint32_t budgetFrames = 0; // Cache bound set by the budget (0 if none)
+uint32_t pressureFrames = 0; // Cache bound set by memory pressure (0 if none)
+
+// Memory pressure watcher state
+pthread_t pressureThread;
+int pressureRunning = 0;
+int pressureStopPipe[2] = { -1, -1 }; // Written to wake the watcher up when stopping
+char pressureCgroup[256];
+
+// Names of the subsystems
+static const char* memoryNames[BLOCK_MEM_MAXVAL] = {
+    "cache_payload",
+    "cache_metadata",
+    "inodes",
+    "handles",
+    "buffers",
+    "stats",
+    "prefetch",
+};
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : update_cache_limit
+// Description  : Bound the cache by the tightest of the budget and the memory
+//                pressure bounds
+//
+// Inputs       : none
+// Outputs      : none
+
+static void update_cache_limit(void)
+{
+    uint32_t budget = __atomic_load_n(&budgetFrames, __ATOMIC_RELAXED);
+    uint32_t pressure = __atomic_load_n(&pressureFrames, __ATOMIC_RELAXED);
+
+    if (budget == 0 || (pressure != 0 && pressure < budget)) {
+        budget = pressure;
+    }
+    set_block_cache_limit(budget);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enforce_memory_budget
+// Description  : Give the cache what is left of the budget once the other
+//                subsystems are served, less some slack so that the small
+//                allocations that come and go don't resize the cache
+//
+// Inputs       : none
+// Outputs      : none
+
+static void enforce_memory_budget(void)
+{
+    uint64_t budget, others, limit;
+    uint32_t frames;
+
+    budget = __atomic_load_n(&memoryBudget, __ATOMIC_RELAXED);
+    if (budget == 0) {
+        __atomic_store_n(&budgetFrames, 0, __ATOMIC_RELAXED);
+        update_cache_limit();
+        return;
+    }
+    others = __atomic_load_n(&othersBytes, __ATOMIC_RELAXED);
+
+    // The cache keeps at least one frame, even over budget
+    frames = (budget > others + BLOCK_MEMORY_SLACK)
+        ? (budget - others - BLOCK_MEMORY_SLACK) / get_block_cache_slot_size() : 0;
+    if (frames == 0) {
+        logMessage(LOG_WARNING_LEVEL, "Memory budget %lu exceeded by the driver (%lu bytes outside the cache)",
+            budget, others);
+        frames = 1;
+    }
+    limit = budget - (uint64_t)frames * get_block_cache_slot_size();
+    __atomic_store_n(&othersLimit, (limit > others + BLOCK_MEMORY_SLACK) ? limit : others + BLOCK_MEMORY_SLACK,
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&budgetFrames, frames, __ATOMIC_RELAXED);
+    update_cache_limit();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_memory_budget
+// Description  : Bound the cache again once the memory used outside it no
+//                longer fits the room the current bound leaves, or has gone
+//                down by more than the slack
+//
+// Inputs       : others - the bytes used outside the cache
+// Outputs      : none
+
+static void check_memory_budget(uint64_t others)
+{
+    uint64_t limit;
+
+    if (__atomic_load_n(&memoryBudget, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    limit = __atomic_load_n(&othersLimit, __ATOMIC_RELAXED);
+    if (others > limit || others + 2 * BLOCK_MEMORY_SLACK < limit) {
+        enforce_memory_budget();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_memory_usage
+// Description  : Get the memory used by each subsystem
+//
+// Inputs       : usage - the structure to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int block_memory_usage(BlockMemoryUsage* usage)
+{
+    int i;
+    if (usage == NULL) {
+        return (-1);
+    }
+    usage->total = 0;
+    for (i = 0; i < BLOCK_MEM_MAXVAL; i++) {
+        usage->bytes[i] = __atomic_load_n(&memoryBytes[i], __ATOMIC_RELAXED);
+        usage->total += usage->bytes[i];
+    }
+    usage->budget = __atomic_load_n(&memoryBudget, __ATOMIC_RELAXED);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_set_memory_budget
+// Description  : Set the global memory budget, the cache is shrunk to keep the
+//                total under it
+//
+// Inputs       : bytes - the budget (0 for no budget)
+// Outputs      : 0 if successful, -1 if failure
+
+int block_set_memory_budget(uint64_t bytes)
+{
+    __atomic_store_n(&memoryBudget, bytes, __ATOMIC_RELAXED);
+    enforce_memory_budget();
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_memory_name
+// Description  : Get the name of a subsystem
+//
+// Inputs       : category - the subsystem
+// Outputs      : the name, or NULL if unknown
+
+const char* block_memory_name(BlockMemoryCategory category)
+{
+    if (category < 0 || category >= BLOCK_MEM_MAXVAL) {
+        return (NULL);
+    }
+    return (memoryNames[category]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_memory_add
+// Description  : Account memory allocated (or freed) by a subsystem
+//
+// Inputs       : category - the subsystem
+//                bytes - the number of bytes allocated, negative if freed
+// Outputs      : none
+
+void block_memory_add(BlockMemoryCategory category, int64_t bytes)
+{
+    __atomic_add_fetch(&memoryBytes[category], (uint64_t)bytes, __ATOMIC_RELAXED);
+    if (category >= BLOCK_MEM_INODES) {
+        check_memory_budget(__atomic_add_fetch(&othersBytes, (uint64_t)bytes, __ATOMIC_RELAXED));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_memory_set
+// Description  : Set the memory used by a subsystem
+//
+// Inputs       : category - the subsystem
+//                bytes - the number of bytes used
+// Outputs      : none
+
+void block_memory_set(BlockMemoryCategory category, uint64_t bytes)
+{
+    uint64_t old = __atomic_exchange_n(&memoryBytes[category], bytes, __ATOMIC_RELAXED);
+    if (category >= BLOCK_MEM_INODES) {
+        check_memory_budget(__atomic_add_fetch(&othersBytes, bytes - old, __ATOMIC_RELAXED));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_memory_alloc
+// Description  : Allocate memory accounted to a subsystem
+//
+// Inputs       : category - the subsystem
+//                size - the number of bytes
+// Outputs      : pointer to the memory, NULL on failure
+
+void* block_memory_alloc(BlockMemoryCategory category, size_t size)
+{
+    void* ptr = malloc(size);
+    if (ptr != NULL) {
+        block_memory_add(category, size);
+    }
+    return (ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_memory_free
+// Description  : Free memory allocated with block_memory_alloc
+//
+// Inputs       : category - the subsystem
+//                ptr - the memory
+//                size - the size it was allocated with
+// Outputs      : none
+
+void block_memory_free(BlockMemoryCategory category, void* ptr, size_t size)
+{
+    if (ptr != NULL) {
+        free(ptr);
+        block_memory_add(category, -(int64_t)size);
+    }
+}
+
+//
+// Memory pressure
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_cgroup_value
+// Description  : Read a numeric value from a cgroup file
+//
+// Inputs       : name - the file in the watched cgroup
+//                value - set to the value ("max" is UINT64_MAX)
+// Outputs      : 0 if successful, -1 if failure
+
+static int read_cgroup_value(const char* name, uint64_t* value)
+{
+    char path[512], buf[64];
+    FILE* fh;
+    int ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", pressureCgroup, name);
+    if ((fh = fopen(path, "r")) == NULL) {
+        return (-1);
+    }
+    if (fgets(buf, sizeof(buf), fh) != NULL) {
+        if (strncmp(buf, "max", 3) == 0) {
+            *value = UINT64_MAX;
+            ret = 0;
+        } else if (sscanf(buf, "%lu", value) == 1) {
+            ret = 0;
+        }
+    }
+    fclose(fh);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pressure_changed
+// Description  : Halve the cache bound under pressure, double it back after a
+//                few calm periods
+//
+// Inputs       : pressure - 1 if the last period saw memory pressure
+//                calm - number of consecutive periods without pressure
+// Outputs      : none
+
+static void pressure_changed(int pressure, int calm)
+{
+    uint32_t size = get_block_cache_size();
+    uint32_t frames = __atomic_load_n(&pressureFrames, __ATOMIC_RELAXED);
+
+    if (pressure) {
+        frames = ((frames != 0) ? frames : size) / 2;
+        if (frames < BLOCK_PRESSURE_MIN_FRAMES) {
+            frames = BLOCK_PRESSURE_MIN_FRAMES;
+        }
+        logMessage(LOG_INFO_LEVEL, "Memory pressure in [%s], cache bound to %u frames", pressureCgroup, frames);
+    } else if (frames != 0 && calm >= BLOCK_PRESSURE_CALM_PERIODS) {
+        frames = (frames * 2 >= size) ? 0 : frames * 2;
+        logMessage(LOG_INFO_LEVEL, "Memory pressure cleared in [%s], cache bound to %u frames", pressureCgroup, frames);
+    } else {
+        return;
+    }
+    __atomic_store_n(&pressureFrames, frames, __ATOMIC_RELAXED);
+    update_cache_limit();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pressure_thread
+// Description  : Body of the watcher thread. It waits for PSI trigger events
+//                on memory.pressure, or compares memory.current to memory.high
+//                when PSI triggers are not available.
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void* pressure_thread(void* arg)
+{
+    struct pollfd fds[2];
+    char path[512];
+    uint64_t current, high;
+    int psi, calm = 0, pressure, ret;
+
+    // Register the PSI trigger
+    snprintf(path, sizeof(path), "%s/memory.pressure", pressureCgroup);
+    psi = open(path, O_RDWR | O_NONBLOCK);
+    if (psi != -1 && write(psi, BLOCK_PRESSURE_TRIGGER, strlen(BLOCK_PRESSURE_TRIGGER) + 1) < 0) {
+        close(psi);
+        psi = -1;
+    }
+    if (psi == -1) {
+        logMessage(LOG_INFO_LEVEL, "No PSI trigger on [%s], watching memory.current instead", pressureCgroup);
+    }
+
+    fds[0].fd = pressureStopPipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = psi;
+    fds[1].events = POLLPRI;
+    while (__atomic_load_n(&pressureRunning, __ATOMIC_RELAXED)) {
+        ret = poll(fds, (psi != -1) ? 2 : 1, BLOCK_PRESSURE_PERIOD_MS);
+        if (ret < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            break;
+        }
+        if (psi != -1) {
+            if (fds[1].revents & POLLERR) {
+                logMessage(LOG_WARNING_LEVEL, "PSI trigger on [%s] went away", pressureCgroup);
+                break;
+            }
+            pressure = (fds[1].revents & POLLPRI) != 0;
+        } else {
+            pressure = (read_cgroup_value("memory.current", &current) == 0)
+                && (read_cgroup_value("memory.high", &high) == 0) && (high != UINT64_MAX)
+                && (current >= high / 100 * BLOCK_PRESSURE_HIGH_PCT);
+        }
+        calm = pressure ? 0 : calm + 1;
+        pressure_changed(pressure, calm);
+        if (calm >= BLOCK_PRESSURE_CALM_PERIODS) {
+            calm = 0;
+        }
+    }
+    if (psi != -1) {
+        close(psi);
+    }
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pressure_start
+// Description  : Start a thread shrinking the cache when the cgroup is under
+//                memory pressure, and letting it grow back when it clears
+//
+// Inputs       : cgroup - the cgroup v2 directory (NULL for the default)
+// Outputs      : 0 if successful, -1 if failure
+
+int block_pressure_start(const char* cgroup)
+{
+    if (pressureRunning) {
+        return (-1);
+    }
+    snprintf(pressureCgroup, sizeof(pressureCgroup), "%s", (cgroup != NULL) ? cgroup : BLOCK_PRESSURE_CGROUP);
+    if (pipe(pressureStopPipe) != 0) {
+        return (-1);
+    }
+    pressureRunning = 1;
+    if (pthread_create(&pressureThread, NULL, pressure_thread, NULL) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Failure starting the memory pressure watcher.");
+        pressureRunning = 0;
+        close(pressureStopPipe[0]);
+        close(pressureStopPipe[1]);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_pressure_stop
+// Description  : Stop watching for memory pressure, the cache regrows
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int block_pressure_stop(void)
+{
+    if (!pressureRunning) {
+        return (-1);
+    }
+    __atomic_store_n(&pressureRunning, 0, __ATOMIC_RELAXED);
+    if (write(pressureStopPipe[1], "", 1) < 0) {
+        logMessage(LOG_WARNING_LEVEL, "Failure waking up the memory pressure watcher.");
+    }
+    pthread_join(pressureThread, NULL);
+    close(pressureStopPipe[0]);
+    close(pressureStopPipe[1]);
+    __atomic_store_n(&pressureFrames, 0, __ATOMIC_RELAXED);
+    update_cache_limit();
+    return (0);
+}
@@ -0,0 +1,78 @@
+#ifndef BLOCK_MEMORY_INCLUDED
+#define BLOCK_MEMORY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_memory.h
+//  Description    : This is the header file for the memory accounting of the
+//                   BLOCK memory system driver and its memory budget.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stddef.h>
+#include <stdint.h>
+
+// Defines
+#define BLOCK_PRESSURE_CGROUP "/sys/fs/cgroup" // Default cgroup watched for pressure
+#define BLOCK_PRESSURE_TRIGGER "some 150000 1000000" // PSI trigger (150ms stalled per 1s)
+#define BLOCK_PRESSURE_PERIOD_MS 1000 // Period of the pressure checks
+#define BLOCK_PRESSURE_CALM_PERIODS 5 // Periods without pressure before the cache regrows
+#define BLOCK_PRESSURE_HIGH_PCT 90 // Usage of memory.high treated as pressure (fallback)
+#define BLOCK_PRESSURE_MIN_FRAMES 16 // The cache is never shrunk below this under pressure
+#define BLOCK_MEMORY_SLACK (64 * 1024) // Room left under the budget for the other subsystems to grow
+
+// Subsystems the memory is accounted to
+typedef enum {
+
+    BLOCK_MEM_CACHE_PAYLOAD = 0, // Frames held by the cache
+    BLOCK_MEM_CACHE_METADATA = 1, // Cache bookkeeping
+    BLOCK_MEM_INODES = 2, // File table and store metadata tables
+    BLOCK_MEM_HANDLES = 3, // File handles
+    BLOCK_MEM_BUFFERS = 4, // Transfer buffers
+    BLOCK_MEM_STATS = 5, // Statistics
+    BLOCK_MEM_PREFETCH = 6, // Prefetcher tables
+    BLOCK_MEM_MAXVAL = 7, // Number of subsystems
+
+} BlockMemoryCategory;
+
+// Memory usage report
+typedef struct {
+    uint64_t bytes[BLOCK_MEM_MAXVAL]; // Bytes used by each subsystem
+    uint64_t total; // Bytes used overall
+    uint64_t budget; // Global memory budget (0 if unlimited)
+} BlockMemoryUsage;
+
+//
+// Functional Prototypes
+
+int block_memory_usage(BlockMemoryUsage* usage);
+// Get the memory used by each subsystem
+
+int block_set_memory_budget(uint64_t bytes);
+// Set the global memory budget (0 for no budget), the cache gives memory back
+// first when the other subsystems grow
+
+const char* block_memory_name(BlockMemoryCategory category);
+// Get the name of a subsystem
+
+void block_memory_add(BlockMemoryCategory category, int64_t bytes);
+// Account memory allocated (or freed if negative) by a subsystem
+
+void block_memory_set(BlockMemoryCategory category, uint64_t bytes);
+// Set the memory used by a subsystem
+
+int block_pressure_start(const char* cgroup);
+// Start shrinking the cache when the cgroup is under memory pressure
+
+int block_pressure_stop(void);
+// Stop watching for memory pressure, the cache regrows
+
+void* block_memory_alloc(BlockMemoryCategory category, size_t size);
+// Allocate memory accounted to a subsystem
+
+void block_memory_free(BlockMemoryCategory category, void* ptr, size_t size);
+// Free memory allocated with block_memory_alloc
+
+#endif
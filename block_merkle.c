@@ -0,0 +1,537 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_merkle.c
+//  Description    : This is the implementation of the per-file hash trees of
+//                   the BLOCK memory system driver. The trees are not
+//                   persisted, they are built from the frames the first time
+//                   they are needed and then updated on every write.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project includes
+#include <block_backend.h>
+#include <block_cache.h>
+#include <block_driver.h>
+#include <block_memory.h>
+#include <block_merkle.h>
+#include <block_stats.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define BLOCK_UNIT_STORE "store.bin" // Frame file of the store of the unit test
+#define BLOCK_UNIT_SMALL 200 // Size of the small files of the unit test, kept in a fragment
+#define BLOCK_UNIT_FRAMES 4 // Frames of the larger files of the unit test
+
+// Global data
+int merkleEnabled = 0;
+BlockMerkleTree* merkleTrees[BLOCK_MAX_TOTAL_FILES]; // Tree of each file (NULL if not built)
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : merkle_combine
+// Description  : Hash two child nodes into their parent (not cryptographic,
+//                the trees detect changes, they don't authenticate them)
+//
+// Inputs       : left - the left child
+//                right - the right child
+// Outputs      : the parent node, 0 if both children are empty
+
+static uint64_t merkle_combine(uint64_t left, uint64_t right)
+{
+    uint64_t h;
+    if (left == 0 && right == 0) {
+        return (0);
+    }
+    h = left * 0x9e3779b97f4a7c15ULL ^ (right + 0x632be59bd9b4e019ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return ((h ^ (h >> 31)) | 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : merkle_leaf
+// Description  : Get the leaf of a frame from its checksum, set apart from the
+//                empty leaves
+//
+// Inputs       : checksum - the checksum of the frame
+// Outputs      : the leaf
+
+static uint64_t merkle_leaf(uint32_t checksum)
+{
+    return ((1ULL << 32) | checksum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_set_merkle
+// Description  : Keep the trees of the files up to date on write. Otherwise
+//                the trees are built on demand and dropped after use.
+//
+// Inputs       : enable - 1 to keep the trees, 0 to drop them
+// Outputs      : 0 if successful, -1 if failure
+
+int block_set_merkle(int enable)
+{
+    if (!enable) {
+        block_merkle_drop_all();
+    }
+    merkleEnabled = enable;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_get_merkle
+// Description  : Check if the trees are kept up to date
+//
+// Inputs       : none
+// Outputs      : 1 if they are, 0 otherwise
+
+int block_get_merkle(void)
+{
+    return (merkleEnabled);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : merkle_fragment
+// Description  : Get the leaf checksum of a small file, the checksum of its
+//                slice padded with zeros to a frame so that it matches the
+//                checksum of the same data in a dedicated frame
+//
+// Inputs       : slice - the start of its data in the fragment frame
+//                size - the size of the file
+// Outputs      : the checksum
+
+static uint32_t merkle_fragment(const char* slice, int32_t size)
+{
+    frame_t frame;
+    uint32_t checksum;
+
+    memset(frame, 0, BLOCK_FRAME_SIZE);
+    memcpy(frame, slice, size);
+    compute_frame_checksum(frame, &checksum);
+    BLOCK_STAT_ADD(checksums, 1);
+    return (checksum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_tree
+// Description  : Get the tree of a file, building it from the checksums of its
+//                frames the first time
+//
+// Inputs       : file_nr - the number of the file
+//                file - the file
+// Outputs      : the tree, NULL on failure
+
+BlockMerkleTree* block_merkle_tree(int32_t file_nr, file_t* file)
+{
+    BlockMerkleTree* tree;
+    frame_t frame;
+    uint32_t checksum;
+    int i;
+
+    if (merkleTrees[file_nr] != NULL) {
+        return (merkleTrees[file_nr]);
+    }
+    tree = block_memory_alloc(BLOCK_MEM_INODES, sizeof(BlockMerkleTree));
+    if (tree == NULL) {
+        return (NULL);
+    }
+    memset(tree, 0, sizeof(BlockMerkleTree));
+    if (file->nrFrames == 0) {
+        if (file->size > 0) {
+            if (fetchFrame(frame, file->fragFrame) == -1) {
+                block_memory_free(BLOCK_MEM_INODES, tree, sizeof(BlockMerkleTree));
+                return (NULL);
+            }
+            tree->nodes[BLOCK_MERKLE_LEAVES] = merkle_leaf(merkle_fragment(frame + file->fragOffset, file->size));
+        }
+    } else {
+        for (i = 0; i < file->nrFrames; i++) {
+            if (fetchFileFrame(file, i, frame, 0) == -1) {
+                block_memory_free(BLOCK_MEM_INODES, tree, sizeof(BlockMerkleTree));
+                return (NULL);
+            }
+            compute_frame_checksum(frame, &checksum);
+            BLOCK_STAT_ADD(checksums, 1);
+            tree->nodes[BLOCK_MERKLE_LEAVES + i] = merkle_leaf(checksum);
+        }
+    }
+    for (i = BLOCK_MERKLE_LEAVES - 1; i > 0; i--) {
+        tree->nodes[i] = merkle_combine(tree->nodes[2 * i], tree->nodes[2 * i + 1]);
+    }
+    merkleTrees[file_nr] = tree;
+    return (tree);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_update
+// Description  : Update the leaf of a frame after it was written, and the
+//                nodes on its path to the root
+//
+// Inputs       : file_nr - the number of the file
+//                index - the index of the frame in the file
+//                checksum - the checksum of the frame written
+// Outputs      : none
+
+void block_merkle_update(int32_t file_nr, int32_t index, uint32_t checksum)
+{
+    BlockMerkleTree* tree = merkleTrees[file_nr];
+    int node;
+
+    if (tree == NULL) {
+        return;
+    }
+    node = BLOCK_MERKLE_LEAVES + index;
+    tree->nodes[node] = merkle_leaf(checksum);
+    for (node /= 2; node > 0; node /= 2) {
+        tree->nodes[node] = merkle_combine(tree->nodes[2 * node], tree->nodes[2 * node + 1]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_update_frame
+// Description  : Update the leaf of a frame written without its checksum (kept
+//                in the cache), the checksum is only computed if the tree is
+//                built
+//
+// Inputs       : file_nr - the number of the file
+//                index - the index of the frame in the file
+//                frame - the frame written
+// Outputs      : none
+
+void block_merkle_update_frame(int32_t file_nr, int32_t index, const void* frame)
+{
+    uint32_t checksum;
+
+    if (merkleTrees[file_nr] == NULL) {
+        return;
+    }
+    compute_frame_checksum((void*)frame, &checksum);
+    BLOCK_STAT_ADD(checksums, 1);
+    block_merkle_update(file_nr, index, checksum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_update_fragment
+// Description  : Update the leaf of a small file after its slice was written
+//
+// Inputs       : file_nr - the number of the file
+//                slice - the start of its data in the fragment frame
+//                size - the size of the file
+// Outputs      : none
+
+void block_merkle_update_fragment(int32_t file_nr, const char* slice, int32_t size)
+{
+    if (merkleTrees[file_nr] == NULL) {
+        return;
+    }
+    block_merkle_update(file_nr, 0, merkle_fragment(slice, size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_drop
+// Description  : Free the tree of a file
+//
+// Inputs       : file_nr - the number of the file
+// Outputs      : none
+
+void block_merkle_drop(int32_t file_nr)
+{
+    block_memory_free(BLOCK_MEM_INODES, merkleTrees[file_nr], sizeof(BlockMerkleTree));
+    merkleTrees[file_nr] = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_drop_all
+// Description  : Free the trees of all the files
+//
+// Inputs       : none
+// Outputs      : none
+
+void block_merkle_drop_all(void)
+{
+    int i;
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        block_merkle_drop(i);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_digest
+// Description  : Get the digest of a file, its root combined with its size
+//
+// Inputs       : tree - the tree of the file
+//                size - the size of the file
+// Outputs      : the digest
+
+uint64_t block_merkle_digest(BlockMerkleTree* tree, int32_t size)
+{
+    return (merkle_combine(tree->nodes[1], (uint64_t)size + 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : merkle_descend
+// Description  : List the differing leaves under a node, skipping the
+//                subtrees that are identical in both trees
+//
+// Inputs       : a, b - the trees
+//                node - the node to compare
+//                frames - the list to fill
+//                max - the size of the list
+//                found - the number of differing leaves, incremented
+// Outputs      : none
+
+static void merkle_descend(BlockMerkleTree* a, BlockMerkleTree* b, int node, uint16_t* frames, int32_t max,
+    int32_t* found)
+{
+    if (a->nodes[node] == b->nodes[node]) {
+        return;
+    }
+    if (node >= BLOCK_MERKLE_LEAVES) {
+        if (*found < max) {
+            frames[*found] = node - BLOCK_MERKLE_LEAVES;
+        }
+        (*found)++;
+        return;
+    }
+    merkle_descend(a, b, 2 * node, frames, max, found);
+    merkle_descend(a, b, 2 * node + 1, frames, max, found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_merkle_diff
+// Description  : List the frames that differ between two trees
+//
+// Inputs       : a, b - the trees
+//                frames - the list to fill with the frame indexes (or NULL)
+//                max - the size of the list
+// Outputs      : the number of frames that differ (possibly more than max)
+
+int block_merkle_diff(BlockMerkleTree* a, BlockMerkleTree* b, uint16_t* frames, int32_t max)
+{
+    int32_t found = 0;
+    merkle_descend(a, b, 1, frames, (frames != NULL) ? max : 0, &found);
+    return (found);
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_fill
+// Description  : Fill a buffer with the data the unit test writes to a file,
+//                the same for all the files
+//
+// Inputs       : buf - the buffer
+//                size - the number of bytes
+// Outputs      : none
+
+static void unit_fill(char* buf, int32_t size)
+{
+    int32_t i;
+    for (i = 0; i < size; i++) {
+        buf[i] = 'a' + (i * 11) % 26;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_create
+// Description  : Create a file of the unit test and open it
+//
+// Inputs       : name - the file
+//                size - the size of the file
+//                policy - the write policy of the file
+// Outputs      : the file handle, -1 if failure
+
+static int16_t unit_create(char* name, int32_t size, BlockWritePolicy policy)
+{
+    char data[BLOCK_UNIT_FRAMES * BLOCK_FRAME_SIZE];
+    int16_t fd;
+
+    unit_fill(data, size);
+    if ((fd = block_open_policy(name, policy)) == -1 || block_write(fd, data, size) != size) {
+        return (-1);
+    }
+    return (fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_change
+// Description  : Write bytes that differ from the data of the unit test
+//
+// Inputs       : fd - the file handle
+//                loc - the location in the file
+//                size - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_change(int16_t fd, uint32_t loc, int32_t size)
+{
+    char data[BLOCK_FRAME_SIZE];
+
+    memset(data, 'Z', size);
+    return ((block_seek(fd, loc) == 0 && block_write(fd, data, size) == size) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_diff
+// Description  : Check the frames that differ between two files, with the
+//                trees kept up to date since the last check, then with trees
+//                built again from the frames (the trees of the other files
+//                are dropped too)
+//
+// Inputs       : fd_a, fd_b - the file handles
+//                expected - the indexes of the frames expected to differ
+//                n - the number of frames expected to differ
+//                what - what the check is about, for the log
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_diff(int16_t fd_a, int16_t fd_b, const uint16_t* expected, int32_t n, const char* what)
+{
+    uint16_t frames[BLOCK_UNIT_FRAMES + 1];
+    uint64_t digest_a, digest_b, kept;
+    int32_t found;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        // The second pass drops the trees, they are built from the frames
+        if (pass == 1) {
+            block_set_merkle(0);
+            block_set_merkle(1);
+        }
+        found = block_diff(fd_a, fd_b, frames, BLOCK_UNIT_FRAMES + 1);
+        if (found != n || (n > 0 && memcmp(frames, expected, n * sizeof(uint16_t)) != 0)
+            || block_file_digest(fd_a, &digest_a) == -1 || block_file_digest(fd_b, &digest_b) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Merkle unit test: %d frames differ %s (%s trees).", found, what,
+                pass ? "rebuilt" : "updated");
+            return (-1);
+        }
+        if (pass == 0) {
+            kept = digest_b;
+        }
+        if ((n == 0) != (digest_a == digest_b) || (pass == 1 && kept != digest_b)) {
+            logMessage(LOG_ERROR_LEVEL, "Merkle unit test: wrong digests %s (%s trees).", what, pass ? "rebuilt" : "updated");
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_trees
+// Description  : Session of the unit test comparing files written the same,
+//                then changed in a few frames, grown and promoted out of
+//                their fragment
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int unit_trees(void)
+{
+    uint16_t changed[] = {1, 3}, last[] = {BLOCK_UNIT_FRAMES - 1}, first[] = {0};
+    char data[BLOCK_UNIT_FRAMES * BLOCK_FRAME_SIZE];
+    int16_t a, b, c, small_a, small_b;
+    int ret = -1;
+
+    if (block_set_backend(block_backend_file(BLOCK_UNIT_STORE)) == -1 || block_poweron() == -1) {
+        return (-1);
+    }
+    block_set_merkle(1);
+    a = unit_create("a", BLOCK_UNIT_FRAMES * BLOCK_FRAME_SIZE, BLOCK_WRITE_THROUGH);
+    b = unit_create("b", BLOCK_UNIT_FRAMES * BLOCK_FRAME_SIZE, BLOCK_WRITE_BACK);
+    c = unit_create("c", (BLOCK_UNIT_FRAMES - 1) * BLOCK_FRAME_SIZE, BLOCK_WRITE_THROUGH);
+    small_a = unit_create("small_a", BLOCK_UNIT_SMALL, BLOCK_WRITE_THROUGH);
+    small_b = unit_create("small_b", BLOCK_UNIT_SMALL, BLOCK_WRITE_THROUGH);
+    if (a == -1 || b == -1 || c == -1 || small_a == -1 || small_b == -1) {
+        block_poweroff();
+        return (-1);
+    }
+    unit_fill(data, sizeof(data));
+
+    // Frames 1 and 3 of the write-back file changed, then the file grown by
+    // a frame against the same data one frame short
+    if (unit_diff(a, b, NULL, 0, "between equal files") == 0 && unit_change(b, BLOCK_FRAME_SIZE + 10, 20) == 0
+        && unit_change(b, 3 * BLOCK_FRAME_SIZE + 4000, 96) == 0
+        && unit_diff(a, b, changed, 2, "after two frames changed") == 0
+        && unit_diff(c, a, last, 1, "with a frame more") == 0
+        && block_seek(c, (BLOCK_UNIT_FRAMES - 1) * BLOCK_FRAME_SIZE) == 0
+        && block_write(c, &data[(BLOCK_UNIT_FRAMES - 1) * BLOCK_FRAME_SIZE], 100) == 100
+        && unit_diff(c, a, last, 1, "with the last frame cut short") == 0
+        && block_write(c, &data[(BLOCK_UNIT_FRAMES - 1) * BLOCK_FRAME_SIZE + 100], BLOCK_FRAME_SIZE - 100)
+            == BLOCK_FRAME_SIZE - 100
+        && unit_diff(c, a, NULL, 0, "once grown to the same data") == 0
+
+        // The small files are leaves of their fragment slice, the same as a
+        // frame of their own once promoted
+        && unit_diff(small_a, small_b, NULL, 0, "between equal small files") == 0
+        && unit_change(small_b, 10, 1) == 0 && unit_diff(small_a, small_b, first, 1, "after a small file changed") == 0
+        && block_seek(small_a, BLOCK_UNIT_SMALL) == 0
+        && block_write(small_a, &data[BLOCK_UNIT_SMALL], 2 * BLOCK_FRAME_SIZE) == 2 * BLOCK_FRAME_SIZE) {
+        ret = 0;
+    }
+
+    // The tree of the small file promoted was kept up to date, it holds the
+    // first frames of the larger files
+    if (ret == 0 && (block_diff(small_a, a, NULL, 0) != BLOCK_UNIT_FRAMES - 2)) {
+        logMessage(LOG_ERROR_LEVEL, "Merkle unit test: the promoted small file does not match its frames.");
+        ret = -1;
+    }
+    block_set_merkle(0);
+    if (block_poweroff() == -1) {
+        ret = -1;
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : blockMerkleUnitTest
+// Description  : Run a UNIT test checking the hash trees of the files and
+//                the frames they find different
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int blockMerkleUnitTest(void)
+{
+    char dir[32];
+    int ret;
+
+    if (unitDirectory(dir) == -1) {
+        return (-1);
+    }
+    ret = unitSession(dir, unit_trees);
+    unitCleanup(dir);
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "Merkle unit test failed.");
+        return (-1);
+    }
+
+    // Return successfully
+    logMessage(LOG_OUTPUT_LEVEL, "Merkle unit test completed successfully.");
+    return (0);
+}
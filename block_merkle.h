@@ -0,0 +1,69 @@
+#ifndef BLOCK_MERKLE_INCLUDED
+#define BLOCK_MERKLE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_merkle.h
+//  Description    : This is the header file for the per-file hash trees of
+//                   the BLOCK memory system driver. The leaves are the frame
+//                   checksums, so two files (or two stores) are compared by
+//                   only descending into the subtrees that differ.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_driver_helper.h>
+
+// Defines
+#define BLOCK_MERKLE_LEAVES BLOCK_MAX_FRAME_PER_FILE // Leaves of a tree, one per frame of a file
+
+// Hash tree of a file, node 1 is the root and the leaf of frame i is node
+// BLOCK_MERKLE_LEAVES + i. Empty subtrees hash to 0.
+typedef struct {
+    uint64_t nodes[2 * BLOCK_MERKLE_LEAVES];
+} BlockMerkleTree;
+
+//
+// Functional Prototypes
+
+int block_set_merkle(int enable);
+// Keep the trees of the files up to date on write (built on demand otherwise)
+
+int block_get_merkle(void);
+// Check if the trees are kept up to date
+
+BlockMerkleTree* block_merkle_tree(int32_t file_nr, file_t* file);
+// Get the tree of a file, building it from its frames if needed
+
+void block_merkle_update(int32_t file_nr, int32_t index, uint32_t checksum);
+// Update the leaf of a frame of a file after it was written, if its tree is built
+
+void block_merkle_update_frame(int32_t file_nr, int32_t index, const void* frame);
+// Update the leaf of a frame of a file written without its checksum, if its
+// tree is built
+
+void block_merkle_update_fragment(int32_t file_nr, const char* slice, int32_t size);
+// Update the leaf of a small file after its fragment slice was written
+
+void block_merkle_drop(int32_t file_nr);
+// Free the tree of a file
+
+void block_merkle_drop_all(void);
+// Free the trees of all the files
+
+uint64_t block_merkle_digest(BlockMerkleTree* tree, int32_t size);
+// Get the digest of a file from its tree and size
+
+int block_merkle_diff(BlockMerkleTree* a, BlockMerkleTree* b, uint16_t* frames, int32_t max);
+// List the frames that differ between two trees, returns how many differ
+
+//
+// Unit test
+
+int blockMerkleUnitTest(void);
+// Run a UNIT test checking the trees and the frames they find different
+
+#endif
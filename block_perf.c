@@ -0,0 +1,455 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_perf.c
+//  Description    : This is the implementation of the hardware performance
+//                   counters of the BLOCK memory system driver. Each thread
+//                   opens its own group of counters the first time it enters a
+//                   phase, the group is read as one so the counters agree.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_memory.h>
+#include <block_perf.h>
+#include <cmpsc311_log.h>
+
+// Counters and phases of a thread, never freed so that they can be summed
+// after their thread exits. Only the thread itself opens and closes its
+// counters.
+typedef struct PerfThread {
+    int fds[BLOCK_PERF_COUNTERS]; // Counter file descriptors (-1 if not opened)
+    int slots[BLOCK_PERF_COUNTERS]; // Position of each counter in a group read (-1 if not opened)
+    int nbOpen; // Counters in the group
+    uint32_t session; // Counting session the counters were opened for
+    int depth; // Phases entered
+    BlockPerfPhase stack[BLOCK_PERF_MAX_DEPTH];
+    uint64_t last[BLOCK_PERF_COUNTERS]; // Counters at the last change of phase
+    BlockPerfCounters phases[BLOCK_PERF_PHASES];
+    struct PerfThread* next;
+} PerfThread;
+
+// Group read of the counters
+typedef struct {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[BLOCK_PERF_COUNTERS];
+} PerfGroupRead;
+
+// Type and config of each counter
+static const uint32_t perfTypes[BLOCK_PERF_COUNTERS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+};
+static const uint64_t perfConfigs[BLOCK_PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+static const char* perfCounterNames[BLOCK_PERF_COUNTERS] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses",
+};
+static const char* perfPhaseNames[BLOCK_PERF_PHASES] = {
+    "parse", "driver", "cache", "checksum", "bus",
+};
+
+// Global data
+int blockPerfOn = 0;
+int perfAvailable[BLOCK_PERF_COUNTERS]; // Counters opened on the thread that started counting
+uint32_t perfSession = 0; // Bumped on each start, the threads then reopen their counters
+PerfThread* perfThreads = NULL; // Counters of all the threads that entered a phase
+pthread_mutex_t perfLock = PTHREAD_MUTEX_INITIALIZER; // Protects the list of threads
+pthread_key_t perfKey; // Closes the counters of a thread when it exits
+pthread_once_t perfKeyOnce = PTHREAD_ONCE_INIT;
+__thread PerfThread* perfLocal = NULL;
+__thread int blockPerfThreadOpen = 0;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : perf_open
+// Description  : Open the group of counters of the calling thread, the
+//                counters the machine (or the sandbox) doesn't have are left
+//                out
+//
+// Inputs       : thread - the counters of the thread
+// Outputs      : the number of counters opened
+
+static int perf_open(PerfThread* thread)
+{
+    struct perf_event_attr attr;
+    int i, leader = -1;
+
+    thread->nbOpen = 0;
+    thread->depth = 0;
+    thread->session = perfSession;
+    memset(thread->last, 0, sizeof(thread->last));
+    for (i = 0; i < BLOCK_PERF_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perfTypes[i];
+        attr.config = perfConfigs[i];
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = (leader == -1);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        thread->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        thread->slots[i] = -1;
+        if (thread->fds[i] == -1) {
+            continue;
+        }
+        if (leader == -1) {
+            leader = thread->fds[i];
+        }
+        thread->slots[i] = thread->nbOpen++;
+    }
+    if (leader != -1) {
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    blockPerfThreadOpen = (thread->nbOpen > 0);
+    return (thread->nbOpen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : perf_close
+// Description  : Close the group of counters of the calling thread
+//
+// Inputs       : thread - the counters of the thread
+// Outputs      : none
+
+static void perf_close(PerfThread* thread)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_PERF_COUNTERS; i++) {
+        if (thread->fds[i] != -1) {
+            close(thread->fds[i]);
+            thread->fds[i] = -1;
+        }
+        thread->slots[i] = -1;
+    }
+    thread->nbOpen = 0;
+    thread->depth = 0;
+    blockPerfThreadOpen = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : perf_thread_exit
+// Description  : Close the counters of a thread that exits
+//
+// Inputs       : arg - the counters of the thread
+// Outputs      : none
+
+static void perf_thread_exit(void* arg)
+{
+    perf_close((PerfThread*)arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : perf_key_create
+// Description  : Create the key closing the counters of the threads that exit
+//
+// Inputs       : none
+// Outputs      : none
+
+static void perf_key_create(void)
+{
+    pthread_key_create(&perfKey, perf_thread_exit);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : perf_thread
+// Description  : Get the counters of the calling thread, registering them the
+//                first time and opening them once per counting session
+//
+// Inputs       : none
+// Outputs      : the counters of the thread, NULL on failure
+
+static PerfThread* perf_thread(void)
+{
+    PerfThread* thread = perfLocal;
+
+    if (thread != NULL) {
+        if (thread->session != perfSession) {
+            perf_close(thread);
+            perf_open(thread);
+        }
+        return (thread);
+    }
+    thread = block_memory_alloc(BLOCK_MEM_BUFFERS, sizeof(PerfThread));
+    if (thread == NULL) {
+        return (NULL);
+    }
+    memset(thread, 0, sizeof(PerfThread));
+    pthread_once(&perfKeyOnce, perf_key_create);
+    pthread_setspecific(perfKey, thread);
+    perf_open(thread);
+    pthread_mutex_lock(&perfLock);
+    thread->next = perfThreads;
+    perfThreads = thread;
+    pthread_mutex_unlock(&perfLock);
+    perfLocal = thread;
+    return (thread);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : perf_charge
+// Description  : Read the counters of a thread and charge what they counted
+//                since the last change of phase to its current phase
+//
+// Inputs       : thread - the counters of the thread
+// Outputs      : none
+
+static void perf_charge(PerfThread* thread)
+{
+    PerfGroupRead group;
+    BlockPerfCounters* phase;
+    uint64_t value;
+    int i, leader = -1;
+
+    for (i = 0; i < BLOCK_PERF_COUNTERS && leader == -1; i++) {
+        leader = thread->fds[i];
+    }
+    if (leader == -1 || read(leader, &group, sizeof(group)) <= 0) {
+        return;
+    }
+    if (thread->depth == 0) {
+        phase = &thread->phases[BLOCK_PERF_PARSE];
+    } else if (thread->depth <= BLOCK_PERF_MAX_DEPTH) {
+        phase = &thread->phases[thread->stack[thread->depth - 1]];
+    } else {
+        phase = &thread->phases[thread->stack[BLOCK_PERF_MAX_DEPTH - 1]];
+    }
+    for (i = 0; i < BLOCK_PERF_COUNTERS; i++) {
+        if (thread->slots[i] == -1) {
+            continue;
+        }
+        // Counters multiplexed with others are scaled to the time enabled
+        value = group.values[thread->slots[i]];
+        if (group.time_running != 0 && group.time_running < group.time_enabled) {
+            value = (uint64_t)((double)value * group.time_enabled / group.time_running);
+        }
+        if (value >= thread->last[i]) {
+            __atomic_store_n(&phase->values[i], phase->values[i] + value - thread->last[i], __ATOMIC_RELAXED);
+        }
+        thread->last[i] = value;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_start
+// Description  : Start counting, the counters of each thread are opened when
+//                it first enters a phase
+//
+// Inputs       : none
+// Outputs      : the number of counters available, 0 if none
+
+int block_perf_start(void)
+{
+    PerfThread* thread;
+    int i, available = 0;
+
+    if (blockPerfOn) {
+        return (-1);
+    }
+
+    // The counts of the previous session are dropped
+    pthread_mutex_lock(&perfLock);
+    perfSession++;
+    for (thread = perfThreads; thread != NULL; thread = thread->next) {
+        memset(thread->phases, 0, sizeof(thread->phases));
+    }
+    pthread_mutex_unlock(&perfLock);
+    thread = perf_thread();
+    if (thread == NULL) {
+        return (0);
+    }
+    for (i = 0; i < BLOCK_PERF_COUNTERS; i++) {
+        perfAvailable[i] = (thread->fds[i] != -1);
+        available += perfAvailable[i];
+        if (!perfAvailable[i]) {
+            logMessage(LOG_INFO_LEVEL, "Performance counter %s not available.", perfCounterNames[i]);
+        }
+    }
+    if (available == 0) {
+        logMessage(LOG_WARNING_LEVEL, "No performance counters available (%s), running without them, check "
+            "/proc/sys/kernel/perf_event_paranoid.", strerror(errno));
+        return (0);
+    }
+    blockPerfOn = 1;
+    return (available);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_stop
+// Description  : Stop counting, the counts are kept until the next start.
+//                The counters of the calling thread are closed, the other
+//                threads close theirs on their next change of phase or when
+//                they exit.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int block_perf_stop(void)
+{
+    if (!blockPerfOn) {
+        return (-1);
+    }
+    if (perfLocal != NULL) {
+        perf_charge(perfLocal);
+    }
+    blockPerfOn = 0;
+    if (perfLocal != NULL) {
+        perf_close(perfLocal);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_available
+// Description  : Check if a counter could be opened
+//
+// Inputs       : counter - the counter
+// Outputs      : 1 if it could, 0 otherwise
+
+int block_perf_available(BlockPerfCounter counter)
+{
+    return ((counter >= 0 && counter < BLOCK_PERF_COUNTERS) ? perfAvailable[counter] : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_read
+// Description  : Get the counters of each phase, summed over the threads
+//
+// Inputs       : phases - the BLOCK_PERF_PHASES counters to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int block_perf_read(BlockPerfCounters* phases)
+{
+    PerfThread* thread;
+    uint64_t* sum = (uint64_t*)phases;
+    uint64_t* counters;
+    size_t i;
+
+    if (phases == NULL) {
+        return (-1);
+    }
+    memset(phases, 0, sizeof(BlockPerfCounters) * BLOCK_PERF_PHASES);
+    pthread_mutex_lock(&perfLock);
+    for (thread = perfThreads; thread != NULL; thread = thread->next) {
+        counters = (uint64_t*)thread->phases;
+        for (i = 0; i < BLOCK_PERF_PHASES * sizeof(BlockPerfCounters) / sizeof(uint64_t); i++) {
+            sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&perfLock);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_counter_name
+// Description  : Get the name of a counter
+//
+// Inputs       : counter - the counter
+// Outputs      : the name
+
+const char* block_perf_counter_name(BlockPerfCounter counter)
+{
+    return ((counter >= 0 && counter < BLOCK_PERF_COUNTERS) ? perfCounterNames[counter] : "unknown");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_phase_name
+// Description  : Get the name of a phase
+//
+// Inputs       : phase - the phase
+// Outputs      : the name
+
+const char* block_perf_phase_name(BlockPerfPhase phase)
+{
+    return ((phase >= 0 && phase < BLOCK_PERF_PHASES) ? perfPhaseNames[phase] : "unknown");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_enter
+// Description  : Charge the events so far to the current phase and enter a
+//                new one
+//
+// Inputs       : phase - the phase entered
+// Outputs      : none
+
+void block_perf_enter(BlockPerfPhase phase)
+{
+    PerfThread* thread;
+
+    // Counting stopped, the thread closes the counters it still has open
+    if (!blockPerfOn) {
+        if (perfLocal != NULL) {
+            perf_close(perfLocal);
+        }
+        return;
+    }
+    thread = perf_thread();
+    if (thread == NULL || thread->nbOpen == 0) {
+        return;
+    }
+    perf_charge(thread);
+    if (thread->depth < BLOCK_PERF_MAX_DEPTH) {
+        thread->stack[thread->depth] = phase;
+    }
+    thread->depth++;
+    __atomic_store_n(&thread->phases[phase].entries, thread->phases[phase].entries + 1, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_perf_exit
+// Description  : Charge the events so far to the current phase and return to
+//                the phase it was entered from
+//
+// Inputs       : none
+// Outputs      : none
+
+void block_perf_exit(void)
+{
+    PerfThread* thread = perfLocal;
+
+    // Counting stopped or restarted, the counters are closed (reopened on
+    // the next phase entered)
+    if (thread != NULL && (!blockPerfOn || thread->session != perfSession)) {
+        perf_close(thread);
+        return;
+    }
+    // Phases entered before counting started are not followed
+    if (thread == NULL || thread->nbOpen == 0 || thread->depth == 0) {
+        return;
+    }
+    perf_charge(thread);
+    thread->depth--;
+}
@@ -0,0 +1,101 @@
+#ifndef BLOCK_PERF_INCLUDED
+#define BLOCK_PERF_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_perf.h
+//  Description    : This is the header file for the hardware performance
+//                   counters of the BLOCK memory system driver. The counters
+//                   are read with perf_event_open on each change of phase, so
+//                   that each phase (workload parsing, driver, cache, checksum
+//                   and bus) is charged with the events it caused.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define BLOCK_PERF_MAX_DEPTH 8 // Most nested phases followed per thread
+
+// Hardware counters
+typedef enum {
+    BLOCK_PERF_CYCLES = 0,
+    BLOCK_PERF_INSTRUCTIONS,
+    BLOCK_PERF_LLC_MISSES,
+    BLOCK_PERF_DTLB_MISSES,
+    BLOCK_PERF_BRANCH_MISSES,
+    BLOCK_PERF_COUNTERS,
+} BlockPerfCounter;
+
+// Phases the counters are charged to, each only with the events outside of
+// the phases nested in it
+typedef enum {
+    BLOCK_PERF_PARSE = 0, // Outside of the driver (workload parsing and checks)
+    BLOCK_PERF_DRIVER, // Driver calls
+    BLOCK_PERF_CACHE, // Cache lookups and inserts
+    BLOCK_PERF_CHECKSUM, // Frame checksums
+    BLOCK_PERF_BUS, // Bus and backend operations
+    BLOCK_PERF_PHASES,
+} BlockPerfPhase;
+
+// Counters of a phase
+typedef struct {
+    uint64_t values[BLOCK_PERF_COUNTERS];
+    uint64_t entries; // Times the phase was entered
+} BlockPerfCounters;
+
+// Enter and leave a phase, a thread with counters still open after counting
+// stopped calls in once more to close them
+#define BLOCK_PERF_ENTER(phase)                                                \
+    do {                                                                        \
+        if (blockPerfOn || blockPerfThreadOpen) {                               \
+            block_perf_enter(phase);                                            \
+        }                                                                       \
+    } while (0)
+#define BLOCK_PERF_EXIT()                                                      \
+    do {                                                                        \
+        if (blockPerfOn || blockPerfThreadOpen) {                               \
+            block_perf_exit();                                                  \
+        }                                                                       \
+    } while (0)
+
+//
+// Global Data
+
+extern int blockPerfOn; // Set while the counters are read
+extern __thread int blockPerfThreadOpen; // Set while the calling thread has counters open
+
+//
+// Functional Prototypes
+
+int block_perf_start(void);
+// Start counting, returns the number of counters available (0 if none, the
+// phases are then not followed)
+
+int block_perf_stop(void);
+// Stop counting and close the counters of the calling thread, the other
+// threads close theirs on their next change of phase or when they exit
+
+int block_perf_available(BlockPerfCounter counter);
+// Check if a counter could be opened
+
+int block_perf_read(BlockPerfCounters* phases);
+// Get the counters of each phase (BLOCK_PERF_PHASES entries), summed over
+// the threads
+
+const char* block_perf_counter_name(BlockPerfCounter counter);
+// Get the name of a counter
+
+const char* block_perf_phase_name(BlockPerfPhase phase);
+// Get the name of a phase
+
+void block_perf_enter(BlockPerfPhase phase);
+// Charge the events so far to the current phase and enter "phase"
+
+void block_perf_exit(void);
+// Charge the events so far to the current phase and return to the phase it
+// was entered from
+
+#endif
@@ -0,0 +1,447 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_prefetch.c
+//  Description    : This is the implementation of the prefetcher of the BLOCK
+//                   memory system driver. Strides are learned per file handle
+//                   on the frame index in the file, the successor table on
+//                   the frame numbers so that it follows chains across files.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <pthread.h>
+#include <string.h>
+
+// Project includes
+#include <block_cache.h>
+#include <block_memory.h>
+#include <block_prefetch.h>
+#include <block_stats.h>
+
+// Stride learned on the reads of a file handle
+typedef struct {
+    int32_t last; // Index of the last frame read (-1 if none)
+    int32_t stride; // Last distance between two frames read
+    uint8_t confidence; // Times the stride repeated
+} PrefetchStream;
+
+// Successors of a frame in the successor table
+typedef struct {
+    int32_t frame; // Frame the entry is for (-1 if unused)
+    uint16_t successors[BLOCK_PREFETCH_MARKOV_WAYS];
+    uint8_t counts[BLOCK_PREFETCH_MARKOV_WAYS]; // Times each successor was seen
+} PrefetchSuccessors;
+
+// Global data
+int prefetchModes = 0;
+PrefetchStream prefetchStreams[BLOCK_MAX_TOTAL_FILES];
+PrefetchSuccessors prefetchTable[BLOCK_PREFETCH_MARKOV_ENTRIES];
+uint8_t prefetched[BLOCK_BLOCK_SIZE]; // Set for frames prefetched and not read yet
+int32_t prefetchLastFrame = -1; // Last frame read, on any handle
+
+// Open prefetch worker state, the queue is guarded by its own lock so that
+// the driver calls never wait for the worker to queue frames
+pthread_t prefetchWorker;
+pthread_mutex_t prefetchQueueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetchQueueWake = PTHREAD_COND_INITIALIZER;
+int prefetchWorkerRunning = 0;
+uint16_t prefetchQueue[BLOCK_OPEN_PREFETCH_QUEUE]; // Ring of frames to read ahead
+uint32_t prefetchQueueHead = 0; // Next frame to read
+uint32_t prefetchQueueCount = 0; // Frames queued
+int32_t openReadRatio = BLOCK_OPEN_PREFETCH_SCALE; // Share of the opened files read before close
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_set_prefetch
+// Description  : Enable the prefetch modes, 0 disables the prefetcher
+//
+// Inputs       : modes - BLOCK_PREFETCH_STRIDE, BLOCK_PREFETCH_MARKOV and/or
+//                        BLOCK_PREFETCH_OPEN
+// Outputs      : 0 if successful, -1 if failure
+
+int block_set_prefetch(int modes)
+{
+    if (modes & ~(BLOCK_PREFETCH_STRIDE | BLOCK_PREFETCH_MARKOV | BLOCK_PREFETCH_OPEN)) {
+        return (-1);
+    }
+    if (!(modes & BLOCK_PREFETCH_OPEN)) {
+        block_prefetch_stop();
+    }
+    if (modes != prefetchModes) {
+        block_prefetch_reset();
+    }
+    prefetchModes = modes;
+    block_memory_set(BLOCK_MEM_PREFETCH,
+        modes ? sizeof(prefetchStreams) + sizeof(prefetchTable) + sizeof(prefetched) : 0);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_get_prefetch
+// Description  : Get the enabled prefetch modes
+//
+// Inputs       : none
+// Outputs      : the modes (0 if the prefetcher is disabled)
+
+int block_get_prefetch(void)
+{
+    return (prefetchModes);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_reset
+// Description  : Forget everything learned, and the frames prefetched (called
+//                when the cache is emptied)
+//
+// Inputs       : none
+// Outputs      : none
+
+void block_prefetch_reset(void)
+{
+    int i;
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        block_prefetch_close(i);
+    }
+    for (i = 0; i < BLOCK_PREFETCH_MARKOV_ENTRIES; i++) {
+        memset(&prefetchTable[i], 0, sizeof(PrefetchSuccessors));
+        prefetchTable[i].frame = -1;
+    }
+    memset(prefetched, 0, sizeof(prefetched));
+    prefetchLastFrame = -1;
+    pthread_mutex_lock(&prefetchQueueLock);
+    prefetchQueueCount = 0;
+    pthread_mutex_unlock(&prefetchQueueLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_close
+// Description  : Forget the stride of a file handle
+//
+// Inputs       : fd - the file handle
+// Outputs      : none
+
+void block_prefetch_close(int16_t fd)
+{
+    prefetchStreams[fd].last = -1;
+    prefetchStreams[fd].stride = 0;
+    prefetchStreams[fd].confidence = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_drop
+// Description  : Count a frame prefetched as wasted, it was evicted from the
+//                cache or overwritten before any read
+//
+// Inputs       : frame_nr - the frame evicted or overwritten
+// Outputs      : none
+
+void block_prefetch_drop(uint16_t frame_nr)
+{
+    if (prefetched[frame_nr]) {
+        prefetched[frame_nr] = 0;
+        BLOCK_STAT_ADD(prefetch_wasted, 1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_frame
+// Description  : Read a frame into the cache ahead of its use
+//
+// Inputs       : frame_nr - the frame to prefetch
+//                budget - prefetches left, decremented
+// Outputs      : none
+
+static void prefetch_frame(uint16_t frame_nr, int* budget)
+{
+    BlockCacheStats before, after;
+    frame_t frame;
+
+    if (*budget == 0 || prefetched[frame_nr] || peek_block_cache(0, frame_nr)) {
+        return;
+    }
+    if (executeOpcode(frame, BLOCK_OP_RDFRME, frame_nr, NULL) == -1) {
+        return;
+    }
+    get_block_cache_stats(&before, NULL);
+    put_block_cache(0, frame_nr, frame);
+    get_block_cache_stats(&after, NULL);
+    prefetched[frame_nr] = 1;
+    (*budget)--;
+    BLOCK_STAT_ADD(prefetches, 1);
+    BLOCK_STAT_ADD(prefetch_evictions, after.evictions - before.evictions);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : learn_successor
+// Description  : Count a transition in the successor table. A successor not
+//                in the table first wears down the weakest one, so that one
+//                off transitions don't push out the established ones.
+//
+// Inputs       : from - the frame read before
+//                to - the frame read after it
+// Outputs      : none
+
+static void learn_successor(uint16_t from, uint16_t to)
+{
+    PrefetchSuccessors* entry = &prefetchTable[from % BLOCK_PREFETCH_MARKOV_ENTRIES];
+    int i, weakest = 0;
+
+    if (entry->frame != from) {
+        memset(entry, 0, sizeof(PrefetchSuccessors));
+        entry->frame = from;
+    }
+    for (i = 0; i < BLOCK_PREFETCH_MARKOV_WAYS; i++) {
+        if (entry->counts[i] != 0 && entry->successors[i] == to) {
+            if (entry->counts[i] < BLOCK_PREFETCH_MARKOV_MAX) {
+                entry->counts[i]++;
+            }
+            return;
+        }
+        if (entry->counts[i] < entry->counts[weakest]) {
+            weakest = i;
+        }
+    }
+    if (entry->counts[weakest] > 1) {
+        entry->counts[weakest]--;
+    } else {
+        entry->successors[weakest] = to;
+        entry->counts[weakest] = 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_access
+// Description  : Score the earlier predictions against the read of a frame,
+//                learn from it, and prefetch the frames predicted next
+//
+// Inputs       : fd - the file handle read
+//                file - the file read
+//                index - the index of the frame in the file (-1 if the frame
+//                        is the fragment frame of a small file)
+//                frame_nr - the frame read
+//                missed - 1 if the frame was not in the cache
+// Outputs      : none
+
+void block_prefetch_access(int16_t fd, file_t* file, int32_t index, uint16_t frame_nr, int missed)
+{
+    PrefetchStream* stream = &prefetchStreams[fd];
+    PrefetchSuccessors* entry;
+    int budget = BLOCK_PREFETCH_BUDGET;
+    int32_t next;
+    int i;
+
+    if (!prefetchModes) {
+        return;
+    }
+
+    // Was the frame prefetched for this read, one evicted or overwritten
+    // since was counted as wasted then
+    if (prefetched[frame_nr]) {
+        prefetched[frame_nr] = 0;
+        if (!missed) {
+            BLOCK_STAT_ADD(prefetch_hits, 1);
+        }
+    }
+
+    // Reads within the frame read last teach nothing new
+    if ((prefetchModes & BLOCK_PREFETCH_STRIDE) && index >= 0 && index != stream->last) {
+        if (stream->last >= 0 && index - stream->last == stream->stride) {
+            if (stream->confidence < BLOCK_PREFETCH_STRIDE_CONFIDENCE) {
+                stream->confidence++;
+            }
+        } else {
+            stream->stride = (stream->last >= 0) ? index - stream->last : 0;
+            stream->confidence = 0;
+        }
+        stream->last = index;
+        if (stream->confidence >= BLOCK_PREFETCH_STRIDE_CONFIDENCE) {
+            for (i = 1; i <= BLOCK_PREFETCH_DEPTH; i++) {
+                next = index + i * stream->stride;
+                // Compressed frames are not prefetched, they share frames
+                if (next >= 0 && next < file->nrFrames && file->packing[next] == 0) {
+                    prefetch_frame(file->frames[next], &budget);
+                }
+            }
+        }
+    }
+    if ((prefetchModes & BLOCK_PREFETCH_MARKOV) && frame_nr != prefetchLastFrame) {
+        if (prefetchLastFrame >= 0) {
+            learn_successor(prefetchLastFrame, frame_nr);
+        }
+        prefetchLastFrame = frame_nr;
+        entry = &prefetchTable[frame_nr % BLOCK_PREFETCH_MARKOV_ENTRIES];
+        if (entry->frame == frame_nr) {
+            for (i = 0; i < BLOCK_PREFETCH_MARKOV_WAYS; i++) {
+                if (entry->counts[i] >= BLOCK_PREFETCH_MARKOV_CONFIDENCE) {
+                    prefetch_frame(entry->successors[i], &budget);
+                }
+            }
+        }
+    }
+}
+
+//
+// Open prefetch
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetch_worker
+// Description  : Body of the worker thread, it reads the queued frames into
+//                the cache, taking the driver lock for each frame
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void* prefetch_worker(void* arg)
+{
+    uint16_t frame_nr;
+    int budget;
+
+    pthread_mutex_lock(&prefetchQueueLock);
+    while (prefetchWorkerRunning) {
+        if (prefetchQueueCount == 0) {
+            pthread_cond_wait(&prefetchQueueWake, &prefetchQueueLock);
+            continue;
+        }
+        frame_nr = prefetchQueue[prefetchQueueHead];
+        prefetchQueueHead = (prefetchQueueHead + 1) % BLOCK_OPEN_PREFETCH_QUEUE;
+        prefetchQueueCount--;
+        pthread_mutex_unlock(&prefetchQueueLock);
+
+        lockDriver();
+        budget = 1;
+        prefetch_frame(frame_nr, &budget);
+        if (budget == 0) {
+            BLOCK_STAT_ADD(open_prefetches, 1);
+        }
+        pthread_mutex_unlock(&blockDriverLock);
+        pthread_mutex_lock(&prefetchQueueLock);
+    }
+    pthread_mutex_unlock(&prefetchQueueLock);
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_frame
+// Description  : Queue a frame for the worker, frames are dropped when the
+//                queue is full. Called with the queue lock held.
+//
+// Inputs       : frame_nr - the frame to read ahead
+// Outputs      : none
+
+static void queue_frame(uint16_t frame_nr)
+{
+    if (prefetchQueueCount < BLOCK_OPEN_PREFETCH_QUEUE) {
+        prefetchQueue[(prefetchQueueHead + prefetchQueueCount) % BLOCK_OPEN_PREFETCH_QUEUE] = frame_nr;
+        prefetchQueueCount++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_open_limit
+// Description  : Get the largest file read whole when opened, it follows the
+//                share of the opened files that are read before being closed
+//
+// Inputs       : none
+// Outputs      : the size limit in frames (0 if nothing is read ahead)
+
+uint32_t block_prefetch_open_limit(void)
+{
+    return ((uint32_t)openReadRatio * BLOCK_OPEN_PREFETCH_MAX_FRAMES / BLOCK_OPEN_PREFETCH_SCALE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_open
+// Description  : Queue the frames of an opened file for the worker, the whole
+//                file if it is under the limit, its leading frames otherwise
+//
+// Inputs       : file - the file opened
+// Outputs      : none
+
+void block_prefetch_open(file_t* file)
+{
+    uint32_t limit = block_prefetch_open_limit();
+    int i, frames;
+
+    if (!(prefetchModes & BLOCK_PREFETCH_OPEN) || limit == 0) {
+        return;
+    }
+    pthread_mutex_lock(&prefetchQueueLock);
+    if (!prefetchWorkerRunning) {
+        prefetchWorkerRunning = 1;
+        if (pthread_create(&prefetchWorker, NULL, prefetch_worker, NULL) != 0) {
+            prefetchWorkerRunning = 0;
+            pthread_mutex_unlock(&prefetchQueueLock);
+            return;
+        }
+    }
+    if (file->nrFrames == 0) {
+        if (file->fragLength != 0) {
+            queue_frame(file->fragFrame);
+        }
+    } else {
+        frames = (file->nrFrames <= limit) ? file->nrFrames : BLOCK_OPEN_PREFETCH_LEADING;
+        if (frames > limit) {
+            frames = limit;
+        }
+        for (i = 0; i < frames; i++) {
+            if (file->packing[i] == 0) {
+                queue_frame(file->frames[i]);
+            }
+        }
+    }
+    pthread_cond_signal(&prefetchQueueWake);
+    pthread_mutex_unlock(&prefetchQueueLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_closed
+// Description  : Learn whether a file was read between its open and close,
+//                a moving average over the last few files
+//
+// Inputs       : read - set if the file was read
+// Outputs      : none
+
+void block_prefetch_closed(int read)
+{
+    openReadRatio += ((read ? BLOCK_OPEN_PREFETCH_SCALE : 0) - openReadRatio) / 8;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_prefetch_stop
+// Description  : Stop the worker, dropping the frames it had queued. Must not
+//                be called with the driver lock held.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the worker was not running
+
+int block_prefetch_stop(void)
+{
+    pthread_mutex_lock(&prefetchQueueLock);
+    if (!prefetchWorkerRunning) {
+        pthread_mutex_unlock(&prefetchQueueLock);
+        return (-1);
+    }
+    prefetchWorkerRunning = 0;
+    prefetchQueueCount = 0;
+    pthread_cond_signal(&prefetchQueueWake);
+    pthread_mutex_unlock(&prefetchQueueLock);
+    pthread_join(prefetchWorker, NULL);
+    return (0);
+}
@@ -0,0 +1,72 @@
+#ifndef BLOCK_PREFETCH_INCLUDED
+#define BLOCK_PREFETCH_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_prefetch.h
+//  Description    : This is the header file for the prefetcher of the BLOCK
+//                   memory system driver. It learns the stride of the reads
+//                   of each file handle, and which frame usually follows
+//                   which across all the files.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_driver_helper.h>
+
+// Defines
+#define BLOCK_PREFETCH_STRIDE 0x1 // Predict from the stride of each handle
+#define BLOCK_PREFETCH_MARKOV 0x2 // Predict from the frame transitions seen
+#define BLOCK_PREFETCH_OPEN 0x4 // Read opened files ahead in the background
+#define BLOCK_PREFETCH_BUDGET 4 // Most frames prefetched per frame read
+#define BLOCK_PREFETCH_DEPTH 2 // Strides prefetched ahead
+#define BLOCK_PREFETCH_STRIDE_CONFIDENCE 2 // Repeats of a stride before it is trusted
+#define BLOCK_PREFETCH_MARKOV_ENTRIES 4096 // Frames in the successor table
+#define BLOCK_PREFETCH_MARKOV_WAYS 2 // Successors kept per frame
+#define BLOCK_PREFETCH_MARKOV_CONFIDENCE 3 // Times a transition is seen before it is trusted
+#define BLOCK_PREFETCH_MARKOV_MAX 15 // Saturation of the transition counts
+#define BLOCK_OPEN_PREFETCH_MAX_FRAMES 16 // Largest file read whole when opened
+#define BLOCK_OPEN_PREFETCH_LEADING 2 // Leading frames read of larger files
+#define BLOCK_OPEN_PREFETCH_QUEUE 256 // Frames waiting for the worker at most
+#define BLOCK_OPEN_PREFETCH_SCALE 1024 // Fixed point scale of the read after open ratio
+
+//
+// Functional Prototypes
+
+int block_set_prefetch(int modes);
+// Enable the prefetch modes (BLOCK_PREFETCH_*), 0 disables the prefetcher
+
+int block_get_prefetch(void);
+// Get the enabled prefetch modes
+
+void block_prefetch_reset(void);
+// Forget everything learned, and the frames prefetched
+
+void block_prefetch_close(int16_t fd);
+// Forget the stride of a file handle
+
+void block_prefetch_drop(uint16_t frame_nr);
+// Count a frame prefetched as wasted if it leaves the cache or is overwritten
+// before it is read
+
+void block_prefetch_access(int16_t fd, file_t* file, int32_t index, uint16_t frame_nr, int missed);
+// Learn from the read of a frame ("index" in the file, -1 for a fragment),
+// and prefetch the frames predicted to be read next
+
+void block_prefetch_open(file_t* file);
+// Queue the frames of an opened file for the worker to read ahead, all of them
+// for small files, the leading ones otherwise
+
+void block_prefetch_closed(int read);
+// Learn whether a file was read between its open and close ("read" set)
+
+uint32_t block_prefetch_open_limit(void);
+// Get the largest file (in frames) currently read whole when opened
+
+int block_prefetch_stop(void);
+// Stop the worker, dropping the frames it had queued
+
+#endif
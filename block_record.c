@@ -0,0 +1,210 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_record.c
+//  Description    : This is the implementation of the workload recorder of the
+//                   BLOCK memory system driver, and of the reader of its
+//                   recordings used for replay.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_record.h>
+#include <block_stats.h>
+#include <cmpsc311_log.h>
+
+// Global data
+int blockRecording = 0;
+FILE* recordFile = NULL;
+int recordPayloads = 0;
+uint64_t recordStart; // Clock at the start of the recording
+pthread_mutex_t recordLock = PTHREAD_MUTEX_INITIALIZER; // Keeps the entries whole and in order
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_start
+// Description  : Start recording all the driver calls
+//
+// Inputs       : path - the recording to create
+//                payloads - 1 to record the write payloads, 0 for hashes only
+// Outputs      : 0 if successful, -1 if failure
+
+int block_record_start(const char* path, int payloads)
+{
+    BlockRecordHeader header;
+
+    if (blockRecording) {
+        return (-1);
+    }
+    if ((recordFile = fopen(path, "wb")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure creating the recording [%s]", path);
+        return (-1);
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = BLOCK_RECORD_MAGIC;
+    header.version = BLOCK_RECORD_VERSION;
+    header.flags = payloads ? BLOCK_RECORD_PAYLOADS : 0;
+    header.start_time = (uint64_t)time(NULL);
+    if (fwrite(&header, sizeof(header), 1, recordFile) != 1) {
+        fclose(recordFile);
+        recordFile = NULL;
+        return (-1);
+    }
+    recordPayloads = payloads;
+    recordStart = block_stats_clock();
+    blockRecording = 1;
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_stop
+// Description  : Stop recording the driver calls
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int block_record_stop(void)
+{
+    int ret;
+
+    if (!blockRecording) {
+        return (-1);
+    }
+    pthread_mutex_lock(&recordLock);
+    blockRecording = 0;
+    ret = fclose(recordFile);
+    recordFile = NULL;
+    pthread_mutex_unlock(&recordLock);
+    return ((ret == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_op
+// Description  : Record a driver call
+//
+// Inputs       : op - the call
+//                fd - the file handle
+//                arg - the bytes requested, or the location of a seek
+//                result - what the call returned
+//                data - the path of an open, the data read or written
+//                length - the number of bytes in data
+// Outputs      : none
+
+void block_record_op(BlockRecordOp op, int16_t fd, int32_t arg, int32_t result, const void* data,
+    uint32_t length)
+{
+    BlockRecordEntry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.ts_ns = block_stats_clock() - recordStart;
+    entry.tid = (uint32_t)syscall(SYS_gettid);
+    entry.op = op;
+    entry.fd = fd;
+    entry.arg = arg;
+    entry.result = result;
+    entry.hash = (data != NULL) ? block_record_hash(data, length) : 0;
+
+    // Only the paths, and the write payloads if asked for, are kept
+    if (op == BLOCK_RECORD_OPEN || (op == BLOCK_RECORD_WRITE && recordPayloads)) {
+        entry.length = length;
+    }
+    pthread_mutex_lock(&recordLock);
+    if (recordFile != NULL) {
+        if ((fwrite(&entry, sizeof(entry), 1, recordFile) != 1)
+            || (entry.length != 0 && fwrite(data, entry.length, 1, recordFile) != 1)) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing the recording, recording stopped");
+            fclose(recordFile);
+            recordFile = NULL;
+            blockRecording = 0;
+        }
+    }
+    pthread_mutex_unlock(&recordLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_hash
+// Description  : Get the FNV-1a hash of a buffer
+//
+// Inputs       : data - the buffer
+//                length - the number of bytes to hash
+// Outputs      : the hash
+
+uint32_t block_record_hash(const void* data, uint32_t length)
+{
+    const unsigned char* bytes = data;
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return (hash);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_open
+// Description  : Open a recording for replay and read its header
+//
+// Inputs       : path - the recording
+//                fh - set to the opened recording
+//                header - the header to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int block_record_open(const char* path, FILE** fh, BlockRecordHeader* header)
+{
+    if ((*fh = fopen(path, "rb")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the recording [%s]", path);
+        return (-1);
+    }
+    if ((fread(header, sizeof(BlockRecordHeader), 1, *fh) != 1) || (header->magic != BLOCK_RECORD_MAGIC)
+        || (header->version != BLOCK_RECORD_VERSION)) {
+        logMessage(LOG_ERROR_LEVEL, "[%s] is not a recording of this version", path);
+        fclose(*fh);
+        *fh = NULL;
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_record_next
+// Description  : Read the next entry of a recording, and the path or payload
+//                following it
+//
+// Inputs       : fh - the recording
+//                entry - the entry to fill
+//                data - the buffer for the bytes following the entry
+//                size - the size of the buffer, a byte is kept after the
+//                       bytes read to terminate a path
+// Outputs      : 1 if an entry was read, 0 at the end, -1 on failure
+
+int block_record_next(FILE* fh, BlockRecordEntry* entry, char* data, uint32_t size)
+{
+    if (fread(entry, sizeof(BlockRecordEntry), 1, fh) != 1) {
+        return (feof(fh) ? 0 : -1);
+    }
+    if (entry->length >= size) {
+        logMessage(LOG_ERROR_LEVEL, "Recorded entry too large [%u > %u]", entry->length, size);
+        return (-1);
+    }
+    if (entry->length != 0 && fread(data, entry->length, 1, fh) != 1) {
+        return (-1);
+    }
+    return (1);
+}
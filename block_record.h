@@ -0,0 +1,83 @@
+#ifndef BLOCK_RECORD_INCLUDED
+#define BLOCK_RECORD_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_record.h
+//  Description    : This is the header file for the workload recorder of the
+//                   BLOCK memory system driver, and for the replay of its
+//                   recordings.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+#include <stdio.h>
+
+// Defines
+#define BLOCK_RECORD_MAGIC 0x524b4c42 // "BLKR"
+#define BLOCK_RECORD_VERSION 1
+#define BLOCK_RECORD_PAYLOADS 0x1 // Write payloads follow their entries
+
+// Driver calls in a recording
+typedef enum {
+    BLOCK_RECORD_OPEN = 0,
+    BLOCK_RECORD_CLOSE = 1,
+    BLOCK_RECORD_READ = 2,
+    BLOCK_RECORD_WRITE = 3,
+    BLOCK_RECORD_SEEK = 4,
+} BlockRecordOp;
+
+// Header at the start of a recording
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags; // BLOCK_RECORD_PAYLOADS if payloads were recorded
+    uint64_t start_time; // Wall clock time the recording started (seconds)
+} BlockRecordHeader;
+
+// A recorded call, the open path (or the write payload) follows it
+typedef struct {
+    uint64_t ts_ns; // Time since the start of the recording
+    uint32_t tid; // Thread that made the call
+    uint8_t op; // BlockRecordOp
+    uint8_t pad;
+    int16_t fd; // File handle
+    int32_t arg; // Bytes requested (read, write), location (seek)
+    int32_t result; // What the call returned
+    uint32_t hash; // FNV-1a of the data read or written, of the path for opens
+    uint32_t length; // Number of bytes following the entry
+} BlockRecordEntry;
+
+//
+// Global Data
+
+extern int blockRecording; // Set while the driver calls are recorded
+
+//
+// Functional Prototypes
+
+int block_record_start(const char* path, int payloads);
+// Start recording all the driver calls to "path", with the write payloads if
+// "payloads" is set (only their hashes otherwise)
+
+int block_record_stop(void);
+// Stop recording the driver calls
+
+void block_record_op(BlockRecordOp op, int16_t fd, int32_t arg, int32_t result, const void* data,
+    uint32_t length);
+// Record a driver call, "data" is the path, or the data read or written
+
+uint32_t block_record_hash(const void* data, uint32_t length);
+// Get the FNV-1a hash of a buffer
+
+int block_record_open(const char* path, FILE** fh, BlockRecordHeader* header);
+// Open a recording for replay and read its header
+
+int block_record_next(FILE* fh, BlockRecordEntry* entry, char* data, uint32_t size);
+// Read the next entry of a recording and the bytes following it (less than
+// "size", so that they can be terminated), returns 1 if an entry was read, 0
+// at the end, -1 on failure
+
+#endif
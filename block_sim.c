@@ -16,29 +16,103 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 // Project Includes
+#include <block_archive.h>
+#include <block_backend.h>
+#include <block_bench.h>
+#include <block_layout.h>
 #include <block_cache.h>
+#include <block_compress.h>
 #include <block_controller.h>
 #include <block_driver.h>
+#include <block_erasure.h>
+#include <block_export.h>
+#include <block_memory.h>
+#include <block_merkle.h>
+#include <block_perf.h>
+#include <block_prefetch.h>
+#include <block_record.h>
+#include <block_stats.h>
+#include <block_trace.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define BLOCK_WORKLOAD_DIR "workload"
 #define BLOCK_SIM_MAX_OPEN_FILES 128
-#define BLOCK_ARGUMENTS "huvl:c:"
-#define USAGE                                                                    \
-    "USAGE: block_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n"      \
-    "\n"                                                                         \
-    "where:\n"                                                                   \
-    "    -h - help mode (display this message)\n"                                \
-    "    -v - verbose output\n"                                                  \
-    "    -l - write log messages to the filename <logfile>\n"                    \
-    "    -c - set the block block cache to size <sz> (disabled for assign #2)\n" \
-    "\n"                                                                         \
-    "    <workload-file> - file contain the workload to simulate\n"              \
+#define BLOCK_SIM_TOP_FILES 5 // Files listed in the performance summary
+#define BLOCK_ARGUMENTS "huvfl:c:w:T:s:m:p:j:HM:g:r:yR:x:b:e:B:G:D:K:W:S:O:L:ZA:I:F:"
+#define BLOCK_SIM_REPLAY_MAX_THREADS 256 // Threads told apart in a replay summary
+#define BLOCK_SIM_REPLAY_MAX_BATCH 1024 // Most calls replayed in one batch
+#define BLOCK_SIM_REPLAY_BUFFER (BLOCK_MAX_FRAME_PER_FILE * BLOCK_FRAME_SIZE) // Largest read or write replayed
+#define USAGE                                                                        \
+    "USAGE: block_sim [-h] [-v] [-f] [-l <logfile>] [-c <sz>] [-w <ops>]\n"          \
+    "                 [-T <ms>] [-s <series-file>] [-m <ops>] [-p <metrics-file>]\n" \
+    "                 [-j <trace-file>] [-H]\n"                                      \
+    "                 [-M <bytes>] [-g <cgroup>] [-r <recording> [-y]]\n"            \
+    "                 [-R <recording> [-x <speed>] [-b <ops>]] [-e <prefetch>]\n"    \
+    "                 [-B <export-file> [-G <generation>]]\n"                        \
+    "                 [-D <file>[,<file>...] [-K <data>,<parity>]] [-W <policy>]\n"  \
+    "                 [-S <threads>[,<sharing>[,<read-percent>[,<ops>]]]] [-O <runs>]\n" \
+    "                 [-L <recording>] [-Z] [-A <image>] [-I <image>]\n"             \
+    "                 [-F <low>,<high>]\n"                                           \
+    "                 <workload-file>\n"                                             \
+    "\n"                                                                             \
+    "where:\n"                                                                       \
+    "    -h - help mode (display this message)\n"                                    \
+    "    -v - verbose output\n"                                                      \
+    "    -f - format the block storage before running the workload\n"                \
+    "    -l - write log messages to the filename <logfile>\n"                        \
+    "    -c - set the block block cache to size <sz> (disabled for assign #2)\n"     \
+    "    -w - sample the driver metrics every <ops> workload operations\n"           \
+    "    -T - sample the driver metrics every <ms> milliseconds\n"                   \
+    "    -s - write the metrics samples to <series-file> (CSV, or JSON if\n"         \
+    "         the name ends in .json)\n"                                             \
+    "    -m - leave the first <ops> workload operations out of the summary\n"        \
+    "    -p - export the metrics in Prometheus text format to <metrics-file>\n"      \
+    "    -j - trace the driver events to <trace-file> (Chrome trace format,\n"       \
+    "         also set by the BLOCK_TRACE environment variable)\n"                   \
+    "    -H - count the cycles, instructions and cache, TLB and branch misses\n"     \
+    "         of each phase with the hardware performance counters\n"                \
+    "    -M - keep the memory used by the driver under <bytes>\n"                    \
+    "    -g - shrink the cache when the <cgroup> is under memory pressure\n"         \
+    "    -r - record the driver calls of the workload to <recording>\n"              \
+    "    -y - also record the write payloads (only their hashes otherwise)\n"        \
+    "    -R - replay <recording> instead of a workload file\n"                       \
+    "    -x - pace the replay at <speed> times the recorded rate (0 for\n"           \
+    "         no pacing, 1 by default)\n"                                            \
+    "    -b - replay the calls in batches of <ops> calls\n"                          \
+    "    -e - prefetch frames, <prefetch> is stride, markov, open or all\n"          \
+    "    -B - export the frames of the store to <export-file> instead of\n"          \
+    "         running a workload\n"                                                  \
+    "    -G - only export the frames written after <generation>\n"                   \
+    "    -D - keep the frames in <file> instead of the controller, or mirror\n"      \
+    "         them to two files\n"                                                   \
+    "    -K - stripe the frames over <data> files of -D, with <parity> more\n"       \
+    "         files of erasure code\n"                                               \
+    "    -W - write the files with the cache <policy>, through (default),\n"         \
+    "         back or around\n"                                                      \
+    "    -S - benchmark the driver with 1, 2, 4... up to <threads> threads\n"        \
+    "         instead of running a workload, the threads use <sharing>\n"            \
+    "         files (disjoint, shared or hot frames, disjoint by default),\n"        \
+    "         <read-percent> of reads (50 by default) and <ops> operations\n"        \
+    "         in total at each step\n"                                               \
+    "    -O - benchmark the power on and off of stores of 0 to 1024 files,\n"        \
+    "         more and more fragmented, with <runs> power cycles each\n"             \
+    "    -L - lay the frames of the store out by the accesses of\n"                  \
+    "         <recording> instead of running a workload, the frames\n"               \
+    "         accessed one after the other next to each other\n"                     \
+    "    -Z - compress the data frames written, packing them in sectors\n"           \
+    "    -A - seal the store into the archive <image> instead of running a\n"        \
+    "         workload\n"                                                            \
+    "    -I - read the frames from the archive <image> (read-only)\n"                \
+    "    -F - evict frames from the cache in the background once fewer\n"            \
+    "         than <low> slots are free, up to <high> free slots\n"                  \
+    "\n"                                                                             \
+    "    <workload-file> - file contain the workload to simulate\n"                  \
     "\n"
 
 // This is the file table
@@ -50,13 +124,39 @@ typedef struct {
 //
 // Global Data
 int verbose;
+int format_store = 0;
 uint32_t cache_size = 0;
+uint32_t window_ops = 0; // Workload operations per metrics window (0 if unused)
+uint32_t window_ms = 0; // Milliseconds per metrics window (0 if unused)
+uint32_t warmup_ops = 0; // Workload operations left out of the summary
+char* series_file = NULL; // File receiving the metrics time series
+char* metrics_file = NULL; // File the metrics are exported to
+char* trace_file = NULL; // File the driver events are traced to
+int perf_counters = 0; // Count the hardware events of each phase
+char* record_file = NULL; // File the driver calls are recorded to
+int record_payloads = 0; // Record the write payloads, not only their hashes
+double replay_speed = 1.0; // Pace of the replay relative to the recording (0 if unpaced)
+uint32_t replay_batch = 0; // Calls replayed per block_batch call (0 to replay them one by one)
+BlockWritePolicy write_policy = BLOCK_WRITE_THROUGH; // Cache write policy of the files opened
 
 //
 // Functional Prototypes
 
 int simulate_BLOCK(char* wload); // control loop of the BLOCK simulation
+int replay_BLOCK(char* recording); // replay a recording of driver calls
+uint64_t replay_chunk(BlockBatchOp* ops, BlockRecordEntry* entries, int32_t n, int16_t* fdmap, uint16_t flags);
+int export_BLOCK(char* path, uint32_t since); // export the frames written since a generation
+int bench_BLOCK(char* spec); // run the thread scaling benchmark
+int mount_BLOCK(int runs); // run the power on and off benchmark
+int layout_BLOCK(char* recording); // lay the store out by the accesses of a recording
+int archive_BLOCK(char* image); // seal the store into an archive
 int validate_file(char* fname, int16_t mfh); // Validate a file in the filesystem
+int open_metrics(void); // Start sampling the driver metrics
+void sample_metrics(int final); // Sample the driver metrics after an operation
+void close_metrics(void); // Stop sampling and log the metrics summary
+void log_write_policy(void); // Log the cache counters of the write policies
+void log_perf_counters(void); // Log the hardware events of each phase
+void log_compression(void); // Log the frames written compressed
 
 //
 // Functions
@@ -75,6 +175,26 @@ int main(int argc, char* argv[])
 
     // Local variables
     int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
+    uint64_t memory_budget = 0;
+    char* pressure_cgroup = NULL;
+    char* replay_recording = NULL;
+    char* export_file = NULL;
+    uint32_t export_since = 0;
+    char* backend_files = NULL;
+    char* bench_spec = NULL;
+    int mount_runs = 0;
+    char* layout_recording = NULL;
+    char* archive_file = NULL;
+    char* image_file = NULL;
+    uint32_t reclaim_low, reclaim_high;
+    char* sep;
+    BlockBackend* backend = NULL;
+    BlockBackend* shards[BLOCK_ERASURE_MAX_DATA + BLOCK_ERASURE_MAX_PARITY];
+    BlockMirrorStats mirror;
+    BlockErasureStats erasure;
+    BlockArchiveStats archive;
+    int data_shards = 0, parity_shards = 0, nshards = 0;
+    int prefetch = 0;
     // uint32_t cache_size = 0;
 
     // Process the command line parameters
@@ -89,6 +209,10 @@ int main(int argc, char* argv[])
             verbose = 1;
             break;
 
+        case 'f': // Format Flag
+            format_store = 1;
+            break;
+
         case 'u': // Unit test Flag
             unit_tests = 1;
             break;
@@ -104,6 +228,159 @@ int main(int argc, char* argv[])
             }
             break;
 
+        case 'w': // Set the metrics window size in operations
+            if (sscanf(optarg, "%u", &window_ops) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad metrics window [%s]", optarg);
+            }
+            break;
+
+        case 'T': // Set the metrics window size in milliseconds
+            if (sscanf(optarg, "%u", &window_ms) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad metrics window [%s]", optarg);
+            }
+            break;
+
+        case 's': // Set the metrics time series filename
+            series_file = optarg;
+            break;
+
+        case 'm': // Set the warm-up period
+            if (sscanf(optarg, "%u", &warmup_ops) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad warm-up period [%s]", optarg);
+            }
+            break;
+
+        case 'p': // Set the exported metrics filename
+            metrics_file = optarg;
+            break;
+
+        case 'j': // Set the trace filename
+            trace_file = optarg;
+            break;
+
+        case 'H': // Count the hardware events
+            perf_counters = 1;
+            break;
+
+        case 'M': // Set the memory budget
+            if (sscanf(optarg, "%lu", &memory_budget) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad memory budget [%s]", optarg);
+            }
+            break;
+
+        case 'g': // Set the cgroup watched for memory pressure
+            pressure_cgroup = optarg;
+            break;
+
+        case 'r': // Set the recording filename
+            record_file = optarg;
+            break;
+
+        case 'y': // Record the payloads
+            record_payloads = 1;
+            break;
+
+        case 'R': // Set the recording to replay
+            replay_recording = optarg;
+            break;
+
+        case 'e': // Enable the prefetcher
+            if (strcmp(optarg, "stride") == 0) {
+                prefetch = BLOCK_PREFETCH_STRIDE;
+            } else if (strcmp(optarg, "markov") == 0) {
+                prefetch = BLOCK_PREFETCH_MARKOV;
+            } else if (strcmp(optarg, "open") == 0) {
+                prefetch = BLOCK_PREFETCH_OPEN;
+            } else if (strcmp(optarg, "all") == 0) {
+                prefetch = BLOCK_PREFETCH_STRIDE | BLOCK_PREFETCH_MARKOV | BLOCK_PREFETCH_OPEN;
+            } else {
+                logMessage(LOG_ERROR_LEVEL, "Bad prefetch mode [%s]", optarg);
+            }
+            break;
+
+        case 'B': // Set the export filename
+            export_file = optarg;
+            break;
+
+        case 'G': // Set the generation the export starts from
+            if (sscanf(optarg, "%u", &export_since) != 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad generation [%s]", optarg);
+            }
+            break;
+
+        case 'D': // Set the files keeping the frames
+            backend_files = optarg;
+            break;
+
+        case 'A': // Set the archive to seal the store into
+            archive_file = optarg;
+            break;
+
+        case 'I': // Set the archive to read the frames from
+            image_file = optarg;
+            break;
+
+        case 'F': // Set the free slots kept by the cache reclaimer
+            if (sscanf(optarg, "%u,%u", &reclaim_low, &reclaim_high) != 2
+                || set_block_cache_watermarks(reclaim_low, reclaim_high) == -1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad cache watermarks [%s]", optarg);
+            }
+            break;
+
+        case 'K': // Set the erasure code of the frame files
+            if ((sscanf(optarg, "%d,%d", &data_shards, &parity_shards) != 2) || (data_shards < 1)
+                || (data_shards > BLOCK_ERASURE_MAX_DATA) || (parity_shards < 1)
+                || (parity_shards > BLOCK_ERASURE_MAX_PARITY)) {
+                logMessage(LOG_ERROR_LEVEL, "Bad erasure code [%s]", optarg);
+                data_shards = parity_shards = 0;
+            }
+            break;
+
+        case 'W': // Set the cache write policy of the files
+            for (write_policy = 0; write_policy < BLOCK_WRITE_POLICIES; write_policy++) {
+                if (strcmp(optarg, block_write_policy_name(write_policy)) == 0) {
+                    break;
+                }
+            }
+            if (write_policy == BLOCK_WRITE_POLICIES) {
+                logMessage(LOG_ERROR_LEVEL, "Bad write policy [%s]", optarg);
+                write_policy = BLOCK_WRITE_THROUGH;
+            }
+            break;
+
+        case 'b': // Set the size of the replay batches
+            if (sscanf(optarg, "%u", &replay_batch) != 1 || replay_batch > BLOCK_SIM_REPLAY_MAX_BATCH) {
+                logMessage(LOG_ERROR_LEVEL, "Bad replay batch size [%s]", optarg);
+                replay_batch = 0;
+            }
+            break;
+
+        case 'S': // Set the scaling benchmark
+            bench_spec = optarg;
+            break;
+
+        case 'Z': // Compress the data frames
+            block_set_compression(1);
+            break;
+
+        case 'L': // Set the recording to lay the store out by
+            layout_recording = optarg;
+            break;
+
+        case 'O': // Set the power on and off benchmark
+            if (sscanf(optarg, "%d", &mount_runs) != 1 || mount_runs < 1) {
+                logMessage(LOG_ERROR_LEVEL, "Bad number of power cycles [%s]", optarg);
+                mount_runs = BLOCK_BENCH_MOUNT_DEFAULT_RUNS;
+            }
+            break;
+
+        case 'x': // Set the pace of the replay
+            if (sscanf(optarg, "%lf", &replay_speed) != 1 || replay_speed < 0) {
+                logMessage(LOG_ERROR_LEVEL, "Bad replay speed [%s]", optarg);
+                replay_speed = 1.0;
+            }
+            break;
+
         default: // Default (unknown)
             fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
             return (-1);
@@ -122,12 +399,69 @@ int main(int argc, char* argv[])
         enableLogLevels(BlockControllerLLevel | BlockDriverLLevel | BlockSimulatorLLevel);
     }
 
+    // Start tracing as needed
+    if ((trace_file != NULL) && (block_trace_start(trace_file) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed starting the trace.");
+        return (-1);
+    }
+
+    // Start exporting the metrics as needed
+    if ((metrics_file != NULL) && (block_metrics_start(metrics_file, 0) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed starting the metrics exporter.");
+        return (-1);
+    }
+
     // Setup the cache size as needed
     if (cache_size != 0) {
         set_block_cache_size(cache_size);
     } else {
         cache_size = DEFAULT_BLOCK_FRAME_CACHE_SIZE;
     }
+    if (memory_budget != 0) {
+        block_set_memory_budget(memory_budget);
+    }
+    block_set_prefetch(prefetch);
+    if ((backend_files != NULL) && (data_shards != 0)) {
+        // The files of the erasure code, a file that can't be opened is a
+        // lost shard
+        for (sep = strtok(backend_files, ","); (sep != NULL) && (nshards < data_shards + parity_shards);
+             sep = strtok(NULL, ",")) {
+            shards[nshards++] = block_backend_file(sep);
+        }
+        if (nshards != data_shards + parity_shards) {
+            logMessage(LOG_ERROR_LEVEL, "The erasure code needs %d files.", data_shards + parity_shards);
+            return (-1);
+        }
+        if ((backend = block_backend_erasure(shards, data_shards, parity_shards)) == NULL) {
+            return (-1);
+        }
+        block_set_backend(backend);
+    } else if (backend_files != NULL) {
+        if ((sep = strchr(backend_files, ',')) != NULL) {
+            *sep = 0x0;
+            backend = block_backend_mirror(block_backend_file(backend_files), block_backend_file(sep + 1), 0);
+        } else {
+            backend = block_backend_file(backend_files);
+        }
+        if ((backend == NULL) || (block_set_backend(backend) == -1)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed opening the frame files [%s].", backend_files);
+            return (-1);
+        }
+    } else if (image_file != NULL) {
+        if (((backend = block_backend_archive(image_file)) == NULL) || (block_set_backend(backend) == -1)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed opening the archive [%s].", image_file);
+            return (-1);
+        }
+    }
+    if ((pressure_cgroup != NULL) && (block_pressure_start(pressure_cgroup) == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed watching [%s] for memory pressure.", pressure_cgroup);
+        return (-1);
+    }
+
+    // Count the hardware events, without counters the run goes on uncounted
+    if (perf_counters && (block_perf_start() == 0)) {
+        perf_counters = 0;
+    }
 
     // If exgtracting file from data
     if (unit_tests) {
@@ -136,12 +470,69 @@ int main(int argc, char* argv[])
         enableLogLevels(LOG_INFO_LEVEL);
         logMessage(LOG_INFO_LEVEL, "Running unit tests ....\n\n");
         // if ((block_unit_test() == 0) && (blockCacheUnitTest() == 0) && (blockCacheUnitTest() == 0)) {
-        if ((blockCacheUnitTest() == 0) && (blockCacheUnitTest() == 0)) {
+        if ((blockCacheUnitTest() == 0) && (blockCacheUnitTest() == 0) && (blockDriverUnitTest() == 0)
+            && (blockBackendUnitTest() == 0) && (blockErasureUnitTest() == 0) && (blockCompressUnitTest() == 0)
+            && (blockArchiveUnitTest() == 0) && (blockExportUnitTest() == 0)
+            && (blockMerkleUnitTest() == 0)) {
             logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
         } else {
             logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
         }
 
+    } else if (replay_recording != NULL) {
+
+        // Replay the recording
+        if (replay_BLOCK(replay_recording) == 0) {
+            logMessage(LOG_INFO_LEVEL, "BLOCK replay completed successfully.\n\n");
+        } else {
+            logMessage(LOG_INFO_LEVEL, "BLOCK replay failed.\n\n");
+        }
+
+    } else if (bench_spec != NULL) {
+
+        // Run the scaling benchmark
+        if (bench_BLOCK(bench_spec) == 0) {
+            logMessage(LOG_INFO_LEVEL, "BLOCK benchmark completed successfully.\n\n");
+        } else {
+            logMessage(LOG_INFO_LEVEL, "BLOCK benchmark failed.\n\n");
+        }
+
+    } else if (mount_runs > 0) {
+
+        // Run the power on and off benchmark
+        if (mount_BLOCK(mount_runs) == 0) {
+            logMessage(LOG_INFO_LEVEL, "BLOCK benchmark completed successfully.\n\n");
+        } else {
+            logMessage(LOG_INFO_LEVEL, "BLOCK benchmark failed.\n\n");
+        }
+
+    } else if (layout_recording != NULL) {
+
+        // Lay the store out
+        if (layout_BLOCK(layout_recording) == 0) {
+            logMessage(LOG_INFO_LEVEL, "BLOCK layout completed successfully.\n\n");
+        } else {
+            logMessage(LOG_INFO_LEVEL, "BLOCK layout failed.\n\n");
+        }
+
+    } else if (archive_file != NULL) {
+
+        // Seal the store
+        if (archive_BLOCK(archive_file) == 0) {
+            logMessage(LOG_INFO_LEVEL, "BLOCK archive completed successfully.\n\n");
+        } else {
+            logMessage(LOG_INFO_LEVEL, "BLOCK archive failed.\n\n");
+        }
+
+    } else if (export_file != NULL) {
+
+        // Export the store
+        if (export_BLOCK(export_file, export_since) == 0) {
+            logMessage(LOG_INFO_LEVEL, "BLOCK export completed successfully.\n\n");
+        } else {
+            logMessage(LOG_INFO_LEVEL, "BLOCK export failed.\n\n");
+        }
+
     } else {
 
         // The filename should be the next option
@@ -160,6 +551,46 @@ int main(int argc, char* argv[])
         }
     }
 
+    // Report the hardware events
+    if (perf_counters) {
+        block_perf_stop();
+        log_perf_counters();
+    }
+
+    // Complete the trace
+    if (blockTracing) {
+        block_trace_stop();
+    }
+
+    // Stop exporting the metrics and watching the memory pressure
+    if (metrics_file != NULL) {
+        block_metrics_stop();
+    }
+    if (pressure_cgroup != NULL) {
+        block_pressure_stop();
+    }
+
+    // Close the frame files, letting the mirror catch up
+    if (block_mirror_stats(backend, &mirror) == 0) {
+        logMessage(LOG_OUTPUT_LEVEL, "BLOCK mirror: %lu primary reads, %lu secondary reads, %lu failovers, "
+            "%lu repairs, %lu lag waits (secondary at most %u writes behind), %lu secondary failures, %lu resyncs, "
+            "%u stale frames.", mirror.primary_reads, mirror.secondary_reads, mirror.failovers, mirror.repairs,
+            mirror.lag_waits, mirror.max_lag, mirror.secondary_failures, mirror.resyncs, mirror.stale);
+    }
+    if (block_erasure_stats(backend, &erasure) == 0) {
+        logMessage(LOG_OUTPUT_LEVEL, "BLOCK erasure code %d+%d: %lu reads, %lu rebuilt, %lu repaired, %lu full "
+            "stripes, %lu partial stripes (%lu frames read to write them).", data_shards, parity_shards,
+            erasure.reads, erasure.reconstructions, erasure.repairs, erasure.full_stripes, erasure.partial_stripes,
+            erasure.stripe_reads);
+    }
+    if (block_archive_stats(backend, &archive) == 0) {
+        logMessage(LOG_OUTPUT_LEVEL, "BLOCK archive: %lu frames read (%lu not in the image), %lu chunks "
+            "decompressed, %lu bad frames.", archive.reads, archive.zero_reads, archive.decodes, archive.bad_frames);
+    }
+    if (backend != NULL) {
+        block_set_backend(NULL);
+    }
+
     // Return successfully
     return (0);
 }
@@ -200,6 +631,19 @@ int simulate_BLOCK(char* wload)
         fclose(fhandle);
         return (-1);
     }
+    if (format_store && (block_format() == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed formatting the storage.");
+        fclose(fhandle);
+        return (-1);
+    }
+    if (open_metrics() == -1) {
+        fclose(fhandle);
+        return (-1);
+    }
+    if ((record_file != NULL) && (block_record_start(record_file, record_payloads) == -1)) {
+        fclose(fhandle);
+        return (-1);
+    }
     logMessage(BlockSimulatorLLevel, "BLOCK simulator initialization complete.");
 
     // While file not done
@@ -246,7 +690,7 @@ int simulate_BLOCK(char* wload)
                 ftable[idx].filename = strdup(fname);
 
                 // Now perform the open
-                ftable[idx].fhandle = block_open(ftable[idx].filename);
+                ftable[idx].fhandle = block_open_policy(ftable[idx].filename, write_policy);
                 if (ftable[idx].fhandle == -1) {
                     // Failed, error out
                     logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
@@ -340,6 +784,7 @@ int simulate_BLOCK(char* wload)
                 // Bomb out, don't understand the command
                 CMPSC_ASSERT1(0, "BLOCK_SIM : Failed, unknown command [%s]", command);
             }
+            sample_metrics(0);
         }
 
         // Check for the virtual level failing
@@ -350,6 +795,13 @@ int simulate_BLOCK(char* wload)
         }
     }
 
+    // Close the last metrics window, validation is not part of the workload
+    sample_metrics(1);
+    close_metrics();
+    if (record_file != NULL) {
+        block_record_stop();
+    }
+
     // Now walk the the table looking for the file
     for (i = 0; i < BLOCK_SIM_MAX_OPEN_FILES; i++) {
         if (ftable[i].filename != NULL) {
@@ -369,6 +821,9 @@ int simulate_BLOCK(char* wload)
     }
     logMessage(BlockSimulatorLLevel, "BLOCK simulator shutdown complete.");
     logMessage(LOG_OUTPUT_LEVEL, "BLOCK simulation: all tests successful!!!.");
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK store at generation %u.", block_generation());
+    log_write_policy();
+    log_compression();
 
     // calculate cache performance
     logMessage(LOG_OUTPUT_LEVEL, "========== Cache Performance ==========");
@@ -385,6 +840,554 @@ int simulate_BLOCK(char* wload)
     return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_BLOCK
+// Description  : Replay a recording of driver calls, paced like the recorded
+//                calls. The calls of all the threads are replayed in the
+//                order they were recorded, from this thread.
+//
+// Inputs       : recording - the name of the recording
+// Outputs      : 0 if successful replay, -1 if failure
+
+int replay_BLOCK(char* recording)
+{
+
+    // Local variables
+    BlockRecordHeader header;
+    BlockRecordEntry entry;
+    FILE* fhandle = NULL;
+    char* data;
+    int16_t fdmap[BLOCK_MAX_TOTAL_FILES];
+    uint32_t tids[BLOCK_SIM_REPLAY_MAX_THREADS];
+    uint64_t start, due, now, calls = 0, mismatches = 0;
+    int32_t result, i, ret, ntids = 0;
+    struct timespec pause;
+    BlockBatchOp* ops = NULL;
+    BlockBatchOp* op;
+    BlockRecordEntry* chunk = NULL;
+    int32_t nops = 0;
+
+    // Open the recording, the data buffer fits the largest file and a terminator
+    if (block_record_open(recording, &fhandle, &header) == -1) {
+        return (-1);
+    }
+    data = malloc(BLOCK_SIM_REPLAY_BUFFER + 1);
+    CMPSC_ASSERT0(data != NULL, "Failed allocating the replay buffer");
+    memset(fdmap, 0xff, sizeof(fdmap));
+    if (replay_batch > 0) {
+        ops = malloc(sizeof(BlockBatchOp) * replay_batch);
+        chunk = malloc(sizeof(BlockRecordEntry) * replay_batch);
+        CMPSC_ASSERT0((ops != NULL) && (chunk != NULL), "Failed allocating the replay batch");
+    }
+
+    // Startup the interface
+    if ((block_poweron() == -1) || (format_store && (block_format() == -1)) || (open_metrics() == -1)) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed initialization.");
+        free(data);
+        free(ops);
+        free(chunk);
+        fclose(fhandle);
+        return (-1);
+    }
+    logMessage(BlockSimulatorLLevel, "BLOCK replay of [%s] (%s) started.", recording,
+        (header.flags & BLOCK_RECORD_PAYLOADS) ? "payloads" : "hashes only");
+
+    start = block_stats_clock();
+    while ((ret = block_record_next(fhandle, &entry, data, BLOCK_SIM_REPLAY_BUFFER + 1)) == 1) {
+
+        // Wait for the time the call was made at (the first call of a batch)
+        if (replay_speed > 0 && nops == 0) {
+            due = start + (uint64_t)(entry.ts_ns / replay_speed);
+            now = block_stats_clock();
+            if (due > now) {
+                pause.tv_sec = (due - now) / 1000000000ULL;
+                pause.tv_nsec = (due - now) % 1000000000ULL;
+                nanosleep(&pause, NULL);
+            }
+        }
+        for (i = 0; i < ntids && tids[i] != entry.tid; i++) {
+        }
+        if (i == ntids && ntids < BLOCK_SIM_REPLAY_MAX_THREADS) {
+            tids[ntids++] = entry.tid;
+        }
+        if ((entry.fd < 0) || (entry.fd >= BLOCK_MAX_TOTAL_FILES)
+            || ((entry.op != BLOCK_RECORD_OPEN) && (fdmap[entry.fd] == -1))) {
+            logMessage(LOG_ERROR_LEVEL, "BLOCK replay on unknown file handle %d, aborting.", entry.fd);
+            ret = -1;
+            break;
+        }
+        if (((entry.op == BLOCK_RECORD_READ) || (entry.op == BLOCK_RECORD_WRITE))
+            && ((entry.arg < 0) || (entry.arg > BLOCK_SIM_REPLAY_BUFFER))) {
+            logMessage(LOG_ERROR_LEVEL, "BLOCK replay of a call of %d bytes, aborting.", entry.arg);
+            ret = -1;
+            break;
+        }
+
+        // Without the payload, write bytes derived from its hash
+        if ((entry.op == BLOCK_RECORD_WRITE) && (entry.length == 0)) {
+            for (i = 0; i < entry.arg; i++) {
+                data[i] = 'a' + (entry.hash + i) % 26;
+            }
+        }
+
+        // Queue the call in the batch, the batch runs once full
+        if (replay_batch > 0) {
+            op = &ops[nops];
+            memset(op, 0, sizeof(BlockBatchOp));
+            op->fd = fdmap[entry.fd];
+            op->count = entry.arg;
+            switch (entry.op) {
+            case BLOCK_RECORD_OPEN:
+                data[entry.length] = 0x0;
+                op->type = BLOCK_BATCH_OPEN;
+                op->path = strdup(data);
+                fdmap[entry.fd] = BLOCK_BATCH_OPENED(nops);
+                break;
+            case BLOCK_RECORD_CLOSE:
+                op->type = BLOCK_BATCH_CLOSE;
+                break;
+            case BLOCK_RECORD_SEEK:
+                op->type = BLOCK_BATCH_SEEK;
+                break;
+            case BLOCK_RECORD_WRITE:
+            case BLOCK_RECORD_READ:
+                op->type = (entry.op == BLOCK_RECORD_WRITE) ? BLOCK_BATCH_WRITE : BLOCK_BATCH_READ;
+                op->buf = malloc(entry.arg > 0 ? entry.arg : 1);
+                CMPSC_ASSERT0(op->buf != NULL, "Failed allocating the replay batch");
+                if (entry.op == BLOCK_RECORD_WRITE) {
+                    memcpy(op->buf, data, entry.arg);
+                }
+                break;
+            default:
+                CMPSC_ASSERT1(0, "BLOCK_SIM : Failed, unknown recorded call [%d]", entry.op);
+            }
+            chunk[nops++] = entry;
+            if (nops == replay_batch) {
+                mismatches += replay_chunk(ops, chunk, nops, fdmap, header.flags);
+                nops = 0;
+            }
+            calls++;
+            continue;
+        }
+
+        // Now execute the recorded call
+        switch (entry.op) {
+        case BLOCK_RECORD_OPEN:
+            data[entry.length] = 0x0;
+            fdmap[entry.fd] = result = block_open_policy(data, write_policy);
+            break;
+
+        case BLOCK_RECORD_CLOSE:
+            result = block_close(fdmap[entry.fd]);
+            break;
+
+        case BLOCK_RECORD_SEEK:
+            result = block_seek(fdmap[entry.fd], entry.arg);
+            break;
+
+        case BLOCK_RECORD_WRITE:
+            result = block_write(fdmap[entry.fd], data, entry.arg);
+            break;
+
+        case BLOCK_RECORD_READ:
+            result = block_read(fdmap[entry.fd], data, entry.arg);
+            if ((header.flags & BLOCK_RECORD_PAYLOADS) && (result > 0)
+                && (block_record_hash(data, result) != entry.hash)) {
+                mismatches++;
+            }
+            break;
+
+        default:
+            CMPSC_ASSERT1(0, "BLOCK_SIM : Failed, unknown recorded call [%d]", entry.op);
+        }
+        if ((entry.op != BLOCK_RECORD_OPEN) && (result != entry.result)) {
+            mismatches++;
+        }
+        calls++;
+        sample_metrics(0);
+    }
+    if (nops > 0) {
+        mismatches += replay_chunk(ops, chunk, nops, fdmap, header.flags);
+    }
+    free(data);
+    free(ops);
+    free(chunk);
+    fclose(fhandle);
+    sample_metrics(1);
+    close_metrics();
+    if (ret == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK replay of [%s] failed after %lu calls.", recording, calls);
+        return (-1);
+    }
+
+    // Shut down the interface
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed shutdown.");
+        return (-1);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK replay: %lu calls from %d threads in %.3f s, %lu mismatches.", calls,
+        ntids, (block_stats_clock() - start) / 1e9, mismatches);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_chunk
+// Description  : Replay a batch of recorded calls with one block_batch call,
+//                then check the results and release the buffers of the batch
+//
+// Inputs       : ops - the calls of the batch
+//                entries - the recorded calls
+//                n - the number of calls
+//                fdmap - the handles of the recorded handles, those opened
+//                        in the batch are replaced by the handles returned
+//                flags - the flags of the recording
+// Outputs      : the number of results that differ from the recording
+
+uint64_t replay_chunk(BlockBatchOp* ops, BlockRecordEntry* entries, int32_t n, int16_t* fdmap, uint16_t flags)
+{
+    uint64_t mismatches = 0;
+    int32_t i;
+
+    block_batch(ops, n);
+    for (i = 0; i < n; i++) {
+        if (entries[i].op == BLOCK_RECORD_OPEN) {
+            if (fdmap[entries[i].fd] == BLOCK_BATCH_OPENED(i)) {
+                fdmap[entries[i].fd] = ops[i].result;
+            }
+        } else if (ops[i].result != entries[i].result) {
+            mismatches++;
+        }
+        if ((entries[i].op == BLOCK_RECORD_READ) && (flags & BLOCK_RECORD_PAYLOADS) && (ops[i].result > 0)
+            && (block_record_hash(ops[i].buf, ops[i].result) != entries[i].hash)) {
+            mismatches++;
+        }
+        free(ops[i].path);
+        free(ops[i].buf);
+        sample_metrics(0);
+    }
+    return (mismatches);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : export_BLOCK
+// Description  : Export the frames of the store written after a generation,
+//                the generation printed is where the next export starts
+//
+// Inputs       : path - the name of the export to create
+//                since - the generation of the previous export (0 for all)
+// Outputs      : 0 if successful export, -1 if failure
+
+int export_BLOCK(char* path, uint32_t since)
+{
+    uint32_t frames, nr_files;
+    uint64_t start;
+
+    // Startup the interface
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed initialization.");
+        return (-1);
+    }
+    start = block_stats_clock();
+    if (block_export(path, since, &frames, &nr_files) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK export to [%s] failed.", path);
+        block_poweroff();
+        return (-1);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK export: %u frames of %u files written after generation %u%s in %.3f s, "
+        "next export from generation %u.", frames, nr_files, since,
+        (since < block_format_generation()) ? " (store formatted since, full export)" : "",
+        (block_stats_clock() - start) / 1e9, block_generation());
+
+    // Shut down the interface
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed shutdown.");
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : layout_BLOCK
+// Description  : Lay the frames of the store out by the accesses of a
+//                recording
+//
+// Inputs       : recording - the recording
+// Outputs      : 0 if successful, -1 if failure
+
+int layout_BLOCK(char* recording)
+{
+    BlockLayoutStats stats;
+    uint64_t start;
+
+    // Startup the interface
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed initialization.");
+        return (-1);
+    }
+    start = block_stats_clock();
+    if (block_layout_optimize(recording, &stats) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK layout by [%s] failed.", recording);
+        block_poweroff();
+        return (-1);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK layout: %u accesses to %u frames joined into %u chains, %u frames moved in "
+        "%.3f s.", stats.accesses, stats.frames, stats.chains, stats.moved, (block_stats_clock() - start) / 1e9);
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK layout: runs broken %u -> %u times, mean distance between accesses "
+        "%.1f -> %.1f frames.", stats.breaks_before, stats.breaks_after,
+        (stats.accesses > 1) ? (double)stats.distance_before / (stats.accesses - 1) : 0.0,
+        (stats.accesses > 1) ? (double)stats.distance_after / (stats.accesses - 1) : 0.0);
+
+    // Shut down the interface
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed shutdown.");
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : archive_BLOCK
+// Description  : Seal the store into an archive
+//
+// Inputs       : image - the archive to create
+// Outputs      : 0 if successful, -1 if failure
+
+int archive_BLOCK(char* image)
+{
+    BlockArchiveSeal seal;
+    uint64_t start;
+
+    // Startup the interface
+    if (block_poweron() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed initialization.");
+        return (-1);
+    }
+    start = block_stats_clock();
+    if (block_archive_seal(image, &seal) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK archive to [%s] failed.", image);
+        block_poweroff();
+        return (-1);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK archive: %u files, %u frames (%u zero frames left out) sealed in %u chunks "
+        "(%u stored raw) in %.3f s.", seal.names, seal.frames, seal.zero_frames, seal.chunks, seal.raw_chunks,
+        (block_stats_clock() - start) / 1e9);
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK archive: image of %lu bytes, %.2fx smaller than its frames.",
+        seal.image_bytes, (seal.image_bytes != 0) ? (double)seal.frames * BLOCK_FRAME_SIZE / seal.image_bytes : 0.0);
+
+    // Shut down the interface
+    if (block_poweroff() == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK simulator failed shutdown.");
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_write_policy
+// Description  : Log the cache counters of the write policies
+//
+// Inputs       : none
+// Outputs      : none
+
+void log_write_policy(void)
+{
+    BlockCacheStats cstats;
+    int i;
+
+    get_block_cache_stats(&cstats, NULL);
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK write policy %s: %lu write-backs, %lu writes absorbed by dirty frames.",
+        block_write_policy_name(write_policy), cstats.writebacks, cstats.absorbed);
+    for (i = 0; i < BLOCK_WRITE_POLICIES; i++) {
+        if (cstats.policy_writes[i] != 0) {
+            logMessage(LOG_OUTPUT_LEVEL, "  write-%s: %lu frames written, %lu added to the cache.",
+                block_write_policy_name(i), cstats.policy_writes[i], cstats.policy_inserts[i]);
+        }
+    }
+    if (cstats.reclaimed != 0 || cstats.stalls != 0) {
+        logMessage(LOG_OUTPUT_LEVEL, "BLOCK cache reclaimer: %lu frames evicted ahead (%lu written back), %lu inserts "
+            "evicted inline.", cstats.reclaimed, cstats.reclaim_writebacks, cstats.stalls);
+    }
+    if (cstats.writeback_failures != 0) {
+        logMessage(LOG_OUTPUT_LEVEL, "BLOCK cache: %lu dirty frames could not be written back.", cstats.writeback_failures);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_compression
+// Description  : Log the data frames written compressed and the space they
+//                took, when compression is on
+//
+// Inputs       : none
+// Outputs      : none
+
+void log_compression(void)
+{
+    BlockDriverStats stats;
+
+    if (!block_get_compression()) {
+        return;
+    }
+    block_get_stats(&stats);
+    logMessage(LOG_OUTPUT_LEVEL, "BLOCK compression: %lu frames packed in %lu bytes (%.1f%% of their size), %lu written raw.",
+        stats.packed_frames, stats.packed_bytes,
+        (stats.packed_frames != 0) ? 100.0 * stats.packed_bytes / (stats.packed_frames * BLOCK_FRAME_SIZE) : 0.0,
+        stats.raw_frames);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_perf_counters
+// Description  : Log the hardware events of each phase, in total and per
+//                driver call, with the instructions per cycle and the misses
+//                per thousand instructions that tell compute bound phases
+//                from memory bound ones
+//
+// Inputs       : none
+// Outputs      : none
+
+void log_perf_counters(void)
+{
+    BlockPerfCounters phases[BLOCK_PERF_PHASES];
+    BlockPerfCounters* phase;
+    BlockDriverStats stats;
+    uint64_t ops;
+    char line[256];
+    int i, j, len;
+
+    block_perf_read(phases);
+    block_get_stats(&stats);
+    ops = stats.opens + stats.closes + stats.reads + stats.writes + stats.seeks;
+    logMessage(LOG_OUTPUT_LEVEL, "========== Hardware Counters ==========");
+    logMessage(LOG_OUTPUT_LEVEL, "%lu driver calls, counts per call (total):", ops);
+    for (i = 0; i < BLOCK_PERF_PHASES; i++) {
+        phase = &phases[i];
+        len = snprintf(line, sizeof(line), "%-8s", block_perf_phase_name(i));
+        for (j = 0; j < BLOCK_PERF_COUNTERS; j++) {
+            if (block_perf_available(j)) {
+                len += snprintf(line + len, sizeof(line) - len, " %s %.1f (%lu)", block_perf_counter_name(j),
+                    ops ? (double)phase->values[j] / ops : 0.0, phase->values[j]);
+            }
+        }
+        logMessage(LOG_OUTPUT_LEVEL, "%s", line);
+        if (block_perf_available(BLOCK_PERF_CYCLES) && block_perf_available(BLOCK_PERF_INSTRUCTIONS)
+            && phase->values[BLOCK_PERF_CYCLES] != 0 && phase->values[BLOCK_PERF_INSTRUCTIONS] != 0) {
+            logMessage(LOG_OUTPUT_LEVEL, "         IPC %.2f, LLC misses %.2f, dTLB misses %.2f and branch misses "
+                "%.2f per 1000 instructions",
+                (double)phase->values[BLOCK_PERF_INSTRUCTIONS] / phase->values[BLOCK_PERF_CYCLES],
+                1000.0 * phase->values[BLOCK_PERF_LLC_MISSES] / phase->values[BLOCK_PERF_INSTRUCTIONS],
+                1000.0 * phase->values[BLOCK_PERF_DTLB_MISSES] / phase->values[BLOCK_PERF_INSTRUCTIONS],
+                1000.0 * phase->values[BLOCK_PERF_BRANCH_MISSES] / phase->values[BLOCK_PERF_INSTRUCTIONS]);
+        }
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "=======================================");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_BLOCK
+// Description  : Run the thread scaling benchmark and log its speedup curve
+//
+// Inputs       : spec - <threads>[,<sharing>[,<read-percent>[,<ops>]]]
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_BLOCK(char* spec)
+{
+    BlockBenchScaling config;
+    BlockBenchStep steps[16];
+    char sharing[16] = "disjoint";
+    int i, nbSteps;
+
+    memset(&config, 0, sizeof(config));
+    config.read_percent = 50;
+    config.ops = BLOCK_BENCH_DEFAULT_OPS;
+    if (sscanf(spec, "%d,%15[a-z],%d,%u", &config.max_threads, sharing, &config.read_percent, &config.ops) < 1) {
+        logMessage(LOG_ERROR_LEVEL, "Bad benchmark [%s]", spec);
+        return (-1);
+    }
+    for (config.sharing = 0; config.sharing < BLOCK_BENCH_SHARINGS; config.sharing++) {
+        if (strcmp(sharing, block_bench_sharing_name(config.sharing)) == 0) {
+            break;
+        }
+    }
+    if ((nbSteps = block_bench_scaling(&config, steps, 16)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK benchmark [%s] failed.", spec);
+        return (-1);
+    }
+
+    logMessage(LOG_OUTPUT_LEVEL, "========== Thread Scaling ==========");
+    logMessage(LOG_OUTPUT_LEVEL, "%u operations of %d bytes, %d%% reads, %s files.", config.ops,
+        BLOCK_BENCH_IO_SIZE, config.read_percent, block_bench_sharing_name(config.sharing));
+    logMessage(LOG_OUTPUT_LEVEL, "threads      ops/s    p99 us  lock wait ms (share)  speedup");
+    for (i = 0; i < nbSteps; i++) {
+        logMessage(LOG_OUTPUT_LEVEL, "%7d %10.0f %9.1f %13.1f (%5.1f%%) %8.2f", steps[i].threads,
+            steps[i].ops_per_sec, steps[i].p99_us, steps[i].lock_wait_ms, 100.0 * steps[i].lock_wait_share,
+            steps[i].speedup);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "====================================");
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_mount_profiles
+// Description  : Log the power on or the power off breakdown of each store
+//
+// Inputs       : title - the title of the table
+//                results - the stores measured
+//                nbResults - the number of stores
+//                poweroff - 0 to log the power ons, 1 the power offs
+// Outputs      : none
+
+static void log_mount_profiles(const char* title, const BlockBenchMount* results, int nbResults, int poweroff)
+{
+    const BlockMountProfile* p;
+    int i;
+
+    logMessage(LOG_OUTPUT_LEVEL, "%s", title);
+    logMessage(LOG_OUTPUT_LEVEL, "files frag frames   mean ms    max ms   ctrl ms    bus ms  cksum ms  alloc ms  cache ms  bus r/w");
+    for (i = 0; i < nbResults; i++) {
+        p = poweroff ? &results[i].poweroff : &results[i].poweron;
+        logMessage(LOG_OUTPUT_LEVEL, "%5d %3d%% %6d %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f  %lu/%lu",
+            results[i].files, results[i].fragmentation, results[i].frames, p->total_ns / 1e6,
+            (poweroff ? results[i].poweroff_max_ns : results[i].poweron_max_ns) / 1e6, p->controller_ns / 1e6,
+            p->bus_ns / 1e6,
+            p->checksum_ns / 1e6, p->allocator_ns / 1e6, p->cache_ns / 1e6, p->bus_reads, p->bus_writes);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mount_BLOCK
+// Description  : Run the power on and off benchmark and log the breakdowns
+//
+// Inputs       : runs - the power cycles of each store
+// Outputs      : 0 if successful, -1 if failure
+
+int mount_BLOCK(int runs)
+{
+    BlockBenchMount results[BLOCK_BENCH_MOUNT_STORES];
+    int nbResults;
+
+    if ((nbResults = block_bench_mount(runs, results, BLOCK_BENCH_MOUNT_STORES)) == -1) {
+        logMessage(LOG_ERROR_LEVEL, "BLOCK power on and off benchmark failed.");
+        return (-1);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "========== Power On / Off ==========");
+    logMessage(LOG_OUTPUT_LEVEL, "%d power cycles of each store, files of %d frames.", runs,
+        BLOCK_BENCH_MOUNT_FILE_FRAMES);
+    log_mount_profiles("Power on:", results, nbResults, 0);
+    log_mount_profiles("Power off (after rewriting the start of each file):", results, nbResults, 1);
+    logMessage(LOG_OUTPUT_LEVEL, "====================================");
+    return (0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : validate_file
@@ -469,3 +1472,193 @@ int validate_file(char* fname, int16_t mfh)
     logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
     return (0);
 }
+
+//
+// Metrics sampling
+
+// Sampling state
+FILE* series_handle = NULL; // Output for the time series
+int series_json = 0; // Series is written as JSON instead of CSV
+uint64_t series_rows = 0; // Number of windows written so far
+uint64_t sampled_ops = 0; // Workload operations executed so far
+uint64_t window_count = 0; // Workload operations in the current window
+uint64_t run_start_ns = 0; // Time the workload started
+uint64_t window_start_ns = 0; // Time the current window started
+BlockDriverStats window_start; // Counters when the current window started
+BlockDriverStats warmup_end; // Counters when the warm-up period ended
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_metrics
+// Description  : Start sampling the driver metrics (if enabled)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int open_metrics(void)
+{
+    int len;
+
+    sampled_ops = window_count = series_rows = 0;
+    run_start_ns = window_start_ns = block_stats_clock();
+    block_get_stats(&window_start);
+    block_get_stats(&warmup_end);
+    if (series_file == NULL) {
+        return (0);
+    }
+
+    // Open the series and write the header
+    if ((series_handle = fopen(series_file, "w")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the metrics file [%s], error: %s.",
+            series_file, strerror(errno));
+        return (-1);
+    }
+    len = strlen(series_file);
+    series_json = (len > 5) && (strcmp(series_file + len - 5, ".json") == 0);
+    if (series_json) {
+        fprintf(series_handle, "[\n");
+    } else {
+        fprintf(series_handle, "window,start_ms,end_ms,warmup,ops,reads,writes,bytes_read,"
+                               "bytes_written,cache_hits,cache_misses,hit_ratio,bus_ops,"
+                               "p50_us,p99_us\n");
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_metrics
+// Description  : Count a workload operation and write out the metrics window
+//                when it is complete
+//
+// Inputs       : final - 1 to close the current window whatever its size
+// Outputs      : none
+
+void sample_metrics(int final)
+{
+    BlockDriverStats now, delta;
+    BlockLatencyHistogram latency;
+    uint64_t ts;
+    double ratio;
+
+    if (!final) {
+        sampled_ops++;
+        window_count++;
+        if (sampled_ops == warmup_ops) {
+            block_get_stats(&warmup_end);
+        }
+    }
+    if ((window_ops == 0) && (window_ms == 0)) {
+        return;
+    }
+
+    // Check if the window is complete
+    ts = block_stats_clock();
+    if (!(final && window_count > 0) && !(window_ops != 0 && window_count >= window_ops)
+        && !(window_ms != 0 && ts - window_start_ns >= (uint64_t)window_ms * 1000000)) {
+        return;
+    }
+
+    // Compute what happened during the window
+    block_get_stats(&now);
+    block_stats_delta(&now, &window_start, &delta);
+    latency = delta.read_latency;
+    block_histogram_merge(&latency, &delta.write_latency);
+    ratio = (delta.cache_hits + delta.cache_misses) ? (double)delta.cache_hits / (delta.cache_hits + delta.cache_misses) : 0.0;
+
+    // Write out the window
+    if (series_handle != NULL && series_json) {
+        fprintf(series_handle, "%s  {\"window\": %lu, \"start_ms\": %.3f, \"end_ms\": %.3f, \"warmup\": %d, "
+                               "\"ops\": %lu, \"reads\": %lu, \"writes\": %lu, \"bytes_read\": %lu, "
+                               "\"bytes_written\": %lu, \"cache_hits\": %lu, \"cache_misses\": %lu, "
+                               "\"hit_ratio\": %.4f, \"bus_ops\": %lu, \"p50_us\": %.3f, \"p99_us\": %.3f}",
+            series_rows ? ",\n" : "", series_rows, (window_start_ns - run_start_ns) / 1e6, (ts - run_start_ns) / 1e6,
+            sampled_ops <= warmup_ops, window_count, delta.reads, delta.writes, delta.bytes_read,
+            delta.bytes_written, delta.cache_hits, delta.cache_misses, ratio, delta.bus_ops,
+            block_histogram_percentile(&latency, 50) / 1e3, block_histogram_percentile(&latency, 99) / 1e3);
+    } else if (series_handle != NULL) {
+        fprintf(series_handle, "%lu,%.3f,%.3f,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.4f,%lu,%.3f,%.3f\n",
+            series_rows, (window_start_ns - run_start_ns) / 1e6, (ts - run_start_ns) / 1e6,
+            sampled_ops <= warmup_ops, window_count, delta.reads, delta.writes, delta.bytes_read,
+            delta.bytes_written, delta.cache_hits, delta.cache_misses, ratio, delta.bus_ops,
+            block_histogram_percentile(&latency, 50) / 1e3, block_histogram_percentile(&latency, 99) / 1e3);
+    }
+    logMessage(BlockSimulatorLLevel, "BLOCK_SIM : window %lu, %lu ops, hit ratio %.2f%%, %lu bus ops",
+        series_rows, window_count, ratio * 100, delta.bus_ops);
+
+    // Start the next window
+    series_rows++;
+    window_count = 0;
+    window_start_ns = ts;
+    window_start = now;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_metrics
+// Description  : Stop sampling and log the driver metrics summary, leaving out
+//                the warm-up period
+//
+// Inputs       : none
+// Outputs      : none
+
+void close_metrics(void)
+{
+    BlockDriverStats now, delta;
+    BlockLatencyHistogram latency;
+    BlockMemoryUsage memory;
+    BlockFileTop top[BLOCK_SIM_TOP_FILES];
+    int i, found;
+
+    if (series_handle != NULL) {
+        if (series_json) {
+            fprintf(series_handle, "\n]\n");
+        }
+        fclose(series_handle);
+        series_handle = NULL;
+    }
+    if ((window_ops == 0) && (window_ms == 0) && (warmup_ops == 0)) {
+        return;
+    }
+
+    // Log the summary of the measured part of the run
+    block_get_stats(&now);
+    if (sampled_ops < warmup_ops) {
+        warmup_end = now;
+        warmup_ops = sampled_ops;
+    }
+    block_stats_delta(&now, &warmup_end, &delta);
+    latency = delta.read_latency;
+    block_histogram_merge(&latency, &delta.write_latency);
+    logMessage(LOG_OUTPUT_LEVEL, "========== Driver Performance ==========");
+    logMessage(LOG_OUTPUT_LEVEL, "Operations: %lu (%u warm-up left out)", sampled_ops - warmup_ops, warmup_ops);
+    logMessage(LOG_OUTPUT_LEVEL, "Bytes read/written: %lu/%lu", delta.bytes_read, delta.bytes_written);
+    logMessage(LOG_OUTPUT_LEVEL, "Cache hits/misses: %lu/%lu", delta.cache_hits, delta.cache_misses);
+    logMessage(LOG_OUTPUT_LEVEL, "Bus ops: %lu (%lu bytes, %lu of metadata)", delta.bus_ops,
+        delta.bus_bytes_read + delta.bus_bytes_written, delta.bus_meta_bytes);
+    logMessage(LOG_OUTPUT_LEVEL, "Read amplification: %.2f bus bytes/byte, %.4f checksums/byte",
+        block_amplification(delta.read_bus_bytes, delta.bytes_read),
+        block_amplification(delta.read_checksums, delta.bytes_read));
+    logMessage(LOG_OUTPUT_LEVEL, "Write amplification: %.2f bus bytes/byte, %.4f checksums/byte",
+        block_amplification(delta.write_bus_bytes, delta.bytes_written),
+        block_amplification(delta.write_checksums, delta.bytes_written));
+    logMessage(LOG_OUTPUT_LEVEL, "Latency p50/p99: %.3f/%.3f us",
+        block_histogram_percentile(&latency, 50) / 1e3, block_histogram_percentile(&latency, 99) / 1e3);
+    if (block_get_prefetch()) {
+        logMessage(LOG_OUTPUT_LEVEL, "Prefetches: %lu, %lu at open (%.1f%% accurate, %lu wasted, %lu evictions)",
+            delta.prefetches, delta.open_prefetches, 100.0 * block_amplification(delta.prefetch_hits, delta.prefetches),
+            delta.prefetch_wasted, delta.prefetch_evictions);
+    }
+    block_memory_usage(&memory);
+    logMessage(LOG_OUTPUT_LEVEL, "Memory: %lu bytes (cache %lu + %lu)", memory.total,
+        memory.bytes[BLOCK_MEM_CACHE_PAYLOAD], memory.bytes[BLOCK_MEM_CACHE_METADATA]);
+    found = block_fstats_top(BLOCK_FSTATS_BUS_OPS, BLOCK_SIM_TOP_FILES, top);
+    for (i = 0; i < found; i++) {
+        logMessage(LOG_OUTPUT_LEVEL, "Top file %d [%s]: %lu bus ops, %lu misses, %lu/%lu bytes, %.2fx amplified, %.3f ms",
+            i + 1, top[i].name, top[i].stats.bus_ops, top[i].stats.cache_misses, top[i].stats.bytes_read,
+            top[i].stats.bytes_written,
+            block_amplification(top[i].stats.bus_bytes, top[i].stats.bytes_read + top[i].stats.bytes_written),
+            top[i].stats.latency_ns / 1e6);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "========================================");
+}
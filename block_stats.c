@@ -0,0 +1,822 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_stats.c
+//  Description    : This is the implementation of the counters and latency
+//                   histograms kept by the BLOCK memory system driver, and
+//                   of the metrics exporter.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_cache.h>
+#include <block_driver.h>
+#include <block_memory.h>
+#include <block_stats.h>
+#include <cmpsc311_log.h>
+
+// A registered per-thread shard of the counters
+typedef struct stats_shard {
+    BlockDriverStats stats;
+    BlockFileStats files[BLOCK_MAX_TOTAL_FILES];
+    struct stats_shard* next;
+} StatsShard;
+
+// Global data
+__thread BlockDriverStats* blockStatsLocal = NULL;
+__thread BlockFileStats* blockFileStatsLocal = NULL;
+StatsShard statsRetired; // Counts of the threads that exited, always the last shard of the list
+StatsShard* statsShards = &statsRetired; // The shards of the live threads, and the retired counts
+StatsShard* statsFree = NULL; // Shards of the threads that exited, for the next threads
+pthread_mutex_t statsShardsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t statsKey; // Retires the shard of a thread when it exits
+pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+
+// Metrics exporter state
+pthread_t metricsThread;
+pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t metricsWake = PTHREAD_COND_INITIALIZER;
+int metricsRunning = 0;
+char* metricsPath = NULL;
+uint32_t metricsInterval = BLOCK_METRICS_INTERVAL_MS;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_get_stats
+// Description  : Sum the driver counters of all the threads into "stats"
+//
+// Inputs       : stats - the structure to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int block_get_stats(BlockDriverStats* stats)
+{
+    StatsShard* shard;
+    uint64_t* sum = (uint64_t*)stats;
+    uint64_t* counters;
+    size_t i;
+
+    if (stats == NULL) {
+        return (-1);
+    }
+    memset(stats, 0, sizeof(BlockDriverStats));
+    pthread_mutex_lock(&statsShardsLock);
+    for (shard = statsShards; shard != NULL; shard = shard->next) {
+        counters = (uint64_t*)&shard->stats;
+        for (i = 0; i < sizeof(BlockDriverStats) / sizeof(uint64_t); i++) {
+            sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&statsShardsLock);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stats_thread_exit
+// Description  : Retire the shard of a thread that exits, its counts are
+//                added to the retired ones and the shard is cleared and kept
+//                for the next thread
+//
+// Inputs       : arg - the shard of the thread
+// Outputs      : none
+
+static void stats_thread_exit(void* arg)
+{
+    StatsShard* shard = (StatsShard*)arg;
+    StatsShard** link;
+    uint64_t* retired = (uint64_t*)&statsRetired;
+    uint64_t* counters = (uint64_t*)shard;
+    size_t i;
+
+    pthread_mutex_lock(&statsShardsLock);
+    for (link = &statsShards; *link != shard; link = &(*link)->next) {
+    }
+    *link = shard->next;
+    for (i = 0; i < offsetof(StatsShard, next) / sizeof(uint64_t); i++) {
+        retired[i] += counters[i];
+    }
+    memset(shard, 0, sizeof(StatsShard));
+    shard->next = statsFree;
+    statsFree = shard;
+    pthread_mutex_unlock(&statsShardsLock);
+    blockStatsLocal = NULL;
+    blockFileStatsLocal = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stats_key_create
+// Description  : Create the key retiring the shards of the threads that exit
+//
+// Inputs       : none
+// Outputs      : none
+
+static void stats_key_create(void)
+{
+    pthread_key_create(&statsKey, stats_thread_exit);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_stats_shard
+// Description  : Get the counters shard of the current thread, registering
+//                it on the first call from a thread (a shard retired by a
+//                thread that exited if there is one)
+//
+// Inputs       : none
+// Outputs      : pointer to the shard of the thread
+
+BlockDriverStats* block_stats_shard(void)
+{
+    StatsShard* shard;
+
+    if (blockStatsLocal != NULL) {
+        return (blockStatsLocal);
+    }
+    pthread_mutex_lock(&statsShardsLock);
+    shard = statsFree;
+    if (shard != NULL) {
+        statsFree = shard->next;
+    }
+    pthread_mutex_unlock(&statsShardsLock);
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(StatsShard));
+        CMPSC_ASSERT0(shard != NULL, "Failed allocating the statistics shard");
+        block_memory_add(BLOCK_MEM_STATS, sizeof(StatsShard));
+    }
+    pthread_once(&statsKeyOnce, stats_key_create);
+    pthread_setspecific(statsKey, shard);
+    pthread_mutex_lock(&statsShardsLock);
+    shard->next = statsShards;
+    statsShards = shard;
+    pthread_mutex_unlock(&statsShardsLock);
+    blockStatsLocal = &shard->stats;
+    blockFileStatsLocal = shard->files;
+    return (blockStatsLocal);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_stats_files_shard
+// Description  : Get the per-file counters shard of the current thread
+//
+// Inputs       : none
+// Outputs      : pointer to the per-file counters of the thread
+
+BlockFileStats* block_stats_files_shard(void)
+{
+    if (blockFileStatsLocal == NULL) {
+        block_stats_shard();
+    }
+    return (blockFileStatsLocal);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_stats_mark
+// Description  : Capture the counters of the current thread before a call on a
+//                file, the call only has to diff them when it is done
+//
+// Inputs       : mark - the structure to fill
+// Outputs      : none
+
+void block_file_stats_mark(BlockFileStatsMark* mark)
+{
+    BlockDriverStats* shard = BLOCK_STATS();
+    mark->start_ns = block_stats_clock();
+    mark->cache_hits = shard->cache_hits;
+    mark->cache_misses = shard->cache_misses;
+    mark->bus_ops = shard->bus_ops;
+    mark->bus_bytes = shard->bus_bytes_read + shard->bus_bytes_written;
+    mark->checksums = shard->checksums;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_stats_charge
+// Description  : Charge the cache lookups and the bus operations since the
+//                mark to a file, and their amplification to the reads or the
+//                writes, without counting a call (the frames a batch reads
+//                ahead for the calls that follow)
+//
+// Inputs       : file - the file number
+//                write - 1 to charge them to the writes, 0 to the reads
+//                mark - the counters captured before
+// Outputs      : none
+
+void block_file_stats_charge(int32_t file, int write, const BlockFileStatsMark* mark)
+{
+    BlockDriverStats* shard = BLOCK_STATS();
+    BlockFileStats* fstats = &blockFileStatsLocal[file];
+    uint64_t busBytes = shard->bus_bytes_read + shard->bus_bytes_written - mark->bus_bytes;
+    uint64_t checksums = shard->checksums - mark->checksums;
+
+    // Charge the amplification to the operation type
+    if (write) {
+        __atomic_store_n(&shard->write_bus_bytes, shard->write_bus_bytes + busBytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&shard->write_checksums, shard->write_checksums + checksums, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&shard->read_bus_bytes, shard->read_bus_bytes + busBytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&shard->read_checksums, shard->read_checksums + checksums, __ATOMIC_RELAXED);
+    }
+
+    // And to the file
+    __atomic_store_n(&fstats->cache_hits, fstats->cache_hits + shard->cache_hits - mark->cache_hits, __ATOMIC_RELAXED);
+    __atomic_store_n(&fstats->cache_misses, fstats->cache_misses + shard->cache_misses - mark->cache_misses,
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&fstats->bus_ops, fstats->bus_ops + shard->bus_ops - mark->bus_ops, __ATOMIC_RELAXED);
+    __atomic_store_n(&fstats->bus_bytes, fstats->bus_bytes + busBytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&fstats->checksums, fstats->checksums + checksums, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_stats_record
+// Description  : Charge a read or a write to a file, with the cache lookups,
+//                the bus operations and the time it took since the mark
+//
+// Inputs       : file - the file number
+//                write - 1 for a write, 0 for a read
+//                bytes - the number of bytes transferred
+//                mark - the counters captured at the start of the call
+// Outputs      : none
+
+void block_file_stats_record(int32_t file, int write, uint64_t bytes, const BlockFileStatsMark* mark)
+{
+    BlockFileStats* fstats;
+
+    block_file_stats_charge(file, write, mark);
+    fstats = &blockFileStatsLocal[file];
+    if (write) {
+        __atomic_store_n(&fstats->writes, fstats->writes + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&fstats->bytes_written, fstats->bytes_written + bytes, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&fstats->reads, fstats->reads + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&fstats->bytes_read, fstats->bytes_read + bytes, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&fstats->latency_ns, fstats->latency_ns + block_stats_clock() - mark->start_ns,
+        __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_get_file_stats
+// Description  : Sum the counters of a file of all the threads into "stats"
+//
+// Inputs       : file - the file number
+//                stats - the structure to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int block_get_file_stats(int32_t file, BlockFileStats* stats)
+{
+    StatsShard* shard;
+    uint64_t* sum = (uint64_t*)stats;
+    uint64_t* counters;
+    size_t i;
+
+    if (stats == NULL || file < 0 || file >= BLOCK_MAX_TOTAL_FILES) {
+        return (-1);
+    }
+    memset(stats, 0, sizeof(BlockFileStats));
+    pthread_mutex_lock(&statsShardsLock);
+    for (shard = statsShards; shard != NULL; shard = shard->next) {
+        counters = (uint64_t*)&shard->files[file];
+        for (i = 0; i < sizeof(BlockFileStats) / sizeof(uint64_t); i++) {
+            sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&statsShardsLock);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_stats_value
+// Description  : Get the counter of a file selected by a ranking key
+//
+// Inputs       : stats - the counters of the file
+//                key - the counter to get
+// Outputs      : the value of the counter
+
+uint64_t block_file_stats_value(const BlockFileStats* stats, BlockFileStatsKey key)
+{
+    switch (key) {
+    case BLOCK_FSTATS_BYTES:
+        return (stats->bytes_read + stats->bytes_written);
+    case BLOCK_FSTATS_MISSES:
+        return (stats->cache_misses);
+    case BLOCK_FSTATS_BUS_OPS:
+        return (stats->bus_ops);
+    case BLOCK_FSTATS_LATENCY:
+        return (stats->latency_ns);
+    case BLOCK_FSTATS_BUS_BYTES:
+        return (stats->bus_bytes);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_stats_top
+// Description  : Get the files with the highest counter, files that never
+//                moved the counter are left out
+//
+// Inputs       : key - the counter to rank the files by
+//                n - the maximum number of files to return
+//                top - filled with the file numbers, highest first
+//                stats - filled with the counters of these files (or NULL)
+// Outputs      : the number of files returned, -1 if failure
+
+int block_file_stats_top(BlockFileStatsKey key, int n, int32_t* top, BlockFileStats* stats)
+{
+    BlockFileStats* all;
+    uint64_t value, best;
+    int found = 0, i, j;
+    int32_t file;
+
+    if (top == NULL || n <= 0) {
+        return (-1);
+    }
+    all = calloc(BLOCK_MAX_TOTAL_FILES, sizeof(BlockFileStats));
+    if (all == NULL) {
+        return (-1);
+    }
+    for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+        block_get_file_stats(i, &all[i]);
+    }
+
+    // Partial selection sort, n is expected to be small
+    while (found < n) {
+        file = -1;
+        best = 0;
+        for (i = 0; i < BLOCK_MAX_TOTAL_FILES; i++) {
+            value = block_file_stats_value(&all[i], key);
+            if (value > best) {
+                for (j = 0; j < found && top[j] != i; j++) {
+                }
+                if (j == found) {
+                    file = i;
+                    best = value;
+                }
+            }
+        }
+        if (file == -1) {
+            break;
+        }
+        top[found] = file;
+        if (stats != NULL) {
+            stats[found] = all[file];
+        }
+        found++;
+    }
+    free(all);
+    return (found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_file_stats_reset
+// Description  : Clear all the per-file counters, used when the file numbers
+//                are handed out again. The shards are written by their own
+//                threads, so this must only run while no file I/O is running.
+//
+// Inputs       : none
+// Outputs      : none
+
+void block_file_stats_reset(void)
+{
+    StatsShard* shard;
+    pthread_mutex_lock(&statsShardsLock);
+    for (shard = statsShards; shard != NULL; shard = shard->next) {
+        memset(shard->files, 0, sizeof(shard->files));
+    }
+    pthread_mutex_unlock(&statsShardsLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_stats_clock
+// Description  : Get a monotonic timestamp in nanoseconds
+//
+// Inputs       : none
+// Outputs      : the timestamp
+
+uint64_t block_stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_histogram_add
+// Description  : Add a latency sample to the histogram
+//
+// Inputs       : hist - the histogram
+//                ns - the latency in nanoseconds
+// Outputs      : none
+
+void block_histogram_add(BlockLatencyHistogram* hist, uint64_t ns)
+{
+    int bucket = 0;
+    while ((ns >> (bucket + 1)) != 0 && bucket < BLOCK_LATENCY_BUCKETS - 1) {
+        bucket++;
+    }
+    // Histograms of a shard are read by other threads while they are updated
+    __atomic_store_n(&hist->buckets[bucket], hist->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->total_ns, hist->total_ns + ns, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_histogram_merge
+// Description  : Add all the samples of "other" to the histogram
+//
+// Inputs       : hist - the histogram to add to
+//                other - the histogram to add
+// Outputs      : none
+
+void block_histogram_merge(BlockLatencyHistogram* hist, const BlockLatencyHistogram* other)
+{
+    int i;
+    for (i = 0; i < BLOCK_LATENCY_BUCKETS; i++) {
+        hist->buckets[i] += other->buckets[i];
+    }
+    hist->count += other->count;
+    hist->total_ns += other->total_ns;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_histogram_percentile
+// Description  : Get an upper bound of the given percentile of the samples
+//
+// Inputs       : hist - the histogram
+//                pct - the percentile (0-100)
+// Outputs      : the upper bound of the bucket holding the percentile, in ns
+
+uint64_t block_histogram_percentile(const BlockLatencyHistogram* hist, double pct)
+{
+    uint64_t rank, seen = 0;
+    int i;
+    if (hist->count == 0) {
+        return (0);
+    }
+    rank = (uint64_t)(hist->count * pct / 100.0);
+    if (rank >= hist->count) {
+        rank = hist->count - 1;
+    }
+    for (i = 0; i < BLOCK_LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            break;
+        }
+    }
+    return (2ULL << i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_amplification
+// Description  : Get the amplification of the requests, the ratio of what was
+//                moved (bus bytes, checksums) to the bytes requested
+//
+// Inputs       : moved - the bytes moved (or checksums computed)
+//                requested - the bytes requested
+// Outputs      : the ratio, 0 if nothing was requested
+
+double block_amplification(uint64_t moved, uint64_t requested)
+{
+    if (requested == 0) {
+        return (0.0);
+    }
+    return ((double)moved / (double)requested);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_stats_delta
+// Description  : Compute the counters accumulated between two snapshots
+//
+// Inputs       : now - the latest snapshot
+//                then - the earlier snapshot
+//                delta - the structure to fill with the difference
+// Outputs      : none
+
+void block_stats_delta(const BlockDriverStats* now, const BlockDriverStats* then, BlockDriverStats* delta)
+{
+    const uint64_t* a = (const uint64_t*)now;
+    const uint64_t* b = (const uint64_t*)then;
+    uint64_t* d = (uint64_t*)delta;
+    size_t i;
+
+    // The structure is only made of 64 bit counters
+    for (i = 0; i < sizeof(BlockDriverStats) / sizeof(uint64_t); i++) {
+        d[i] = a[i] - b[i];
+    }
+}
+
+//
+// Metrics exporter
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_histogram
+// Description  : Write a latency histogram in Prometheus text format
+//
+// Inputs       : out - the output file
+//                name - the metric name
+//                op - the value of the "op" label
+//                hist - the histogram
+// Outputs      : none
+
+static void write_histogram(FILE* out, const char* name, const char* op, const BlockLatencyHistogram* hist)
+{
+    uint64_t cumulative = 0;
+    int i;
+    for (i = 0; i < BLOCK_LATENCY_BUCKETS; i++) {
+        cumulative += hist->buckets[i];
+        fprintf(out, "%s_bucket{op=\"%s\",le=\"%.9f\"} %lu\n", name, op, (2ULL << i) / 1e9, cumulative);
+    }
+    fprintf(out, "%s_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", name, op, hist->count);
+    fprintf(out, "%s_sum{op=\"%s\"} %.9f\n", name, op, hist->total_ns / 1e9);
+    fprintf(out, "%s_count{op=\"%s\"} %lu\n", name, op, hist->count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_metrics_write
+// Description  : Atomically write all the metrics in Prometheus text format,
+//                the file is written under a temporary name then renamed
+//
+// Inputs       : path - the metrics file
+// Outputs      : 0 if successful, -1 if failure
+
+int block_metrics_write(const char* path)
+{
+    BlockDriverStats stats;
+    BlockCacheStats cstats;
+    BlockMemoryUsage memory;
+    uint32_t frames;
+    char tmp[256];
+    FILE* out;
+    int i;
+
+    block_get_stats(&stats);
+    get_block_cache_stats(&cstats, &frames);
+    block_memory_usage(&memory);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid());
+    if ((out = fopen(tmp, "w")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure opening the metrics file [%s], error: %s.", tmp, strerror(errno));
+        return (-1);
+    }
+
+    // Driver counters
+    fprintf(out, "# HELP block_driver_operations_total Driver API calls.\n");
+    fprintf(out, "# TYPE block_driver_operations_total counter\n");
+    fprintf(out, "block_driver_operations_total{op=\"open\"} %lu\n", stats.opens);
+    fprintf(out, "block_driver_operations_total{op=\"close\"} %lu\n", stats.closes);
+    fprintf(out, "block_driver_operations_total{op=\"read\"} %lu\n", stats.reads);
+    fprintf(out, "block_driver_operations_total{op=\"write\"} %lu\n", stats.writes);
+    fprintf(out, "block_driver_operations_total{op=\"seek\"} %lu\n", stats.seeks);
+    fprintf(out, "# HELP block_driver_batches_total Calls executing a batch of operations.\n");
+    fprintf(out, "# TYPE block_driver_batches_total counter\n");
+    fprintf(out, "block_driver_batches_total %lu\n", stats.batches);
+    fprintf(out, "# HELP block_driver_batch_operations_total Operations executed in batches.\n");
+    fprintf(out, "# TYPE block_driver_batch_operations_total counter\n");
+    fprintf(out, "block_driver_batch_operations_total %lu\n", stats.batch_ops);
+    fprintf(out, "# HELP block_driver_batch_frame_reads_total Frames read ahead of the operations of a batch.\n");
+    fprintf(out, "# TYPE block_driver_batch_frame_reads_total counter\n");
+    fprintf(out, "block_driver_batch_frame_reads_total %lu\n", stats.batch_reads);
+    fprintf(out, "# HELP block_driver_lock_waits_total Driver lock acquisitions that had to wait.\n");
+    fprintf(out, "# TYPE block_driver_lock_waits_total counter\n");
+    fprintf(out, "block_driver_lock_waits_total %lu\n", stats.lock_waits);
+    fprintf(out, "# HELP block_driver_lock_wait_seconds_total Time spent waiting for the driver lock.\n");
+    fprintf(out, "# TYPE block_driver_lock_wait_seconds_total counter\n");
+    fprintf(out, "block_driver_lock_wait_seconds_total %.9f\n", stats.lock_wait_ns / 1e9);
+    fprintf(out, "# HELP block_driver_packed_frames_total Data frames written compressed.\n");
+    fprintf(out, "# TYPE block_driver_packed_frames_total counter\n");
+    fprintf(out, "block_driver_packed_frames_total %lu\n", stats.packed_frames);
+    fprintf(out, "# HELP block_driver_packed_bytes_total Compressed size of the data frames written compressed.\n");
+    fprintf(out, "# TYPE block_driver_packed_bytes_total counter\n");
+    fprintf(out, "block_driver_packed_bytes_total %lu\n", stats.packed_bytes);
+    fprintf(out, "# HELP block_driver_raw_frames_total Data frames written raw as they did not compress.\n");
+    fprintf(out, "# TYPE block_driver_raw_frames_total counter\n");
+    fprintf(out, "block_driver_raw_frames_total %lu\n", stats.raw_frames);
+    fprintf(out, "# HELP block_driver_bytes_total Bytes transferred by the driver API.\n");
+    fprintf(out, "# TYPE block_driver_bytes_total counter\n");
+    fprintf(out, "block_driver_bytes_total{op=\"read\"} %lu\n", stats.bytes_read);
+    fprintf(out, "block_driver_bytes_total{op=\"write\"} %lu\n", stats.bytes_written);
+    fprintf(out, "# HELP block_driver_frame_fetches_total Frames the driver looked up in the cache.\n");
+    fprintf(out, "# TYPE block_driver_frame_fetches_total counter\n");
+    fprintf(out, "block_driver_frame_fetches_total{result=\"hit\"} %lu\n", stats.cache_hits);
+    fprintf(out, "block_driver_frame_fetches_total{result=\"miss\"} %lu\n", stats.cache_misses);
+    fprintf(out, "# HELP block_driver_latency_seconds Latency of the driver API calls.\n");
+    fprintf(out, "# TYPE block_driver_latency_seconds histogram\n");
+    write_histogram(out, "block_driver_latency_seconds", "read", &stats.read_latency);
+    write_histogram(out, "block_driver_latency_seconds", "write", &stats.write_latency);
+
+    // Bus counters
+    fprintf(out, "# HELP block_bus_operations_total Operations sent to the controller bus.\n");
+    fprintf(out, "# TYPE block_bus_operations_total counter\n");
+    fprintf(out, "block_bus_operations_total{opcode=\"read\"} %lu\n", stats.bus_reads);
+    fprintf(out, "block_bus_operations_total{opcode=\"write\"} %lu\n", stats.bus_writes);
+    fprintf(out, "block_bus_operations_total{opcode=\"other\"} %lu\n",
+        stats.bus_ops - stats.bus_reads - stats.bus_writes);
+    fprintf(out, "# HELP block_bus_bytes_total Bytes moved on the controller bus.\n");
+    fprintf(out, "# TYPE block_bus_bytes_total counter\n");
+    fprintf(out, "block_bus_bytes_total{opcode=\"read\"} %lu\n", stats.bus_bytes_read);
+    fprintf(out, "block_bus_bytes_total{opcode=\"write\"} %lu\n", stats.bus_bytes_written);
+    fprintf(out, "# HELP block_bus_metadata_bytes_total Bus bytes moving metadata frames.\n");
+    fprintf(out, "# TYPE block_bus_metadata_bytes_total counter\n");
+    fprintf(out, "block_bus_metadata_bytes_total %lu\n", stats.bus_meta_bytes);
+    fprintf(out, "# HELP block_checksums_total Frame checksums computed.\n");
+    fprintf(out, "# TYPE block_checksums_total counter\n");
+    fprintf(out, "block_checksums_total %lu\n", stats.checksums);
+    fprintf(out, "# HELP block_driver_bus_bytes_total Bus bytes caused by the driver API calls.\n");
+    fprintf(out, "# TYPE block_driver_bus_bytes_total counter\n");
+    fprintf(out, "block_driver_bus_bytes_total{op=\"read\"} %lu\n", stats.read_bus_bytes);
+    fprintf(out, "block_driver_bus_bytes_total{op=\"write\"} %lu\n", stats.write_bus_bytes);
+    fprintf(out, "# HELP block_driver_checksums_total Frame checksums caused by the driver API calls.\n");
+    fprintf(out, "# TYPE block_driver_checksums_total counter\n");
+    fprintf(out, "block_driver_checksums_total{op=\"read\"} %lu\n", stats.read_checksums);
+    fprintf(out, "block_driver_checksums_total{op=\"write\"} %lu\n", stats.write_checksums);
+
+    fprintf(out, "# HELP block_prefetches_total Frames read ahead by the prefetcher, by outcome.\n");
+    fprintf(out, "# TYPE block_prefetches_total counter\n");
+    fprintf(out, "block_prefetches_total{result=\"issued\"} %lu\n", stats.prefetches);
+    fprintf(out, "block_prefetches_total{result=\"hit\"} %lu\n", stats.prefetch_hits);
+    fprintf(out, "block_prefetches_total{result=\"wasted\"} %lu\n", stats.prefetch_wasted);
+    fprintf(out, "# HELP block_open_prefetches_total Frames read ahead for opened files.\n");
+    fprintf(out, "# TYPE block_open_prefetches_total counter\n");
+    fprintf(out, "block_open_prefetches_total %lu\n", stats.open_prefetches);
+    fprintf(out, "# HELP block_prefetch_evictions_total Frames evicted to make room for prefetches.\n");
+    fprintf(out, "# TYPE block_prefetch_evictions_total counter\n");
+    fprintf(out, "block_prefetch_evictions_total %lu\n", stats.prefetch_evictions);
+
+    // Cache counters
+    fprintf(out, "# HELP block_cache_lookups_total Frame cache lookups.\n");
+    fprintf(out, "# TYPE block_cache_lookups_total counter\n");
+    fprintf(out, "block_cache_lookups_total %lu\n", cstats.lookups);
+    fprintf(out, "# HELP block_cache_hits_total Frame cache lookups that found the frame.\n");
+    fprintf(out, "# TYPE block_cache_hits_total counter\n");
+    fprintf(out, "block_cache_hits_total %lu\n", cstats.hits);
+    fprintf(out, "# HELP block_cache_inserts_total Frames added to the cache.\n");
+    fprintf(out, "# TYPE block_cache_inserts_total counter\n");
+    fprintf(out, "block_cache_inserts_total %lu\n", cstats.inserts);
+    fprintf(out, "# HELP block_cache_evictions_total Frames evicted from the cache.\n");
+    fprintf(out, "# TYPE block_cache_evictions_total counter\n");
+    fprintf(out, "block_cache_evictions_total %lu\n", cstats.evictions);
+    fprintf(out, "# HELP block_cache_writebacks_total Dirty frames written back to the bus.\n");
+    fprintf(out, "# TYPE block_cache_writebacks_total counter\n");
+    fprintf(out, "block_cache_writebacks_total %lu\n", cstats.writebacks);
+    fprintf(out, "# HELP block_cache_absorbed_writes_total Writes to frames already dirty in the cache.\n");
+    fprintf(out, "# TYPE block_cache_absorbed_writes_total counter\n");
+    fprintf(out, "block_cache_absorbed_writes_total %lu\n", cstats.absorbed);
+    fprintf(out, "# HELP block_cache_reclaimed_total Frames evicted ahead of demand by the reclaimer.\n");
+    fprintf(out, "# TYPE block_cache_reclaimed_total counter\n");
+    fprintf(out, "block_cache_reclaimed_total %lu\n", cstats.reclaimed);
+    fprintf(out, "# HELP block_cache_reclaim_writebacks_total Dirty frames written back by the reclaimer.\n");
+    fprintf(out, "# TYPE block_cache_reclaim_writebacks_total counter\n");
+    fprintf(out, "block_cache_reclaim_writebacks_total %lu\n", cstats.reclaim_writebacks);
+    fprintf(out, "# HELP block_cache_writeback_failures_total Dirty frames that could not be written back.\n");
+    fprintf(out, "# TYPE block_cache_writeback_failures_total counter\n");
+    fprintf(out, "block_cache_writeback_failures_total %lu\n", cstats.writeback_failures);
+    fprintf(out, "# HELP block_cache_stalls_total Inserts that evicted inline as no slot was free.\n");
+    fprintf(out, "# TYPE block_cache_stalls_total counter\n");
+    fprintf(out, "block_cache_stalls_total %lu\n", cstats.stalls);
+    fprintf(out, "# HELP block_cache_policy_writes_total Frames written under each write policy.\n");
+    fprintf(out, "# TYPE block_cache_policy_writes_total counter\n");
+    for (i = 0; i < BLOCK_WRITE_POLICIES; i++) {
+        fprintf(out, "block_cache_policy_writes_total{policy=\"%s\"} %lu\n", block_write_policy_name(i),
+            cstats.policy_writes[i]);
+    }
+    fprintf(out, "# HELP block_cache_policy_inserts_total Frames written that were added to the cache, by write policy.\n");
+    fprintf(out, "# TYPE block_cache_policy_inserts_total counter\n");
+    for (i = 0; i < BLOCK_WRITE_POLICIES; i++) {
+        fprintf(out, "block_cache_policy_inserts_total{policy=\"%s\"} %lu\n", block_write_policy_name(i),
+            cstats.policy_inserts[i]);
+    }
+    fprintf(out, "# HELP block_cache_frames Frames currently in the cache.\n");
+    fprintf(out, "# TYPE block_cache_frames gauge\n");
+    fprintf(out, "block_cache_frames %u\n", frames);
+
+    // Memory accounting
+    fprintf(out, "# HELP block_memory_bytes Memory used by each subsystem.\n");
+    fprintf(out, "# TYPE block_memory_bytes gauge\n");
+    for (i = 0; i < BLOCK_MEM_MAXVAL; i++) {
+        fprintf(out, "block_memory_bytes{subsystem=\"%s\"} %lu\n", block_memory_name(i), memory.bytes[i]);
+    }
+    fprintf(out, "# HELP block_memory_budget_bytes Global memory budget (0 if unlimited).\n");
+    fprintf(out, "# TYPE block_memory_budget_bytes gauge\n");
+    fprintf(out, "block_memory_budget_bytes %lu\n", memory.budget);
+
+    // Move the complete file in place
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Failure writing the metrics file [%s], error: %s.", path, strerror(errno));
+        unlink(tmp);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : metrics_thread
+// Description  : Body of the exporter thread, writes the metrics periodically
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void* metrics_thread(void* arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&metricsLock);
+    while (metricsRunning) {
+        pthread_mutex_unlock(&metricsLock);
+        block_metrics_write(metricsPath);
+        pthread_mutex_lock(&metricsLock);
+
+        // Sleep until the next period, or until stopped
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += metricsInterval / 1000;
+        deadline.tv_nsec += (metricsInterval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (metricsRunning && pthread_cond_timedwait(&metricsWake, &metricsLock, &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&metricsLock);
+    return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_metrics_start
+// Description  : Start a thread writing the metrics to "path" periodically
+//
+// Inputs       : path - the metrics file
+//                interval_ms - the period in milliseconds (0 for the default)
+// Outputs      : 0 if successful, -1 if failure
+
+int block_metrics_start(const char* path, uint32_t interval_ms)
+{
+    if (metricsRunning || path == NULL) {
+        return (-1);
+    }
+    metricsPath = strdup(path);
+    metricsInterval = interval_ms ? interval_ms : BLOCK_METRICS_INTERVAL_MS;
+    metricsRunning = 1;
+    if (pthread_create(&metricsThread, NULL, metrics_thread, NULL) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "Failure starting the metrics exporter.");
+        metricsRunning = 0;
+        free(metricsPath);
+        metricsPath = NULL;
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_metrics_stop
+// Description  : Stop the metrics thread, after writing the metrics one last
+//                time
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int block_metrics_stop(void)
+{
+    int ret;
+    if (!metricsRunning) {
+        return (-1);
+    }
+    pthread_mutex_lock(&metricsLock);
+    metricsRunning = 0;
+    pthread_cond_signal(&metricsWake);
+    pthread_mutex_unlock(&metricsLock);
+    pthread_join(metricsThread, NULL);
+    ret = block_metrics_write(metricsPath);
+    free(metricsPath);
+    metricsPath = NULL;
+    return (ret);
+}
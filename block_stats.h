@@ -0,0 +1,191 @@
+#ifndef BLOCK_STATS_INCLUDED
+#define BLOCK_STATS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_stats.h
+//  Description    : This is the header file for the counters and latency
+//                   histograms kept by the BLOCK memory system driver, and
+//                   for the metrics exporter.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define BLOCK_LATENCY_BUCKETS 48 // Number of log2 latency buckets (in ns)
+#define BLOCK_METRICS_INTERVAL_MS 1000 // Default period of the metrics exporter
+
+// Counters are kept in per-thread shards, only written by their own thread
+// (relaxed stores, no locked instructions) and summed up on query
+#define BLOCK_STATS() (blockStatsLocal != NULL ? blockStatsLocal : block_stats_shard())
+#define BLOCK_STAT_ADD(field, n)                                                   \
+    do {                                                                           \
+        BlockDriverStats* shard_ = BLOCK_STATS();                                  \
+        __atomic_store_n(&shard_->field, shard_->field + (n), __ATOMIC_RELAXED);   \
+    } while (0)
+
+// Latency histogram, bucket i counts latencies in [2^i, 2^(i+1)) ns
+typedef struct {
+    uint64_t count; // Number of samples
+    uint64_t total_ns; // Sum of all the samples
+    uint64_t buckets[BLOCK_LATENCY_BUCKETS];
+} BlockLatencyHistogram;
+
+// Driver counters, all of them only ever increase (64 bit counters only)
+typedef struct {
+    uint64_t opens;
+    uint64_t closes;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t seeks;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t bus_ops;
+    uint64_t bus_reads;
+    uint64_t bus_writes;
+    uint64_t bus_bytes_read; // Bytes moved by the bus operations
+    uint64_t bus_bytes_written;
+    uint64_t bus_meta_bytes; // Part of the bus bytes moving metadata frames
+    uint64_t checksums; // Frame checksums computed
+    uint64_t read_bus_bytes; // Bus bytes and checksums caused by block_read
+    uint64_t read_checksums;
+    uint64_t write_bus_bytes; // Bus bytes and checksums caused by block_write
+    uint64_t write_checksums;
+    uint64_t prefetches; // Frames read ahead by the prefetcher
+    uint64_t prefetch_hits; // Prefetched frames later read from the cache
+    uint64_t prefetch_wasted; // Prefetched frames evicted or overwritten before being read
+    uint64_t prefetch_evictions; // Frames evicted to make room for prefetches
+    uint64_t open_prefetches; // Part of the prefetches made for opened files
+    uint64_t batches; // Calls to block_batch
+    uint64_t batch_ops; // Operations executed by these calls
+    uint64_t batch_reads; // Frames the batches read ahead of their operations
+    uint64_t lock_waits; // Driver lock acquisitions that had to wait
+    uint64_t lock_wait_ns; // Time spent waiting for the driver lock
+    uint64_t packed_frames; // Data frames written compressed
+    uint64_t packed_bytes; // Their compressed size
+    uint64_t raw_frames; // Data frames written raw as they did not compress
+    BlockLatencyHistogram read_latency;
+    BlockLatencyHistogram write_latency;
+} BlockDriverStats;
+
+// Per-file counters, kept in the same shards and indexed by file number
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t bus_ops; // Bus operations caused by the reads and writes
+    uint64_t bus_bytes; // Bytes these bus operations moved
+    uint64_t checksums; // Frame checksums computed for the reads and writes
+    uint64_t latency_ns; // Cumulative latency of the reads and writes
+} BlockFileStats;
+
+// Counters a per-file query can be ranked by
+typedef enum {
+    BLOCK_FSTATS_BYTES = 0, // Bytes read and written
+    BLOCK_FSTATS_MISSES = 1, // Cache misses
+    BLOCK_FSTATS_BUS_OPS = 2, // Bus operations
+    BLOCK_FSTATS_LATENCY = 3, // Cumulative latency
+    BLOCK_FSTATS_BUS_BYTES = 4, // Bytes moved on the bus
+} BlockFileStatsKey;
+
+// Shard counters captured at the start of a call, to charge the cache and
+// bus activity of the call to its file
+typedef struct {
+    uint64_t start_ns;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t bus_ops;
+    uint64_t bus_bytes;
+    uint64_t checksums;
+} BlockFileStatsMark;
+
+// Breakdown of a power on or off of the driver, the controller, metadata I/O
+// and checksums are not counted in the allocator and cache phases
+typedef struct {
+    uint64_t total_ns;
+    uint64_t controller_ns; // Initializing or powering off the controller
+    uint64_t bus_ns; // Moving metadata frames (and write-back frames flushed at power off)
+    uint64_t checksum_ns; // Checksumming frames and file table entries
+    uint64_t allocator_ns; // Rebuilding the free frame and the number of files
+    uint64_t cache_ns; // Creating the cache (power on) or flushing and closing it (power off)
+    uint64_t bus_ops;
+    uint64_t bus_reads;
+    uint64_t bus_writes;
+} BlockMountProfile;
+
+//
+// Global Data
+
+extern __thread BlockDriverStats* blockStatsLocal; // Shard of the current thread
+extern __thread BlockFileStats* blockFileStatsLocal; // Per-file shard of the current thread
+
+//
+// Functional Prototypes
+
+int block_get_stats(BlockDriverStats* stats);
+// Sum the driver counters of all the threads into "stats"
+
+BlockDriverStats* block_stats_shard(void);
+// Get the counters shard of the current thread, creating it as needed
+
+BlockFileStats* block_stats_files_shard(void);
+// Get the per-file counters shard of the current thread
+
+void block_file_stats_mark(BlockFileStatsMark* mark);
+// Capture the counters of the current thread before a call on a file
+
+void block_file_stats_record(int32_t file, int write, uint64_t bytes, const BlockFileStatsMark* mark);
+// Charge a read or a write, and what it caused since "mark", to "file"
+
+void block_file_stats_charge(int32_t file, int write, const BlockFileStatsMark* mark);
+// Charge the cache and bus activity since "mark" to "file" and to its reads
+// or writes, without counting a read or a write
+
+int block_get_file_stats(int32_t file, BlockFileStats* stats);
+// Sum the counters of "file" of all the threads into "stats"
+
+int block_file_stats_top(BlockFileStatsKey key, int n, int32_t* top, BlockFileStats* stats);
+// Get the (at most) "n" files with the highest "key" counter, returns how many
+
+uint64_t block_file_stats_value(const BlockFileStats* stats, BlockFileStatsKey key);
+// Get the counter of "stats" selected by "key"
+
+void block_file_stats_reset(void);
+// Clear all the per-file counters (only while no file I/O is running)
+
+uint64_t block_stats_clock(void);
+// Get a monotonic timestamp in nanoseconds
+
+void block_histogram_add(BlockLatencyHistogram* hist, uint64_t ns);
+// Add a latency sample to the histogram
+
+void block_histogram_merge(BlockLatencyHistogram* hist, const BlockLatencyHistogram* other);
+// Add all the samples of "other" to the histogram
+
+uint64_t block_histogram_percentile(const BlockLatencyHistogram* hist, double pct);
+// Get an upper bound of the given percentile (0-100) of the samples, in ns
+
+int block_metrics_write(const char* path);
+// Atomically write all the metrics in Prometheus text format to "path"
+
+int block_metrics_start(const char* path, uint32_t interval_ms);
+// Start a thread writing the metrics to "path" every "interval_ms"
+
+int block_metrics_stop(void);
+// Stop the metrics thread, after writing the metrics one last time
+
+double block_amplification(uint64_t moved, uint64_t requested);
+// Get the ratio of what was moved (bytes, checksums) to the bytes requested
+
+void block_stats_delta(const BlockDriverStats* now, const BlockDriverStats* then, BlockDriverStats* delta);
+// Compute the counters accumulated between the "then" and "now" snapshots
+
+#endif
@@ -0,0 +1,273 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_trace.c
+//  Description    : This is the implementation of the event tracer of the
+//                   BLOCK memory system driver. Each thread keeps its spans in
+//                   its own buffer, written to the trace file when it fills up
+//                   and when the trace stops.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Project includes
+#include <block_memory.h>
+#include <block_trace.h>
+#include <cmpsc311_log.h>
+
+// A traced span
+typedef struct {
+    uint64_t start_ns; // Clock at the start of the span
+    uint64_t dur_ns; // Length of the span
+    uint32_t event; // BlockTraceEvent
+    int32_t arg;
+} TraceRecord;
+
+// Spans of a thread during a trace, the buffers are kept in a list so that
+// they can be written after their thread exits and freed when the trace stops
+typedef struct TraceBuffer {
+    uint32_t tid;
+    uint32_t count; // Spans in the buffer, published with release ordering
+    TraceRecord records[BLOCK_TRACE_BUFFER_EVENTS];
+    struct TraceBuffer* next;
+} TraceBuffer;
+
+// Name, category and argument name of each span
+static const char* traceNames[BLOCK_TRACE_MAXVAL][3] = {
+    { "block_poweron", "driver", "result" },
+    { "block_poweroff", "driver", "result" },
+    { "block_format", "driver", "result" },
+    { "block_open", "driver", "result" },
+    { "block_close", "driver", "result" },
+    { "block_read", "driver", "result" },
+    { "block_write", "driver", "result" },
+    { "block_seek", "driver", "result" },
+    { "block_batch", "driver", "result" },
+    { "cache_hit", "cache", "frame" },
+    { "cache_miss", "cache", "frame" },
+    { "cache_insert", "cache", "frame" },
+    { "cache_flush", "cache", "result" },
+    { "checksum", "checksum", "frame" },
+    { "bus_read", "bus", "frame" },
+    { "bus_write", "bus", "frame" },
+    { "bus_other", "bus", "opcode" },
+};
+
+// Global data
+int blockTracing = 0;
+FILE* traceFile = NULL;
+uint64_t traceEvents; // Spans written to the trace file
+TraceBuffer* traceBuffers = NULL; // Buffers of all the threads that traced
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // Protects the file and the list of buffers
+uint32_t traceGeneration = 0; // Trace running, a buffer only serves the trace it was created for
+uint32_t traceActive = 0; // Spans being recorded, the trace stops once none are
+__thread TraceBuffer* traceLocal = NULL;
+__thread uint32_t traceLocalGeneration = 0;
+int traceAtExit = 0; // Set once the trace is completed at exit
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_write
+// Description  : Write the spans of a buffer to the trace file and empty it,
+//                the trace lock is held
+//
+// Inputs       : buffer - the buffer
+// Outputs      : none
+
+static void trace_write(TraceBuffer* buffer)
+{
+    TraceRecord* record;
+    uint32_t count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    for (i = 0; i < count && traceFile != NULL; i++) {
+        record = &buffer->records[i];
+        fprintf(traceFile,
+            "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+            "\"args\":{\"%s\":%d}}",
+            (traceEvents++ == 0) ? "\n" : ",\n", traceNames[record->event][0], traceNames[record->event][1],
+            record->start_ns / 1e3, record->dur_ns / 1e3, (int)getpid(), buffer->tid, traceNames[record->event][2],
+            record->arg);
+    }
+    __atomic_store_n(&buffer->count, 0, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trace_exit
+// Description  : Complete the trace file when the process exits tracing
+//
+// Inputs       : none
+// Outputs      : none
+
+static void trace_exit(void)
+{
+    if (__atomic_load_n(&blockTracing, __ATOMIC_ACQUIRE)) {
+        block_trace_stop();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_start
+// Description  : Start tracing the events to a file
+//
+// Inputs       : path - the trace file to create
+// Outputs      : 0 if successful, -1 if failure
+
+int block_trace_start(const char* path)
+{
+    if (__atomic_load_n(&blockTracing, __ATOMIC_ACQUIRE)) {
+        return (-1);
+    }
+    pthread_mutex_lock(&traceLock);
+    // A trace still being stopped holds the file
+    if (traceFile != NULL) {
+        pthread_mutex_unlock(&traceLock);
+        return (-1);
+    }
+    if ((traceFile = fopen(path, "w")) == NULL) {
+        pthread_mutex_unlock(&traceLock);
+        logMessage(LOG_ERROR_LEVEL, "Failure creating the trace file [%s]", path);
+        return (-1);
+    }
+    fprintf(traceFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    traceEvents = 0;
+    traceGeneration++;
+    if (!traceAtExit) {
+        atexit(trace_exit);
+        traceAtExit = 1;
+    }
+    __atomic_store_n(&blockTracing, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&traceLock);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_start_env
+// Description  : Start tracing to the file named by the environment
+//
+// Inputs       : none
+// Outputs      : 0 if successful or not asked for, -1 if failure
+
+int block_trace_start_env(void)
+{
+    const char* path = getenv(BLOCK_TRACE_ENV);
+
+    if (__atomic_load_n(&blockTracing, __ATOMIC_ACQUIRE) || path == NULL || path[0] == '\0') {
+        return (0);
+    }
+    return (block_trace_start(path));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_stop
+// Description  : Stop tracing, wait for the spans being recorded, write the
+//                spans left in the buffers, free them and complete the trace
+//                file
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int block_trace_stop(void)
+{
+    TraceBuffer* buffer;
+    int ret;
+
+    pthread_mutex_lock(&traceLock);
+    if (!__atomic_load_n(&blockTracing, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&traceLock);
+        return (-1);
+    }
+    __atomic_store_n(&blockTracing, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&traceLock);
+
+    // A span seen after this point sees the trace stopped, the buffers are
+    // no longer written to (a span may take the lock when its buffer is full)
+    while (__atomic_load_n(&traceActive, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    pthread_mutex_lock(&traceLock);
+    while (traceBuffers != NULL) {
+        buffer = traceBuffers;
+        traceBuffers = buffer->next;
+        trace_write(buffer);
+        block_memory_free(BLOCK_MEM_BUFFERS, buffer, sizeof(TraceBuffer));
+    }
+    fprintf(traceFile, "\n]}\n");
+    ret = fclose(traceFile);
+    traceFile = NULL;
+    pthread_mutex_unlock(&traceLock);
+    return ((ret == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_trace_span
+// Description  : Trace a span in the buffer of the calling thread, creating
+//                and registering the buffer on the first span of a thread in
+//                a trace
+//
+// Inputs       : event - the span
+//                start_ns - the clock at the start of the span
+//                arg - the argument of the span
+// Outputs      : none
+
+void block_trace_span(BlockTraceEvent event, uint64_t start_ns, int32_t arg)
+{
+    TraceBuffer* buffer;
+    TraceRecord* record;
+    uint64_t now = block_stats_clock();
+    uint32_t count;
+
+    // Keep the trace from stopping (and freeing the buffer) during the span
+    __atomic_fetch_add(&traceActive, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&blockTracing, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_sub(&traceActive, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    // The buffer of an earlier trace was freed when it stopped
+    if (traceLocal == NULL || traceLocalGeneration != traceGeneration) {
+        traceLocal = NULL;
+        buffer = block_memory_alloc(BLOCK_MEM_BUFFERS, sizeof(TraceBuffer));
+        if (buffer == NULL) {
+            __atomic_fetch_sub(&traceActive, 1, __ATOMIC_RELEASE);
+            return;
+        }
+        buffer->tid = (uint32_t)syscall(SYS_gettid);
+        buffer->count = 0;
+        pthread_mutex_lock(&traceLock);
+        buffer->next = traceBuffers;
+        traceBuffers = buffer;
+        pthread_mutex_unlock(&traceLock);
+        traceLocal = buffer;
+        traceLocalGeneration = traceGeneration;
+    }
+    buffer = traceLocal;
+    if (buffer->count == BLOCK_TRACE_BUFFER_EVENTS) {
+        pthread_mutex_lock(&traceLock);
+        trace_write(buffer);
+        pthread_mutex_unlock(&traceLock);
+    }
+    count = buffer->count;
+    record = &buffer->records[count];
+    record->start_ns = start_ns;
+    record->dur_ns = now - start_ns;
+    record->event = event;
+    record->arg = arg;
+    __atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&traceActive, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,80 @@
+#ifndef BLOCK_TRACE_INCLUDED
+#define BLOCK_TRACE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : block_trace.h
+//  Description    : This is the header file for the event tracer of the BLOCK
+//                   memory system driver. The spans of the driver calls, cache
+//                   lookups, checksums and bus operations are written in the
+//                   Chrome trace event format, for chrome://tracing or
+//                   Perfetto.
+//
+//  Author         : Michael Fox
+//
+
+// Includes
+#include <stdint.h>
+
+#include <block_stats.h>
+
+// Defines
+#define BLOCK_TRACE_ENV "BLOCK_TRACE" // Environment variable naming a trace file to write
+#define BLOCK_TRACE_BUFFER_EVENTS 8192 // Events kept per thread before they are written
+
+// Spans traced
+typedef enum {
+    BLOCK_TRACE_POWERON = 0,
+    BLOCK_TRACE_POWEROFF,
+    BLOCK_TRACE_FORMAT,
+    BLOCK_TRACE_OPEN,
+    BLOCK_TRACE_CLOSE,
+    BLOCK_TRACE_READ,
+    BLOCK_TRACE_WRITE,
+    BLOCK_TRACE_SEEK,
+    BLOCK_TRACE_BATCH,
+    BLOCK_TRACE_CACHE_HIT,
+    BLOCK_TRACE_CACHE_MISS,
+    BLOCK_TRACE_CACHE_INSERT,
+    BLOCK_TRACE_CACHE_FLUSH,
+    BLOCK_TRACE_CHECKSUM,
+    BLOCK_TRACE_BUS_READ,
+    BLOCK_TRACE_BUS_WRITE,
+    BLOCK_TRACE_BUS_OTHER,
+    BLOCK_TRACE_MAXVAL,
+} BlockTraceEvent;
+
+// Get the start of a span, 0 when not tracing
+#define BLOCK_TRACE_BEGIN() (__atomic_load_n(&blockTracing, __ATOMIC_RELAXED) ? block_stats_clock() : 0)
+
+// Trace a span that started at "start", with an argument (frame, result...)
+#define BLOCK_TRACE_END(event, start, arg)                                      \
+    do {                                                                        \
+        if (__atomic_load_n(&blockTracing, __ATOMIC_RELAXED) && (start) != 0) { \
+            block_trace_span((event), (start), (arg));                          \
+        }                                                                       \
+    } while (0)
+
+//
+// Global Data
+
+extern int blockTracing; // Set while the events are traced
+
+//
+// Functional Prototypes
+
+int block_trace_start(const char* path);
+// Start tracing the events to "path"
+
+int block_trace_start_env(void);
+// Start tracing to the file named by the BLOCK_TRACE environment variable, if
+// it is set and no trace is running
+
+int block_trace_stop(void);
+// Stop tracing and complete the trace file, once the spans being recorded
+// have returned; the buffers of the threads are freed
+
+void block_trace_span(BlockTraceEvent event, uint64_t start_ns, int32_t arg);
+// Trace a span from "start_ns" to now in the buffer of the calling thread
+
+#endif